@@ -0,0 +1,581 @@
+#include "atomic_kms.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include <xf86drm.h>
+#include <drm_fourcc.h>
+
+#include <QDebug>
+
+static_assert(sizeof(damage_rect) == sizeof(struct drm_mode_rect),
+              "damage_rect must match the FB_DAMAGE_CLIPS layout");
+
+/* ---- DRM atomic device ---- */
+
+DrmAtomicDevice::DrmAtomicDevice(int drm_fd) :
+    m_drm_fd(drm_fd)
+{
+}
+
+int DrmAtomicDevice::init()
+{
+    /* Without universal planes, the primary and cursor planes are hidden */
+    int ret = drmSetClientCap(m_drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ? -errno : 0;
+    if (!ret)
+        ret = drmSetClientCap(m_drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) ? -errno : 0;
+
+    if (ret)
+    {
+        qDebug("%s %d This driver does not support atomic modesetting : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+    }
+    return ret;
+}
+
+uint32_t DrmAtomicDevice::property_id(uint32_t object_id, uint32_t object_type, char const *name)
+{
+    std::map<std::string, uint32_t> &object_properties = m_properties[object_id];
+
+    if (object_properties.empty())
+    {
+        drmModeObjectProperties *properties =
+            drmModeObjectGetProperties(m_drm_fd, object_id, object_type);
+        if (!properties)
+            return 0;
+
+        for (uint32_t p = 0; p < properties->count_props; p++)
+        {
+            drmModePropertyRes *property = drmModeGetProperty(m_drm_fd, properties->props[p]);
+            if (property)
+            {
+                object_properties[property->name] = property->prop_id;
+                drmModeFreeProperty(property);
+            }
+        }
+        drmModeFreeObjectProperties(properties);
+    }
+
+    std::map<std::string, uint32_t>::const_iterator found = object_properties.find(name);
+    return (found != object_properties.end()) ? found->second : 0;
+}
+
+int DrmAtomicDevice::get_planes(std::vector<plane_info> &planes)
+{
+    drmModePlaneRes *plane_resources = drmModeGetPlaneResources(m_drm_fd);
+    if (!plane_resources)
+        return -errno;
+
+    planes.clear();
+    for (uint32_t p = 0; p < plane_resources->count_planes; p++)
+    {
+        drmModePlane *plane = drmModeGetPlane(m_drm_fd, plane_resources->planes[p]);
+        if (!plane)
+            continue;
+
+        plane_info info;
+        info.plane_id       = plane->plane_id;
+        info.type           = DRM_PLANE_TYPE_OVERLAY;
+        info.possible_crtcs = plane->possible_crtcs;
+        info.zpos           = p;
+        info.formats.assign(plane->formats, plane->formats + plane->count_formats);
+        drmModeFreePlane(plane);
+
+        /* The plane type and zpos are only available as properties */
+        drmModeObjectProperties *properties =
+            drmModeObjectGetProperties(m_drm_fd, info.plane_id, DRM_MODE_OBJECT_PLANE);
+        if (properties)
+        {
+            std::map<std::string, uint32_t> &object_properties = m_properties[info.plane_id];
+            for (uint32_t prop = 0; prop < properties->count_props; prop++)
+            {
+                drmModePropertyRes *property = drmModeGetProperty(m_drm_fd, properties->props[prop]);
+                if (!property)
+                    continue;
+
+                object_properties[property->name] = property->prop_id;
+                if (!strcmp(property->name, "type"))
+                    info.type = properties->prop_values[prop];
+                else if (!strcmp(property->name, "zpos"))
+                    info.zpos = properties->prop_values[prop];
+
+                drmModeFreeProperty(property);
+            }
+            drmModeFreeObjectProperties(properties);
+        }
+
+        planes.push_back(info);
+    }
+
+    drmModeFreePlaneResources(plane_resources);
+    return 0;
+}
+
+int DrmAtomicDevice::commit(uint32_t crtc_id,
+                            std::vector<plane_state> const &planes,
+                            atomic_modeset const *modeset,
+                            uint32_t flags,
+                            void *user_data)
+{
+    drmModeAtomicReq *request = drmModeAtomicAlloc();
+    if (!request)
+        return -ENOMEM;
+
+    int ret = 0;
+    uint32_t mode_blob_id = 0;
+    std::vector<uint32_t> damage_blob_ids;
+
+    if (modeset)
+    {
+        ret = drmModeCreatePropertyBlob(m_drm_fd, &modeset->mode, sizeof(modeset->mode), &mode_blob_id);
+        if (!ret)
+        {
+            drmModeAtomicAddProperty(request, crtc_id,
+                                     property_id(crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID"), mode_blob_id);
+            drmModeAtomicAddProperty(request, crtc_id,
+                                     property_id(crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE"), 1);
+            drmModeAtomicAddProperty(request, modeset->connector_id,
+                                     property_id(modeset->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID"),
+                                     crtc_id);
+        }
+    }
+
+    for (size_t p = 0; !ret && p < planes.size(); p++)
+    {
+        uint32_t const plane_id = planes[p].plane_id;
+        plane_layer const &layer = planes[p].layer;
+
+        struct
+        {
+            char const *name;
+            uint64_t    value;
+        } const values[] =
+        {
+            /* Source coordinates are in 16.16 fixed point */
+            { "FB_ID",   layer.fb_id },
+            { "CRTC_ID", layer.fb_id ? crtc_id : 0 },
+            { "SRC_X",   (uint64_t) layer.src_x << 16 },
+            { "SRC_Y",   (uint64_t) layer.src_y << 16 },
+            { "SRC_W",   (uint64_t) layer.src_w << 16 },
+            { "SRC_H",   (uint64_t) layer.src_h << 16 },
+            { "CRTC_X",  (uint64_t) (int64_t) layer.crtc_x },
+            { "CRTC_Y",  (uint64_t) (int64_t) layer.crtc_y },
+            { "CRTC_W",  layer.crtc_w },
+            { "CRTC_H",  layer.crtc_h },
+        };
+
+        /* Disabling a plane only needs FB_ID and CRTC_ID */
+        size_t const value_count = layer.fb_id ? sizeof(values) / sizeof(values[0]) : 2;
+        for (size_t v = 0; v < value_count; v++)
+        {
+            uint32_t const id = property_id(plane_id, DRM_MODE_OBJECT_PLANE, values[v].name);
+            if (!id || drmModeAtomicAddProperty(request, plane_id, id, values[v].value) < 0)
+            {
+                qDebug("%s %d Could not set %s on plane %u\n",
+                       __FUNCTION__, __LINE__, values[v].name, plane_id);
+                ret = -EINVAL;
+                break;
+            }
+        }
+
+        /* FB_DAMAGE_CLIPS is an array of struct drm_mode_rect, which
+         * damage_rect mirrors. Kernels without it just get full updates. */
+        uint32_t const damage_property = property_id(plane_id, DRM_MODE_OBJECT_PLANE, "FB_DAMAGE_CLIPS");
+        if (!ret && layer.fb_id && damage_property && !planes[p].damage_clips.empty())
+        {
+            std::vector<damage_rect> const &clips = planes[p].damage_clips;
+            uint32_t damage_blob_id = 0;
+            if (!drmModeCreatePropertyBlob(m_drm_fd, &clips[0], clips.size() * sizeof(clips[0]), &damage_blob_id))
+            {
+                damage_blob_ids.push_back(damage_blob_id);
+                drmModeAtomicAddProperty(request, plane_id, damage_property, damage_blob_id);
+            }
+        }
+    }
+
+    if (!ret)
+        ret = drmModeAtomicCommit(m_drm_fd, request, flags, user_data);
+
+    drmModeAtomicFree(request);
+    /* The committed state keeps its own reference on the mode blob */
+    if (mode_blob_id)
+        drmModeDestroyPropertyBlob(m_drm_fd, mode_blob_id);
+    for (size_t b = 0; b < damage_blob_ids.size(); b++)
+        drmModeDestroyPropertyBlob(m_drm_fd, damage_blob_ids[b]);
+
+    return ret;
+}
+
+/* ---- Fake atomic device ---- */
+
+FakeAtomicDevice::FakeAtomicDevice() :
+    m_drm_device(NULL),
+    m_max_active_planes(0),
+    m_overlay_scaling(true),
+    m_test_commits(0),
+    m_commits(0)
+{
+}
+
+int FakeAtomicDevice::get_planes(std::vector<plane_info> &planes)
+{
+    planes = m_planes;
+    return 0;
+}
+
+plane_info const *FakeAtomicDevice::find_plane(uint32_t plane_id) const
+{
+    for (size_t p = 0; p < m_planes.size(); p++)
+    {
+        if (m_planes[p].plane_id == plane_id)
+            return &m_planes[p];
+    }
+    return NULL;
+}
+
+int FakeAtomicDevice::commit(uint32_t crtc_id,
+                             std::vector<plane_state> const &planes,
+                             atomic_modeset const *modeset,
+                             uint32_t flags,
+                             void *user_data)
+{
+    if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+        m_test_commits++;
+
+    if (modeset && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+        return -EINVAL;
+
+    unsigned int active_planes = 0;
+    uint32_t primary_fb_id = 0;
+    for (size_t p = 0; p < planes.size(); p++)
+    {
+        plane_layer const &layer = planes[p].layer;
+        if (!layer.fb_id)
+            continue;
+
+        active_planes++;
+
+        plane_info const *plane = find_plane(planes[p].plane_id);
+        if (!plane)
+            return -ENOENT;
+        if (plane->type == DRM_PLANE_TYPE_PRIMARY)
+            primary_fb_id = layer.fb_id;
+
+        if (std::find(plane->formats.begin(), plane->formats.end(), layer.format) == plane->formats.end())
+            return -EINVAL;
+
+        bool const scaled = (layer.src_w != layer.crtc_w || layer.src_h != layer.crtc_h);
+        if (scaled && plane->type != DRM_PLANE_TYPE_PRIMARY && !m_overlay_scaling)
+            return -ERANGE;
+    }
+
+    if (m_max_active_planes && active_planes > m_max_active_planes)
+        return -ENOSPC;
+
+    if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+        return 0;
+
+    if (m_drm_device && primary_fb_id)
+    {
+        int ret;
+        if (modeset)
+        {
+            uint32_t connector_id = modeset->connector_id;
+            drmModeModeInfo mode  = modeset->mode;
+            ret = m_drm_device->set_crtc(crtc_id, primary_fb_id, &connector_id, 1, &mode);
+        }
+        else
+        {
+            ret = m_drm_device->page_flip(crtc_id, primary_fb_id,
+                                          flags & DRM_MODE_PAGE_FLIP_EVENT, user_data);
+        }
+        if (ret)
+            return ret;
+    }
+
+    m_commits++;
+    m_last_commit = planes;
+    return 0;
+}
+
+/* ---- Plane assignment ---- */
+
+static bool supports_format(plane_info const &plane, uint32_t format)
+{
+    return std::find(plane.formats.begin(), plane.formats.end(), format) != plane.formats.end();
+}
+
+static bool lower_zpos(plane_info const *a, plane_info const *b)
+{
+    return (a->zpos != b->zpos) ? (a->zpos < b->zpos) : (a->plane_id < b->plane_id);
+}
+
+int assign_planes(AtomicDevice &device,
+                  uint32_t crtc_id,
+                  unsigned int crtc_index,
+                  std::vector<plane_layer> const &layers,
+                  atomic_modeset const *modeset,
+                  plane_configuration &configuration)
+{
+    if (layers.empty())
+        return -EINVAL;
+
+    std::vector<plane_info> planes;
+    int ret = device.get_planes(planes);
+    if (ret)
+        return ret;
+
+    /* Keep the planes usable on this CRTC, primary on one side, overlays
+     * sorted bottom to top on the other. Cursor planes are left alone. */
+    plane_info const *primary = NULL;
+    std::vector<plane_info const *> overlays;
+    for (size_t p = 0; p < planes.size(); p++)
+    {
+        if (!(planes[p].possible_crtcs & (1u << crtc_index)))
+            continue;
+
+        if (planes[p].type == DRM_PLANE_TYPE_PRIMARY && !primary)
+            primary = &planes[p];
+        else if (planes[p].type == DRM_PLANE_TYPE_OVERLAY)
+            overlays.push_back(&planes[p]);
+    }
+    std::sort(overlays.begin(), overlays.end(), lower_zpos);
+
+    if (!primary)
+        return -ENODEV;
+    if (!supports_format(*primary, layers[0].format))
+        return -EINVAL;
+
+    uint32_t const flags = DRM_MODE_ATOMIC_TEST_ONLY | (modeset ? DRM_MODE_ATOMIC_ALLOW_MODESET : 0);
+    ret = -ENOSPC;
+
+    /* cpu_layers : how many of the lowest layers end up on the primary
+     * plane. Blending is only done when the hardware refuses. */
+    for (unsigned int cpu_layers = 1; cpu_layers <= layers.size(); cpu_layers++)
+    {
+        /* Layers without CPU mapping, like imported dma-bufs, can only be
+         * shown by a plane */
+        if (cpu_layers > 1 && !layers[cpu_layers - 1].map)
+            break;
+
+        std::vector<plane_state> states;
+
+        plane_state primary_state;
+        primary_state.plane_id = primary->plane_id;
+        primary_state.layer    = layers[0];
+        states.push_back(primary_state);
+
+        /* Remaining layers go, in order, to the next overlay that can
+         * read their format */
+        size_t overlay = 0;
+        bool fits = true;
+        for (size_t l = cpu_layers; l < layers.size() && fits; l++)
+        {
+            while (overlay < overlays.size() && !supports_format(*overlays[overlay], layers[l].format))
+                overlay++;
+
+            if (overlay == overlays.size())
+            {
+                fits = false;
+                break;
+            }
+
+            plane_state overlay_state;
+            overlay_state.plane_id = overlays[overlay]->plane_id;
+            overlay_state.layer    = layers[l];
+            states.push_back(overlay_state);
+            overlay++;
+        }
+
+        if (!fits)
+            continue;
+
+        /* Overlays we don't use must be turned off, they may still show
+         * whatever a previous user left on them */
+        for (size_t o = 0; o < overlays.size(); o++)
+        {
+            bool used = false;
+            for (size_t s = 1; s < states.size(); s++)
+                used |= (states[s].plane_id == overlays[o]->plane_id);
+
+            if (!used)
+            {
+                plane_state disabled = plane_state();
+                disabled.plane_id = overlays[o]->plane_id;
+                states.push_back(disabled);
+            }
+        }
+
+        ret = device.commit(crtc_id, states, modeset, flags, NULL);
+        if (!ret)
+        {
+            configuration.planes     = states;
+            configuration.cpu_layers = cpu_layers;
+            return 0;
+        }
+    }
+
+    qDebug("%s %d No plane configuration accepted for %u layers : %s\n",
+           __FUNCTION__, __LINE__, (unsigned int) layers.size(), strerror(-ret));
+    return ret;
+}
+
+void composite_cpu_layers(std::vector<plane_layer> const &layers,
+                          unsigned int cpu_layers)
+{
+    if (layers.empty())
+        return;
+
+    plane_layer const &target = layers[0];
+    pixel_surface const destination = { target.map, target.crtc_w, target.crtc_h, target.pitch };
+    bool const blendable = target.format == DRM_FORMAT_XRGB8888 || target.format == DRM_FORMAT_ARGB8888;
+
+    pixel_image target_image;
+    pixel_image_layout(target.format, target.crtc_w, target.crtc_h, target.map, target.pitch, target_image);
+
+    for (unsigned int l = 1; l < cpu_layers && l < layers.size(); l++)
+    {
+        plane_layer const &layer = layers[l];
+        if (!layer.map || !target.map)
+            continue;
+
+        /* No scaling in software : the source is clipped to the
+         * destination rectangle */
+        pixel_surface const source = { layer.map, layer.src_x + layer.src_w, layer.src_y + layer.src_h, layer.pitch };
+        uint32_t const width  = std::min(layer.src_w, layer.crtc_w);
+        uint32_t const height = std::min(layer.src_h, layer.crtc_h);
+
+        if (blendable && layer.format == DRM_FORMAT_ARGB8888)
+        {
+            pixel_blend(destination, layer.crtc_x, layer.crtc_y, source, layer.src_x, layer.src_y, width, height);
+        }
+        else if (blendable && layer.format == DRM_FORMAT_XRGB8888)
+        {
+            pixel_blit(destination, layer.crtc_x, layer.crtc_y, source, layer.src_x, layer.src_y, width, height);
+        }
+        else
+        {
+            /* Anything else is converted, opaque : video layers, or
+             * a primary plane in RGB565 */
+            pixel_image layer_image;
+            pixel_image_layout(layer.format, source.width, source.height, layer.map, layer.pitch, layer_image);
+            if (layer.chroma_offset)
+                layer_image.planes[1].pixels = layer.map + layer.chroma_offset;
+
+            if (pixel_image_convert(target_image, layer.crtc_x, layer.crtc_y,
+                                    layer_image, layer.src_x, layer.src_y, width, height))
+            {
+                qDebug("%s %d Cannot compose a layer of format %.4s\n",
+                       __FUNCTION__, __LINE__, (char const *) &layer.format);
+            }
+        }
+    }
+}
+
+/* ---- Atomic swapchain backend ---- */
+
+AtomicSwapchainBackend::AtomicSwapchainBackend(DrmDevice &drm_device,
+                                               AtomicDevice &device,
+                                               uint32_t crtc_id,
+                                               unsigned int crtc_index,
+                                               uint32_t connector_id,
+                                               drmModeModeInfo const &mode) :
+    DrmSwapchainBackend(drm_device, crtc_id, connector_id, mode),
+    m_atomic_device(device),
+    m_crtc_index(crtc_index),
+    m_configured(false),
+    m_cpu_blended(false)
+{
+    m_configuration.cpu_layers = 0;
+}
+
+void AtomicSwapchainBackend::set_overlay_layers(std::vector<plane_layer> const &layers)
+{
+    m_overlays   = layers;
+    m_configured = false;
+}
+
+int AtomicSwapchainBackend::queue_flip(swapchain_buffer &buffer)
+{
+    std::vector<plane_layer> layers;
+
+    plane_layer base;
+    memset(&base, 0, sizeof(base));
+    base.fb_id  = buffer.fb_id;
+    base.format = buffer.format;
+    base.crtc_w = base.src_w = buffer.width;
+    base.crtc_h = base.src_h = buffer.height;
+    base.map    = buffer.map;
+    base.pitch  = buffer.pitch;
+    layers.push_back(base);
+    layers.insert(layers.end(), m_overlays.begin(), m_overlays.end());
+
+    atomic_modeset modeset;
+    modeset.connector_id = m_connector_ids[0];
+    modeset.mode         = m_mode;
+    atomic_modeset const *first_modeset = m_crtc_set ? NULL : &modeset;
+
+    /* The plane assignment only changes with the layers, not with the
+     * buffer being presented */
+    if (!m_configured)
+    {
+        int ret = assign_planes(m_atomic_device, m_crtc_id, m_crtc_index, layers, first_modeset, m_configuration);
+        if (ret)
+            return ret;
+        m_configured = true;
+    }
+
+    /* assign_planes puts the primary plane first */
+    m_configuration.planes[0].layer        = base;
+    m_configuration.planes[0].damage_clips = buffer.damage.rects();
+
+    /* Layers the overlays could not take end up in the buffer itself,
+     * which makes the damage of the buffer meaningless. What they cover
+     * still goes into the damage history, and the buffers are repainted
+     * entirely from now on, instead of blending the layers again over
+     * their previous copy. */
+    if (m_configuration.cpu_layers > 1)
+    {
+        composite_cpu_layers(layers, m_configuration.cpu_layers);
+        m_configuration.planes[0].damage_clips.clear();
+        m_cpu_blended = true;
+
+        for (unsigned int l = 1; l < m_configuration.cpu_layers && l < layers.size(); l++)
+        {
+            plane_layer const &layer = layers[l];
+            buffer.damage.add(layer.crtc_x, layer.crtc_y,
+                              std::min(layer.src_w, layer.crtc_w),
+                              std::min(layer.src_h, layer.crtc_h));
+        }
+        buffer.damage.clip(buffer.width, buffer.height);
+    }
+
+    if (first_modeset)
+    {
+        /* The modeset is done synchronously, like drmModeSetCrtc */
+        int ret = m_atomic_device.commit(m_crtc_id, m_configuration.planes, first_modeset,
+                                  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+        if (ret)
+        {
+            qDebug("%s %d Atomic modeset failed : %s\n", __FUNCTION__, __LINE__, strerror(-ret));
+            return ret;
+        }
+
+        m_crtc_set = true;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (m_listener)
+            m_listener->flip_complete(0, now.tv_sec, now.tv_nsec / 1000);
+        return 0;
+    }
+
+    int ret = m_atomic_device.commit(m_crtc_id, m_configuration.planes, NULL,
+                              DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+                              static_cast<DrmSwapchainBackend *>(this));
+    if (ret)
+        qDebug("%s %d Atomic commit failed : %s\n", __FUNCTION__, __LINE__, strerror(-ret));
+    return ret;
+}
@@ -0,0 +1,207 @@
+#ifndef ATOMIC_KMS_H
+#define ATOMIC_KMS_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+#include "swapchain.h"
+
+/* What we know about a KMS plane */
+struct plane_info
+{
+    uint32_t plane_id;
+    /* DRM_PLANE_TYPE_PRIMARY, DRM_PLANE_TYPE_OVERLAY or DRM_PLANE_TYPE_CURSOR */
+    uint32_t type;
+    /* Bitmask of the CRTC indexes (in drmModeRes.crtcs) it can be used with */
+    uint32_t possible_crtcs;
+    uint64_t zpos;
+    std::vector<uint32_t> formats;
+};
+
+/* Something to put on screen. Coordinates are in pixels. */
+struct plane_layer
+{
+    uint32_t fb_id;
+    uint32_t format;
+
+    int32_t  crtc_x;
+    int32_t  crtc_y;
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+
+    uint32_t src_x;
+    uint32_t src_y;
+    uint32_t src_w;
+    uint32_t src_h;
+
+    /* CPU access to the pixels, used when the layer has to be blended
+     * in software. The chroma plane of semi-planar formats starts
+     * chroma_offset bytes after map, with the same pitch. */
+    uint8_t *map;
+    uint32_t pitch;
+    uint32_t chroma_offset;
+};
+
+/* The state of one plane in an atomic commit. fb_id == 0 disables it */
+struct plane_state
+{
+    uint32_t plane_id;
+    plane_layer layer;
+    /* Sent as FB_DAMAGE_CLIPS when the plane has that property.
+     * Empty means the whole framebuffer changed. */
+    std::vector<damage_rect> damage_clips;
+};
+
+/* The full modeset done by the first commit on a CRTC */
+struct atomic_modeset
+{
+    uint32_t        connector_id;
+    drmModeModeInfo mode;
+};
+
+/* The atomic KMS calls we need, so that the plane assignment can be
+ * checked against FakeAtomicDevice instead of real hardware. */
+class AtomicDevice
+{
+public:
+    virtual ~AtomicDevice() {}
+
+    virtual int get_planes(std::vector<plane_info> &planes) = 0;
+
+    /* flags are DRM_MODE_ATOMIC_* and DRM_MODE_PAGE_FLIP_EVENT.
+     * modeset can be NULL.
+     * Returns 0 or a negative errno value. */
+    virtual int commit(uint32_t crtc_id,
+                       std::vector<plane_state> const &planes,
+                       atomic_modeset const *modeset,
+                       uint32_t flags,
+                       void *user_data) = 0;
+};
+
+class DrmAtomicDevice : public AtomicDevice
+{
+public:
+    explicit DrmAtomicDevice(int drm_fd);
+
+    /* Enable universal planes and atomic. Fails on drivers without atomic
+     * support, in which case the legacy path must be used. */
+    int init();
+
+    int get_planes(std::vector<plane_info> &planes);
+    int commit(uint32_t crtc_id,
+               std::vector<plane_state> const &planes,
+               atomic_modeset const *modeset,
+               uint32_t flags,
+               void *user_data);
+
+private:
+    uint32_t property_id(uint32_t object_id, uint32_t object_type, char const *name);
+
+    int m_drm_fd;
+    /* object id -> property name -> property id */
+    std::map<uint32_t, std::map<std::string, uint32_t> > m_properties;
+};
+
+/* In-process plane table. TEST_ONLY commits are checked against simple
+ * hardware limits, so that we can see how the assignment reacts to them.
+ * With a DRM device, the other commits scan the primary plane out through
+ * it, which then sends the flip events, as the kernel would. */
+class FakeAtomicDevice : public AtomicDevice
+{
+public:
+    FakeAtomicDevice();
+
+    void add_plane(plane_info const &plane) { m_planes.push_back(plane); }
+    /* Reject commits enabling more than this many planes. 0 : no limit */
+    void set_max_active_planes(unsigned int max) { m_max_active_planes = max; }
+    /* Reject commits where overlays scale their source */
+    void set_overlay_scaling(bool supported) { m_overlay_scaling = supported; }
+    void set_drm_device(DrmDevice *device) { m_drm_device = device; }
+
+    int get_planes(std::vector<plane_info> &planes);
+    int commit(uint32_t crtc_id,
+               std::vector<plane_state> const &planes,
+               atomic_modeset const *modeset,
+               uint32_t flags,
+               void *user_data);
+
+    unsigned int test_commits() const { return m_test_commits; }
+    unsigned int commits() const { return m_commits; }
+    std::vector<plane_state> const &last_commit() const { return m_last_commit; }
+
+private:
+    plane_info const *find_plane(uint32_t plane_id) const;
+
+    std::vector<plane_info>  m_planes;
+    DrmDevice               *m_drm_device;
+    unsigned int             m_max_active_planes;
+    bool                     m_overlay_scaling;
+    unsigned int             m_test_commits;
+    unsigned int             m_commits;
+    std::vector<plane_state> m_last_commit;
+};
+
+struct plane_configuration
+{
+    /* One entry per plane usable on the CRTC, disabled ones included */
+    std::vector<plane_state> planes;
+    /* The layers[1 .. cpu_layers - 1] have to be blended on layers[0]
+     * by the CPU. 0 or 1 means everything is composited by the hardware. */
+    unsigned int cpu_layers;
+};
+
+/* Find which plane shows which layer.
+ * layers are sorted bottom to top, layers[0] goes on the primary plane,
+ * which comes first in configuration.planes.
+ * Starting with every layer on its own plane, the lowest layers are moved
+ * to CPU blending until a TEST_ONLY commit is accepted.
+ * modeset must be given if the CRTC is not active yet.
+ * Returns 0 or a negative errno value. */
+int assign_planes(AtomicDevice &device,
+                  uint32_t crtc_id,
+                  unsigned int crtc_index,
+                  std::vector<plane_layer> const &layers,
+                  atomic_modeset const *modeset,
+                  plane_configuration &configuration);
+
+/* Blend layers[1 .. cpu_layers - 1] on layers[0], for the layers the
+ * hardware could not take. */
+void composite_cpu_layers(std::vector<plane_layer> const &layers,
+                          unsigned int cpu_layers);
+
+/* Swapchain presented through atomic commits on the primary plane, with
+ * optional layers put on overlay planes above it. */
+class AtomicSwapchainBackend : public DrmSwapchainBackend
+{
+public:
+    AtomicSwapchainBackend(DrmDevice &drm_device,
+                           AtomicDevice &device,
+                           uint32_t crtc_id,
+                           unsigned int crtc_index,
+                           uint32_t connector_id,
+                           drmModeModeInfo const &mode);
+
+    /* Layers displayed above the swapchain buffers, bottom to top */
+    void set_overlay_layers(std::vector<plane_layer> const &layers);
+
+    int queue_flip(swapchain_buffer &buffer);
+
+    unsigned int cpu_blended_layers() const { return m_configuration.cpu_layers; }
+    bool draws_into_buffers() const { return m_cpu_blended; }
+
+private:
+    AtomicDevice             &m_atomic_device;
+    unsigned int              m_crtc_index;
+    std::vector<plane_layer>  m_overlays;
+    plane_configuration       m_configuration;
+    bool                      m_configured;
+    /* Layers were blended into the swapchain buffers. Those may still be
+     * around in them, even once the overlays take the layers. */
+    bool                      m_cpu_blended;
+};
+
+#endif // ATOMIC_KMS_H
@@ -0,0 +1,246 @@
+#include "buffer_pool.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include <QDebug>
+
+#include "frame_stats.h"
+
+bool BufferPool::size_class::operator<(size_class const &other) const
+{
+    if (width != other.width)
+        return width < other.width;
+    if (height != other.height)
+        return height < other.height;
+    return format < other.format;
+}
+
+BufferPool::BufferPool(DrmDevice &device, uint64_t memory_cap) :
+    m_device(device),
+    m_memory_cap(memory_cap)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+BufferPool::~BufferPool()
+{
+    clear();
+}
+
+int BufferPool::acquire(uint32_t width, uint32_t height, uint32_t format, pooled_buffer &buffer)
+{
+    size_class const wanted = { width, height, format };
+
+    /* The last one of the class is the most recently released, the most
+     * likely to still be in the caches */
+    std::pair<std::multimap<size_class, lru_list::iterator>::iterator,
+              std::multimap<size_class, lru_list::iterator>::iterator> const
+        candidates = m_classes.equal_range(wanted);
+    if (candidates.first != candidates.second)
+    {
+        std::multimap<size_class, lru_list::iterator>::iterator found = candidates.second;
+        --found;
+
+        buffer = *found->second;
+        m_lru.erase(found->second);
+        m_classes.erase(found);
+
+        m_stats.hits++;
+        m_stats.cached_bytes -= buffer.size;
+        m_stats.used_bytes   += buffer.size;
+        return 0;
+    }
+
+    m_stats.misses++;
+
+    uint64_t const start_us = monotonic_us();
+    int ret = create_scanout_buffer(m_device, width, height, format, buffer);
+    m_stats.create_us += monotonic_us() - start_us;
+    if (ret)
+    {
+        m_stats.failures++;
+        return ret;
+    }
+
+    m_stats.used_bytes += buffer.size;
+    make_room(0);
+    return 0;
+}
+
+void BufferPool::release(pooled_buffer const &buffer)
+{
+    m_stats.used_bytes -= buffer.size;
+
+    if (buffer.size > m_memory_cap)
+    {
+        uint64_t const start_us = monotonic_us();
+        destroy_scanout_buffer(m_device, buffer);
+        m_stats.destroy_us += monotonic_us() - start_us;
+        m_stats.evictions++;
+        return;
+    }
+
+    make_room(buffer.size);
+
+    size_class const released = { buffer.width, buffer.height, buffer.format };
+    lru_list::iterator const cached = m_lru.insert(m_lru.end(), buffer);
+    m_classes.insert(std::make_pair(released, cached));
+    m_stats.cached_bytes += buffer.size;
+}
+
+void BufferPool::trim(uint64_t max_cached_bytes)
+{
+    while (!m_lru.empty() && m_stats.cached_bytes > max_cached_bytes)
+        evict_oldest();
+}
+
+void BufferPool::set_memory_cap(uint64_t memory_cap)
+{
+    m_memory_cap = memory_cap;
+    make_room(0);
+}
+
+void BufferPool::make_room(uint64_t extra_bytes)
+{
+    while (!m_lru.empty() &&
+           m_stats.used_bytes + m_stats.cached_bytes + extra_bytes > m_memory_cap)
+    {
+        evict_oldest();
+    }
+}
+
+void BufferPool::evict_oldest()
+{
+    lru_list::iterator const oldest = m_lru.begin();
+    size_class const key = { oldest->width, oldest->height, oldest->format };
+
+    std::pair<std::multimap<size_class, lru_list::iterator>::iterator,
+              std::multimap<size_class, lru_list::iterator>::iterator> const
+        candidates = m_classes.equal_range(key);
+    for (std::multimap<size_class, lru_list::iterator>::iterator c = candidates.first;
+         c != candidates.second; ++c)
+    {
+        if (c->second == oldest)
+        {
+            m_classes.erase(c);
+            break;
+        }
+    }
+
+    uint64_t const start_us = monotonic_us();
+    destroy_scanout_buffer(m_device, *oldest);
+    m_stats.destroy_us += monotonic_us() - start_us;
+
+    m_stats.cached_bytes -= oldest->size;
+    m_stats.evictions++;
+    m_lru.erase(oldest);
+}
+
+int create_scanout_buffer(DrmDevice &device,
+                          uint32_t width, uint32_t height, uint32_t format,
+                          pooled_buffer &buffer)
+{
+    pixel_format_info const *info = pixel_format_find(format);
+    if (!info || !width || !height)
+        return -EINVAL;
+
+    /* Dumb buffers only know about bits per pixel : semi-planar images
+     * are allocated as 8 bpp, with the chroma rows below the luma ones */
+    uint32_t dumb_width  = width;
+    uint32_t dumb_height = height;
+    uint32_t dumb_bpp    = info->bytes_per_pixel * 8;
+    if (info->plane_count > 1)
+    {
+        dumb_width  = std::max(width, pixel_format_row_bytes(*info, 1, width));
+        dumb_height = height + pixel_format_plane_rows(*info, 1, height);
+    }
+
+    DumbBuffer dumb;
+    int ret = dumb.create(device, dumb_width, dumb_height, dumb_bpp);
+    if (ret)
+    {
+        qDebug("%s %d Dumb Buffer Object Allocation request of %ux%u@%u failed : %s\n",
+               __FUNCTION__, __LINE__, dumb_width, dumb_height, dumb_bpp, strerror(-ret));
+        return ret;
+    }
+
+    pixel_image image;
+    uint32_t const pitch = dumb.info().pitch;
+    if (pixel_image_layout(format, width, height, NULL, pitch, image) > dumb.info().size)
+        return -EINVAL;
+
+    uint32_t handles[4] = { 0, 0, 0, 0 };
+    uint32_t pitches[4] = { 0, 0, 0, 0 };
+    uint32_t offsets[4] = { 0, 0, 0, 0 };
+    for (unsigned int plane = 0; plane < info->plane_count; plane++)
+    {
+        handles[plane] = dumb.handle();
+        pitches[plane] = pitch;
+        offsets[plane] = plane ? pitch * height : 0;
+    }
+
+    uint32_t frame_buffer_id;
+    ret = device.add_fb2(width, height, format, handles, pitches, offsets, NULL, &frame_buffer_id);
+    if (ret)
+    {
+        qDebug("%s %d Could not add a %s framebuffer using drmModeAddFB2 : %s\n",
+               __FUNCTION__, __LINE__, info->name, strerror(-ret));
+        return ret;
+    }
+    FramebufferId frame_buffer(device, frame_buffer_id);
+
+    /* Export the buffer using PRIME and map it through the PRIME fd */
+    int prime_fd = -1;
+    ret = device.prime_handle_to_fd(dumb.handle(), DRM_CLOEXEC | DRM_RDWR, &prime_fd);
+    if (ret || prime_fd < 0)
+    {
+        int const err = ret ? -ret : EINVAL;
+        qDebug("%s %d Could not export buffer : %s (%d)\n",
+               __FUNCTION__, __LINE__, strerror(err), err);
+        return -err;
+    }
+    UniqueFd dma_buf(prime_fd);
+
+    Mapping map(dma_buf.get(), dumb.info().size);
+    if (!map.valid())
+    {
+        int const err = errno;
+        qDebug("%s %d Could not map buffer exported through PRIME : %s (%d)\n",
+               __FUNCTION__, __LINE__, strerror(err), err);
+        return -err;
+    }
+
+    /* Everything worked, the buffer owns it all from now on */
+    buffer.width      = width;
+    buffer.height     = height;
+    buffer.format     = format;
+    buffer.pitch      = pitch;
+    buffer.size       = dumb.info().size;
+    buffer.handle     = dumb.release();
+    buffer.fb_id      = frame_buffer.release();
+    buffer.dma_buf_fd = dma_buf.release();
+    buffer.map        = static_cast<uint8_t *>(map.release());
+    return 0;
+}
+
+void destroy_scanout_buffer(DrmDevice &device, pooled_buffer const &buffer)
+{
+    munmap(buffer.map, buffer.size);
+    close(buffer.dma_buf_fd);
+    device.rm_fb(buffer.fb_id);
+    device.destroy_dumb(buffer.handle);
+}
+
+pixel_image pooled_image(pooled_buffer const &buffer)
+{
+    pixel_image image;
+    pixel_image_layout(buffer.format, buffer.width, buffer.height,
+                       buffer.map, buffer.pitch, image);
+    return image;
+}
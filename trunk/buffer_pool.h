@@ -0,0 +1,119 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdint.h>
+#include <list>
+#include <map>
+
+#include "drm_device.h"
+#include "pixel_format.h"
+
+/* A dumb buffer, its framebuffer and its PRIME mapping, as handed out by
+ * BufferPool */
+struct pooled_buffer
+{
+    uint32_t width;
+    uint32_t height;
+    /* Any format of pixel_format_find. The planes follow each other
+     * with the same pitch, see pixel_image_layout. */
+    uint32_t format;
+    uint32_t pitch;
+    uint64_t size;
+
+    uint32_t handle;
+    uint32_t fb_id;
+    int      dma_buf_fd;
+    uint8_t *map;
+};
+
+/* Creates a dumb buffer able to hold a width x height image of format,
+ * its framebuffer (drmModeAddFB2) and its PRIME mapping.
+ * Returns 0 or a negative errno, -EINVAL for an unknown format. */
+int create_scanout_buffer(DrmDevice &device,
+                          uint32_t width, uint32_t height, uint32_t format,
+                          pooled_buffer &buffer);
+void destroy_scanout_buffer(DrmDevice &device, pooled_buffer const &buffer);
+
+/* The planes of the buffer, to draw into them */
+pixel_image pooled_image(pooled_buffer const &buffer);
+
+struct buffer_pool_stats
+{
+    /* Buffers found in the pool, and buffers that had to be created */
+    uint64_t hits;
+    uint64_t misses;
+    /* Cached buffers destroyed to stay under the memory cap, or trimmed */
+    uint64_t evictions;
+    uint64_t failures;
+    /* Bytes of the buffers handed out, and of the ones waiting in the pool */
+    uint64_t used_bytes;
+    uint64_t cached_bytes;
+    /* Time spent creating and destroying buffers */
+    uint64_t create_us;
+    uint64_t destroy_us;
+};
+
+/* Recycles dumb buffers along with their framebuffer and mapping.
+ *
+ * Creating one costs DRM_IOCTL_MODE_CREATE_DUMB, drmModeAddFB2, a PRIME
+ * export and a mmap, and the first write to each page faults it in.
+ * Destroying it costs as much again. Buffers given back are kept, by size
+ * class (width, height and format : the pitch the driver picks follows),
+ * and handed out again to the next request of the same class, the most
+ * recently released first.
+ *
+ * The buffers in use plus the cached ones stay under memory_cap bytes by
+ * destroying the least recently released cached buffers. Buffers in use
+ * are never taken back, so the pool goes over the cap rather than fail.
+ * Destroying the framebuffer being scanned out turns the CRTC off : a
+ * buffer must only be released once it left the screen. */
+class BufferPool
+{
+public:
+    BufferPool(DrmDevice &device, uint64_t memory_cap = 256ull << 20);
+    ~BufferPool();
+
+    /* Returns 0 or a negative errno, see create_scanout_buffer */
+    int acquire(uint32_t width, uint32_t height, uint32_t format, pooled_buffer &buffer);
+    /* Gives the buffer back, to be reused or destroyed */
+    void release(pooled_buffer const &buffer);
+
+    /* Destroys cached buffers, least recently released first, until no
+     * more than max_cached_bytes are cached */
+    void trim(uint64_t max_cached_bytes);
+    void clear() { trim(0); }
+    void set_memory_cap(uint64_t memory_cap);
+
+    uint64_t memory_cap() const { return m_memory_cap; }
+    size_t cached() const { return m_lru.size(); }
+    buffer_pool_stats const &stats() const { return m_stats; }
+
+private:
+    BufferPool(BufferPool const &);
+    BufferPool &operator=(BufferPool const &);
+
+    struct size_class
+    {
+        uint32_t width;
+        uint32_t height;
+        uint32_t format;
+
+        bool operator<(size_class const &other) const;
+    };
+
+    /* Least recently released first */
+    typedef std::list<pooled_buffer> lru_list;
+
+    /* Destroys the least recently released cached buffer */
+    void evict_oldest();
+    /* Evicts until extra_bytes more fit under the cap, if they can */
+    void make_room(uint64_t extra_bytes);
+
+    DrmDevice                                      &m_device;
+    uint64_t                                        m_memory_cap;
+    lru_list                                        m_lru;
+    std::multimap<size_class, lru_list::iterator>   m_classes;
+    buffer_pool_stats                               m_stats;
+};
+
+#endif // BUFFER_POOL_H
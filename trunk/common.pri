@@ -0,0 +1,31 @@
+# Settings shared by the drmcore library and the programs using it
+
+QT += core
+QT -= gui
+
+CONFIG += c++11
+
+# The following define makes your compiler emit warnings if you use
+# any feature of Qt which as been marked deprecated (the exact warnings
+# depend on your compiler). Please consult the documentation of the
+# deprecated API in order to know how to port your code away from it.
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# You can also make your code fail to compile if you use deprecated APIs.
+# In order to do so, uncomment the following line.
+# You can also select to disable deprecated APIs only up to a certain version of Qt.
+#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
+
+# The NEON kernels of pixel_ops.cpp are only built when NEON is enabled,
+# which is not the default of every 32 bits ARM toolchain
+equals(QT_ARCH, arm): QMAKE_CXXFLAGS += -mfpu=neon
+
+# add paths
+INCLUDEPATH += /opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/include/libdrm
+INCLUDEPATH += /opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/include/drm
+INCLUDEPATH += /opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/include
+
+unix {
+    LIBS += -L/opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/lib
+    LIBS += -ldrm
+}
@@ -0,0 +1,187 @@
+#include "damage.h"
+
+#include <algorithm>
+
+static inline uint64_t rect_area(damage_rect const &rect)
+{
+    return (uint64_t) (rect.x2 - rect.x1) * (uint64_t) (rect.y2 - rect.y1);
+}
+
+static inline damage_rect rect_union(damage_rect const &a, damage_rect const &b)
+{
+    damage_rect merged =
+    {
+        std::min(a.x1, b.x1), std::min(a.y1, b.y1),
+        std::max(a.x2, b.x2), std::max(a.y2, b.y2)
+    };
+    return merged;
+}
+
+/* Overlapping or sharing an edge */
+static inline bool rect_touches(damage_rect const &a, damage_rect const &b)
+{
+    return a.x1 <= b.x2 && b.x1 <= a.x2 && a.y1 <= b.y2 && b.y1 <= a.y2;
+}
+
+static inline bool rect_contains(damage_rect const &outer, damage_rect const &inner)
+{
+    return outer.x1 <= inner.x1 && outer.y1 <= inner.y1 && outer.x2 >= inner.x2 && outer.y2 >= inner.y2;
+}
+
+/* Area the union would cover without being damaged. Counting the overlap
+ * twice makes it an upper bound, which is good enough here. */
+static inline int64_t union_waste(damage_rect const &a, damage_rect const &b)
+{
+    return (int64_t) rect_area(rect_union(a, b)) - (int64_t) rect_area(a) - (int64_t) rect_area(b);
+}
+
+DamageRegion::DamageRegion(unsigned int max_rects) :
+    m_max_rects(max_rects ? max_rects : 1)
+{
+}
+
+void DamageRegion::add(int32_t x, int32_t y, uint32_t width, uint32_t height)
+{
+    damage_rect rect = { x, y, x + (int32_t) width, y + (int32_t) height };
+    add(rect);
+}
+
+void DamageRegion::add(damage_rect const &rect)
+{
+    if (rect.x2 <= rect.x1 || rect.y2 <= rect.y1)
+        return;
+
+    damage_rect pending = rect;
+
+    /* Absorb every rectangle that touches the new one, as long as the
+     * union is mostly damaged. Each merge can reach new neighbours, so
+     * start again until nothing changes. */
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (size_t r = 0; r < m_rects.size(); r++)
+        {
+            if (rect_contains(m_rects[r], pending))
+                return;
+
+            if (rect_touches(m_rects[r], pending) && union_waste(m_rects[r], pending) <= 0)
+            {
+                pending = rect_union(m_rects[r], pending);
+                m_rects.erase(m_rects.begin() + r);
+                merged = true;
+                break;
+            }
+        }
+    }
+
+    m_rects.push_back(pending);
+    coalesce();
+}
+
+void DamageRegion::add(DamageRegion const &region)
+{
+    for (size_t r = 0; r < region.m_rects.size(); r++)
+        add(region.m_rects[r]);
+}
+
+void DamageRegion::coalesce()
+{
+    while (m_rects.size() > m_max_rects)
+    {
+        size_t best_a = 0, best_b = 1;
+        int64_t best_waste = union_waste(m_rects[0], m_rects[1]);
+
+        for (size_t a = 0; a < m_rects.size(); a++)
+        {
+            for (size_t b = a + 1; b < m_rects.size(); b++)
+            {
+                int64_t const waste = union_waste(m_rects[a], m_rects[b]);
+                if (waste < best_waste)
+                {
+                    best_waste = waste;
+                    best_a = a;
+                    best_b = b;
+                }
+            }
+        }
+
+        m_rects[best_a] = rect_union(m_rects[best_a], m_rects[best_b]);
+        m_rects.erase(m_rects.begin() + best_b);
+    }
+}
+
+void DamageRegion::clip(uint32_t width, uint32_t height)
+{
+    std::vector<damage_rect> clipped;
+    for (size_t r = 0; r < m_rects.size(); r++)
+    {
+        damage_rect rect = m_rects[r];
+        rect.x1 = std::max(rect.x1, 0);
+        rect.y1 = std::max(rect.y1, 0);
+        rect.x2 = std::min(rect.x2, (int32_t) width);
+        rect.y2 = std::min(rect.y2, (int32_t) height);
+
+        if (rect.x2 > rect.x1 && rect.y2 > rect.y1)
+            clipped.push_back(rect);
+    }
+    m_rects.swap(clipped);
+}
+
+uint64_t DamageRegion::area() const
+{
+    uint64_t total = 0;
+    for (size_t r = 0; r < m_rects.size(); r++)
+        total += rect_area(m_rects[r]);
+    return total;
+}
+
+damage_rect DamageRegion::bounds() const
+{
+    damage_rect bounding = { 0, 0, 0, 0 };
+    for (size_t r = 0; r < m_rects.size(); r++)
+        bounding = r ? rect_union(bounding, m_rects[r]) : m_rects[r];
+    return bounding;
+}
+
+DamageHistory::DamageHistory(unsigned int max_age) :
+    m_max_age(max_age)
+{
+}
+
+void DamageHistory::push(DamageRegion const &frame_damage)
+{
+    m_frames.push_front(frame_damage);
+    if (m_frames.size() > m_max_age)
+        m_frames.pop_back();
+}
+
+bool DamageHistory::stale_region(unsigned int age, DamageRegion &region) const
+{
+    region.clear();
+
+    if (age == 0 || age - 1 > m_frames.size())
+        return false;
+
+    for (unsigned int frame = 0; frame + 1 < age; frame++)
+        region.add(m_frames[frame]);
+
+    return true;
+}
+
+void copy_damage(pixel_surface const &destination,
+                 pixel_surface const &source,
+                 DamageRegion const &region)
+{
+    std::vector<damage_rect> const &rects = region.rects();
+    for (size_t r = 0; r < rects.size(); r++)
+    {
+        damage_rect const &rect = rects[r];
+        if (rect.x1 < 0 || rect.y1 < 0)
+            continue;
+
+        pixel_blit(destination, rect.x1, rect.y1,
+                   source, rect.x1, rect.y1,
+                   rect.x2 - rect.x1, rect.y2 - rect.y1);
+    }
+}
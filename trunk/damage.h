@@ -0,0 +1,76 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include "pixel_ops.h"
+
+/* A damaged rectangle. x2 and y2 are excluded.
+ * Same layout as struct drm_mode_rect, used by FB_DAMAGE_CLIPS. */
+struct damage_rect
+{
+    int32_t x1;
+    int32_t y1;
+    int32_t x2;
+    int32_t y2;
+};
+
+/* A set of rectangles that changed in a buffer.
+ * Overlapping or touching rectangles are merged when that does not add
+ * much undamaged area, and the list never grows past max_rects : the
+ * pair whose union wastes the least area is merged instead. */
+class DamageRegion
+{
+public:
+    explicit DamageRegion(unsigned int max_rects = 16);
+
+    void add(int32_t x, int32_t y, uint32_t width, uint32_t height);
+    void add(damage_rect const &rect);
+    void add(DamageRegion const &region);
+
+    /* Drop everything outside of a width x height buffer */
+    void clip(uint32_t width, uint32_t height);
+    void clear() { m_rects.clear(); }
+
+    bool empty() const { return m_rects.empty(); }
+    uint64_t area() const;
+    damage_rect bounds() const;
+    std::vector<damage_rect> const &rects() const { return m_rects; }
+
+private:
+    void coalesce();
+
+    std::vector<damage_rect> m_rects;
+    unsigned int             m_max_rects;
+};
+
+/* The damage of the last frames, most recent first, to find what changed
+ * in a buffer since it was last displayed.
+ * A buffer of age N holds the content of N frames ago. */
+class DamageHistory
+{
+public:
+    explicit DamageHistory(unsigned int max_age = 8);
+
+    /* Damage of the frame just presented */
+    void push(DamageRegion const &frame_damage);
+    void reset() { m_frames.clear(); }
+
+    /* What changed in the last age - 1 frames.
+     * Returns false when it is unknown (age 0 or too old), in which case
+     * the whole buffer must be repainted. */
+    bool stale_region(unsigned int age, DamageRegion &region) const;
+
+private:
+    std::deque<DamageRegion> m_frames;
+    unsigned int             m_max_age;
+};
+
+/* Copy the damaged rectangles of source into destination */
+void copy_damage(pixel_surface const &destination,
+                 pixel_surface const &source,
+                 DamageRegion const &region);
+
+#endif // DAMAGE_H
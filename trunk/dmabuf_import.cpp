@@ -0,0 +1,259 @@
+#include "dmabuf_import.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/udmabuf.h>)
+#include <linux/udmabuf.h>
+#define HAVE_UDMABUF 1
+#endif
+#endif
+
+#include <drm_fourcc.h>
+
+#include <QDebug>
+
+#include "frame_stats.h"
+
+DmabufImporter::DmabufImporter(DrmDevice &device, unsigned int max_cached) :
+    m_device(device),
+    m_max_cached(max_cached ? max_cached : 1),
+    m_use_counter(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+DmabufImporter::~DmabufImporter()
+{
+    clear();
+}
+
+bool DmabufImporter::matches(cache_entry const &entry,
+                             dmabuf_frame const &frame,
+                             buffer_identity const identities[4]) const
+{
+    if (entry.frame.width != frame.width ||
+        entry.frame.height != frame.height ||
+        entry.frame.format != frame.format ||
+        entry.frame.modifier != frame.modifier ||
+        entry.frame.plane_count != frame.plane_count)
+    {
+        return false;
+    }
+
+    for (unsigned int p = 0; p < frame.plane_count; p++)
+    {
+        if (entry.frame.planes[p].offset != frame.planes[p].offset ||
+            entry.frame.planes[p].pitch != frame.planes[p].pitch ||
+            entry.buffers[p].device != identities[p].device ||
+            entry.buffers[p].inode != identities[p].inode)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int DmabufImporter::framebuffer(dmabuf_frame const &frame, uint32_t &fb_id)
+{
+    if (!frame.plane_count || frame.plane_count > 4)
+        return -EINVAL;
+
+    buffer_identity identities[4];
+    memset(identities, 0, sizeof(identities));
+    for (unsigned int p = 0; p < frame.plane_count; p++)
+    {
+        struct stat buffer_stat;
+        if (fstat(frame.planes[p].fd, &buffer_stat))
+            return -errno;
+
+        identities[p].device = buffer_stat.st_dev;
+        identities[p].inode  = buffer_stat.st_ino;
+    }
+
+    for (size_t e = 0; e < m_entries.size(); e++)
+    {
+        if (matches(m_entries[e], frame, identities))
+        {
+            m_entries[e].last_used = ++m_use_counter;
+            m_stats.hits++;
+            fb_id = m_entries[e].fb_id;
+            return 0;
+        }
+    }
+
+    uint64_t const start_us = monotonic_us();
+
+    cache_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.frame = frame;
+    memcpy(entry.buffers, identities, sizeof(identities));
+
+    uint32_t pitches[4] = { 0, 0, 0, 0 };
+    uint32_t offsets[4] = { 0, 0, 0, 0 };
+    uint64_t modifiers[4] = { 0, 0, 0, 0 };
+
+    int ret = 0;
+    unsigned int imported = 0;
+    for (; imported < frame.plane_count; imported++)
+    {
+        ret = m_device.prime_fd_to_handle(frame.planes[imported].fd, &entry.handles[imported]);
+        if (ret)
+        {
+            qDebug("%s %d Could not import the dma-buf of plane %u : %s\n",
+                   __FUNCTION__, __LINE__, imported, strerror(-ret));
+            break;
+        }
+        m_handle_users[entry.handles[imported]]++;
+
+        pitches[imported]   = frame.planes[imported].pitch;
+        offsets[imported]   = frame.planes[imported].offset;
+        modifiers[imported] = frame.modifier;
+    }
+
+    if (!ret)
+    {
+        ret = m_device.add_fb2(frame.width, frame.height, frame.format,
+                               entry.handles, pitches, offsets,
+                               (frame.modifier != DRM_FORMAT_MOD_LINEAR) ? modifiers : NULL,
+                               &entry.fb_id);
+        if (ret)
+            qDebug("%s %d Could not add a %ux%u framebuffer with modifier 0x%llx : %s\n",
+                   __FUNCTION__, __LINE__, frame.width, frame.height,
+                   (unsigned long long) frame.modifier, strerror(-ret));
+    }
+
+    if (ret)
+    {
+        for (unsigned int p = 0; p < imported; p++)
+            release_handle(entry.handles[p]);
+        m_stats.failures++;
+        return ret;
+    }
+
+    if (m_entries.size() >= m_max_cached)
+    {
+        size_t oldest = 0;
+        for (size_t e = 1; e < m_entries.size(); e++)
+        {
+            if (m_entries[e].last_used < m_entries[oldest].last_used)
+                oldest = e;
+        }
+        evict(oldest);
+        m_stats.evictions++;
+    }
+
+    entry.last_used = ++m_use_counter;
+    m_entries.push_back(entry);
+
+    m_stats.imports++;
+    m_stats.import_us += monotonic_us() - start_us;
+    fb_id = entry.fb_id;
+    return 0;
+}
+
+void DmabufImporter::release_handle(uint32_t handle)
+{
+    std::map<uint32_t, unsigned int>::iterator users = m_handle_users.find(handle);
+    if (users == m_handle_users.end())
+        return;
+
+    if (--users->second == 0)
+    {
+        m_device.close_handle(handle);
+        m_handle_users.erase(users);
+    }
+}
+
+void DmabufImporter::evict(size_t index)
+{
+    cache_entry const &entry = m_entries[index];
+
+    m_device.rm_fb(entry.fb_id);
+    for (unsigned int p = 0; p < entry.frame.plane_count; p++)
+        release_handle(entry.handles[p]);
+
+    m_entries.erase(m_entries.begin() + index);
+}
+
+void DmabufImporter::forget(int fd)
+{
+    struct stat buffer_stat;
+    if (fstat(fd, &buffer_stat))
+        return;
+
+    for (size_t e = m_entries.size(); e-- > 0; )
+    {
+        cache_entry const &entry = m_entries[e];
+
+        bool uses_buffer = false;
+        for (unsigned int p = 0; p < entry.frame.plane_count; p++)
+        {
+            uses_buffer |= entry.buffers[p].device == buffer_stat.st_dev &&
+                           entry.buffers[p].inode == buffer_stat.st_ino;
+        }
+
+        if (uses_buffer)
+            evict(e);
+    }
+}
+
+void DmabufImporter::clear()
+{
+    while (!m_entries.empty())
+        evict(m_entries.size() - 1);
+}
+
+int create_stand_in_dmabuf(size_t size)
+{
+    /* udmabuf wants whole pages, and a memfd that cannot shrink */
+    long const page_size = sysconf(_SC_PAGESIZE);
+    size = (size + page_size - 1) / page_size * page_size;
+
+    int memory_fd = memfd_create("stand_in_dmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memory_fd < 0)
+        return -errno;
+
+    if (ftruncate(memory_fd, size))
+    {
+        int const err = errno;
+        close(memory_fd);
+        return -err;
+    }
+
+#ifdef HAVE_UDMABUF
+    int udmabuf_device = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (udmabuf_device >= 0)
+    {
+        int dma_buf_fd = -1;
+        if (fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+        {
+            struct udmabuf_create create_request;
+            memset(&create_request, 0, sizeof(create_request));
+            create_request.memfd  = memory_fd;
+            create_request.flags  = UDMABUF_FLAGS_CLOEXEC;
+            create_request.offset = 0;
+            create_request.size   = size;
+            dma_buf_fd = ioctl(udmabuf_device, UDMABUF_CREATE, &create_request);
+        }
+        close(udmabuf_device);
+
+        /* The dma-buf keeps the pages, the memfd is not needed anymore */
+        if (dma_buf_fd >= 0)
+        {
+            close(memory_fd);
+            return dma_buf_fd;
+        }
+    }
+#endif
+
+    return memory_fd;
+}
@@ -0,0 +1,114 @@
+#ifndef DMABUF_IMPORT_H
+#define DMABUF_IMPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <vector>
+
+#include "drm_device.h"
+
+/* One plane of a buffer shared by another device */
+struct dmabuf_plane
+{
+    int      fd;
+    uint32_t offset;
+    uint32_t pitch;
+};
+
+/* A frame as a V4L2 decoder or a camera hands it over.
+ * Planes can share the same fd, like NV12 buffers usually do. */
+struct dmabuf_frame
+{
+    uint32_t     width;
+    uint32_t     height;
+    /* DRM_FORMAT_* */
+    uint32_t     format;
+    /* DRM_FORMAT_MOD_LINEAR, DRM_FORMAT_MOD_ARM_AFBC(...) */
+    uint64_t     modifier;
+    unsigned int plane_count;
+    dmabuf_plane planes[4];
+};
+
+struct dmabuf_import_stats
+{
+    /* Frames that had to be imported, and frames found in the cache */
+    uint64_t imports;
+    uint64_t hits;
+    uint64_t evictions;
+    uint64_t failures;
+    /* Time spent importing, cache lookups excluded */
+    uint64_t import_us;
+};
+
+/* Turns dma-bufs from other devices into framebuffers that can be
+ * scanned out, without copying them.
+ *
+ * Importing (drmPrimeFDToHandle + drmModeAddFB2WithModifiers) is done
+ * once per buffer. Producers cycle through a small set of buffers, so the
+ * framebuffers are kept and found again by the identity of the dma-bufs
+ * (device and inode of the fd, which stay the same whatever fd number the
+ * producer uses), along with the format, size and layout.
+ *
+ * When more than max_cached framebuffers exist, the least recently used
+ * one is removed. Removing the framebuffer being scanned out turns the
+ * CRTC off, so max_cached must be larger than the number of buffers the
+ * producer cycles through. */
+class DmabufImporter
+{
+public:
+    explicit DmabufImporter(DrmDevice &device, unsigned int max_cached = 16);
+    ~DmabufImporter();
+
+    /* The framebuffer showing frame. Returns 0 or a negative errno. */
+    int framebuffer(dmabuf_frame const &frame, uint32_t &fb_id);
+
+    /* The producer freed the buffer behind fd : drop its framebuffers */
+    void forget(int fd);
+    void clear();
+
+    size_t cached() const { return m_entries.size(); }
+    dmabuf_import_stats const &stats() const { return m_stats; }
+
+private:
+    DmabufImporter(DmabufImporter const &);
+    DmabufImporter &operator=(DmabufImporter const &);
+
+    struct buffer_identity
+    {
+        dev_t device;
+        ino_t inode;
+    };
+
+    struct cache_entry
+    {
+        dmabuf_frame    frame;
+        buffer_identity buffers[4];
+        uint32_t        handles[4];
+        uint32_t        fb_id;
+        uint64_t        last_used;
+    };
+
+    bool matches(cache_entry const &entry,
+                 dmabuf_frame const &frame,
+                 buffer_identity const identities[4]) const;
+    void evict(size_t index);
+    void release_handle(uint32_t handle);
+
+    DrmDevice               &m_device;
+    unsigned int             m_max_cached;
+    std::vector<cache_entry> m_entries;
+    /* Imported handles are shared by every plane and every entry using
+     * the same buffer, and closed when the last one goes away */
+    std::map<uint32_t, unsigned int> m_handle_users;
+    uint64_t                 m_use_counter;
+    dmabuf_import_stats      m_stats;
+};
+
+/* A dma-buf from system memory, standing in for a decoder or camera
+ * buffer when testing : a udmabuf if /dev/udmabuf exists, a plain memfd
+ * otherwise. Returns the fd or a negative errno. */
+int create_stand_in_dmabuf(size_t size);
+
+#endif // DMABUF_IMPORT_H
@@ -0,0 +1,13 @@
+include(common.pri)
+
+TARGET = drmBench
+CONFIG += console
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += drm_bench.cpp
+
+# Same as drmTest.pro
+LIBS = -L$$OUT_PWD -ldrmcore $$LIBS
+PRE_TARGETDEPS += $$OUT_PWD/libdrmcore.a
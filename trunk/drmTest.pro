@@ -1,7 +1,4 @@
-QT += core
-QT -= gui
-
-CONFIG += c++11
+include(common.pri)
 
 TARGET = drmTest
 CONFIG += console
@@ -11,24 +8,7 @@ TEMPLATE = app
 
 SOURCES += main.cpp
 
-# The following define makes your compiler emit warnings if you use
-# any feature of Qt which as been marked deprecated (the exact warnings
-# depend on your compiler). Please consult the documentation of the
-# deprecated API in order to know how to port your code away from it.
-DEFINES += QT_DEPRECATED_WARNINGS
-
-# You can also make your code fail to compile if you use deprecated APIs.
-# In order to do so, uncomment the following line.
-# You can also select to disable deprecated APIs only up to a certain version of Qt.
-#DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
-
-# add paths
-INCLUDEPATH += /opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/include/libdrm
-INCLUDEPATH += /opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/include/drm
-INCLUDEPATH += /opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/include
-
-unix {
-    LIBS += -L/opt/rockchip/output/host/arm-buildroot-linux-gnueabihf/sysroot/usr/lib
-    LIBS += -ldrm
-}
-
+# drmcore is built in the same directory by drmTesting.pro.
+# It goes before -ldrm, which it needs.
+LIBS = -L$$OUT_PWD -ldrmcore $$LIBS
+PRE_TARGETDEPS += $$OUT_PWD/libdrmcore.a
@@ -0,0 +1,12 @@
+# Builds the drmcore library, then the programs linked against it.
+# Open this one rather than drmTest.pro.
+
+TEMPLATE = subdirs
+
+SUBDIRS = drmcore drmTest drmBench
+
+drmcore.file = drmcore.pro
+drmTest.file = drmTest.pro
+drmTest.depends = drmcore
+drmBench.file = drmBench.pro
+drmBench.depends = drmcore
@@ -0,0 +1,596 @@
+// Measures the drawing paths of drmTest without a screen or a keyboard,
+// so that performance regressions can be caught on any machine.
+//
+// The buffers are dumb buffers mapped through PRIME, like the ones the
+// swapchain uses. They come from vkms when the module is loaded, from
+// FakeDrmDevice (memfds with the same pitch and size rules) otherwise.
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <QDebug>
+#include <drm_fourcc.h>
+
+#include "buffer_pool.h"
+#include "drm_device.h"
+#include "pixel_format.h"
+#include "pixel_ops.h"
+
+#ifndef ALIGN_ON_POW2
+#define ALIGN_ON_POW2(n, align) ((n + align - 1) & ~(align - 1))
+#endif
+
+struct bench_options
+{
+    /* Timed frames per case, after the warm up ones */
+    unsigned int frames;
+    /* Use FakeDrmDevice even if vkms is there */
+    bool         memory;
+    /* Only run the cases at this size. 0 runs 720p, 1080p and 4K. */
+    uint32_t     width;
+    uint32_t     height;
+    /* Where to write the results */
+    std::string  output;
+    /* Results to compare with, and how much slower (in %) a case can be
+     * before it is reported as a regression */
+    std::string  baseline;
+    double       tolerance;
+};
+
+static void parse_options(int argc, char *argv[], bench_options &options)
+{
+    options.frames    = 30;
+    options.memory    = false;
+    options.width     = 0;
+    options.height    = 0;
+    options.tolerance = 10;
+    options.output.clear();
+    options.baseline.clear();
+
+    for (int a = 1; a < argc; a++)
+    {
+        if (!strcmp(argv[a], "--frames") && a + 1 < argc)
+            options.frames = strtoul(argv[++a], NULL, 10);
+        else if (!strcmp(argv[a], "--memory"))
+            options.memory = true;
+        else if (!strcmp(argv[a], "--size") && a + 1 < argc)
+            sscanf(argv[++a], "%ux%u", &options.width, &options.height);
+        else if (!strcmp(argv[a], "--output") && a + 1 < argc)
+            options.output = argv[++a];
+        else if (!strcmp(argv[a], "--baseline") && a + 1 < argc)
+            options.baseline = argv[++a];
+        else if (!strcmp(argv[a], "--tolerance") && a + 1 < argc)
+            options.tolerance = strtod(argv[++a], NULL);
+        else
+            qDebug("Usage : %s [--frames N] [--memory] [--size WxH] [--output FILE] [--baseline FILE [--tolerance PERCENT]]",
+                   argv[0]);
+    }
+
+    if (!options.frames)
+        options.frames = 1;
+}
+
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* A mapped dumb buffer, set up like DrmSwapchainBackend::allocate does */
+struct bench_target
+{
+    DumbBuffer    dumb;
+    UniqueFd      dma_buf;
+    Mapping       map;
+    pixel_surface surface;
+};
+
+static int create_target(DrmDevice &device, uint32_t width, uint32_t height, bench_target &target)
+{
+    int ret = target.dumb.create(device, width, height, 32);
+    if (ret)
+    {
+        qDebug("%s %d Could not allocate a %ux%u dumb buffer : %s\n",
+               __FUNCTION__, __LINE__, width, height, strerror(-ret));
+        return ret;
+    }
+
+    int prime_fd = -1;
+    ret = device.prime_handle_to_fd(target.dumb.handle(), DRM_CLOEXEC | DRM_RDWR, &prime_fd);
+    if (ret)
+    {
+        qDebug("%s %d Could not export the dumb buffer : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+    target.dma_buf.reset(prime_fd);
+
+    target.map = Mapping(target.dma_buf.get(), target.dumb.info().size);
+    if (!target.map.valid())
+    {
+        int const err = errno;
+        qDebug("%s %d Could not map the dumb buffer : %s\n",
+               __FUNCTION__, __LINE__, strerror(err));
+        return -err;
+    }
+
+    target.surface.pixels = target.map.get();
+    target.surface.width  = width;
+    target.surface.height = height;
+    target.surface.pitch  = target.dumb.info().pitch;
+    return 0;
+}
+
+/* What the cases read from, in cacheable memory */
+struct bench_sources
+{
+    std::vector<uint8_t> xrgb;
+    std::vector<uint8_t> argb;
+    std::vector<uint8_t> nv12;
+    pixel_surface        xrgb_surface;
+    pixel_surface        argb_surface;
+    pixel_surface        luma;
+    pixel_surface        chroma;
+    std::vector<uint32_t> row_colors;
+};
+
+static void create_sources(uint32_t width, uint32_t height, bench_sources &sources)
+{
+    uint32_t const pitch = ALIGN_ON_POW2(width * 4, 64u);
+    sources.xrgb.resize((size_t) pitch * height);
+    sources.argb.resize((size_t) pitch * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint32_t *xrgb = reinterpret_cast<uint32_t *>(&sources.xrgb[(size_t) y * pitch]);
+        uint32_t *argb = reinterpret_cast<uint32_t *>(&sources.argb[(size_t) y * pitch]);
+        for (uint32_t x = 0; x < width; x++)
+        {
+            uint32_t const color = ((x & 0xff) << 16) | ((y & 0xff) << 8) | ((x ^ y) & 0xff);
+            xrgb[x] = 0xff000000 | color;
+            argb[x] = (((x + y) & 0xff) << 24) | color;
+        }
+    }
+
+    pixel_surface const xrgb_surface = { &sources.xrgb[0], width, height, pitch };
+    pixel_surface const argb_surface = { &sources.argb[0], width, height, pitch };
+    sources.xrgb_surface = xrgb_surface;
+    sources.argb_surface = argb_surface;
+
+    /* NV12 as a decoder hands it over, chroma right after luma */
+    uint32_t const luma_pitch = ALIGN_ON_POW2(width, 64u);
+    sources.nv12.resize((size_t) luma_pitch * height * 3 / 2);
+    pixel_surface const luma   = { &sources.nv12[0], width, height, luma_pitch };
+    pixel_surface const chroma = { &sources.nv12[(size_t) luma_pitch * height], width / 2, height / 2, luma_pitch };
+    sources.luma   = luma;
+    sources.chroma = chroma;
+    pixel_xrgb_to_nv12(luma, chroma, xrgb_surface);
+
+    uint32_t const colors[] = { 0xffff0000, 0xff00ff00, 0xff0000ff };
+    sources.row_colors.resize(height);
+    for (uint32_t y = 0; y < height; y++)
+        sources.row_colors[y] = colors[y % 3];
+}
+
+enum bench_case
+{
+    CASE_FILL,
+    CASE_ROWS,
+    CASE_BLIT,
+    CASE_BLEND,
+    CASE_XRGB_TO_RGB565,
+    CASE_NV12_TO_XRGB,
+    CASE_FILL_RGB565,
+    CASE_XRGB_TO_NV16,
+    CASE_COUNT
+};
+
+struct bench_case_info
+{
+    char const *name;
+    /* Bytes read and written per pixel */
+    double      bytes_per_pixel;
+};
+
+static bench_case_info const case_infos[CASE_COUNT] = {
+    { "fill",           4 },
+    /* One pixel_fill_rect per row, like the drmTest loop */
+    { "rows",           4 },
+    { "blit",           8 },
+    /* Source and destination read, destination written */
+    { "blend",          12 },
+    { "xrgb_to_rgb565", 6 },
+    { "nv12_to_xrgb",   5.5 },
+    /* Half the bytes of fill to scan out */
+    { "fill_rgb565",    2 },
+    { "xrgb_to_nv16",   6 }
+};
+
+static void draw_case(bench_case which, pixel_surface const &target, bench_sources const &sources)
+{
+    switch (which)
+    {
+    case CASE_FILL:
+        pixel_fill(target, 0xff336699);
+        break;
+    case CASE_ROWS:
+        for (uint32_t row = 0; row < target.height; row++)
+            pixel_fill_rect(target, 0, row, target.width, 1, sources.row_colors[row]);
+        break;
+    case CASE_BLIT:
+        pixel_blit(target, 0, 0, sources.xrgb_surface, 0, 0, target.width, target.height);
+        break;
+    case CASE_BLEND:
+        pixel_blend(target, 0, 0, sources.argb_surface, 0, 0, target.width, target.height);
+        break;
+    case CASE_XRGB_TO_RGB565:
+    {
+        /* The RGB565 image fits in the pitch of the XRGB8888 buffer */
+        pixel_surface const rgb565 = { target.pixels, target.width, target.height, target.pitch };
+        pixel_xrgb_to_rgb565(rgb565, sources.xrgb_surface);
+        break;
+    }
+    case CASE_NV12_TO_XRGB:
+        pixel_nv12_to_xrgb(target, sources.luma, sources.chroma);
+        break;
+    case CASE_FILL_RGB565:
+    {
+        pixel_image rgb565;
+        pixel_image_layout(DRM_FORMAT_RGB565, target.width, target.height, target.pixels, target.pitch, rgb565);
+        pixel_fill_rect_as<DRM_FORMAT_RGB565>(rgb565, 0, 0, target.width, target.height, 0xff336699);
+        break;
+    }
+    case CASE_XRGB_TO_NV16:
+    {
+        /* Both NV16 planes fit in the XRGB8888 buffer at half its pitch */
+        pixel_image nv16, xrgb;
+        pixel_image_layout(DRM_FORMAT_NV16, target.width, target.height, target.pixels, target.pitch / 2, nv16);
+        pixel_image_layout(DRM_FORMAT_XRGB8888, sources.xrgb_surface.width, sources.xrgb_surface.height,
+                           sources.xrgb_surface.pixels, sources.xrgb_surface.pitch, xrgb);
+        pixel_convert_as<DRM_FORMAT_NV16, DRM_FORMAT_XRGB8888>(nv16, 0, 0, xrgb, 0, 0, target.width, target.height);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+struct bench_result
+{
+    std::string name;
+    uint32_t    width;
+    uint32_t    height;
+    /* Median frame time */
+    double      frame_us;
+    double      mpix_per_s;
+    double      gb_per_s;
+};
+
+/* Each frame is bracketed with DMA_BUF_IOCTL_SYNC, like the swapchain
+ * does. The median frame time is reported : it ignores the frames
+ * delayed by the scheduler, which the mean does not. */
+static bench_result run_case(bench_case which,
+                             bench_target &target,
+                             bench_sources const &sources,
+                             unsigned int frames)
+{
+    cpu_access_mode const mode = (which == CASE_BLEND) ? CPU_ACCESS_READ_WRITE : CPU_ACCESS_WRITE;
+
+    unsigned int const warm_up_frames = 3;
+    for (unsigned int frame = 0; frame < warm_up_frames; frame++)
+    {
+        CpuAccess access(target.dma_buf.get(), mode);
+        draw_case(which, target.surface, sources);
+    }
+
+    std::vector<uint64_t> frame_ns(frames);
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        uint64_t const start_ns = monotonic_ns();
+        {
+            CpuAccess access(target.dma_buf.get(), mode);
+            draw_case(which, target.surface, sources);
+        }
+        frame_ns[frame] = monotonic_ns() - start_ns;
+    }
+
+    std::sort(frame_ns.begin(), frame_ns.end());
+    double const median_us = frame_ns[frames / 2] / 1000.0;
+    double const pixels    = (double) target.surface.width * target.surface.height;
+
+    bench_result result;
+    result.name       = case_infos[which].name;
+    result.width      = target.surface.width;
+    result.height     = target.surface.height;
+    result.frame_us   = median_us;
+    result.mpix_per_s = median_us > 0 ? pixels / median_us : 0;
+    result.gb_per_s   = median_us > 0 ? pixels * case_infos[which].bytes_per_pixel / median_us / 1000.0 : 0;
+    return result;
+}
+
+/* What a mode change or a menu popping up allocates : a swapchain at the
+ * screen size, an OSD and a subtitle band. Each cycle creates them, draws
+ * them once, which faults in the pages of new buffers, and drops them,
+ * through a pool capped at memory_cap bytes. A cap of 0 keeps nothing,
+ * which is creating and destroying every buffer. */
+static bench_result run_alloc_case(DrmDevice &device,
+                                   uint32_t width,
+                                   uint32_t height,
+                                   uint64_t memory_cap,
+                                   unsigned int cycles,
+                                   buffer_pool_stats &stats)
+{
+    struct layer_size
+    {
+        uint32_t width;
+        uint32_t height;
+        uint32_t format;
+    };
+    layer_size const layers[] = {
+        { width,         height,     DRM_FORMAT_XRGB8888 },
+        { width,         height,     DRM_FORMAT_XRGB8888 },
+        { width,         height,     DRM_FORMAT_XRGB8888 },
+        { width / 3,     height / 3, DRM_FORMAT_ARGB8888 },
+        { width * 2 / 3, height / 8, DRM_FORMAT_ARGB8888 }
+    };
+    unsigned int const layer_count = sizeof(layers) / sizeof(layers[0]);
+
+    BufferPool pool(device, memory_cap);
+    std::vector<uint64_t> cycle_ns;
+    pooled_buffer buffers[layer_count];
+
+    /* The first cycle fills the pool */
+    for (unsigned int cycle = 0; cycle <= cycles; cycle++)
+    {
+        uint64_t const start_ns = monotonic_ns();
+        unsigned int created = 0;
+        for (; created < layer_count; created++)
+        {
+            layer_size const &layer = layers[created];
+            if (pool.acquire(layer.width, layer.height, layer.format, buffers[created]))
+                break;
+
+            pixel_surface const surface = { buffers[created].map, layer.width, layer.height, buffers[created].pitch };
+            CpuAccess access(buffers[created].dma_buf_fd, CPU_ACCESS_WRITE);
+            pixel_fill(surface, 0xff336699);
+        }
+        for (unsigned int b = 0; b < created; b++)
+            pool.release(buffers[b]);
+
+        if (cycle)
+            cycle_ns.push_back(monotonic_ns() - start_ns);
+    }
+
+    std::sort(cycle_ns.begin(), cycle_ns.end());
+    stats = pool.stats();
+
+    bench_result result;
+    result.name       = memory_cap ? "alloc_pooled" : "alloc_direct";
+    result.width      = width;
+    result.height     = height;
+    result.frame_us   = cycle_ns.empty() ? 0 : cycle_ns[cycle_ns.size() / 2] / 1000.0;
+    result.mpix_per_s = 0;
+    result.gb_per_s   = 0;
+    return result;
+}
+
+/* One result per line, so that read_baseline does not need a JSON parser */
+static int write_results(std::string const &path,
+                         char const *device_name,
+                         std::vector<bench_result> const &results)
+{
+    FILE *output = fopen(path.c_str(), "w");
+    if (!output)
+        return -errno;
+
+    fprintf(output, "{\n  \"device\": \"%s\",\n  \"kernels\": \"%s\",\n  \"results\": [\n",
+            device_name, pixel_ops_kernels().name);
+    for (size_t r = 0; r < results.size(); r++)
+    {
+        bench_result const &result = results[r];
+        fprintf(output, "    { \"case\": \"%s\", \"width\": %u, \"height\": %u, \"frame_us\": %.1f, \"mpix_per_s\": %.1f, \"gb_per_s\": %.3f }%s\n",
+                result.name.c_str(), result.width, result.height,
+                result.frame_us, result.mpix_per_s, result.gb_per_s,
+                (r + 1 < results.size()) ? "," : "");
+    }
+    fprintf(output, "  ]\n}\n");
+
+    /* A failed fprintf only leaves the error flag, not errno */
+    bool const failed = ferror(output);
+    if (fclose(output))
+        return -errno;
+    return failed ? -EIO : 0;
+}
+
+/* device_name and kernels : where the baseline was recorded, left empty
+ * if the file does not say */
+static int read_baseline(std::string const &path,
+                         std::string &device_name,
+                         std::string &kernels,
+                         std::vector<bench_result> &results)
+{
+    FILE *input = fopen(path.c_str(), "r");
+    if (!input)
+        return -errno;
+
+    device_name.clear();
+    kernels.clear();
+
+    char line[512];
+    while (fgets(line, sizeof(line), input))
+    {
+        char name[64];
+        bench_result result;
+        if (sscanf(line, " \"device\": \"%63[^\"]\"", name) == 1)
+        {
+            device_name = name;
+        }
+        else if (sscanf(line, " \"kernels\": \"%63[^\"]\"", name) == 1)
+        {
+            kernels = name;
+        }
+        else if (sscanf(line,
+                   " { \"case\": \"%63[^\"]\", \"width\": %u, \"height\": %u, \"frame_us\": %lf, \"mpix_per_s\": %lf, \"gb_per_s\": %lf",
+                   name, &result.width, &result.height,
+                   &result.frame_us, &result.mpix_per_s, &result.gb_per_s) == 6)
+        {
+            result.name = name;
+            results.push_back(result);
+        }
+    }
+
+    fclose(input);
+    return 0;
+}
+
+/* Returns the number of cases slower than the baseline by more than
+ * tolerance percent */
+static unsigned int compare_with_baseline(std::vector<bench_result> const &results,
+                                          std::vector<bench_result> const &baseline,
+                                          double tolerance)
+{
+    unsigned int regressions = 0;
+    for (size_t r = 0; r < results.size(); r++)
+    {
+        bench_result const &result = results[r];
+        for (size_t b = 0; b < baseline.size(); b++)
+        {
+            bench_result const &reference = baseline[b];
+            if (reference.name != result.name ||
+                reference.width != result.width ||
+                reference.height != result.height ||
+                reference.frame_us <= 0)
+            {
+                continue;
+            }
+
+            double const change = (result.frame_us - reference.frame_us) * 100.0 / reference.frame_us;
+            if (change > tolerance)
+            {
+                qDebug("REGRESSION %s %ux%u : %.1f us per frame instead of %.1f (+%.1f%%)",
+                       result.name.c_str(), result.width, result.height,
+                       result.frame_us, reference.frame_us, change);
+                regressions++;
+            }
+        }
+    }
+    return regressions;
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options options;
+    parse_options(argc, argv, options);
+
+    LinuxDrmDevice vkms;
+    FakeDrmDevice memory;
+    DrmDevice *device = &memory;
+    char const *device_name = "memory";
+    if (!options.memory && vkms.open_driver("vkms") == 0)
+    {
+        device = &vkms;
+        device_name = "vkms";
+    }
+
+    std::vector<std::pair<uint32_t, uint32_t> > sizes;
+    if (options.width && options.height)
+    {
+        sizes.push_back(std::make_pair(options.width, options.height));
+    }
+    else
+    {
+        sizes.push_back(std::make_pair(1280u, 720u));
+        sizes.push_back(std::make_pair(1920u, 1080u));
+        sizes.push_back(std::make_pair(3840u, 2160u));
+    }
+
+    qDebug("%s buffers, %s kernels, %u frames per case",
+           device_name, pixel_ops_kernels().name, options.frames);
+
+    std::vector<bench_result> results;
+    for (size_t s = 0; s < sizes.size(); s++)
+    {
+        bench_target target;
+        int ret = create_target(*device, sizes[s].first, sizes[s].second, target);
+        if (ret)
+            return 1;
+
+        bench_sources sources;
+        create_sources(sizes[s].first, sizes[s].second, sources);
+
+        for (int c = 0; c < CASE_COUNT; c++)
+        {
+            bench_result const result = run_case((bench_case) c, target, sources, options.frames);
+            qDebug("%-14s %4ux%-4u : %9.1f us per frame, %8.1f MPix/s, %6.2f GB/s",
+                   result.name.c_str(), result.width, result.height,
+                   result.frame_us, result.mpix_per_s, result.gb_per_s);
+            results.push_back(result);
+        }
+
+        uint64_t const memory_caps[] = { 0, 256ull << 20 };
+        for (unsigned int c = 0; c < 2; c++)
+        {
+            buffer_pool_stats stats;
+            bench_result const result = run_alloc_case(*device, sizes[s].first, sizes[s].second,
+                                                       memory_caps[c], options.frames, stats);
+            qDebug("%-14s %4ux%-4u : %9.1f us per cycle, %llu hits, %llu misses, %llu evictions, %llu us creating, %llu us destroying",
+                   result.name.c_str(), result.width, result.height, result.frame_us,
+                   (unsigned long long) stats.hits,
+                   (unsigned long long) stats.misses,
+                   (unsigned long long) stats.evictions,
+                   (unsigned long long) stats.create_us,
+                   (unsigned long long) stats.destroy_us);
+            results.push_back(result);
+        }
+    }
+
+    if (!options.output.empty())
+    {
+        int ret = write_results(options.output, device_name, results);
+        if (ret)
+        {
+            qDebug("%s %d Could not write %s : %s\n",
+                   __FUNCTION__, __LINE__, options.output.c_str(), strerror(-ret));
+            return 1;
+        }
+    }
+
+    if (!options.baseline.empty())
+    {
+        std::string baseline_device, baseline_kernels;
+        std::vector<bench_result> baseline;
+        int ret = read_baseline(options.baseline, baseline_device, baseline_kernels, baseline);
+        if (ret)
+        {
+            qDebug("%s %d Could not read %s : %s\n",
+                   __FUNCTION__, __LINE__, options.baseline.c_str(), strerror(-ret));
+            return 1;
+        }
+
+        /* vkms and memory buffers, or AVX2 and scalar kernels, are not
+         * the same measurement : comparing them means nothing */
+        if ((!baseline_device.empty() && baseline_device != device_name) ||
+            (!baseline_kernels.empty() && baseline_kernels != pixel_ops_kernels().name))
+        {
+            qDebug("%s was recorded with %s buffers and %s kernels, not %s and %s : not compared",
+                   options.baseline.c_str(),
+                   baseline_device.c_str(), baseline_kernels.c_str(),
+                   device_name, pixel_ops_kernels().name);
+            return 0;
+        }
+
+        unsigned int const regressions = compare_with_baseline(results, baseline, options.tolerance);
+        qDebug("%u regressions against %s (tolerance %.0f%%)",
+               regressions, options.baseline.c_str(), options.tolerance);
+        if (regressions)
+            return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,1213 @@
+#include "drm_device.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <drm_fourcc.h>
+#include <linux/dma-buf.h>
+
+#include <QDebug>
+
+#include "pixel_format.h"
+
+#ifndef ALIGN_ON_POW2
+#define ALIGN_ON_POW2(n, align) ((n + align - 1) & ~(align - 1))
+#endif
+
+/* ---- Linux DRM device ---- */
+
+LinuxDrmDevice::LinuxDrmDevice() :
+    m_fd(-1)
+{
+}
+
+LinuxDrmDevice::~LinuxDrmDevice()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int LinuxDrmDevice::open(char const *path)
+{
+    if (m_fd >= 0)
+        return -EBUSY;
+
+    m_fd = ::open(path, O_RDWR | O_CLOEXEC);
+    return (m_fd >= 0) ? 0 : -errno;
+}
+
+int LinuxDrmDevice::open_driver(char const *driver_name)
+{
+    if (m_fd >= 0)
+        return -EBUSY;
+
+    for (unsigned int card = 0; card < 16; card++)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/dri/card%u", card);
+
+        int fd = ::open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        drmVersionPtr version = drmGetVersion(fd);
+        bool const matches = version && version->name && !strcmp(version->name, driver_name);
+        if (version)
+            drmFreeVersion(version);
+
+        if (matches)
+        {
+            m_fd = fd;
+            return 0;
+        }
+        close(fd);
+    }
+
+    return -ENODEV;
+}
+
+drmModeRes *LinuxDrmDevice::get_resources()
+{
+    return drmModeGetResources(m_fd);
+}
+
+void LinuxDrmDevice::free_resources(drmModeRes *resources)
+{
+    drmModeFreeResources(resources);
+}
+
+drmModeConnector *LinuxDrmDevice::get_connector(uint32_t connector_id)
+{
+    return drmModeGetConnector(m_fd, connector_id);
+}
+
+drmModeConnector *LinuxDrmDevice::get_connector_current(uint32_t connector_id)
+{
+    return drmModeGetConnectorCurrent(m_fd, connector_id);
+}
+
+void LinuxDrmDevice::free_connector(drmModeConnector *connector)
+{
+    drmModeFreeConnector(connector);
+}
+
+int LinuxDrmDevice::get_edid(uint32_t connector_id, std::vector<uint8_t> &edid)
+{
+    edid.clear();
+
+    drmModeObjectProperties *properties =
+        drmModeObjectGetProperties(m_fd, connector_id, DRM_MODE_OBJECT_CONNECTOR);
+    if (!properties)
+        return errno ? -errno : -ENOENT;
+
+    int ret = -ENOENT;
+    for (uint32_t p = 0; p < properties->count_props && ret == -ENOENT; p++)
+    {
+        drmModePropertyRes *property = drmModeGetProperty(m_fd, properties->props[p]);
+        if (!property)
+            continue;
+
+        if (!strcmp(property->name, "EDID") && properties->prop_values[p])
+        {
+            drmModePropertyBlobRes *blob =
+                drmModeGetPropertyBlob(m_fd, properties->prop_values[p]);
+            if (blob)
+            {
+                uint8_t const *data = static_cast<uint8_t const *>(blob->data);
+                edid.assign(data, data + blob->length);
+                drmModeFreePropertyBlob(blob);
+                ret = 0;
+            }
+        }
+        drmModeFreeProperty(property);
+    }
+
+    drmModeFreeObjectProperties(properties);
+    return ret;
+}
+
+drmModeEncoder *LinuxDrmDevice::get_encoder(uint32_t encoder_id)
+{
+    return drmModeGetEncoder(m_fd, encoder_id);
+}
+
+void LinuxDrmDevice::free_encoder(drmModeEncoder *encoder)
+{
+    drmModeFreeEncoder(encoder);
+}
+
+drmModeCrtc *LinuxDrmDevice::get_crtc(uint32_t crtc_id)
+{
+    return drmModeGetCrtc(m_fd, crtc_id);
+}
+
+void LinuxDrmDevice::free_crtc(drmModeCrtc *crtc)
+{
+    drmModeFreeCrtc(crtc);
+}
+
+int LinuxDrmDevice::set_crtc(uint32_t crtc_id, uint32_t fb_id,
+                             uint32_t *connector_ids, int connector_count,
+                             drmModeModeInfo *mode)
+{
+    return drmModeSetCrtc(m_fd, crtc_id, fb_id, 0, 0, connector_ids, connector_count, mode);
+}
+
+int LinuxDrmDevice::page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data)
+{
+    return drmModePageFlip(m_fd, crtc_id, fb_id, flags, user_data);
+}
+
+int LinuxDrmDevice::dirty_fb(uint32_t fb_id, drmModeClip *clips, uint32_t clip_count)
+{
+    return drmModeDirtyFB(m_fd, fb_id, clips, clip_count);
+}
+
+int LinuxDrmDevice::handle_event(drmEventContext &context)
+{
+    return drmHandleEvent(m_fd, &context) ? -EIO : 0;
+}
+
+int LinuxDrmDevice::create_dumb(struct drm_mode_create_dumb &request)
+{
+    return drmIoctl(m_fd, DRM_IOCTL_MODE_CREATE_DUMB, &request) ? -errno : 0;
+}
+
+int LinuxDrmDevice::destroy_dumb(uint32_t handle)
+{
+    struct drm_mode_destroy_dumb destroy_request;
+    memset(&destroy_request, 0, sizeof(destroy_request));
+    destroy_request.handle = handle;
+    return drmIoctl(m_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_request) ? -errno : 0;
+}
+
+int LinuxDrmDevice::add_fb(uint32_t width, uint32_t height,
+                           uint8_t depth, uint8_t bpp,
+                           uint32_t pitch, uint32_t handle,
+                           uint32_t *fb_id)
+{
+    return drmModeAddFB(m_fd, width, height, depth, bpp, pitch, handle, fb_id);
+}
+
+int LinuxDrmDevice::rm_fb(uint32_t fb_id)
+{
+    return drmModeRmFB(m_fd, fb_id);
+}
+
+int LinuxDrmDevice::prime_handle_to_fd(uint32_t handle, uint32_t flags, int *dma_buf_fd)
+{
+    return drmPrimeHandleToFD(m_fd, handle, flags, dma_buf_fd) ? -errno : 0;
+}
+
+int LinuxDrmDevice::prime_fd_to_handle(int dma_buf_fd, uint32_t *handle)
+{
+    return drmPrimeFDToHandle(m_fd, dma_buf_fd, handle) ? -errno : 0;
+}
+
+int LinuxDrmDevice::close_handle(uint32_t handle)
+{
+    struct drm_gem_close close_request;
+    memset(&close_request, 0, sizeof(close_request));
+    close_request.handle = handle;
+    return drmIoctl(m_fd, DRM_IOCTL_GEM_CLOSE, &close_request) ? -errno : 0;
+}
+
+int LinuxDrmDevice::add_fb2(uint32_t width, uint32_t height, uint32_t pixel_format,
+                            uint32_t const handles[4], uint32_t const pitches[4],
+                            uint32_t const offsets[4], uint64_t const modifiers[4],
+                            uint32_t *fb_id)
+{
+    if (!modifiers)
+        return drmModeAddFB2(m_fd, width, height, pixel_format,
+                             handles, pitches, offsets, fb_id, 0);
+
+    return drmModeAddFB2WithModifiers(m_fd, width, height, pixel_format,
+                                      handles, pitches, offsets, modifiers,
+                                      fb_id, DRM_MODE_FB_MODIFIERS);
+}
+
+/* ---- Fake DRM device ---- */
+
+FakeDrmDevice::FakeDrmDevice() :
+    m_event_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)),
+    m_next_id(1),
+    m_calls(0),
+    m_probes(0),
+    m_probe_delay_us(0),
+    m_afbc_supported(false),
+    m_simulate_vblank(false),
+    m_live_mode_objects(0)
+{
+}
+
+FakeDrmDevice::~FakeDrmDevice()
+{
+    for (std::map<uint32_t, dumb_state>::iterator dumb = m_dumb_buffers.begin();
+         dumb != m_dumb_buffers.end();
+         ++dumb)
+    {
+        close(dumb->second.memory_fd);
+    }
+
+    for (std::map<uint32_t, import_state>::iterator imported = m_imports.begin();
+         imported != m_imports.end();
+         ++imported)
+    {
+        close(imported->second.dma_buf_fd);
+    }
+
+    if (m_event_fd >= 0)
+        close(m_event_fd);
+}
+
+uint32_t FakeDrmDevice::add_connector(fake_connector const &connector)
+{
+    unsigned int const crtc_index = m_crtcs.size();
+    uint32_t const connector_id = add_connector(connector, 1u << crtc_index);
+    add_crtc();
+
+    if (connector.connected && !connector.modes.empty())
+    {
+        /* Whatever the console left on screen. It belongs to nobody, so
+         * it is not counted by live_objects */
+        crtc_state &crtc = m_crtcs[crtc_index];
+        crtc.active = true;
+        crtc.mode   = connector.modes[0];
+        crtc.fb_id  = m_next_id++;
+        crtc.vblank_period_ns = 1000000000ull / (crtc.mode.vrefresh ? crtc.mode.vrefresh : 60);
+        m_connectors.back().crtc_index = crtc_index;
+    }
+
+    return connector_id;
+}
+
+uint32_t FakeDrmDevice::add_connector(fake_connector const &connector, uint32_t possible_crtcs)
+{
+    connector_state state;
+    state.connector_id   = m_next_id++;
+    state.encoder_id     = m_next_id++;
+    state.possible_crtcs = possible_crtcs;
+    state.crtc_index     = -1;
+    state.description    = connector;
+    /* Probed at boot by the console */
+    state.probed         = connector;
+    m_connectors.push_back(state);
+
+    return state.connector_id;
+}
+
+uint32_t FakeDrmDevice::add_crtc()
+{
+    crtc_state crtc;
+    memset(&crtc, 0, sizeof(crtc));
+    crtc.crtc_id = m_next_id++;
+    m_crtcs.push_back(crtc);
+    return crtc.crtc_id;
+}
+
+void FakeDrmDevice::hotplug(uint32_t connector_id, fake_connector const &connector)
+{
+    connector_state *state = find_connector(connector_id);
+    if (!state)
+        return;
+
+    state->description      = connector;
+    state->probed.connected = connector.connected;
+    state->probed.edid      = connector.edid;
+}
+
+void FakeDrmDevice::fail_next(char const *name, int error)
+{
+    m_failures[name] = error;
+}
+
+int FakeDrmDevice::injected_failure(char const *name)
+{
+    m_calls++;
+
+    std::map<std::string, int>::iterator failure = m_failures.find(name);
+    if (failure == m_failures.end())
+        return 0;
+
+    int const error = failure->second;
+    m_failures.erase(failure);
+    return -error;
+}
+
+unsigned int FakeDrmDevice::live_objects() const
+{
+    return m_live_mode_objects + m_dumb_buffers.size() + m_imports.size() + m_framebuffers.size();
+}
+
+FakeDrmDevice::crtc_state *FakeDrmDevice::find_crtc(uint32_t crtc_id)
+{
+    for (size_t c = 0; c < m_crtcs.size(); c++)
+    {
+        if (m_crtcs[c].crtc_id == crtc_id)
+            return &m_crtcs[c];
+    }
+    return NULL;
+}
+
+drmModeRes *FakeDrmDevice::get_resources()
+{
+    if (injected_failure("get_resources"))
+        return NULL;
+
+    drmModeRes *resources = new drmModeRes();
+    resources->count_crtcs      = m_crtcs.size();
+    resources->count_connectors = m_connectors.size();
+    resources->count_encoders   = m_connectors.size();
+    resources->crtcs      = new uint32_t[m_crtcs.size()];
+    resources->connectors = new uint32_t[m_connectors.size()];
+    resources->encoders   = new uint32_t[m_connectors.size()];
+    resources->max_width  = 8192;
+    resources->max_height = 8192;
+
+    for (size_t c = 0; c < m_crtcs.size(); c++)
+        resources->crtcs[c] = m_crtcs[c].crtc_id;
+
+    for (size_t c = 0; c < m_connectors.size(); c++)
+    {
+        resources->connectors[c] = m_connectors[c].connector_id;
+        resources->encoders[c]   = m_connectors[c].encoder_id;
+    }
+
+    m_live_mode_objects++;
+    return resources;
+}
+
+void FakeDrmDevice::free_resources(drmModeRes *resources)
+{
+    if (!resources)
+        return;
+
+    delete[] resources->crtcs;
+    delete[] resources->connectors;
+    delete[] resources->encoders;
+    delete resources;
+    m_live_mode_objects--;
+}
+
+FakeDrmDevice::connector_state *FakeDrmDevice::find_connector(uint32_t connector_id)
+{
+    for (size_t c = 0; c < m_connectors.size(); c++)
+    {
+        if (m_connectors[c].connector_id == connector_id)
+            return &m_connectors[c];
+    }
+    return NULL;
+}
+
+drmModeConnector *FakeDrmDevice::copy_connector(connector_state const &state)
+{
+    fake_connector const &probed = state.probed;
+    bool const driven = state.crtc_index >= 0 && m_crtcs[state.crtc_index].active;
+
+    drmModeConnector *connector = new drmModeConnector();
+    connector->connector_id      = state.connector_id;
+    connector->encoder_id        = driven ? state.encoder_id : 0;
+    connector->connector_type    = probed.connector_type;
+    connector->connector_type_id = 1;
+    connector->connection        = probed.connected ? DRM_MODE_CONNECTED : DRM_MODE_DISCONNECTED;
+    connector->count_modes       = probed.connected ? probed.modes.size() : 0;
+    connector->modes             = new drmModeModeInfo[connector->count_modes + 1];
+    for (int m = 0; m < connector->count_modes; m++)
+        connector->modes[m] = probed.modes[m];
+    connector->count_encoders    = 1;
+    connector->encoders          = new uint32_t[1];
+    connector->encoders[0]       = state.encoder_id;
+
+    m_live_mode_objects++;
+    return connector;
+}
+
+drmModeConnector *FakeDrmDevice::get_connector(uint32_t connector_id)
+{
+    if (injected_failure("get_connector"))
+        return NULL;
+
+    connector_state *state = find_connector(connector_id);
+    if (!state)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    /* A full probe sees what is really plugged in */
+    m_probes++;
+    if (m_probe_delay_us)
+        usleep(m_probe_delay_us);
+    state->probed = state->description;
+
+    return copy_connector(*state);
+}
+
+drmModeConnector *FakeDrmDevice::get_connector_current(uint32_t connector_id)
+{
+    if (injected_failure("get_connector_current"))
+        return NULL;
+
+    connector_state const *state = find_connector(connector_id);
+    if (!state)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return copy_connector(*state);
+}
+
+void FakeDrmDevice::free_connector(drmModeConnector *connector)
+{
+    if (!connector)
+        return;
+
+    delete[] connector->modes;
+    delete[] connector->encoders;
+    delete connector;
+    m_live_mode_objects--;
+}
+
+int FakeDrmDevice::get_edid(uint32_t connector_id, std::vector<uint8_t> &edid)
+{
+    edid.clear();
+
+    int ret = injected_failure("get_edid");
+    if (ret)
+        return ret;
+
+    connector_state const *state = find_connector(connector_id);
+    if (!state)
+        return -ENOENT;
+    if (!state->probed.connected || state->probed.edid.empty())
+        return -ENOENT;
+
+    edid = state->probed.edid;
+    return 0;
+}
+
+drmModeEncoder *FakeDrmDevice::get_encoder(uint32_t encoder_id)
+{
+    if (injected_failure("get_encoder"))
+        return NULL;
+
+    /* Each connector has its own encoder */
+    for (size_t c = 0; c < m_connectors.size(); c++)
+    {
+        connector_state const &state = m_connectors[c];
+        if (state.encoder_id != encoder_id)
+            continue;
+
+        bool const driven = state.crtc_index >= 0 && m_crtcs[state.crtc_index].active;
+
+        drmModeEncoder *encoder = new drmModeEncoder();
+        encoder->encoder_id     = encoder_id;
+        encoder->crtc_id        = driven ? m_crtcs[state.crtc_index].crtc_id : 0;
+        encoder->possible_crtcs = state.possible_crtcs;
+
+        m_live_mode_objects++;
+        return encoder;
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+void FakeDrmDevice::free_encoder(drmModeEncoder *encoder)
+{
+    if (!encoder)
+        return;
+
+    delete encoder;
+    m_live_mode_objects--;
+}
+
+drmModeCrtc *FakeDrmDevice::get_crtc(uint32_t crtc_id)
+{
+    if (injected_failure("get_crtc"))
+        return NULL;
+
+    crtc_state const *state = find_crtc(crtc_id);
+    if (!state)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    drmModeCrtc *crtc = new drmModeCrtc();
+    crtc->crtc_id    = state->crtc_id;
+    crtc->buffer_id  = state->fb_id;
+    crtc->mode_valid = state->active;
+    crtc->mode       = state->mode;
+    crtc->width      = state->mode.hdisplay;
+    crtc->height     = state->mode.vdisplay;
+
+    m_live_mode_objects++;
+    return crtc;
+}
+
+void FakeDrmDevice::free_crtc(drmModeCrtc *crtc)
+{
+    if (!crtc)
+        return;
+
+    delete crtc;
+    m_live_mode_objects--;
+}
+
+int FakeDrmDevice::set_crtc(uint32_t crtc_id, uint32_t fb_id,
+                            uint32_t *connector_ids, int connector_count,
+                            drmModeModeInfo *mode)
+{
+    int ret = injected_failure("set_crtc");
+    if (ret)
+        return ret;
+
+    crtc_state *crtc = find_crtc(crtc_id);
+    if (!crtc)
+        return -ENOENT;
+    int const crtc_index = crtc - &m_crtcs[0];
+
+    if (!fb_id)
+    {
+        crtc->active = false;
+        crtc->fb_id  = 0;
+        for (size_t c = 0; c < m_connectors.size(); c++)
+        {
+            if (m_connectors[c].crtc_index == crtc_index)
+                m_connectors[c].crtc_index = -1;
+        }
+        return 0;
+    }
+
+    if (!mode || !connector_count)
+        return -EINVAL;
+
+    /* Like the kernel, refuse connectors whose encoder cannot drive the
+     * CRTC */
+    for (int c = 0; c < connector_count; c++)
+    {
+        connector_state const *connector = find_connector(connector_ids[c]);
+        if (!connector)
+            return -ENOENT;
+        if (!(connector->possible_crtcs & (1u << crtc_index)))
+            return -EINVAL;
+    }
+
+    /* The connectors given are taken from the CRTCs they were on, and
+     * the ones not given anymore are left off */
+    for (size_t c = 0; c < m_connectors.size(); c++)
+    {
+        connector_state &connector = m_connectors[c];
+        bool listed = false;
+        for (int l = 0; l < connector_count; l++)
+            listed |= connector.connector_id == connector_ids[l];
+
+        if (listed)
+            connector.crtc_index = crtc_index;
+        else if (connector.crtc_index == crtc_index)
+            connector.crtc_index = -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    crtc->active = true;
+    crtc->fb_id  = fb_id;
+    crtc->mode   = *mode;
+    crtc->vblank_start_ns  = (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+    crtc->vblank_period_ns = 1000000000ull / (mode->vrefresh ? mode->vrefresh : 60);
+    return 0;
+}
+
+int FakeDrmDevice::page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data)
+{
+    int ret = injected_failure("page_flip");
+    if (ret)
+        return ret;
+
+    crtc_state *crtc = find_crtc(crtc_id);
+    if (!crtc)
+        return -ENOENT;
+    if (!crtc->active)
+        return -EINVAL;
+    if (crtc->flip_pending)
+        return -EBUSY;
+    if (!m_framebuffers.count(fb_id))
+        return -ENOENT;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t const now_ns = (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    crtc->flip_pending     = true;
+    crtc->flip_fb_id       = fb_id;
+    crtc->flip_user_data   = (flags & DRM_MODE_PAGE_FLIP_EVENT) ? user_data : NULL;
+    crtc->flip_deadline_ns = now_ns;
+
+    /* Otherwise the flip happens at once */
+    if (m_simulate_vblank && crtc->vblank_period_ns)
+    {
+        uint64_t const vblanks = (now_ns - crtc->vblank_start_ns) / crtc->vblank_period_ns + 1;
+        crtc->flip_deadline_ns = crtc->vblank_start_ns + vblanks * crtc->vblank_period_ns;
+    }
+
+    arm_flip_timer();
+    return 0;
+}
+
+void FakeDrmDevice::arm_flip_timer()
+{
+    uint64_t earliest_ns = 0;
+    for (size_t c = 0; c < m_crtcs.size(); c++)
+    {
+        if (m_crtcs[c].flip_pending &&
+            (!earliest_ns || m_crtcs[c].flip_deadline_ns < earliest_ns))
+        {
+            earliest_ns = m_crtcs[c].flip_deadline_ns;
+        }
+    }
+
+    /* A zero it_value would disarm the timer : a deadline already passed
+     * is turned into the earliest possible time */
+    struct itimerspec expiration;
+    memset(&expiration, 0, sizeof(expiration));
+    if (earliest_ns)
+    {
+        expiration.it_value.tv_sec  = earliest_ns / 1000000000ull;
+        expiration.it_value.tv_nsec = earliest_ns % 1000000000ull;
+        if (!expiration.it_value.tv_sec && !expiration.it_value.tv_nsec)
+            expiration.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(m_event_fd, TFD_TIMER_ABSTIME, &expiration, NULL);
+}
+
+int FakeDrmDevice::dirty_fb(uint32_t fb_id, drmModeClip *clips, uint32_t clip_count)
+{
+    Q_UNUSED(fb_id);
+    Q_UNUSED(clips);
+    Q_UNUSED(clip_count);
+    /* Like most drivers */
+    return -ENOSYS;
+}
+
+int FakeDrmDevice::handle_event(drmEventContext &context)
+{
+    uint64_t expirations = 0;
+    if (read(m_event_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t const now_ns = (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    for (size_t c = 0; c < m_crtcs.size(); c++)
+    {
+        crtc_state &crtc = m_crtcs[c];
+        if (!crtc.flip_pending || crtc.flip_deadline_ns > now_ns)
+            continue;
+
+        crtc.flip_pending = false;
+        crtc.fb_id        = crtc.flip_fb_id;
+
+        /* Simulated vblanks are numbered from the modeset, so that the
+         * vblanks without a flip show up as gaps */
+        uint64_t event_ns = now_ns;
+        if (m_simulate_vblank && crtc.vblank_period_ns)
+        {
+            crtc.sequence = (crtc.flip_deadline_ns - crtc.vblank_start_ns) / crtc.vblank_period_ns;
+            event_ns      = crtc.flip_deadline_ns;
+        }
+        else
+        {
+            crtc.sequence++;
+        }
+
+        if (crtc.flip_user_data && context.page_flip_handler)
+        {
+            context.page_flip_handler(m_event_fd, crtc.sequence,
+                                      event_ns / 1000000000ull,
+                                      (event_ns % 1000000000ull) / 1000,
+                                      crtc.flip_user_data);
+        }
+    }
+
+    arm_flip_timer();
+    return 0;
+}
+
+int FakeDrmDevice::create_dumb(struct drm_mode_create_dumb &request)
+{
+    int ret = injected_failure("create_dumb");
+    if (ret)
+        return ret;
+
+    if (!request.width || !request.height || !request.bpp)
+        return -EINVAL;
+
+    /* Same rules as most dumb buffer implementations */
+    request.pitch = ALIGN_ON_POW2(request.width * ((request.bpp + 7) / 8), 64u);
+    request.size  = (uint64_t) request.pitch * request.height;
+
+    dumb_state dumb;
+    dumb.size      = request.size;
+    dumb.memory_fd = memfd_create("fake_dumb_buffer", MFD_CLOEXEC);
+    if (dumb.memory_fd < 0)
+        return -errno;
+
+    if (ftruncate(dumb.memory_fd, dumb.size))
+    {
+        int const err = errno;
+        close(dumb.memory_fd);
+        return -err;
+    }
+
+    request.handle = m_next_id++;
+    m_dumb_buffers[request.handle] = dumb;
+    return 0;
+}
+
+int FakeDrmDevice::destroy_dumb(uint32_t handle)
+{
+    int ret = injected_failure("destroy_dumb");
+    if (ret)
+        return ret;
+
+    std::map<uint32_t, dumb_state>::iterator dumb = m_dumb_buffers.find(handle);
+    if (dumb == m_dumb_buffers.end())
+        return -ENOENT;
+
+    close(dumb->second.memory_fd);
+    m_dumb_buffers.erase(dumb);
+    return 0;
+}
+
+int FakeDrmDevice::add_fb(uint32_t width, uint32_t height,
+                          uint8_t depth, uint8_t bpp,
+                          uint32_t pitch, uint32_t handle,
+                          uint32_t *fb_id)
+{
+    Q_UNUSED(depth);
+    int ret = injected_failure("add_fb");
+    if (ret)
+        return ret;
+
+    std::map<uint32_t, dumb_state>::const_iterator dumb = m_dumb_buffers.find(handle);
+    if (dumb == m_dumb_buffers.end())
+        return -ENOENT;
+    if ((uint64_t) pitch * height > dumb->second.size || pitch < width * (bpp / 8))
+        return -EINVAL;
+
+    *fb_id = m_next_id++;
+    m_framebuffers[*fb_id] = handle;
+    return 0;
+}
+
+int FakeDrmDevice::rm_fb(uint32_t fb_id)
+{
+    int ret = injected_failure("rm_fb");
+    if (ret)
+        return ret;
+
+    if (!m_framebuffers.erase(fb_id))
+        return -ENOENT;
+
+    /* Like the kernel, removing the framebuffer being scanned out turns
+     * the CRTC off */
+    for (size_t c = 0; c < m_crtcs.size(); c++)
+    {
+        if (m_crtcs[c].fb_id == fb_id)
+        {
+            m_crtcs[c].active = false;
+            m_crtcs[c].fb_id  = 0;
+            for (size_t n = 0; n < m_connectors.size(); n++)
+            {
+                if (m_connectors[n].crtc_index == (int) c)
+                    m_connectors[n].crtc_index = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int FakeDrmDevice::prime_handle_to_fd(uint32_t handle, uint32_t flags, int *dma_buf_fd)
+{
+    Q_UNUSED(flags);
+    int ret = injected_failure("prime_handle_to_fd");
+    if (ret)
+        return ret;
+
+    std::map<uint32_t, dumb_state>::const_iterator dumb = m_dumb_buffers.find(handle);
+    if (dumb == m_dumb_buffers.end())
+        return -ENOENT;
+
+    *dma_buf_fd = fcntl(dumb->second.memory_fd, F_DUPFD_CLOEXEC, 0);
+    return (*dma_buf_fd >= 0) ? 0 : -errno;
+}
+
+int FakeDrmDevice::prime_fd_to_handle(int dma_buf_fd, uint32_t *handle)
+{
+    int ret = injected_failure("prime_fd_to_handle");
+    if (ret)
+        return ret;
+
+    struct stat buffer_stat;
+    if (fstat(dma_buf_fd, &buffer_stat))
+        return -errno;
+
+    /* Like the kernel, the same buffer always gets the same handle */
+    for (std::map<uint32_t, import_state>::const_iterator imported = m_imports.begin();
+         imported != m_imports.end();
+         ++imported)
+    {
+        if (imported->second.device == buffer_stat.st_dev &&
+            imported->second.inode == buffer_stat.st_ino)
+        {
+            *handle = imported->first;
+            return 0;
+        }
+    }
+
+    /* dma-bufs report their size through lseek, not fstat */
+    off_t const size = lseek(dma_buf_fd, 0, SEEK_END);
+    if (size <= 0)
+        return -EINVAL;
+
+    import_state imported;
+    imported.dma_buf_fd = fcntl(dma_buf_fd, F_DUPFD_CLOEXEC, 0);
+    if (imported.dma_buf_fd < 0)
+        return -errno;
+    imported.size   = size;
+    imported.device = buffer_stat.st_dev;
+    imported.inode  = buffer_stat.st_ino;
+
+    *handle = m_next_id++;
+    m_imports[*handle] = imported;
+    return 0;
+}
+
+int FakeDrmDevice::close_handle(uint32_t handle)
+{
+    int ret = injected_failure("close_handle");
+    if (ret)
+        return ret;
+
+    std::map<uint32_t, import_state>::iterator imported = m_imports.find(handle);
+    if (imported == m_imports.end())
+        return -EINVAL;
+
+    close(imported->second.dma_buf_fd);
+    m_imports.erase(imported);
+    return 0;
+}
+
+uint64_t FakeDrmDevice::handle_size(uint32_t handle) const
+{
+    std::map<uint32_t, dumb_state>::const_iterator dumb = m_dumb_buffers.find(handle);
+    if (dumb != m_dumb_buffers.end())
+        return dumb->second.size;
+
+    std::map<uint32_t, import_state>::const_iterator imported = m_imports.find(handle);
+    if (imported != m_imports.end())
+        return imported->second.size;
+
+    return 0;
+}
+
+/* Checks each plane against the buffer it lives in, as the kernel does,
+ * and the modifier against what the fake was set to support */
+int FakeDrmDevice::add_fb2(uint32_t width, uint32_t height, uint32_t pixel_format,
+                           uint32_t const handles[4], uint32_t const pitches[4],
+                           uint32_t const offsets[4], uint64_t const modifiers[4],
+                           uint32_t *fb_id)
+{
+    int ret = injected_failure("add_fb2");
+    if (ret)
+        return ret;
+
+    pixel_format_info const *info = pixel_format_find(pixel_format);
+    if (!info || !width || !height)
+        return -EINVAL;
+
+    uint64_t const modifier = modifiers ? modifiers[0] : DRM_FORMAT_MOD_LINEAR;
+    /* ARM vendor, type 0 : AFBC */
+    bool const afbc = (modifier >> 52) == ((uint64_t) DRM_FORMAT_MOD_VENDOR_ARM << 4);
+    if (modifier != DRM_FORMAT_MOD_LINEAR && !(afbc && m_afbc_supported))
+        return -EINVAL;
+
+    for (unsigned int plane = 0; plane < info->plane_count; plane++)
+    {
+        if (modifiers && modifiers[plane] != modifier)
+            return -EINVAL;
+
+        uint64_t const size = handle_size(handles[plane]);
+        if (!size)
+            return -ENOENT;
+
+        /* The compressed layouts are not checked, only where they start */
+        uint64_t const end = afbc
+            ? (uint64_t) offsets[plane] + 1
+            : (uint64_t) offsets[plane] + (uint64_t) pitches[plane] * pixel_format_plane_rows(*info, plane, height);
+        if ((!afbc && pitches[plane] < pixel_format_row_bytes(*info, plane, width)) || end > size)
+            return -EINVAL;
+    }
+
+    *fb_id = m_next_id++;
+    m_framebuffers[*fb_id] = handles[0];
+    return 0;
+}
+
+/* ---- RAII owners ---- */
+
+ResourcesPtr get_resources(DrmDevice &device)
+{
+    ResourcesDeleter deleter = { &device };
+    return ResourcesPtr(device.get_resources(), deleter);
+}
+
+ConnectorPtr get_connector(DrmDevice &device, uint32_t connector_id)
+{
+    ConnectorDeleter deleter = { &device };
+    return ConnectorPtr(device.get_connector(connector_id), deleter);
+}
+
+ConnectorPtr get_connector_current(DrmDevice &device, uint32_t connector_id)
+{
+    ConnectorDeleter deleter = { &device };
+    return ConnectorPtr(device.get_connector_current(connector_id), deleter);
+}
+
+EncoderPtr get_encoder(DrmDevice &device, uint32_t encoder_id)
+{
+    EncoderDeleter deleter = { &device };
+    return EncoderPtr(device.get_encoder(encoder_id), deleter);
+}
+
+CrtcPtr get_crtc(DrmDevice &device, uint32_t crtc_id)
+{
+    CrtcDeleter deleter = { &device };
+    return CrtcPtr(device.get_crtc(crtc_id), deleter);
+}
+
+UniqueFd &UniqueFd::operator=(UniqueFd &&other)
+{
+    if (this != &other)
+        reset(other.release());
+    return *this;
+}
+
+int UniqueFd::release()
+{
+    int const fd = m_fd;
+    m_fd = -1;
+    return fd;
+}
+
+void UniqueFd::reset(int fd)
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = fd;
+}
+
+int DumbBuffer::create(DrmDevice &device, uint32_t width, uint32_t height, uint32_t bpp)
+{
+    reset();
+
+    memset(&m_info, 0, sizeof(m_info));
+    m_info.width  = width;
+    m_info.height = height;
+    m_info.bpp    = bpp;
+
+    int ret = device.create_dumb(m_info);
+    if (ret)
+        return ret;
+
+    m_device = &device;
+    m_handle = m_info.handle;
+    return 0;
+}
+
+DumbBuffer::DumbBuffer(DumbBuffer &&other) :
+    m_device(other.m_device),
+    m_handle(other.m_handle),
+    m_info(other.m_info)
+{
+    other.m_handle = 0;
+}
+
+uint32_t DumbBuffer::release()
+{
+    uint32_t const handle = m_handle;
+    m_handle = 0;
+    return handle;
+}
+
+void DumbBuffer::reset()
+{
+    if (m_handle)
+        m_device->destroy_dumb(m_handle);
+    m_handle = 0;
+}
+
+FramebufferId::FramebufferId(FramebufferId &&other) :
+    m_device(other.m_device),
+    m_fb_id(other.release())
+{
+}
+
+uint32_t FramebufferId::release()
+{
+    uint32_t const fb_id = m_fb_id;
+    m_fb_id = 0;
+    return fb_id;
+}
+
+void FramebufferId::reset()
+{
+    if (m_fb_id)
+        m_device->rm_fb(m_fb_id);
+    m_fb_id = 0;
+}
+
+Mapping::Mapping(int fd, size_t size) :
+    m_address(NULL),
+    m_size(0)
+{
+    void *address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address != MAP_FAILED)
+    {
+        m_address = address;
+        m_size    = size;
+    }
+}
+
+Mapping::Mapping(Mapping &&other) :
+    m_address(other.m_address),
+    m_size(other.m_size)
+{
+    other.m_address = NULL;
+    other.m_size    = 0;
+}
+
+Mapping &Mapping::operator=(Mapping &&other)
+{
+    if (this != &other)
+    {
+        reset();
+        m_size    = other.m_size;
+        m_address = other.release();
+    }
+    return *this;
+}
+
+void *Mapping::release()
+{
+    void *const address = m_address;
+    m_address = NULL;
+    m_size    = 0;
+    return address;
+}
+
+void Mapping::reset()
+{
+    if (m_address)
+        munmap(m_address, m_size);
+    m_address = NULL;
+    m_size    = 0;
+}
+
+static int dma_buf_sync(int dma_buf_fd, cpu_access_mode mode, uint64_t stage)
+{
+    struct dma_buf_sync sync;
+    memset(&sync, 0, sizeof(sync));
+    sync.flags = stage;
+    if (mode & CPU_ACCESS_READ)
+        sync.flags |= DMA_BUF_SYNC_READ;
+    if (mode & CPU_ACCESS_WRITE)
+        sync.flags |= DMA_BUF_SYNC_WRITE;
+
+    /* Interrupted while waiting for the fences of the buffer */
+    int ret;
+    do {
+        ret = ioctl(dma_buf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    return ret < 0 ? -errno : 0;
+}
+
+int dma_buf_begin_cpu_access(int dma_buf_fd, cpu_access_mode mode)
+{
+    return dma_buf_sync(dma_buf_fd, mode, DMA_BUF_SYNC_START);
+}
+
+int dma_buf_end_cpu_access(int dma_buf_fd, cpu_access_mode mode)
+{
+    return dma_buf_sync(dma_buf_fd, mode, DMA_BUF_SYNC_END);
+}
+
+CpuAccess::CpuAccess(int dma_buf_fd, cpu_access_mode mode) :
+    m_fd(dma_buf_fd),
+    m_mode(mode),
+    m_synced(false)
+{
+    if (m_fd < 0)
+        return;
+
+    int ret = dma_buf_begin_cpu_access(m_fd, m_mode);
+    m_synced = (ret == 0);
+    if (ret && ret != -ENOTTY)
+        qDebug("%s %d Could not start the CPU access to dma-buf %d : %s\n",
+               __FUNCTION__, __LINE__, m_fd, strerror(-ret));
+}
+
+void CpuAccess::end()
+{
+    if (!m_synced)
+        return;
+
+    int ret = dma_buf_end_cpu_access(m_fd, m_mode);
+    if (ret)
+        qDebug("%s %d Could not end the CPU access to dma-buf %d : %s\n",
+               __FUNCTION__, __LINE__, m_fd, strerror(-ret));
+    m_synced = false;
+}
+
+CrtcRestore::CrtcRestore(DrmDevice &device, uint32_t crtc_id, uint32_t connector_id) :
+    m_device(device),
+    m_saved(get_crtc(device, crtc_id)),
+    m_connector_id(connector_id),
+    m_restored(false)
+{
+}
+
+CrtcRestore::~CrtcRestore()
+{
+    restore();
+}
+
+void CrtcRestore::restore()
+{
+    if (m_restored || !m_saved)
+        return;
+
+    if (m_saved->mode_valid && m_saved->buffer_id)
+    {
+        m_device.set_crtc(m_saved->crtc_id, m_saved->buffer_id,
+                          &m_connector_id, 1, &m_saved->mode);
+    }
+    else
+    {
+        m_device.set_crtc(m_saved->crtc_id, 0, NULL, 0, NULL);
+    }
+    m_restored = true;
+}
@@ -0,0 +1,480 @@
+#ifndef DRM_DEVICE_H
+#define DRM_DEVICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libdrm/drm.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* The DRM calls we make, so that FakeDrmDevice can stand in for
+ * /dev/dri/card0. Every call returns 0 or a negative errno value, like
+ * libdrm does, and the get_* ones return NULL on error. */
+class DrmDevice
+{
+public:
+    virtual ~DrmDevice() {}
+
+    /* Becomes readable when handle_event has events to dispatch */
+    virtual int fd() const = 0;
+
+    virtual drmModeRes *get_resources() = 0;
+    virtual void free_resources(drmModeRes *resources) = 0;
+    /* Probes the connector, which can mean reading the EDID over DDC */
+    virtual drmModeConnector *get_connector(uint32_t connector_id) = 0;
+    /* What the kernel already knows about the connector, without probing.
+     * The modes are empty if it was never probed. */
+    virtual drmModeConnector *get_connector_current(uint32_t connector_id) = 0;
+    virtual void free_connector(drmModeConnector *connector) = 0;
+    /* The EDID property blob of the connector. -ENOENT if there is none. */
+    virtual int get_edid(uint32_t connector_id, std::vector<uint8_t> &edid) = 0;
+    virtual drmModeEncoder *get_encoder(uint32_t encoder_id) = 0;
+    virtual void free_encoder(drmModeEncoder *encoder) = 0;
+    virtual drmModeCrtc *get_crtc(uint32_t crtc_id) = 0;
+    virtual void free_crtc(drmModeCrtc *crtc) = 0;
+
+    virtual int set_crtc(uint32_t crtc_id, uint32_t fb_id,
+                         uint32_t *connector_ids, int connector_count,
+                         drmModeModeInfo *mode) = 0;
+    virtual int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data) = 0;
+    virtual int dirty_fb(uint32_t fb_id, drmModeClip *clips, uint32_t clip_count) = 0;
+    virtual int handle_event(drmEventContext &context) = 0;
+
+    virtual int create_dumb(struct drm_mode_create_dumb &request) = 0;
+    virtual int destroy_dumb(uint32_t handle) = 0;
+    virtual int add_fb(uint32_t width, uint32_t height,
+                       uint8_t depth, uint8_t bpp,
+                       uint32_t pitch, uint32_t handle,
+                       uint32_t *fb_id) = 0;
+    virtual int rm_fb(uint32_t fb_id) = 0;
+    /* The returned fd can be mmapped */
+    virtual int prime_handle_to_fd(uint32_t handle, uint32_t flags, int *dma_buf_fd) = 0;
+
+    /* Imports a dma-buf. Importing the same buffer again gives the same
+     * handle, which must only be closed once. */
+    virtual int prime_fd_to_handle(int dma_buf_fd, uint32_t *handle) = 0;
+    /* Closes an imported handle */
+    virtual int close_handle(uint32_t handle) = 0;
+    /* drmModeAddFB2WithModifiers. Without modifiers (NULL), the layout
+     * is whatever the driver uses by default, linear most of the time. */
+    virtual int add_fb2(uint32_t width, uint32_t height, uint32_t pixel_format,
+                        uint32_t const handles[4], uint32_t const pitches[4],
+                        uint32_t const offsets[4], uint64_t const modifiers[4],
+                        uint32_t *fb_id) = 0;
+};
+
+/* The real thing, through libdrm */
+class LinuxDrmDevice : public DrmDevice
+{
+public:
+    LinuxDrmDevice();
+    ~LinuxDrmDevice();
+
+    int open(char const *path);
+    /* Opens the first /dev/dri/card* driven by driver_name, like "vkms".
+     * Returns -ENODEV when there is none. */
+    int open_driver(char const *driver_name);
+    int fd() const { return m_fd; }
+
+    drmModeRes *get_resources();
+    void free_resources(drmModeRes *resources);
+    drmModeConnector *get_connector(uint32_t connector_id);
+    drmModeConnector *get_connector_current(uint32_t connector_id);
+    void free_connector(drmModeConnector *connector);
+    int get_edid(uint32_t connector_id, std::vector<uint8_t> &edid);
+    drmModeEncoder *get_encoder(uint32_t encoder_id);
+    void free_encoder(drmModeEncoder *encoder);
+    drmModeCrtc *get_crtc(uint32_t crtc_id);
+    void free_crtc(drmModeCrtc *crtc);
+
+    int set_crtc(uint32_t crtc_id, uint32_t fb_id,
+                 uint32_t *connector_ids, int connector_count,
+                 drmModeModeInfo *mode);
+    int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data);
+    int dirty_fb(uint32_t fb_id, drmModeClip *clips, uint32_t clip_count);
+    int handle_event(drmEventContext &context);
+
+    int create_dumb(struct drm_mode_create_dumb &request);
+    int destroy_dumb(uint32_t handle);
+    int add_fb(uint32_t width, uint32_t height,
+               uint8_t depth, uint8_t bpp,
+               uint32_t pitch, uint32_t handle,
+               uint32_t *fb_id);
+    int rm_fb(uint32_t fb_id);
+    int prime_handle_to_fd(uint32_t handle, uint32_t flags, int *dma_buf_fd);
+    int prime_fd_to_handle(int dma_buf_fd, uint32_t *handle);
+    int close_handle(uint32_t handle);
+    int add_fb2(uint32_t width, uint32_t height, uint32_t pixel_format,
+                uint32_t const handles[4], uint32_t const pitches[4],
+                uint32_t const offsets[4], uint64_t const modifiers[4],
+                uint32_t *fb_id);
+
+private:
+    LinuxDrmDevice(LinuxDrmDevice const &);
+    LinuxDrmDevice &operator=(LinuxDrmDevice const &);
+
+    int m_fd;
+};
+
+/* Describes a connector of FakeDrmDevice */
+struct fake_connector
+{
+    uint32_t connector_type;
+    bool     connected;
+    std::vector<drmModeModeInfo> modes;
+    std::vector<uint8_t>         edid;
+};
+
+/* An in-process DRM device.
+ * Dumb buffers are memfds, page flips complete right away (or at the next
+ * simulated vblank of their CRTC) through a timerfd, and every object
+ * handed out is counted so that leaks show up in live_objects(). */
+class FakeDrmDevice : public DrmDevice
+{
+public:
+    FakeDrmDevice();
+    ~FakeDrmDevice();
+
+    /* Each connector gets its own encoder and CRTC, the CRTC of a
+     * connected connector being already active. Returns the connector id */
+    uint32_t add_connector(fake_connector const &connector);
+    /* A connector whose encoder can drive the CRTCs of possible_crtcs
+     * (bit n being the n-th CRTC), like the outputs of a SoC sharing two
+     * display controllers. It starts off. */
+    uint32_t add_connector(fake_connector const &connector, uint32_t possible_crtcs);
+    /* A CRTC driving nothing yet. Returns its id. */
+    uint32_t add_crtc();
+
+    /* Replace what is plugged into a connector. Like a hotplug interrupt,
+     * this updates the connection state and the EDID, but the modes are
+     * only updated by the next probe (get_connector). */
+    void hotplug(uint32_t connector_id, fake_connector const &connector);
+    /* Whether add_fb2 accepts the ARM AFBC modifiers, like the Rockchip
+     * VOP does. Linear buffers are always accepted. */
+    void set_afbc_supported(bool supported) { m_afbc_supported = supported; }
+    /* Make every probe take that long, like a slow DDC bus */
+    void set_probe_delay(unsigned int delay_us) { m_probe_delay_us = delay_us; }
+    /* Complete the page flips at the next vblank of their CRTC, each CRTC
+     * having its own clock running at the refresh rate of its mode,
+     * instead of right away */
+    void set_vblank_simulation(bool simulate) { m_simulate_vblank = simulate; }
+
+    /* Make the next call to the function called name (like "add_fb")
+     * fail with -error */
+    void fail_next(char const *name, int error);
+
+    /* Objects created through this device and not yet freed :
+     * resources, connectors, encoders, CRTCs, dumb buffers, imported
+     * buffers and framebuffers */
+    unsigned int live_objects() const;
+    unsigned int calls() const { return m_calls; }
+    unsigned int probes() const { return m_probes; }
+
+    int fd() const { return m_event_fd; }
+
+    drmModeRes *get_resources();
+    void free_resources(drmModeRes *resources);
+    drmModeConnector *get_connector(uint32_t connector_id);
+    drmModeConnector *get_connector_current(uint32_t connector_id);
+    void free_connector(drmModeConnector *connector);
+    int get_edid(uint32_t connector_id, std::vector<uint8_t> &edid);
+    drmModeEncoder *get_encoder(uint32_t encoder_id);
+    void free_encoder(drmModeEncoder *encoder);
+    drmModeCrtc *get_crtc(uint32_t crtc_id);
+    void free_crtc(drmModeCrtc *crtc);
+
+    int set_crtc(uint32_t crtc_id, uint32_t fb_id,
+                 uint32_t *connector_ids, int connector_count,
+                 drmModeModeInfo *mode);
+    int page_flip(uint32_t crtc_id, uint32_t fb_id, uint32_t flags, void *user_data);
+    int dirty_fb(uint32_t fb_id, drmModeClip *clips, uint32_t clip_count);
+    int handle_event(drmEventContext &context);
+
+    int create_dumb(struct drm_mode_create_dumb &request);
+    int destroy_dumb(uint32_t handle);
+    int add_fb(uint32_t width, uint32_t height,
+               uint8_t depth, uint8_t bpp,
+               uint32_t pitch, uint32_t handle,
+               uint32_t *fb_id);
+    int rm_fb(uint32_t fb_id);
+    int prime_handle_to_fd(uint32_t handle, uint32_t flags, int *dma_buf_fd);
+    int prime_fd_to_handle(int dma_buf_fd, uint32_t *handle);
+    int close_handle(uint32_t handle);
+    int add_fb2(uint32_t width, uint32_t height, uint32_t pixel_format,
+                uint32_t const handles[4], uint32_t const pitches[4],
+                uint32_t const offsets[4], uint64_t const modifiers[4],
+                uint32_t *fb_id);
+
+protected:
+    struct crtc_state
+    {
+        uint32_t        crtc_id;
+        uint32_t        fb_id;
+        bool            active;
+        drmModeModeInfo mode;
+        /* Pending page flip */
+        bool            flip_pending;
+        uint32_t        flip_fb_id;
+        void           *flip_user_data;
+        uint64_t        flip_deadline_ns;
+        unsigned int    sequence;
+        /* Simulated vblanks happen every period after the modeset */
+        uint64_t        vblank_start_ns;
+        uint64_t        vblank_period_ns;
+    };
+
+    struct connector_state
+    {
+        uint32_t       connector_id;
+        uint32_t       encoder_id;
+        uint32_t       possible_crtcs;
+        /* Index of the CRTC driving the connector, -1 if none */
+        int            crtc_index;
+        /* What is plugged in, and what the last probe saw */
+        fake_connector description;
+        fake_connector probed;
+    };
+
+    struct dumb_state
+    {
+        int      memory_fd;
+        uint64_t size;
+    };
+
+    /* An imported dma-buf, kept alive by a duplicate of its fd */
+    struct import_state
+    {
+        int      dma_buf_fd;
+        uint64_t size;
+        dev_t    device;
+        ino_t    inode;
+    };
+
+    /* Size of the buffer behind a handle, 0 if there is no such handle */
+    uint64_t handle_size(uint32_t handle) const;
+
+    /* Returns the injected error for this call, or 0 */
+    int injected_failure(char const *name);
+    crtc_state *find_crtc(uint32_t crtc_id);
+    connector_state *find_connector(uint32_t connector_id);
+    drmModeConnector *copy_connector(connector_state const &state);
+    /* Arms the timer for the earliest pending flip */
+    void arm_flip_timer();
+
+    int          m_event_fd;
+    uint32_t     m_next_id;
+    unsigned int m_calls;
+    unsigned int m_probes;
+    unsigned int m_probe_delay_us;
+    bool         m_afbc_supported;
+    bool         m_simulate_vblank;
+    unsigned int m_live_mode_objects;
+
+    std::vector<connector_state>    m_connectors;
+    std::vector<crtc_state>         m_crtcs;
+    std::map<uint32_t, dumb_state>  m_dumb_buffers;
+    std::map<uint32_t, import_state> m_imports;
+    std::map<uint32_t, uint32_t>    m_framebuffers;
+    std::map<std::string, int>      m_failures;
+
+private:
+    FakeDrmDevice(FakeDrmDevice const &);
+    FakeDrmDevice &operator=(FakeDrmDevice const &);
+};
+
+/* ---- RAII owners ----
+ * Each one releases what it owns when it goes out of scope, unless
+ * release() was called to hand the ownership over. */
+
+struct ResourcesDeleter
+{
+    DrmDevice *device;
+    void operator()(drmModeRes *resources) const { device->free_resources(resources); }
+};
+struct ConnectorDeleter
+{
+    DrmDevice *device;
+    void operator()(drmModeConnector *connector) const { device->free_connector(connector); }
+};
+struct EncoderDeleter
+{
+    DrmDevice *device;
+    void operator()(drmModeEncoder *encoder) const { device->free_encoder(encoder); }
+};
+struct CrtcDeleter
+{
+    DrmDevice *device;
+    void operator()(drmModeCrtc *crtc) const { device->free_crtc(crtc); }
+};
+
+typedef std::unique_ptr<drmModeRes,       ResourcesDeleter> ResourcesPtr;
+typedef std::unique_ptr<drmModeConnector, ConnectorDeleter> ConnectorPtr;
+typedef std::unique_ptr<drmModeEncoder,   EncoderDeleter>   EncoderPtr;
+typedef std::unique_ptr<drmModeCrtc,      CrtcDeleter>      CrtcPtr;
+
+ResourcesPtr get_resources(DrmDevice &device);
+ConnectorPtr get_connector(DrmDevice &device, uint32_t connector_id);
+ConnectorPtr get_connector_current(DrmDevice &device, uint32_t connector_id);
+EncoderPtr   get_encoder(DrmDevice &device, uint32_t encoder_id);
+CrtcPtr      get_crtc(DrmDevice &device, uint32_t crtc_id);
+
+/* A file descriptor, closed on destruction */
+class UniqueFd
+{
+public:
+    explicit UniqueFd(int fd = -1) : m_fd(fd) {}
+    UniqueFd(UniqueFd &&other) : m_fd(other.release()) {}
+    UniqueFd &operator=(UniqueFd &&other);
+    ~UniqueFd() { reset(); }
+
+    int get() const { return m_fd; }
+    bool valid() const { return m_fd >= 0; }
+    int release();
+    void reset(int fd = -1);
+
+private:
+    UniqueFd(UniqueFd const &);
+    UniqueFd &operator=(UniqueFd const &);
+
+    int m_fd;
+};
+
+/* A GEM handle of a dumb buffer, destroyed on destruction */
+class DumbBuffer
+{
+public:
+    DumbBuffer() : m_device(NULL), m_handle(0) {}
+    /* Allocates the buffer. Check valid() or the returned error. */
+    int create(DrmDevice &device, uint32_t width, uint32_t height, uint32_t bpp);
+    DumbBuffer(DumbBuffer &&other);
+    ~DumbBuffer() { reset(); }
+
+    bool valid() const { return m_handle != 0; }
+    uint32_t handle() const { return m_handle; }
+    struct drm_mode_create_dumb const &info() const { return m_info; }
+    uint32_t release();
+    void reset();
+
+private:
+    DumbBuffer(DumbBuffer const &);
+    DumbBuffer &operator=(DumbBuffer const &);
+
+    DrmDevice                  *m_device;
+    uint32_t                    m_handle;
+    struct drm_mode_create_dumb m_info;
+};
+
+/* A KMS framebuffer id, removed on destruction */
+class FramebufferId
+{
+public:
+    FramebufferId() : m_device(NULL), m_fb_id(0) {}
+    FramebufferId(DrmDevice &device, uint32_t fb_id) : m_device(&device), m_fb_id(fb_id) {}
+    FramebufferId(FramebufferId &&other);
+    ~FramebufferId() { reset(); }
+
+    uint32_t get() const { return m_fb_id; }
+    uint32_t release();
+    void reset();
+
+private:
+    FramebufferId(FramebufferId const &);
+    FramebufferId &operator=(FramebufferId const &);
+
+    DrmDevice *m_device;
+    uint32_t   m_fb_id;
+};
+
+/* A shared memory mapping, unmapped on destruction */
+class Mapping
+{
+public:
+    Mapping() : m_address(NULL), m_size(0) {}
+    /* mmap fd read/write. Check valid() and errno. */
+    Mapping(int fd, size_t size);
+    Mapping(Mapping &&other);
+    Mapping &operator=(Mapping &&other);
+    ~Mapping() { reset(); }
+
+    bool valid() const { return m_address != NULL; }
+    uint8_t *get() const { return static_cast<uint8_t *>(m_address); }
+    size_t size() const { return m_size; }
+    void *release();
+    void reset();
+
+private:
+    Mapping(Mapping const &);
+    Mapping &operator=(Mapping const &);
+
+    void  *m_address;
+    size_t m_size;
+};
+
+/* What the CPU does with a mapped dma-buf, for DMA_BUF_IOCTL_SYNC */
+enum cpu_access_mode
+{
+    CPU_ACCESS_READ       = 1,
+    CPU_ACCESS_WRITE      = 2,
+    CPU_ACCESS_READ_WRITE = 3
+};
+
+/* DMA_BUF_IOCTL_SYNC with DMA_BUF_SYNC_START or DMA_BUF_SYNC_END.
+ * Returns 0 or a negative errno : -ENOTTY when fd is not a dma-buf, like
+ * the memfds of the memory backend. */
+int dma_buf_begin_cpu_access(int dma_buf_fd, cpu_access_mode mode);
+int dma_buf_end_cpu_access(int dma_buf_fd, cpu_access_mode mode);
+
+/* Brackets CPU accesses to a mapped dma-buf : the exporter invalidates
+ * the CPU caches on entry (reads see what the GPU or the display wrote)
+ * and writes them back on exit (scanout sees what the CPU wrote).
+ * Buffers that cannot be synced are accessed as they are. */
+class CpuAccess
+{
+public:
+    CpuAccess(int dma_buf_fd, cpu_access_mode mode);
+    ~CpuAccess() { end(); }
+
+    /* Ends the access before the destruction, e.g. before queueing a flip */
+    void end();
+    /* The exporter was told about the access */
+    bool synced() const { return m_synced; }
+
+private:
+    CpuAccess(CpuAccess const &);
+    CpuAccess &operator=(CpuAccess const &);
+
+    int             m_fd;
+    cpu_access_mode m_mode;
+    bool            m_synced;
+};
+
+/* Saves the state of a CRTC and puts it back on destruction, so that the
+ * console or whatever was displayed before comes back, whatever the path
+ * we leave through. */
+class CrtcRestore
+{
+public:
+    CrtcRestore(DrmDevice &device, uint32_t crtc_id, uint32_t connector_id);
+    ~CrtcRestore();
+
+    bool valid() const { return m_saved.get() != NULL; }
+    /* Put the saved state back now */
+    void restore();
+
+private:
+    CrtcRestore(CrtcRestore const &);
+    CrtcRestore &operator=(CrtcRestore const &);
+
+    DrmDevice &m_device;
+    CrtcPtr    m_saved;
+    uint32_t   m_connector_id;
+    bool       m_restored;
+};
+
+#endif // DRM_DEVICE_H
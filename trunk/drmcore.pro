@@ -0,0 +1,40 @@
+# The DRM and pixel code, without main(), so that other programs
+# (benchmarks, tests) can link against it.
+
+include(common.pri)
+
+TARGET = drmcore
+TEMPLATE = lib
+CONFIG += staticlib
+
+SOURCES += atomic_kms.cpp \
+    buffer_pool.cpp \
+    damage.cpp \
+    dmabuf_import.cpp \
+    drm_device.cpp \
+    event_loop.cpp \
+    event_thread.cpp \
+    frame_source.cpp \
+    frame_stats.cpp \
+    output_scheduler.cpp \
+    pixel_format.cpp \
+    pixel_ops.cpp \
+    render_pool.cpp \
+    swapchain.cpp \
+    topology_cache.cpp
+
+HEADERS += atomic_kms.h \
+    buffer_pool.h \
+    damage.h \
+    dmabuf_import.h \
+    drm_device.h \
+    event_loop.h \
+    event_thread.h \
+    frame_source.h \
+    frame_stats.h \
+    output_scheduler.h \
+    pixel_format.h \
+    pixel_ops.h \
+    render_pool.h \
+    swapchain.h \
+    topology_cache.h
@@ -0,0 +1,505 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include <QDebug>
+
+/* ---- Loop ---- */
+
+EventLoop::EventLoop() :
+    m_epoll_fd(-1),
+    m_wake_fd(-1),
+    m_quit(false)
+{
+}
+
+EventLoop::~EventLoop()
+{
+    if (m_wake_fd >= 0)
+        close(m_wake_fd);
+    if (m_epoll_fd >= 0)
+        close(m_epoll_fd);
+}
+
+int EventLoop::init()
+{
+    if (m_epoll_fd >= 0)
+        return 0;
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0)
+        return -errno;
+
+    m_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wake_fd < 0)
+        return -errno;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events  = EPOLLIN;
+    event.data.fd = m_wake_fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event))
+        return -errno;
+
+    return 0;
+}
+
+int EventLoop::add(int fd, uint32_t events, EventHandler *handler)
+{
+    if (m_epoll_fd < 0)
+        return -EBADF;
+    if (fd < 0 || !handler || m_handlers.count(fd))
+        return -EINVAL;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events  = events;
+    event.data.fd = fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event))
+        return -errno;
+
+    m_handlers[fd] = handler;
+    return 0;
+}
+
+int EventLoop::remove(int fd)
+{
+    if (!m_handlers.erase(fd))
+        return -ENOENT;
+
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL))
+        return -errno;
+    return 0;
+}
+
+int EventLoop::dispatch(int timeout_ms)
+{
+    if (m_epoll_fd < 0)
+        return -EBADF;
+    if (m_quit)
+        return 0;
+
+    struct epoll_event events[16];
+    int const count = epoll_wait(m_epoll_fd, events, 16, timeout_ms);
+    if (count < 0)
+        return (errno == EINTR) ? 0 : -errno;
+
+    int handled = 0;
+    for (int e = 0; e < count && !m_quit; e++)
+    {
+        int const fd = events[e].data.fd;
+        if (fd == m_wake_fd)
+        {
+            uint64_t wakes;
+            if (read(m_wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+                qDebug("%s %d Could not read the wake up eventfd : %s\n",
+                       __FUNCTION__, __LINE__, strerror(errno));
+            continue;
+        }
+
+        /* A previous handler may have removed it */
+        std::map<int, EventHandler *>::iterator const found = m_handlers.find(fd);
+        if (found == m_handlers.end())
+            continue;
+
+        found->second->handle_events(fd, events[e].events);
+        handled++;
+    }
+
+    return handled;
+}
+
+int EventLoop::run()
+{
+    while (!m_quit)
+    {
+        int ret = dispatch(-1);
+        if (ret < 0)
+        {
+            qDebug("%s %d epoll_wait failed : %s\n", __FUNCTION__, __LINE__, strerror(-ret));
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void EventLoop::quit()
+{
+    m_quit = true;
+
+    uint64_t const one = 1;
+    if (m_wake_fd >= 0 && write(m_wake_fd, &one, sizeof(one)) != sizeof(one))
+        qDebug("%s %d Could not wake the event loop up : %s\n",
+               __FUNCTION__, __LINE__, strerror(errno));
+}
+
+/* ---- Signals ---- */
+
+static void termination_signals(sigset_t &signals)
+{
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+}
+
+SignalSource::SignalSource() :
+    m_fd(-1),
+    m_loop(NULL),
+    m_received(0)
+{
+    sigemptyset(&m_previous_mask);
+}
+
+SignalSource::~SignalSource()
+{
+    close();
+}
+
+int SignalSource::open()
+{
+    if (m_fd >= 0)
+        return 0;
+
+    sigset_t signals;
+    termination_signals(signals);
+
+    int ret = pthread_sigmask(SIG_BLOCK, &signals, &m_previous_mask);
+    if (ret)
+        return -ret;
+
+    m_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (m_fd < 0)
+    {
+        int const err = errno;
+        pthread_sigmask(SIG_SETMASK, &m_previous_mask, NULL);
+        return -err;
+    }
+
+    return 0;
+}
+
+void SignalSource::close()
+{
+    if (m_fd < 0)
+        return;
+
+    detach();
+
+    /* Unblocking a pending signal would deliver it right away */
+    read_signals();
+    ::close(m_fd);
+    m_fd = -1;
+    pthread_sigmask(SIG_SETMASK, &m_previous_mask, NULL);
+}
+
+int SignalSource::attach(EventLoop &loop)
+{
+    detach();
+
+    int ret = loop.add(m_fd, EPOLLIN, this);
+    if (!ret)
+        m_loop = &loop;
+    return ret;
+}
+
+void SignalSource::detach()
+{
+    if (m_loop)
+        m_loop->remove(m_fd);
+    m_loop = NULL;
+}
+
+int SignalSource::read_signals()
+{
+    int last = 0;
+    struct signalfd_siginfo info;
+    while (read(m_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        last = info.ssi_signo;
+        m_received = last;
+    }
+    return last;
+}
+
+int SignalSource::poll()
+{
+    if (m_fd >= 0)
+        read_signals();
+    return m_received;
+}
+
+void SignalSource::handle_events(int fd, uint32_t events)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(events);
+
+    int const signal_number = read_signals();
+    if (!signal_number)
+        return;
+
+    qDebug("%s %d %s received, leaving\n", __FUNCTION__, __LINE__, strsignal(signal_number));
+    if (m_loop)
+        m_loop->quit();
+}
+
+/* ---- Timer ---- */
+
+TimerSource::TimerSource() :
+    m_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK)),
+    m_loop(NULL),
+    m_expired(false)
+{
+}
+
+TimerSource::~TimerSource()
+{
+    detach();
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int TimerSource::attach(EventLoop &loop)
+{
+    if (m_fd < 0)
+        return -EBADF;
+
+    detach();
+
+    int ret = loop.add(m_fd, EPOLLIN, this);
+    if (!ret)
+        m_loop = &loop;
+    return ret;
+}
+
+void TimerSource::detach()
+{
+    if (m_loop)
+        m_loop->remove(m_fd);
+    m_loop = NULL;
+}
+
+int TimerSource::arm(uint64_t delay_us)
+{
+    if (m_fd < 0)
+        return -EBADF;
+
+    /* A zero it_value would disarm it */
+    if (!delay_us)
+        delay_us = 1;
+
+    struct itimerspec deadline;
+    memset(&deadline, 0, sizeof(deadline));
+    deadline.it_value.tv_sec  = delay_us / 1000000;
+    deadline.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+
+    m_expired = false;
+    if (timerfd_settime(m_fd, 0, &deadline, NULL))
+        return -errno;
+    return 0;
+}
+
+void TimerSource::handle_events(int fd, uint32_t events)
+{
+    Q_UNUSED(events);
+
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) || !expirations)
+        return;
+
+    m_expired = true;
+}
+
+/* ---- Input ---- */
+
+InputSource::InputSource(int fd) :
+    m_fd(fd),
+    m_loop(NULL),
+    m_lines(0),
+    m_read_us(0),
+    m_line_start(true),
+    m_quit(false),
+    m_callback(NULL),
+    m_context(NULL)
+{
+}
+
+InputSource::~InputSource()
+{
+    detach();
+}
+
+int InputSource::attach(EventLoop &loop)
+{
+    detach();
+
+    int ret = loop.add(m_fd, EPOLLIN, this);
+    if (!ret)
+    {
+        m_loop = &loop;
+    }
+    else if (ret == -EPERM)
+    {
+        /* epoll refuses regular files, as when stdin is redirected from
+         * one. Reading them never blocks : take all of it now. */
+        while (!m_quit)
+            handle_events(m_fd, EPOLLIN);
+        ret = 0;
+    }
+    return ret;
+}
+
+void InputSource::detach()
+{
+    if (m_loop)
+        m_loop->remove(m_fd);
+    m_loop = NULL;
+}
+
+bool InputSource::take_line(uint64_t *read_us)
+{
+    if (!m_lines)
+        return false;
+
+    m_lines--;
+    if (read_us)
+        *read_us = m_read_us;
+    return true;
+}
+
+void InputSource::set_callback(event_callback callback, void *context)
+{
+    m_callback = callback;
+    m_context  = context;
+}
+
+void InputSource::handle_events(int fd, uint32_t events)
+{
+    Q_UNUSED(events);
+
+    char input[256];
+    ssize_t const size = read(fd, input, sizeof(input));
+    if (size < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+
+    m_read_us = monotonic_us();
+
+    /* Nothing more will come */
+    if (size <= 0)
+        m_quit = true;
+
+    for (ssize_t c = 0; c < size && !m_quit; c++)
+    {
+        if (m_line_start && input[c] == 'q')
+            m_quit = true;
+
+        m_line_start = (input[c] == '\n');
+        if (m_line_start && !m_quit)
+            m_lines++;
+    }
+
+    /* A closed fd stays readable : stop watching it */
+    if (m_quit)
+        detach();
+
+    if (m_callback)
+        m_callback(m_context);
+}
+
+/* ---- Page flips ---- */
+
+FlipEventSource::FlipEventSource(Swapchain &swapchain) :
+    m_swapchain(swapchain),
+    m_loop(NULL),
+    m_error(0)
+{
+}
+
+FlipEventSource::~FlipEventSource()
+{
+    detach();
+}
+
+int FlipEventSource::attach(EventLoop &loop)
+{
+    detach();
+
+    int ret = loop.add(m_swapchain.backend_fd(), EPOLLIN, this);
+    if (!ret)
+        m_loop = &loop;
+    return ret;
+}
+
+void FlipEventSource::detach()
+{
+    if (m_loop)
+        m_loop->remove(m_swapchain.backend_fd());
+    m_loop = NULL;
+}
+
+void FlipEventSource::handle_events(int fd, uint32_t events)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(events);
+
+    int ret = m_swapchain.dispatch_events(0);
+    if (ret >= 0)
+        return;
+
+    qDebug("%s %d Could not dispatch the flip events : %s\n",
+           __FUNCTION__, __LINE__, strerror(-ret));
+    m_error = ret;
+    if (m_loop)
+        m_loop->quit();
+}
+
+/* ---- Hotplug ---- */
+
+HotplugSource::HotplugSource(HotplugMonitor &monitor) :
+    m_monitor(monitor),
+    m_loop(NULL),
+    m_hotplugged(false)
+{
+}
+
+HotplugSource::~HotplugSource()
+{
+    detach();
+}
+
+int HotplugSource::attach(EventLoop &loop)
+{
+    detach();
+
+    int ret = loop.add(m_monitor.fd(), EPOLLIN, this);
+    if (!ret)
+        m_loop = &loop;
+    return ret;
+}
+
+void HotplugSource::detach()
+{
+    if (m_loop)
+        m_loop->remove(m_monitor.fd());
+    m_loop = NULL;
+}
+
+void HotplugSource::handle_events(int fd, uint32_t events)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(events);
+
+    if (m_monitor.check() && !m_hotplugged)
+    {
+        qDebug("%s %d Connector hotplug, the topology will be probed again next time\n",
+               __FUNCTION__, __LINE__);
+        m_hotplugged = true;
+    }
+}
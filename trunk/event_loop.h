@@ -0,0 +1,221 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+
+#include "swapchain.h"
+#include "topology_cache.h"
+
+/* Called by EventLoop when the fd it was added with is ready.
+ * events : what epoll reported, EPOLLIN, EPOLLHUP... */
+class EventHandler
+{
+public:
+    virtual ~EventHandler() {}
+    virtual void handle_events(int fd, uint32_t events) = 0;
+};
+
+/* Waits on every fd at once with epoll and calls their handlers.
+ * The thread sleeps until one of them is ready or quit() is called : the
+ * flips, the input, the hotplug uevents and the signals all wake the same
+ * thread, without any of them blocking the others.
+ *
+ * add and remove must be called before the loop runs, or by the thread
+ * running it (from a handler). quit can be called from anywhere. */
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    /* Returns 0 or a negative errno */
+    int init();
+
+    /* Level triggered : handler is called again as long as fd is ready */
+    int add(int fd, uint32_t events, EventHandler *handler);
+    int remove(int fd);
+
+    /* Waits for at most timeout_ms milliseconds (-1 : forever) and calls
+     * the handlers of the ready fds. Returns how many were called, 0 on
+     * timeout or once quit() was called, or a negative errno. */
+    int dispatch(int timeout_ms);
+    /* Dispatches until quit() */
+    int run();
+
+    void quit();
+    bool quitting() const { return m_quit; }
+
+private:
+    EventLoop(EventLoop const &);
+    EventLoop &operator=(EventLoop const &);
+
+    int                           m_epoll_fd;
+    /* Written to by quit() to wake the loop up */
+    int                           m_wake_fd;
+    std::map<int, EventHandler *> m_handlers;
+    std::atomic<bool>             m_quit;
+};
+
+typedef void (*event_callback)(void *context);
+
+/* The sources below watch one fd each, once attached to a loop. They must
+ * be detached, or destroyed, before the loop is. */
+
+/* SIGINT, SIGTERM and SIGHUP as events : blocked, and read from a
+ * signalfd, so that they stop the loop instead of the process and the
+ * CRTCs can be restored.
+ * The mask is inherited : open before starting any thread. */
+class SignalSource : public EventHandler
+{
+public:
+    SignalSource();
+    ~SignalSource();
+
+    /* Returns 0 or a negative errno */
+    int open();
+    /* Reads what is still pending, and unblocks the signals */
+    void close();
+
+    int attach(EventLoop &loop);
+    void detach();
+
+    /* The last signal received, 0 if none */
+    int received() const { return m_received; }
+    /* For the loops not running an EventLoop : reads what is pending,
+     * then returns received() */
+    int poll();
+    void reset() { m_received = 0; }
+
+    void handle_events(int fd, uint32_t events);
+
+private:
+    SignalSource(SignalSource const &);
+    SignalSource &operator=(SignalSource const &);
+
+    /* Returns the last signal read, 0 if none */
+    int read_signals();
+
+    int              m_fd;
+    sigset_t         m_previous_mask;
+    EventLoop       *m_loop;
+    std::atomic<int> m_received;
+};
+
+/* One shot timerfd, for deadlines */
+class TimerSource : public EventHandler
+{
+public:
+    TimerSource();
+    ~TimerSource();
+
+    int attach(EventLoop &loop);
+    void detach();
+
+    /* Expires delay_us microseconds from now. Rearming moves the
+     * deadline. Returns 0 or a negative errno. */
+    int arm(uint64_t delay_us);
+    /* The deadline went by since it was armed */
+    bool expired() const { return m_expired; }
+
+    void handle_events(int fd, uint32_t events);
+
+private:
+    TimerSource(TimerSource const &);
+    TimerSource &operator=(TimerSource const &);
+
+    int        m_fd;
+    EventLoop *m_loop;
+    bool       m_expired;
+};
+
+/* Lines typed on stdin, or written to a pipe.
+ * 'q' at the start of a line, or the end of the input, requests to quit :
+ * the lines read before are still there to take.
+ * A regular file, which epoll cannot watch, is read entirely by attach. */
+class InputSource : public EventHandler
+{
+public:
+    explicit InputSource(int fd = STDIN_FILENO);
+    ~InputSource();
+
+    int attach(EventLoop &loop);
+    void detach();
+
+    /* Takes one of the lines read, if any. read_us : when it was read */
+    bool take_line(uint64_t *read_us = NULL);
+    unsigned int lines() const { return m_lines; }
+    bool quit_requested() const { return m_quit; }
+
+    /* Called after each read, on the thread running the loop */
+    void set_callback(event_callback callback, void *context);
+
+    void handle_events(int fd, uint32_t events);
+
+private:
+    InputSource(InputSource const &);
+    InputSource &operator=(InputSource const &);
+
+    int            m_fd;
+    EventLoop     *m_loop;
+    unsigned int   m_lines;
+    uint64_t       m_read_us;
+    bool           m_line_start;
+    bool           m_quit;
+    event_callback m_callback;
+    void          *m_context;
+};
+
+/* The page flip events of a swapchain, through the DRM fd (or the timerfd
+ * of the memory backend and of FakeDrmDevice) */
+class FlipEventSource : public EventHandler
+{
+public:
+    explicit FlipEventSource(Swapchain &swapchain);
+    ~FlipEventSource();
+
+    int attach(EventLoop &loop);
+    void detach();
+
+    /* The negative errno dispatching failed with, 0 if it never did */
+    int error() const { return m_error; }
+
+    void handle_events(int fd, uint32_t events);
+
+private:
+    FlipEventSource(FlipEventSource const &);
+    FlipEventSource &operator=(FlipEventSource const &);
+
+    Swapchain &m_swapchain;
+    EventLoop *m_loop;
+    int        m_error;
+};
+
+/* The connector hotplug uevents of a HotplugMonitor */
+class HotplugSource : public EventHandler
+{
+public:
+    explicit HotplugSource(HotplugMonitor &monitor);
+    ~HotplugSource();
+
+    int attach(EventLoop &loop);
+    void detach();
+
+    /* A DRM hotplug uevent was read since attach */
+    bool hotplugged() const { return m_hotplugged; }
+
+    void handle_events(int fd, uint32_t events);
+
+private:
+    HotplugSource(HotplugSource const &);
+    HotplugSource &operator=(HotplugSource const &);
+
+    HotplugMonitor &m_monitor;
+    EventLoop      *m_loop;
+    bool            m_hotplugged;
+};
+
+#endif // EVENT_LOOP_H
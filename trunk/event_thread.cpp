@@ -0,0 +1,83 @@
+#include "event_thread.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <QDebug>
+
+EventThread::EventThread(Swapchain &swapchain, EventLoop &loop, int input_fd) :
+    m_swapchain(swapchain),
+    m_loop(loop),
+    m_flips(swapchain),
+    m_input(input_fd),
+    m_quit(false),
+    m_running(false)
+{
+    m_input.set_callback(input_read, this);
+}
+
+EventThread::~EventThread()
+{
+    stop();
+}
+
+int EventThread::start(bool watch_input)
+{
+    if (m_running)
+        return -EBUSY;
+
+    int ret = m_loop.init();
+    if (!ret)
+        ret = m_flips.attach(m_loop);
+    if (!ret && watch_input)
+        ret = m_input.attach(m_loop);
+    if (ret)
+    {
+        m_flips.detach();
+        return ret;
+    }
+
+    m_running = true;
+    m_swapchain.set_external_dispatch(true);
+    m_thread = std::thread(&EventThread::run, this);
+    return 0;
+}
+
+void EventThread::stop()
+{
+    if (!m_running)
+        return;
+
+    m_loop.quit();
+    m_thread.join();
+
+    m_flips.detach();
+    m_input.detach();
+    m_swapchain.set_external_dispatch(false);
+    m_running = false;
+}
+
+bool EventThread::quit_requested() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_quit || m_loop.quitting();
+}
+
+void EventThread::input_read(void *context)
+{
+    EventThread * const thread = static_cast<EventThread *>(context);
+    std::lock_guard<std::mutex> lock(thread->m_mutex);
+    /* Only 'q' matters to the rendering thread, the lines are dropped */
+    while (thread->m_input.take_line())
+        ;
+    thread->m_quit = thread->m_input.quit_requested();
+}
+
+void EventThread::run()
+{
+    m_loop.run();
+
+    /* Left on a signal or an error as well : let the rendering thread
+     * dispatch the events by itself rather than wait forever */
+    m_swapchain.set_external_dispatch(false);
+}
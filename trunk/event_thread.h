@@ -0,0 +1,47 @@
+#ifndef EVENT_THREAD_H
+#define EVENT_THREAD_H
+
+#include <mutex>
+#include <thread>
+
+#include "event_loop.h"
+#include "swapchain.h"
+
+/* Runs an EventLoop on its own thread, for what must not wait for the
+ * rendering : the page flip events of a swapchain, and the lines typed on
+ * stdin (or written to input_fd). Whatever else was attached to the loop,
+ * like a SignalSource, is handled there too.
+ * While it runs, the swapchain no longer dispatches its events by itself. */
+class EventThread
+{
+public:
+    EventThread(Swapchain &swapchain, EventLoop &loop, int input_fd = STDIN_FILENO);
+    ~EventThread();
+
+    /* watch_input : also read the lines of input_fd */
+    int start(bool watch_input);
+    void stop();
+
+    /* 'q' was typed, stdin was closed, or the loop was told to quit,
+     * by a signal for instance */
+    bool quit_requested() const;
+
+private:
+    EventThread(EventThread const &);
+    EventThread &operator=(EventThread const &);
+
+    void run();
+    static void input_read(void *context);
+
+    Swapchain              &m_swapchain;
+    EventLoop              &m_loop;
+    FlipEventSource         m_flips;
+    InputSource             m_input;
+    std::thread             m_thread;
+
+    mutable std::mutex      m_mutex;
+    bool                    m_quit;
+    bool                    m_running;
+};
+
+#endif // EVENT_THREAD_H
@@ -0,0 +1,578 @@
+#include "frame_source.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <QDebug>
+
+#include "frame_stats.h"
+
+static char const y4m_signature[] = "YUV4MPEG2 ";
+static size_t const y4m_signature_size = sizeof(y4m_signature) - 1;
+
+FrameSource::FrameSource() :
+    m_fd(-1),
+    m_map(NULL),
+    m_map_size(0),
+    m_offset(0),
+    m_data_offset(0),
+    m_ready_fd(-1),
+    m_stop_fd(-1),
+    m_loop(NULL),
+    m_y4m(false),
+    m_repeat(false),
+    m_format(0),
+    m_width(0),
+    m_height(0),
+    m_rate_numerator(0),
+    m_rate_denominator(1),
+    m_frame_bytes(0),
+    m_next_index(0),
+    m_stopping(false),
+    m_end(false),
+    m_error(0)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+FrameSource::~FrameSource()
+{
+    close();
+}
+
+int FrameSource::open(frame_source_config const &config)
+{
+    if (m_fd >= 0)
+        return -EBUSY;
+
+    m_fd = (config.path == "-") ? dup(STDIN_FILENO)
+                                : ::open(config.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0)
+        return -errno;
+
+    m_ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    m_stop_fd  = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_ready_fd < 0 || m_stop_fd < 0)
+    {
+        int const err = errno;
+        close();
+        return -err;
+    }
+
+    /* A file is read through the page cache without any copy into a
+     * read buffer, the kernel reading ahead since the access is
+     * sequential. Pipes cannot be mapped. */
+    struct stat status;
+    if (fstat(m_fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0)
+    {
+        void *map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (map != MAP_FAILED)
+        {
+            m_map      = (uint8_t *) map;
+            m_map_size = status.st_size;
+            if (madvise(m_map, m_map_size, MADV_SEQUENTIAL))
+                qDebug("%s %d madvise(MADV_SEQUENTIAL) failed : %s\n",
+                       __FUNCTION__, __LINE__, strerror(errno));
+        }
+    }
+
+    m_format           = config.format;
+    m_width            = config.width;
+    m_height           = config.height;
+    m_rate_numerator   = config.fps;
+    m_rate_denominator = 1;
+    m_repeat           = config.repeat && m_map;
+
+    int ret = read_header();
+    if (ret)
+    {
+        close();
+        return ret;
+    }
+
+    pixel_format_info const *info = pixel_format_find(m_format);
+    if (!info || !m_width || !m_height ||
+        (info->horizontal_subsampling > 1 && (m_width & 1)))
+    {
+        qDebug("%s %d Cannot play %ux%u frames of format %08x\n",
+               __FUNCTION__, __LINE__, m_width, m_height, m_format);
+        close();
+        return -EINVAL;
+    }
+
+    /* The frames are kept the way they are stored, without padding : a
+     * raw frame is read with a single copy */
+    pixel_image layout;
+    uint32_t const pitch = pixel_format_row_bytes(*info, 0, m_width);
+    uint64_t const image_size = pixel_image_layout(m_format, m_width, m_height, NULL, pitch, layout);
+    m_frame_bytes = image_size;
+    if (m_y4m)
+    {
+        /* The U and V planes, before they are interleaved */
+        m_chroma.resize(layout.planes[1].width * layout.planes[1].height * 2);
+        m_frame_bytes = m_width * m_height + m_chroma.size() + strlen("FRAME\n");
+    }
+
+    unsigned int const depth = std::max(config.queue_depth, 2u);
+    for (unsigned int f = 0; f < depth; f++)
+    {
+        void *memory = NULL;
+        if (posix_memalign(&memory, 64, image_size))
+        {
+            close();
+            return -ENOMEM;
+        }
+
+        m_memory.push_back((uint8_t *) memory);
+        source_frame frame;
+        memset(&frame, 0, sizeof(frame));
+        pixel_image_layout(m_format, m_width, m_height, (uint8_t *) memory, pitch, frame.image);
+        m_frames.push_back(frame);
+        m_free.push_back(f);
+    }
+
+    qDebug("%s %d Playing %s : %s %ux%u, %u/%u fps, %u frames read ahead%s\n",
+           __FUNCTION__, __LINE__, config.path.c_str(),
+           m_y4m ? "YUV4MPEG2" : "raw", m_width, m_height,
+           m_rate_numerator, m_rate_denominator, depth,
+           m_map ? ", mapped" : "");
+    return 0;
+}
+
+int FrameSource::start()
+{
+    if (m_fd < 0)
+        return -EBADF;
+    if (m_thread.joinable())
+        return 0;
+
+    m_thread = std::thread(&FrameSource::read_loop, this);
+    return 0;
+}
+
+void FrameSource::close()
+{
+    detach();
+
+    if (m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_released.notify_all();
+
+        /* Wakes it up if it waits for a pipe */
+        uint64_t const one = 1;
+        if (write(m_stop_fd, &one, sizeof(one)) != sizeof(one))
+            qDebug("%s %d Could not stop the I/O thread : %s\n",
+                   __FUNCTION__, __LINE__, strerror(errno));
+        m_thread.join();
+    }
+
+    if (m_map)
+        munmap(m_map, m_map_size);
+    m_map      = NULL;
+    m_map_size = 0;
+
+    if (m_fd >= 0)
+        ::close(m_fd);
+    if (m_ready_fd >= 0)
+        ::close(m_ready_fd);
+    if (m_stop_fd >= 0)
+        ::close(m_stop_fd);
+    m_fd = m_ready_fd = m_stop_fd = -1;
+
+    for (size_t m = 0; m < m_memory.size(); m++)
+        free(m_memory[m]);
+    m_memory.clear();
+    m_frames.clear();
+    m_free.clear();
+    m_ready.clear();
+    m_chroma.clear();
+    m_peeked.clear();
+    m_offset = m_data_offset = 0;
+    m_next_index = 0;
+    m_y4m = false;
+    m_stopping = false;
+    m_end = false;
+    m_error = 0;
+}
+
+int FrameSource::attach(EventLoop &loop)
+{
+    if (m_ready_fd < 0)
+        return -EBADF;
+
+    detach();
+
+    int ret = loop.add(m_ready_fd, EPOLLIN, this);
+    if (!ret)
+        m_loop = &loop;
+    return ret;
+}
+
+void FrameSource::detach()
+{
+    if (m_loop)
+        m_loop->remove(m_ready_fd);
+    m_loop = NULL;
+}
+
+void FrameSource::handle_events(int fd, uint32_t events)
+{
+    Q_UNUSED(events);
+
+    /* The loop only needs waking up : acquire tells what is ready */
+    uint64_t notifications;
+    if (read(fd, &notifications, sizeof(notifications)) < 0 && errno != EAGAIN)
+        qDebug("%s %d Could not read the frame eventfd : %s\n",
+               __FUNCTION__, __LINE__, strerror(errno));
+}
+
+source_frame *FrameSource::acquire()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (m_ready.empty())
+        return NULL;
+
+    unsigned int const slot = m_ready.front();
+    m_ready.pop_front();
+    return &m_frames[slot];
+}
+
+void FrameSource::release(source_frame *frame)
+{
+    if (!frame)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(frame - &m_frames[0]);
+    }
+    m_released.notify_one();
+}
+
+unsigned int FrameSource::ready() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_ready.size();
+}
+
+bool FrameSource::finished() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_end && m_ready.empty();
+}
+
+int FrameSource::error() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error;
+}
+
+frame_source_stats FrameSource::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+/* ---- Reading ---- */
+
+int FrameSource::read_bytes(uint8_t *destination, size_t size)
+{
+    if (m_map)
+    {
+        if (size > m_map_size - m_offset)
+            return 1;
+
+        memcpy(destination, m_map + m_offset, size);
+        m_offset += size;
+        return 0;
+    }
+
+    size_t const peeked = std::min(size, m_peeked.size());
+    memcpy(destination, m_peeked.data(), peeked);
+    m_peeked.erase(0, peeked);
+    destination += peeked;
+    size        -= peeked;
+
+    while (size)
+    {
+        /* Waits for the writer of the pipe, or for close() */
+        struct pollfd fds[2];
+        memset(fds, 0, sizeof(fds));
+        fds[0].fd     = m_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd     = m_stop_fd;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (fds[1].revents)
+            return -ECANCELED;
+
+        ssize_t const count = read(m_fd, destination, size);
+        if (count < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -errno;
+        }
+        if (!count)
+            return 1;
+
+        destination += count;
+        size        -= count;
+    }
+    return 0;
+}
+
+int FrameSource::read_line(char *line, size_t size)
+{
+    for (size_t c = 0; c + 1 < size; c++)
+    {
+        int ret = read_bytes((uint8_t *) &line[c], 1);
+        if (ret)
+            return ret;
+
+        if (line[c] == '\n')
+        {
+            line[c] = '\0';
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+int FrameSource::read_header()
+{
+    char signature[y4m_signature_size];
+    int ret = read_bytes((uint8_t *) signature, y4m_signature_size);
+    if (ret < 0)
+        return ret;
+
+    m_y4m = (ret == 0 && !memcmp(signature, y4m_signature, y4m_signature_size));
+    if (!m_y4m)
+    {
+        /* Raw frames : what was read belongs to the first one */
+        if (m_map)
+            m_offset = 0;
+        else if (ret == 0)
+            m_peeked.assign(signature, y4m_signature_size);
+        m_data_offset = 0;
+        return 0;
+    }
+
+    char header[512];
+    ret = read_line(header, sizeof(header));
+    if (ret)
+        return (ret < 0) ? ret : -EINVAL;
+
+    m_data_offset = m_offset;
+    return parse_y4m_header(header);
+}
+
+/* The parameters following the signature, separated by spaces : W640
+ * H480 F30000:1001 Ip A1:1 C420jpeg... */
+int FrameSource::parse_y4m_header(char const *header)
+{
+    std::string colour_space = "420jpeg";
+    m_width  = 0;
+    m_height = 0;
+    m_rate_numerator   = 0;
+    m_rate_denominator = 1;
+
+    for (char const *token = header; *token; )
+    {
+        char const *end = strchr(token, ' ');
+        size_t const length = end ? (size_t) (end - token) : strlen(token);
+        std::string const value(token + 1, length ? length - 1 : 0);
+
+        switch (*token)
+        {
+        case 'W':
+            m_width = strtoul(value.c_str(), NULL, 10);
+            break;
+        case 'H':
+            m_height = strtoul(value.c_str(), NULL, 10);
+            break;
+        case 'F':
+            if (sscanf(value.c_str(), "%u:%u", &m_rate_numerator, &m_rate_denominator) != 2 ||
+                !m_rate_denominator)
+            {
+                m_rate_numerator   = 0;
+                m_rate_denominator = 1;
+            }
+            break;
+        case 'C':
+            colour_space = value;
+            break;
+        default:
+            /* Interlacing, aspect ratio and extensions do not matter here */
+            break;
+        }
+
+        token += length;
+        while (*token == ' ')
+            token++;
+    }
+
+    if (colour_space == "420jpeg" || colour_space == "420paldv" ||
+        colour_space == "420mpeg2" || colour_space == "420")
+        m_format = DRM_FORMAT_NV12;
+    else if (colour_space == "422")
+        m_format = DRM_FORMAT_NV16;
+    else
+    {
+        qDebug("%s %d Unsupported YUV4MPEG2 colour space %s\n",
+               __FUNCTION__, __LINE__, colour_space.c_str());
+        return -ENOTSUP;
+    }
+    return 0;
+}
+
+int FrameSource::rewind()
+{
+    if (!m_repeat || m_map_size - m_data_offset < m_frame_bytes)
+        return 1;
+
+    m_offset = m_data_offset;
+    return 0;
+}
+
+int FrameSource::read_frame(source_frame &frame)
+{
+    pixel_image const &image = frame.image;
+
+    int ret;
+    if (m_y4m)
+    {
+        char header[256];
+        ret = read_line(header, sizeof(header));
+        if (ret == 1 && rewind() == 0)
+            ret = read_line(header, sizeof(header));
+        if (ret)
+            return ret;
+        if (strncmp(header, "FRAME", 5))
+        {
+            qDebug("%s %d Not a YUV4MPEG2 frame header : %.16s\n", __FUNCTION__, __LINE__, header);
+            return -EINVAL;
+        }
+
+        /* Planar Y, U and V : the Y plane is read as it is, U and V are
+         * interleaved into the UV plane */
+        pixel_surface const &uv = image.planes[1];
+        size_t const chroma_plane = uv.width * uv.height;
+        ret = read_bytes(image.planes[0].pixels, (size_t) m_width * m_height);
+        if (!ret)
+            ret = read_bytes(&m_chroma[0], m_chroma.size());
+        if (!ret)
+        {
+            uint8_t const *u = &m_chroma[0];
+            uint8_t const *v = u + chroma_plane;
+            for (uint32_t row = 0; row < uv.height; row++)
+            {
+                uint8_t *pair = uv.pixels + (size_t) row * uv.pitch;
+                for (uint32_t x = 0; x < uv.width; x++)
+                {
+                    pair[2 * x]     = *u++;
+                    pair[2 * x + 1] = *v++;
+                }
+            }
+        }
+    }
+    else
+    {
+        ret = read_bytes(image.planes[0].pixels, m_frame_bytes);
+        if (ret == 1 && rewind() == 0)
+            ret = read_bytes(image.planes[0].pixels, m_frame_bytes);
+    }
+
+    if (ret == 1 && m_map && m_offset != m_map_size)
+        qDebug("%s %d The last frame is truncated\n", __FUNCTION__, __LINE__);
+    if (ret)
+        return ret;
+
+    /* The pages of the next frame are read while this one is shown */
+    if (m_map && m_offset < m_map_size)
+    {
+        size_t const page = sysconf(_SC_PAGESIZE);
+        size_t const start = m_offset & ~(page - 1);
+        size_t const end = std::min(m_map_size, m_offset + m_frame_bytes);
+        madvise(m_map + start, end - start, MADV_WILLNEED);
+    }
+
+    frame.index = m_next_index++;
+    return 0;
+}
+
+void FrameSource::notify()
+{
+    uint64_t const one = 1;
+    if (write(m_ready_fd, &one, sizeof(one)) != sizeof(one))
+        qDebug("%s %d Could not wake the event loop up : %s\n",
+               __FUNCTION__, __LINE__, strerror(errno));
+}
+
+void FrameSource::read_loop()
+{
+    for (;;)
+    {
+        unsigned int slot;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_free.empty() && !m_stopping)
+                m_stats.queue_full++;
+            while (m_free.empty() && !m_stopping)
+                m_released.wait(lock);
+            if (m_stopping)
+                return;
+
+            slot = m_free.front();
+            m_free.pop_front();
+        }
+
+        uint64_t const start_us = monotonic_us();
+        int const ret = read_frame(m_frames[slot]);
+        uint64_t const end_us = monotonic_us();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (ret)
+            {
+                m_free.push_front(slot);
+                m_end = true;
+                if (ret < 0 && ret != -ECANCELED)
+                    m_error = ret;
+            }
+            else
+            {
+                m_frames[slot].read_us = end_us;
+                m_ready.push_back(slot);
+                m_stats.frames_read++;
+                m_stats.bytes_read += m_frame_bytes;
+                m_stats.read_us    += end_us - start_us;
+            }
+        }
+
+        if (ret < 0 && ret != -ECANCELED)
+            qDebug("%s %d Could not read a frame : %s\n", __FUNCTION__, __LINE__, strerror(-ret));
+
+        notify();
+        if (ret)
+            return;
+    }
+}
@@ -0,0 +1,159 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "pixel_format.h"
+
+/* What to play, see FrameSource::open */
+struct frame_source_config
+{
+    /* A file, or "-" for stdin */
+    std::string  path;
+    /* Raw frames : their format and size, the planes one after the other
+     * without any padding. Unused for YUV4MPEG2 streams, whose header
+     * gives them. */
+    uint32_t     format;
+    uint32_t     width;
+    uint32_t     height;
+    /* Raw frames per second, 0 if unknown */
+    unsigned int fps;
+    /* Frames read ahead of the one being displayed */
+    unsigned int queue_depth;
+    /* Files : start again once at the end, for playlists */
+    bool         repeat;
+};
+
+/* A frame read, owned by the caller of acquire until released */
+struct source_frame
+{
+    /* Position in the stream, from 0. Repeats keep counting. */
+    uint64_t    index;
+    /* When the I/O thread finished reading it */
+    uint64_t    read_us;
+    pixel_image image;
+};
+
+struct frame_source_stats
+{
+    uint64_t frames_read;
+    uint64_t bytes_read;
+    /* Time the I/O thread spent reading and converting, not waiting */
+    uint64_t read_us;
+    /* The I/O thread found every buffer in use : it is ahead */
+    uint64_t queue_full;
+};
+
+/* Frames read from a raw or YUV4MPEG2 file or pipe by an I/O thread,
+ * into a fixed set of buffers : the thread reads ahead until they are all
+ * ready, and waits for the player to release one.
+ * Regular files are mapped and read with MADV_SEQUENTIAL, the pages of
+ * the next frame being requested ahead with MADV_WILLNEED. Pipes are
+ * read with read().
+ * YUV4MPEG2 4:2:0 and 4:2:2 planar frames are handed out as NV12 and NV16.
+ *
+ * Attached to an event loop, it wakes it up whenever a frame is ready or
+ * the stream ended. acquire and release are called from the thread
+ * running that loop. */
+class FrameSource : public EventHandler
+{
+public:
+    FrameSource();
+    ~FrameSource();
+
+    /* Opens the stream and reads its header, waiting for the writer of a
+     * pipe to send it. Returns 0 or a negative errno, -ENOTSUP for a
+     * YUV4MPEG2 colour space without a matching format. */
+    int open(frame_source_config const &config);
+    /* Starts the I/O thread */
+    int start();
+    /* Stops the I/O thread and closes the stream */
+    void close();
+
+    int attach(EventLoop &loop);
+    void detach();
+
+    uint32_t format() const { return m_format; }
+    uint32_t width() const { return m_width; }
+    uint32_t height() const { return m_height; }
+    /* Frames per second as a fraction, 0 / 1 if the stream does not say */
+    uint32_t rate_numerator() const { return m_rate_numerator; }
+    uint32_t rate_denominator() const { return m_rate_denominator; }
+
+    /* The oldest frame ready, NULL if none. Never blocks. */
+    source_frame *acquire();
+    void release(source_frame *frame);
+    /* Frames ready to be acquired */
+    unsigned int ready() const;
+    /* Every frame was acquired, and no more will come */
+    bool finished() const;
+    /* The negative errno reading failed with, 0 if it did not */
+    int error() const;
+
+    frame_source_stats stats() const;
+
+    void handle_events(int fd, uint32_t events);
+
+private:
+    FrameSource(FrameSource const &);
+    FrameSource &operator=(FrameSource const &);
+
+    int read_header();
+    int parse_y4m_header(char const *header);
+    /* Returns 0, 1 at the end of the stream, or a negative errno */
+    int read_bytes(uint8_t *destination, size_t size);
+    int read_line(char *line, size_t size);
+    int read_frame(source_frame &frame);
+    int rewind();
+    void notify();
+    void read_loop();
+
+    int                       m_fd;
+    /* Regular files are mapped whole */
+    uint8_t                  *m_map;
+    size_t                    m_map_size;
+    size_t                    m_offset;
+    /* Where the first frame starts */
+    size_t                    m_data_offset;
+    /* Read from a pipe while looking for the YUV4MPEG2 signature */
+    std::string               m_peeked;
+    /* Written to wake up the event loop, and the I/O thread while it
+     * waits for a pipe */
+    int                       m_ready_fd;
+    int                       m_stop_fd;
+    EventLoop                *m_loop;
+
+    bool                      m_y4m;
+    bool                      m_repeat;
+    uint32_t                  m_format;
+    uint32_t                  m_width;
+    uint32_t                  m_height;
+    uint32_t                  m_rate_numerator;
+    uint32_t                  m_rate_denominator;
+    /* Bytes of a frame in the stream, and of its U and V planes */
+    size_t                    m_frame_bytes;
+    std::vector<uint8_t>      m_chroma;
+
+    std::vector<source_frame> m_frames;
+    std::vector<uint8_t *>    m_memory;
+    uint64_t                  m_next_index;
+
+    std::thread               m_thread;
+    mutable std::mutex        m_mutex;
+    std::condition_variable   m_released;
+    std::deque<unsigned int>  m_free;
+    std::deque<unsigned int>  m_ready;
+    bool                      m_stopping;
+    bool                      m_end;
+    int                       m_error;
+    frame_source_stats        m_stats;
+};
+
+#endif // FRAME_SOURCE_H
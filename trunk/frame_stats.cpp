@@ -0,0 +1,535 @@
+#include "frame_stats.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <QDebug>
+
+uint64_t monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+}
+
+/* ---- Per thread rings ---- */
+
+FrameEventRing::FrameEventRing(unsigned int capacity) :
+    m_head(0),
+    m_dropped(0),
+    m_tail(0)
+{
+    unsigned int size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    m_events.resize(size);
+    m_mask = size - 1;
+}
+
+bool FrameEventRing::push(frame_event const &event)
+{
+    uint64_t const head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) > m_mask)
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    m_events[head & m_mask] = event;
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool FrameEventRing::pop(frame_event &event)
+{
+    uint64_t const tail = m_tail.load(std::memory_order_relaxed);
+    if (tail == m_head.load(std::memory_order_acquire))
+        return false;
+
+    event = m_events[tail & m_mask];
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+/* ---- Histograms ---- */
+
+/* 2^sub_bucket_bits linear buckets per power of two. Values below
+ * 2^(sub_bucket_bits + 1) have a bucket each. */
+static unsigned int const sub_bucket_bits  = 4;
+static unsigned int const sub_bucket_count = 1u << sub_bucket_bits;
+/* Up to 2^64 */
+static unsigned int const bucket_count = (64 - sub_bucket_bits + 1) * sub_bucket_count;
+
+static unsigned int highest_bit(uint64_t value)
+{
+    unsigned int bit = 0;
+    while (value >>= 1)
+        bit++;
+    return bit;
+}
+
+LatencyHistogram::LatencyHistogram() :
+    m_counts(bucket_count, 0)
+{
+    reset();
+}
+
+void LatencyHistogram::reset()
+{
+    std::fill(m_counts.begin(), m_counts.end(), 0);
+    m_count = 0;
+    m_min   = UINT64_MAX;
+    m_max   = 0;
+    m_sum   = 0;
+}
+
+unsigned int LatencyHistogram::bucket_index(uint64_t value)
+{
+    if (value < 2 * sub_bucket_count)
+        return value;
+
+    /* The sub_bucket_bits bits after the highest one pick the bucket */
+    unsigned int const magnitude = highest_bit(value) - sub_bucket_bits;
+    return magnitude * sub_bucket_count + (value >> magnitude);
+}
+
+uint64_t LatencyHistogram::bucket_lowest(unsigned int index)
+{
+    if (index < 2 * sub_bucket_count)
+        return index;
+
+    unsigned int const magnitude = index / sub_bucket_count - 1;
+    return (uint64_t) (index - magnitude * sub_bucket_count) << magnitude;
+}
+
+uint64_t LatencyHistogram::bucket_highest(unsigned int index)
+{
+    if (index + 1 >= bucket_count)
+        return UINT64_MAX;
+    return bucket_lowest(index + 1) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    m_counts[bucket_index(value)]++;
+    m_count++;
+    m_sum += value;
+    if (value < m_min)
+        m_min = value;
+    if (value > m_max)
+        m_max = value;
+}
+
+uint64_t LatencyHistogram::percentile(double percentile) const
+{
+    if (!m_count)
+        return 0;
+
+    uint64_t const wanted = std::max<uint64_t>(1, (uint64_t) (m_count * percentile / 100.0 + 0.5));
+    uint64_t seen = 0;
+    for (unsigned int b = 0; b < bucket_count; b++)
+    {
+        seen += m_counts[b];
+        if (seen >= wanted)
+        {
+            /* The middle of the bucket, never outside of what was seen */
+            uint64_t const lowest  = bucket_lowest(b);
+            uint64_t const middle  = lowest + (bucket_highest(b) - lowest) / 2;
+            return std::max(m_min, std::min(m_max, middle));
+        }
+    }
+    return m_max;
+}
+
+void LatencyHistogram::buckets(std::vector<std::pair<uint64_t, uint64_t> > &non_empty) const
+{
+    non_empty.clear();
+    for (unsigned int b = 0; b < bucket_count; b++)
+    {
+        if (m_counts[b])
+            non_empty.push_back(std::make_pair(bucket_lowest(b), m_counts[b]));
+    }
+}
+
+char const *frame_metric_name(frame_metric metric)
+{
+    switch (metric)
+    {
+    case METRIC_RENDER:          return "render";
+    case METRIC_PRESENT:         return "present";
+    case METRIC_SUBMIT_TO_FLIP:  return "submit_to_flip";
+    case METRIC_FRAME_INTERVAL:  return "frame_interval";
+    case METRIC_INPUT_TO_PHOTON: return "input_to_photon";
+    default:                     return "unknown";
+    }
+}
+
+/* ---- Collector ---- */
+
+/* Bumped by the SIGUSR1 handler, compared by every collector with the
+ * value it last dumped for */
+static volatile sig_atomic_t dump_requests = 0;
+
+static void request_dump(int signal_number)
+{
+    (void) signal_number;
+    dump_requests = dump_requests + 1;
+}
+
+void FrameStats::install_dump_signal()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_dump;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+static std::atomic<uint64_t> next_instance(1);
+
+/* The ring of the calling thread for the FrameStats it used last, to skip
+ * the lookup in the common case of a single FrameStats */
+struct cached_ring
+{
+    uint64_t        instance;
+    FrameEventRing *ring;
+};
+static thread_local cached_ring thread_cached_ring = { 0, NULL };
+
+FrameStats::FrameStats(unsigned int ring_capacity, unsigned int history) :
+    m_ring_capacity(ring_capacity ? ring_capacity : 1),
+    m_history_size(history),
+    m_instance(next_instance.fetch_add(1)),
+    m_frames(0),
+    m_missed_vblanks(0),
+    m_last_flip_us(0),
+    m_collector_stopping(false)
+{
+}
+
+FrameStats::~FrameStats()
+{
+    stop_collector();
+
+    for (size_t r = 0; r < m_rings.size(); r++)
+        delete m_rings[r].ring;
+}
+
+FrameEventRing *FrameStats::ring_for_thread()
+{
+    if (thread_cached_ring.instance == m_instance)
+        return thread_cached_ring.ring;
+
+    std::thread::id const self = std::this_thread::get_id();
+    FrameEventRing *ring = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_rings_mutex);
+        for (size_t r = 0; r < m_rings.size() && !ring; r++)
+        {
+            if (m_rings[r].id == self)
+                ring = m_rings[r].ring;
+        }
+
+        if (!ring)
+        {
+            thread_ring added;
+            added.id   = self;
+            added.ring = new FrameEventRing(m_ring_capacity);
+            m_rings.push_back(added);
+            ring = added.ring;
+        }
+    }
+
+    thread_cached_ring.instance = m_instance;
+    thread_cached_ring.ring     = ring;
+    return ring;
+}
+
+void FrameStats::record(frame_event_type type, uint64_t frame, uint64_t time_us, uint32_t value)
+{
+    frame_event event;
+    event.frame   = frame;
+    event.time_us = time_us;
+    event.type    = type;
+    event.value   = value;
+    ring_for_thread()->push(event);
+}
+
+static bool earlier_event(frame_event const &a, frame_event const &b)
+{
+    return a.time_us < b.time_us;
+}
+
+void FrameStats::collect()
+{
+    std::lock_guard<std::mutex> lock(m_collect_mutex);
+
+    /* Flipped during the previous collect : complete now */
+    std::vector<uint64_t> flipped;
+    flipped.swap(m_flipped);
+
+    std::vector<FrameEventRing *> rings;
+    {
+        std::lock_guard<std::mutex> rings_lock(m_rings_mutex);
+        for (size_t r = 0; r < m_rings.size(); r++)
+            rings.push_back(m_rings[r].ring);
+    }
+
+    m_drained.clear();
+    frame_event event;
+    for (size_t r = 0; r < rings.size(); r++)
+    {
+        while (rings[r]->pop(event))
+            m_drained.push_back(event);
+    }
+
+    std::stable_sort(m_drained.begin(), m_drained.end(), earlier_event);
+    for (size_t e = 0; e < m_drained.size(); e++)
+        process(m_drained[e]);
+
+    std::sort(flipped.begin(), flipped.end());
+    for (size_t f = 0; f < flipped.size(); f++)
+    {
+        std::map<uint64_t, frame_record>::iterator pending = m_pending.find(flipped[f]);
+        if (pending == m_pending.end())
+            continue;
+
+        complete(pending->second);
+
+        /* Frames flip in order : the older ones were never presented */
+        m_pending.erase(m_pending.begin(), ++pending);
+    }
+}
+
+void FrameStats::process(frame_event const &event)
+{
+    if (event.type == FRAME_MISSED_VBLANK)
+    {
+        m_missed_vblanks += event.value;
+        return;
+    }
+
+    std::map<uint64_t, frame_record>::iterator pending = m_pending.find(event.frame);
+    if (pending == m_pending.end())
+    {
+        frame_record record;
+        memset(&record, 0, sizeof(record));
+        record.frame = event.frame;
+        pending = m_pending.insert(std::make_pair(event.frame, record)).first;
+    }
+    frame_record &record = pending->second;
+
+    switch (event.type)
+    {
+    case FRAME_RENDER_START:
+        record.render_start_us = event.time_us;
+        break;
+    case FRAME_RENDER_END:
+        record.render_end_us = event.time_us;
+        break;
+    case FRAME_SUBMIT:
+        record.submit_us = event.time_us;
+        break;
+    case FRAME_FLIP:
+        record.flip_us  = event.time_us;
+        record.sequence = event.value;
+        m_flipped.push_back(event.frame);
+        break;
+    case FRAME_INPUT:
+        /* The first input the frame answers to waited the longest */
+        if (!record.input_us)
+            record.input_us = event.time_us;
+        break;
+    }
+}
+
+static void record_interval(LatencyHistogram &histogram, uint64_t from_us, uint64_t to_us)
+{
+    if (from_us && to_us >= from_us)
+        histogram.record(to_us - from_us);
+}
+
+void FrameStats::complete(frame_record const &record)
+{
+    record_interval(m_histograms[METRIC_RENDER], record.render_start_us, record.render_end_us);
+    record_interval(m_histograms[METRIC_PRESENT], record.render_end_us, record.submit_us);
+    record_interval(m_histograms[METRIC_SUBMIT_TO_FLIP], record.submit_us, record.flip_us);
+    record_interval(m_histograms[METRIC_FRAME_INTERVAL], m_last_flip_us, record.flip_us);
+    record_interval(m_histograms[METRIC_INPUT_TO_PHOTON], record.input_us, record.flip_us);
+
+    m_last_flip_us = record.flip_us;
+    m_frames++;
+
+    if (!m_history_size)
+        return;
+    if (m_history.size() >= m_history_size)
+        m_history.pop_front();
+    m_history.push_back(record);
+}
+
+LatencyHistogram FrameStats::histogram(frame_metric metric) const
+{
+    std::lock_guard<std::mutex> lock(m_collect_mutex);
+    return m_histograms[metric];
+}
+
+uint64_t FrameStats::frames() const
+{
+    std::lock_guard<std::mutex> lock(m_collect_mutex);
+    return m_frames;
+}
+
+uint64_t FrameStats::missed_vblanks() const
+{
+    std::lock_guard<std::mutex> lock(m_collect_mutex);
+    return m_missed_vblanks;
+}
+
+uint64_t FrameStats::dropped_events() const
+{
+    std::lock_guard<std::mutex> lock(m_rings_mutex);
+    uint64_t dropped = 0;
+    for (size_t r = 0; r < m_rings.size(); r++)
+        dropped += m_rings[r].ring->dropped();
+    return dropped;
+}
+
+void FrameStats::write_json(FILE *output)
+{
+    uint64_t const dropped = dropped_events();
+
+    std::lock_guard<std::mutex> lock(m_collect_mutex);
+    fprintf(output, "{\n  \"frames\": %llu,\n  \"missed_vblanks\": %llu,\n  \"dropped_events\": %llu,\n  \"unit\": \"us\",\n  \"metrics\": {",
+            (unsigned long long) m_frames,
+            (unsigned long long) m_missed_vblanks,
+            (unsigned long long) dropped);
+
+    std::vector<std::pair<uint64_t, uint64_t> > buckets;
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        LatencyHistogram const &histogram = m_histograms[m];
+        fprintf(output, "%s\n    \"%s\": { \"count\": %llu, \"min\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p99.9\": %llu, \"max\": %llu,\n      \"buckets\": [",
+                m ? "," : "",
+                frame_metric_name((frame_metric) m),
+                (unsigned long long) histogram.count(),
+                (unsigned long long) histogram.min(),
+                (unsigned long long) histogram.mean(),
+                (unsigned long long) histogram.percentile(50),
+                (unsigned long long) histogram.percentile(90),
+                (unsigned long long) histogram.percentile(99),
+                (unsigned long long) histogram.percentile(99.9),
+                (unsigned long long) histogram.max());
+
+        histogram.buckets(buckets);
+        for (size_t b = 0; b < buckets.size(); b++)
+            fprintf(output, "%s[%llu, %llu]", b ? ", " : "",
+                    (unsigned long long) buckets[b].first,
+                    (unsigned long long) buckets[b].second);
+        fprintf(output, "] }");
+    }
+    fprintf(output, "\n  }\n}\n");
+}
+
+void FrameStats::write_csv(FILE *output)
+{
+    std::lock_guard<std::mutex> lock(m_collect_mutex);
+    fprintf(output, "frame,sequence,input_us,render_start_us,render_end_us,submit_us,flip_us\n");
+    for (size_t f = 0; f < m_history.size(); f++)
+    {
+        frame_record const &record = m_history[f];
+        fprintf(output, "%llu,%u,%llu,%llu,%llu,%llu,%llu\n",
+                (unsigned long long) record.frame,
+                record.sequence,
+                (unsigned long long) record.input_us,
+                (unsigned long long) record.render_start_us,
+                (unsigned long long) record.render_end_us,
+                (unsigned long long) record.submit_us,
+                (unsigned long long) record.flip_us);
+    }
+}
+
+static int write_file(std::string const &path, FrameStats &stats, void (FrameStats::*writer)(FILE *))
+{
+    /* Written aside and renamed, so that whatever reads the dump never
+     * sees half of it */
+    std::string const temporary = path + ".tmp";
+    FILE *output = fopen(temporary.c_str(), "w");
+    if (!output)
+        return -errno;
+
+    (stats.*writer)(output);
+    if (fclose(output) || rename(temporary.c_str(), path.c_str()))
+    {
+        int const err = errno;
+        unlink(temporary.c_str());
+        return -err;
+    }
+    return 0;
+}
+
+int FrameStats::dump(std::string const &prefix)
+{
+    int ret = write_file(prefix + ".json", *this, &FrameStats::write_json);
+    if (!ret)
+        ret = write_file(prefix + ".csv", *this, &FrameStats::write_csv);
+    if (ret)
+        qDebug("%s %d Could not write the frame statistics to %s : %s\n",
+               __FUNCTION__, __LINE__, prefix.c_str(), strerror(-ret));
+    return ret;
+}
+
+int FrameStats::start_collector(std::string const &dump_prefix, unsigned int period_ms)
+{
+    if (m_collector.joinable())
+        return -EBUSY;
+
+    m_collector_stopping = false;
+    m_collector = std::thread(&FrameStats::collector_main, this, dump_prefix, period_ms ? period_ms : 1);
+    return 0;
+}
+
+void FrameStats::stop_collector()
+{
+    if (!m_collector.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_collector_mutex);
+        m_collector_stopping = true;
+    }
+    m_collector_wake.notify_all();
+    m_collector.join();
+}
+
+void FrameStats::collector_main(std::string dump_prefix, unsigned int period_ms)
+{
+    sig_atomic_t dumped_requests = dump_requests;
+
+    std::unique_lock<std::mutex> lock(m_collector_mutex);
+    while (!m_collector_stopping)
+    {
+        m_collector_wake.wait_for(lock, std::chrono::milliseconds(period_ms));
+
+        lock.unlock();
+        collect();
+        if (dump_requests != dumped_requests)
+        {
+            dumped_requests = dump_requests;
+            dump(dump_prefix);
+        }
+        lock.lock();
+    }
+    lock.unlock();
+
+    /* The frames flipped during the last collect */
+    collect();
+    dump(dump_prefix);
+}
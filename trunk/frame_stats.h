@@ -0,0 +1,220 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* What happened to a frame, and when. Times are CLOCK_MONOTONIC
+ * microseconds, like the page flip events of drivers reporting
+ * DRM_CAP_TIMESTAMP_MONOTONIC. */
+enum frame_event_type
+{
+    FRAME_RENDER_START,
+    FRAME_RENDER_END,
+    /* The flip or the atomic commit was queued */
+    FRAME_SUBMIT,
+    /* The frame reached the screen. value is the vblank sequence. */
+    FRAME_FLIP,
+    /* value vblanks went by without a new frame */
+    FRAME_MISSED_VBLANK,
+    /* The input the frame answers to was read */
+    FRAME_INPUT
+};
+
+/* The CLOCK_MONOTONIC time, in microseconds */
+uint64_t monotonic_us();
+
+struct frame_event
+{
+    uint64_t frame;
+    uint64_t time_us;
+    uint32_t type;
+    uint32_t value;
+};
+
+/* Events recorded by one thread, waiting for the collector.
+ * Single producer, single consumer, never blocks : when the collector is
+ * late, the new events are dropped and counted. */
+class FrameEventRing
+{
+public:
+    /* capacity is rounded up to a power of two */
+    explicit FrameEventRing(unsigned int capacity);
+
+    bool push(frame_event const &event);
+    bool pop(frame_event &event);
+
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    FrameEventRing(FrameEventRing const &);
+    FrameEventRing &operator=(FrameEventRing const &);
+
+    std::vector<frame_event> m_events;
+    uint64_t                 m_mask;
+    /* Written by the producer and by the consumer, on their own cache
+     * line each */
+    std::atomic<uint64_t>    m_head;
+    std::atomic<uint64_t>    m_dropped;
+    char                     m_padding[64];
+    std::atomic<uint64_t>    m_tail;
+};
+
+/* Counts values in logarithmic buckets, each power of two being split in
+ * 16 linear ones, like HdrHistogram with about 1 significant digit :
+ * percentiles are within 6% of the exact value, whatever the range, in a
+ * fixed amount of memory. */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(uint64_t value);
+    void reset();
+
+    uint64_t count() const { return m_count; }
+    uint64_t min() const { return m_count ? m_min : 0; }
+    uint64_t max() const { return m_max; }
+    uint64_t mean() const { return m_count ? m_sum / m_count : 0; }
+    /* percentile between 0 and 100 */
+    uint64_t percentile(double percentile) const;
+
+    /* Non empty buckets, as [lowest value, count] */
+    void buckets(std::vector<std::pair<uint64_t, uint64_t> > &non_empty) const;
+
+private:
+    static unsigned int bucket_index(uint64_t value);
+    static uint64_t bucket_lowest(unsigned int index);
+    static uint64_t bucket_highest(unsigned int index);
+
+    std::vector<uint64_t> m_counts;
+    uint64_t              m_count;
+    uint64_t              m_min;
+    uint64_t              m_max;
+    uint64_t              m_sum;
+};
+
+enum frame_metric
+{
+    /* render start to render end */
+    METRIC_RENDER,
+    /* render end to submit : waiting for a free slot, flushing */
+    METRIC_PRESENT,
+    /* submit to the frame reaching the screen */
+    METRIC_SUBMIT_TO_FLIP,
+    /* between two frames reaching the screen */
+    METRIC_FRAME_INTERVAL,
+    /* input read to the frame answering it reaching the screen */
+    METRIC_INPUT_TO_PHOTON,
+    METRIC_COUNT
+};
+
+char const *frame_metric_name(frame_metric metric);
+
+/* A frame whose flip was seen. Missing times are 0. */
+struct frame_record
+{
+    uint64_t frame;
+    uint32_t sequence;
+    uint64_t input_us;
+    uint64_t render_start_us;
+    uint64_t render_end_us;
+    uint64_t submit_us;
+    uint64_t flip_us;
+};
+
+/* Collects the frame events recorded by the render, event and input
+ * threads, and turns them into latency histograms.
+ *
+ * record() only writes into a ring owned by the calling thread, so it
+ * costs a few atomic operations and never waits for the collector.
+ * collect() matches the events by frame number. A frame is complete once
+ * its flip was seen by a previous collect() : every event recorded before
+ * the flip was then already in the rings.
+ *
+ * The frame number is the one Swapchain::present gives the frame, see
+ * Swapchain::next_frame(). */
+class FrameStats
+{
+public:
+    /* ring_capacity : events buffered per thread between two collects.
+     * history : complete frames kept for write_csv. */
+    explicit FrameStats(unsigned int ring_capacity = 4096, unsigned int history = 4096);
+    ~FrameStats();
+
+    void record(frame_event_type type, uint64_t frame, uint64_t time_us, uint32_t value = 0);
+    void collect();
+
+    /* Collects every period_ms on its own thread, and writes
+     * dump_prefix.json and dump_prefix.csv whenever SIGUSR1 is received,
+     * and once more when stopped. */
+    int start_collector(std::string const &dump_prefix, unsigned int period_ms = 100);
+    void stop_collector();
+
+    /* Writes prefix.json and prefix.csv. Returns 0 or a negative errno. */
+    int dump(std::string const &prefix);
+    /* Summary and histograms */
+    void write_json(FILE *output);
+    /* The last complete frames, one per line */
+    void write_csv(FILE *output);
+
+    /* Copies, taken under the collector lock */
+    LatencyHistogram histogram(frame_metric metric) const;
+    uint64_t frames() const;
+    uint64_t missed_vblanks() const;
+    uint64_t dropped_events() const;
+
+    /* Makes SIGUSR1 request a dump from the collectors */
+    static void install_dump_signal();
+
+private:
+    FrameStats(FrameStats const &);
+    FrameStats &operator=(FrameStats const &);
+
+    struct thread_ring
+    {
+        std::thread::id id;
+        FrameEventRing *ring;
+    };
+
+    FrameEventRing *ring_for_thread();
+    void process(frame_event const &event);
+    void complete(frame_record const &record);
+    void collector_main(std::string dump_prefix, unsigned int period_ms);
+
+    unsigned int const        m_ring_capacity;
+    unsigned int const        m_history_size;
+    /* Tells this instance apart from one created later at the same
+     * address, for the per thread ring cache */
+    uint64_t const            m_instance;
+
+    mutable std::mutex        m_rings_mutex;
+    std::vector<thread_ring>  m_rings;
+
+    /* Everything below is only touched under m_collect_mutex */
+    mutable std::mutex        m_collect_mutex;
+    std::vector<frame_event>  m_drained;
+    std::map<uint64_t, frame_record> m_pending;
+    /* Frames whose flip was seen during the current collect */
+    std::vector<uint64_t>     m_flipped;
+    std::deque<frame_record>  m_history;
+    LatencyHistogram          m_histograms[METRIC_COUNT];
+    uint64_t                  m_frames;
+    uint64_t                  m_missed_vblanks;
+    uint64_t                  m_last_flip_us;
+
+    std::thread               m_collector;
+    std::mutex                m_collector_mutex;
+    std::condition_variable   m_collector_wake;
+    bool                      m_collector_stopping;
+};
+
+#endif // FRAME_STATS_H
@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -16,399 +17,2241 @@
 #include <errno.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 // rand
 #include <stdlib.h>
 #include <QDebug>
 
+#include <dirent.h>
+#include <time.h>
 
-#define ALIGN_ON_POW2(n, align) ((n + align - 1) & ~(align - 1))
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
-// Works on Rockchip systems but fail with ENOSYS on AMDGPU
-int main(int argc, char *argv[])
+#include "atomic_kms.h"
+#include "dmabuf_import.h"
+#include "drm_device.h"
+#include "event_loop.h"
+#include "event_thread.h"
+#include "frame_source.h"
+#include "frame_stats.h"
+#include "output_scheduler.h"
+#include "render_pool.h"
+#include "swapchain.h"
+#include "topology_cache.h"
+
+struct demo_options
 {
-    Q_UNUSED(argc);
-    Q_UNUSED(argv);
+    /* Use memory buffers and a simulated vblank instead of /dev/dri/card0 */
+    bool         headless;
+    /* Draw a row every frame instead of waiting for Enter */
+    bool         automatic;
+    /* Present through atomic commits instead of drmModePageFlip */
+    bool         atomic;
+    /* Run against FakeDrmDevice and report setup, teardown and leaks */
+    bool         fake;
+    /* With fake : scan out decoder frames imported as dma-bufs instead */
+    bool         import;
+    /* Drive every connected output at once, each on its own CRTC */
+    bool         multi;
+    /* With multi : outputs using the same mode share a CRTC and buffers */
+    bool         clone;
+    unsigned int buffer_count;
+    unsigned int max_frames;
+    uint32_t     width;
+    uint32_t     height;
+    unsigned int refresh_hz;
+    /* Animate the whole screen on that many threads, 0 being one per
+     * core. -1 draws the rows on the main thread instead. */
+    int          render_threads;
+    /* Tiles given to the render threads. A width of 0 gives row bands. */
+    uint32_t     tile_width;
+    uint32_t     tile_height;
+    /* Headless : render with 1 to render_threads threads and compare */
+    bool         scaling;
+    /* Draw into a cacheable copy of the buffers, see Swapchain */
+    bool         shadow;
+    /* Scanout format. Anything but XRGB8888 and ARGB8888 implies shadow. */
+    uint32_t     format;
+    /* Compare drawing into a mapped dumb buffer with drawing into a
+     * shadow copy and flushing it */
+    bool         access_bench;
+    /* Which output and mode to use */
+    mode_policy  policy;
+    /* Where the connectors found are saved between runs */
+    std::string  topology_cache;
+    /* Record the frame timings, and write them to frame_stats.json and
+     * .csv on exit and on SIGUSR1 */
+    std::string  frame_stats;
+    /* Where the lines of the interactive demos are read from */
+    int          input_fd;
+    /* Set by main : SIGINT, SIGTERM and SIGHUP stop the demos */
+    SignalSource *signals;
+    /* Fake device : drive the row demo through a pipe, a file and a SIGTERM */
+    bool         events;
+    /* Check the damage tracking, without any device */
+    bool         damage;
+    /* Fake device : check the plane assignment and the CPU blending */
+    bool         planes;
+    /* Play frames from a file or a pipe instead of the demos, when a
+     * path is given */
+    frame_source_config playback;
+};
 
-    /* DRM is based on the fact that you can connect multiple screens,
-     * on multiple different connectors which have, of course, multiple
-     * encoders that transform CRTC (The screen final buffer where all
-     * the framebuffers are blended together) represented in XRGB8888 (or
-     * similar) into something the selected screen comprehend.
-     * (Think XRGB8888 to DVI-D format for example)
-     *
-     * The default selection system is simple :
-     * - We try to find the first connected screen and choose its
-     *   preferred resolution.
-     */
-    drmModeRes         * __restrict drm_resources;
-    drmModeConnector   * __restrict valid_connector   = NULL;
-    drmModeModeInfo    * __restrict chosen_resolution = NULL;
-    drmModeEncoder     * __restrict screen_encoder    = NULL;
+/* One of formats, by name. Returns 0 if unknown. */
+static uint32_t parse_format(char const *name, uint32_t const *formats, size_t count)
+{
+    for (size_t f = 0; f < count; f++)
+    {
+        if (!strcasecmp(name, pixel_format_find(formats[f])->name))
+            return formats[f];
+    }
+    return 0;
+}
 
-    int ret = 0;
+/* XRGB8888, ARGB8888 or RGB565 */
+static uint32_t parse_scanout_format(char const *name)
+{
+    static uint32_t const formats[] = {
+        DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565
+    };
+    return parse_format(name, formats, sizeof(formats) / sizeof(formats[0]));
+}
 
-    /* Open the DRM device node and get a File Descriptor */
-    int const drm_fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+/* Any format the converters read */
+static uint32_t parse_source_format(char const *name)
+{
+    static uint32_t const formats[] = {
+        DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565,
+        DRM_FORMAT_NV12, DRM_FORMAT_NV16
+    };
+    return parse_format(name, formats, sizeof(formats) / sizeof(formats[0]));
+}
+
+static void parse_options(int argc, char *argv[], demo_options &options)
+{
+    options.headless     = false;
+    options.automatic    = false;
+    options.atomic       = false;
+    options.fake         = false;
+    options.import       = false;
+    options.multi        = false;
+    options.clone        = false;
+    options.buffer_count = 3;
+    options.max_frames   = 0;
+    options.width        = 1920;
+    options.height       = 1080;
+    options.refresh_hz   = 60;
+    options.render_threads = -1;
+    options.tile_width     = 0;
+    options.tile_height    = 32;
+    options.scaling        = false;
+    options.shadow         = false;
+    options.format         = DRM_FORMAT_XRGB8888;
+    options.access_bench   = false;
+    options.policy.width      = 0;
+    options.policy.height     = 0;
+    options.policy.refresh_hz = 0;
+    /* Depends on the device, see main */
+    options.topology_cache.clear();
+    options.frame_stats.clear();
+    options.input_fd       = STDIN_FILENO;
+    options.signals        = NULL;
+    options.events         = false;
+    options.damage         = false;
+    options.planes         = false;
+    options.playback.path.clear();
+    options.playback.format      = DRM_FORMAT_XRGB8888;
+    options.playback.width       = 0;
+    options.playback.height      = 0;
+    options.playback.fps         = 0;
+    options.playback.queue_depth = 4;
+    options.playback.repeat      = false;
+
+    for (int a = 1; a < argc; a++)
+    {
+        if (!strcmp(argv[a], "--headless"))
+        {
+            options.headless  = true;
+            options.automatic = true;
+        }
+        else if (!strcmp(argv[a], "--auto"))
+            options.automatic = true;
+        else if (!strcmp(argv[a], "--atomic"))
+            options.atomic = true;
+        else if (!strcmp(argv[a], "--fake"))
+        {
+            options.fake      = true;
+            options.automatic = true;
+        }
+        else if (!strcmp(argv[a], "--import"))
+            options.import = true;
+        else if (!strcmp(argv[a], "--events"))
+            options.events = true;
+        else if (!strcmp(argv[a], "--damage"))
+            options.damage = true;
+        else if (!strcmp(argv[a], "--planes"))
+            options.planes = true;
+        else if (!strcmp(argv[a], "--multi"))
+            options.multi = true;
+        else if (!strcmp(argv[a], "--clone"))
+        {
+            options.multi = true;
+            options.clone = true;
+        }
+        else if (!strcmp(argv[a], "--buffers") && a + 1 < argc)
+            options.buffer_count = strtoul(argv[++a], NULL, 10);
+        else if (!strcmp(argv[a], "--frames") && a + 1 < argc)
+            options.max_frames = strtoul(argv[++a], NULL, 10);
+        else if (!strcmp(argv[a], "--size") && a + 1 < argc)
+            sscanf(argv[++a], "%ux%u@%u", &options.width, &options.height, &options.refresh_hz);
+        else if (!strcmp(argv[a], "--threads") && a + 1 < argc)
+            options.render_threads = strtol(argv[++a], NULL, 10);
+        else if (!strcmp(argv[a], "--tiles") && a + 1 < argc)
+            sscanf(argv[++a], "%ux%u", &options.tile_width, &options.tile_height);
+        else if (!strcmp(argv[a], "--scaling"))
+            options.scaling = true;
+        else if (!strcmp(argv[a], "--shadow"))
+            options.shadow = true;
+        else if (!strcmp(argv[a], "--format") && a + 1 < argc)
+        {
+            options.format = parse_scanout_format(argv[++a]);
+            if (!options.format)
+            {
+                qDebug("Unknown format %s, using XRGB8888", argv[a]);
+                options.format = DRM_FORMAT_XRGB8888;
+            }
+        }
+        else if (!strcmp(argv[a], "--access-bench"))
+            options.access_bench = true;
+        else if (!strcmp(argv[a], "--mode") && a + 1 < argc)
+            parse_mode_constraint(argv[++a], options.policy);
+        else if (!strcmp(argv[a], "--connector") && a + 1 < argc)
+            options.policy.connector_name = argv[++a];
+        else if (!strcmp(argv[a], "--topology-cache") && a + 1 < argc)
+            options.topology_cache = argv[++a];
+        else if (!strcmp(argv[a], "--frame-stats") && a + 1 < argc)
+            options.frame_stats = argv[++a];
+        else if (!strcmp(argv[a], "--play") && a + 1 < argc)
+            options.playback.path = argv[++a];
+        else if (!strcmp(argv[a], "--play-format") && a + 1 < argc)
+        {
+            options.playback.format = parse_source_format(argv[++a]);
+            if (!options.playback.format)
+            {
+                qDebug("Unknown format %s, using XRGB8888", argv[a]);
+                options.playback.format = DRM_FORMAT_XRGB8888;
+            }
+        }
+        else if (!strcmp(argv[a], "--play-size") && a + 1 < argc)
+            sscanf(argv[++a], "%ux%u@%u", &options.playback.width, &options.playback.height,
+                   &options.playback.fps);
+        else if (!strcmp(argv[a], "--prefetch") && a + 1 < argc)
+            options.playback.queue_depth = strtoul(argv[++a], NULL, 10);
+        else if (!strcmp(argv[a], "--repeat"))
+            options.playback.repeat = true;
+        else
+            qDebug("Usage : %s [--headless] [--fake [--import|--events|--damage|--planes]] [--multi [--clone]] [--auto] [--atomic] [--buffers 2|3] [--frames N] [--size WxH@Hz]"
+                   " [--threads N] [--tiles WxH] [--scaling] [--shadow] [--format XRGB8888|ARGB8888|RGB565] [--access-bench] [--mode WxH[@Hz]] [--connector HDMI-A-1] [--topology-cache FILE]"
+                   " [--frame-stats PREFIX] [--play FILE|- [--play-format NV12|NV16|XRGB8888|ARGB8888|RGB565] [--play-size WxH[@fps]] [--prefetch N] [--repeat]]", argv[0]);
+    }
+
+    if (options.buffer_count < 2)
+        options.buffer_count = 2;
+    if (options.scaling && options.render_threads < 0)
+        options.render_threads = 0;
+    if (!options.tile_height)
+        options.tile_height = 32;
+    /* The renderer draws XRGB8888, the shadow copy converts */
+    if (options.format != DRM_FORMAT_XRGB8888 && options.format != DRM_FORMAT_ARGB8888)
+        options.shadow = true;
+    /* Raw frames are as large as the swapchain unless told otherwise */
+    if (!options.playback.width || !options.playback.height)
+    {
+        options.playback.width  = options.width;
+        options.playback.height = options.height;
+    }
+}
+
+/* Draw the rows [first_row, last_row[ */
+static void draw_rows(swapchain_buffer &buffer,
+                      std::vector<uint32_t> const &row_colors,
+                      uint32_t first_row,
+                      uint32_t last_row)
+{
+    /* The rows are padded up to the pitch so that each row starts with a
+     * specific alignment. The pixel operations leave that padding alone. */
+    pixel_surface const surface = swapchain_surface(buffer);
+
+    for (uint32_t row = first_row; row < last_row && row < buffer.height; row++)
+    {
+        pixel_fill_rect(surface, 0, row, buffer.width, 1, row_colors[row]);
+    }
+}
+
+/* The fun begins ! At last !
+ * We'll do something simple :
+ * We'll lit a row of pixel, on the screen, starting from the top,
+ * down to the bottom of screen, using either Red, Blue or Green
+ * randomly, each time we press Enter.
+ * If we press 'q' and then Enter, the process will stop.
+ * The process will also stop once we've reached the bottom of the
+ * screen.
+ * In automatic mode, a row is drawn every frame instead.
+ *
+ * Everything goes through the event loop : the lines typed, the flips,
+ * the signals. A row is drawn as soon as there is one to draw and the
+ * previous one reached the screen, and the thread sleeps otherwise.
+ */
+static int run_row_demo(Swapchain &swapchain,
+                        EventLoop &loop,
+                        demo_options const &options,
+                        FrameStats *frame_stats)
+{
+    /* The colors table */
+    uint32_t const red   = (0xff<<16);
+    uint32_t const green = (0xff<<8);
+    uint32_t const blue  = (0xff);
+    uint32_t const colors[] = {red, green, blue};
+    uint32_t const background = 0xffffff00;
 
-    if (drm_fd >= 0)
+    std::vector<uint32_t> row_colors;
+
+    uint32_t height = 0;
+
+    FlipEventSource flips(swapchain);
+    InputSource input(options.input_fd);
+    /* A flip taking that long means the display is gone */
+    uint64_t const flip_timeout_us = 1000000;
+    TimerSource flip_deadline;
+
+    int ret = flips.attach(loop);
+    if (!ret)
+        ret = flip_deadline.attach(loop);
+    if (!ret && !options.automatic)
+        ret = input.attach(loop);
+    if (ret)
+    {
+        qDebug("%s %d Could not watch the events : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+
+    bool started = options.automatic;
+    if (!started)
+        qDebug() << "enter a key to start drawing pixels. enter will draw a line, 'q' will exit";
+
+    unsigned int frame = 0;
+    while (!loop.quitting() && (!options.max_frames || frame < options.max_frames))
     {
-        /* Let's see what we can use through this drm node */
-        drm_resources = drmModeGetResources(drm_fd);
+        if (!started)
+            started = input.take_line();
+
+        /* While we didn't get a 'q' + Enter, or a signal ... */
+        if (input.quit_requested() && !input.lines())
+            break;
 
-        /* Get a valid connector. A valid connector is one that's connected */
-        for (int_fast32_t c = 0; c < drm_resources->count_connectors; c++)
+        bool const row_wanted = started && (options.automatic || input.lines());
+        if (!row_wanted || swapchain.flip_pending())
         {
-            valid_connector = drmModeGetConnector(drm_fd, drm_resources->connectors[c]);
+            ret = loop.dispatch(-1);
+            if (ret < 0)
+                break;
+            ret = flips.error();
+            if (ret)
+                break;
 
-            if (valid_connector->connection == DRM_MODE_CONNECTED)
+            if (flip_deadline.expired() && swapchain.flip_pending())
             {
+                qDebug("%s %d No page flip for %llu us\n",
+                       __FUNCTION__, __LINE__, (unsigned long long) flip_timeout_us);
+                ret = -ETIMEDOUT;
                 break;
             }
+            continue;
+        }
+
+        /* The row answering the key press is the next frame */
+        uint64_t input_us = 0;
+        if (!options.automatic)
+            input.take_line(&input_us);
 
-            drmModeFreeConnector(valid_connector);
-            valid_connector = NULL;
+        uint64_t const frame_number = swapchain.next_frame();
+        if (frame_stats && !options.automatic)
+            frame_stats->record(FRAME_INPUT, frame_number, input_us);
+
+        /* Nothing is queued : a buffer is free without waiting */
+        swapchain_buffer *buffer = swapchain.acquire(0);
+        if (!buffer)
+        {
+            qDebug("%s %d Could not acquire a buffer\n", __FUNCTION__, __LINE__);
+            ret = -EIO;
+            break;
         }
 
-        /* Bail out if nothing was connected */
-        if (!valid_connector)
+        height = buffer->height;
+        if (frame_stats)
+            frame_stats->record(FRAME_RENDER_START, frame_number, monotonic_us());
+
+        /* Catch up with the frames presented since this buffer was last
+         * on screen, copying only what changed in them.
+         * A buffer we know nothing about is repainted entirely.
+         * memset only uses the low byte of its value, hence the fill. */
+        uint32_t const new_row = row_colors.size();
+        if (!swapchain.copy_stale_regions(*buffer))
         {
-            /* Then there was no connectors,
-             * or no connector were connected */
-            qDebug() << __FUNCTION__ << __LINE__ << "No connectors or no connected connectors found...\n";
-            ret = -ENOLINK;
-            close(drm_fd);
+            pixel_fill(swapchain_surface(*buffer), background);
+            draw_rows(*buffer, row_colors, 0, new_row);
         }
-        else
+
+        /* Choose a random color. 3 being the size of the colors table. */
+        row_colors.push_back(colors[rand()%3]);
+        draw_rows(*buffer, row_colors, new_row, new_row + 1);
+        buffer->damage.add(0, new_row, buffer->width, 1);
+        if (frame_stats)
+            frame_stats->record(FRAME_RENDER_END, frame_number, monotonic_us());
+
+        ret = swapchain.present(buffer);
+        if (ret)
+            break;
+        flip_deadline.arm(flip_timeout_us);
+        frame++;
+
+        /* ... or reached the bottom of the screen. */
+        if (row_colors.size() >= height)
+            break;
+    }
+
+    /* The last flip is still dispatched by the swapchain itself */
+    flips.detach();
+    input.detach();
+    flip_deadline.detach();
+
+    int const idle = swapchain.wait_idle();
+    return ret ? ret : idle;
+}
+
+static void print_swapchain_stats(Swapchain const &swapchain)
+{
+    swapchain_stats const &stats = swapchain.stats();
+
+    uint64_t const average_frame_us = (stats.flips_completed > 1)
+        ? (stats.last_flip_us - stats.first_flip_us) / (stats.flips_completed - 1)
+        : 0;
+
+    qDebug("%u buffers : %llu frames presented, %llu flips, %llu waits, %llu missed vblanks, %llu us per frame",
+           swapchain.buffer_count(),
+           (unsigned long long) stats.frames_presented,
+           (unsigned long long) stats.flips_completed,
+           (unsigned long long) stats.waits,
+           (unsigned long long) stats.missed_vblanks,
+           (unsigned long long) average_frame_us);
+    qDebug("%llu pixels damaged, %llu pixels copied to reused buffers, %llu pixels flushed from the shadow copy",
+           (unsigned long long) stats.damaged_pixels,
+           (unsigned long long) stats.repaired_pixels,
+           (unsigned long long) stats.flushed_pixels);
+}
+
+/* A moving pattern covering the whole buffer */
+static void draw_pattern(pixel_surface const &tile_pixels,
+                         render_tile const &tile,
+                         void *context)
+{
+    uint32_t const frame = *static_cast<uint32_t const *>(context);
+
+    for (uint32_t row = 0; row < tile.height; row++)
+    {
+        uint32_t *pixels = reinterpret_cast<uint32_t *>(tile_pixels.pixels + (size_t) row * tile_pixels.pitch);
+        uint32_t const y = tile.y + row;
+
+        for (uint32_t column = 0; column < tile.width; column++)
+        {
+            uint32_t const x = tile.x + column;
+            uint32_t const red   = (x + frame * 4) & 0xff;
+            uint32_t const green = (y + frame * 2) & 0xff;
+            uint32_t const blue  = ((x ^ y) + frame) & 0xff;
+            pixels[column] = 0xff000000 | (red << 16) | (green << 8) | blue;
+        }
+    }
+}
+
+struct render_demo_stats
+{
+    uint64_t frames;
+    /* Time spent in RenderPool::render */
+    uint64_t render_us;
+    uint64_t total_us;
+};
+
+/* Redraws the whole buffer every frame, split into tiles drawn by the
+ * pool threads, until 'q' + Enter is typed, a signal is received or
+ * max_frames are drawn.
+ * The event loop runs on an EventThread, so that neither the flips nor
+ * stdin wait for the drawing. */
+static int run_render_demo(Swapchain &swapchain,
+                           EventLoop &loop,
+                           RenderPool &pool,
+                           demo_options const &options,
+                           FrameStats *frame_stats,
+                           render_demo_stats &demo_stats)
+{
+    memset(&demo_stats, 0, sizeof(demo_stats));
+
+    EventThread events(swapchain, loop, options.input_fd);
+    int ret = events.start(!options.automatic);
+    if (ret)
+    {
+        qDebug("%s %d Could not start the event thread : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+
+    if (!options.automatic)
+        qDebug() << "drawing. 'q' and enter will exit";
+
+    std::vector<render_tile> tiles;
+    uint64_t const start_us = monotonic_us();
+
+    for (uint32_t frame = 0; !options.max_frames || frame < options.max_frames; frame++)
+    {
+        if (events.quit_requested())
+            break;
+
+        swapchain_buffer *buffer = swapchain.acquire();
+        if (!buffer)
+        {
+            qDebug("%s %d Could not acquire a buffer\n", __FUNCTION__, __LINE__);
+            ret = -EIO;
+            break;
+        }
+
+        if (tiles.empty())
+            split_tiles(buffer->width, buffer->height, options.tile_width, options.tile_height, tiles);
+
+        uint64_t const frame_number = swapchain.next_frame();
+        uint64_t const render_start_us = monotonic_us();
+        pool.render(swapchain_surface(*buffer), tiles, draw_pattern, &frame);
+        uint64_t const render_end_us = monotonic_us();
+        demo_stats.render_us += render_end_us - render_start_us;
+
+        if (frame_stats)
+        {
+            frame_stats->record(FRAME_RENDER_START, frame_number, render_start_us);
+            frame_stats->record(FRAME_RENDER_END, frame_number, render_end_us);
+        }
+
+        buffer->damage.add(0, 0, buffer->width, buffer->height);
+        ret = swapchain.present(buffer);
+        if (ret)
+            break;
+        demo_stats.frames++;
+    }
+
+    if (!ret)
+        ret = swapchain.wait_idle();
+    events.stop();
+
+    demo_stats.total_us = monotonic_us() - start_us;
+    return ret;
+}
+
+static void print_render_stats(RenderPool const &pool,
+                               render_demo_stats const &demo_stats,
+                               uint32_t width, uint32_t height)
+{
+    render_pool_stats const stats = pool.stats();
+    uint64_t const pixels = demo_stats.frames * width * height;
+
+    qDebug("%u threads : %llu frames, %llu us rendering per frame, %llu MPix/s, %llu fps, %llu tiles of which %llu stolen",
+           pool.thread_count(),
+           (unsigned long long) demo_stats.frames,
+           (unsigned long long) (demo_stats.frames ? demo_stats.render_us / demo_stats.frames : 0),
+           (unsigned long long) (demo_stats.render_us ? pixels / demo_stats.render_us : 0),
+           (unsigned long long) (demo_stats.total_us ? demo_stats.frames * 1000000ull / demo_stats.total_us : 0),
+           (unsigned long long) stats.tiles,
+           (unsigned long long) stats.steals);
+}
+
+static void print_frame_stats(FrameStats const &frame_stats)
+{
+    qDebug("%llu frames timed, %llu missed vblanks, %llu events dropped",
+           (unsigned long long) frame_stats.frames(),
+           (unsigned long long) frame_stats.missed_vblanks(),
+           (unsigned long long) frame_stats.dropped_events());
+
+    for (int m = 0; m < METRIC_COUNT; m++)
+    {
+        LatencyHistogram const histogram = frame_stats.histogram((frame_metric) m);
+        if (!histogram.count())
+            continue;
+
+        qDebug("  %-15s : p50 %llu us, p99 %llu us, max %llu us",
+               frame_metric_name((frame_metric) m),
+               (unsigned long long) histogram.percentile(50),
+               (unsigned long long) histogram.percentile(99),
+               (unsigned long long) histogram.max());
+    }
+}
+
+struct playback_stats
+{
+    uint64_t presented;
+    /* Skipped to catch up, the next one being ready already */
+    uint64_t dropped;
+    /* Presented more than a refresh period after they were due */
+    uint64_t late;
+    /* Late ones that were only read after they were due : the I/O is
+     * too slow, rather than the conversion or the display */
+    uint64_t late_reads;
+    uint64_t convert_us;
+    uint64_t start_us;
+    uint64_t end_us;
+};
+
+/* Shows the frames of source, each one when it is due : at the rate of
+ * the stream, or one per vblank when it does not give one.
+ * A frame is presented during the refresh period before it is due, so
+ * that it reaches the screen on time. A frame late by more than a period
+ * is skipped when the next one is ready already, and shown anyway
+ * otherwise, there being nothing more recent to show.
+ * Frames smaller than the screen are centered on black, larger ones are
+ * cropped. */
+static int run_playback(Swapchain &swapchain,
+                        EventLoop &loop,
+                        FrameSource &source,
+                        demo_options const &options,
+                        unsigned int refresh_hz,
+                        FrameStats *frame_stats,
+                        playback_stats &stats)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    uint64_t const refresh_us = 1000000 / (refresh_hz ? refresh_hz : 60);
+    uint32_t const rate_numerator   = source.rate_numerator();
+    uint32_t const rate_denominator = source.rate_denominator();
+
+    FlipEventSource flips(swapchain);
+    /* Wakes up when the next frame is due */
+    TimerSource due_timer;
+    /* A flip taking that long means the display is gone */
+    uint64_t const flip_timeout_us = 1000000;
+    TimerSource flip_deadline;
+
+    int ret = flips.attach(loop);
+    if (!ret)
+        ret = due_timer.attach(loop);
+    if (!ret)
+        ret = flip_deadline.attach(loop);
+    if (!ret)
+        ret = source.attach(loop);
+    if (ret)
+    {
+        qDebug("%s %d Could not watch the events : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+
+    source_frame *frame = NULL;
+    uint64_t first_index = 0;
+    while (!loop.quitting() && (!options.max_frames || stats.presented < options.max_frames))
+    {
+        if (!frame)
+            frame = source.acquire();
+        if (!frame && source.finished())
+            break;
+
+        bool show = frame && !swapchain.flip_pending();
+        bool late = false;
+        bool late_read = false;
+        if (show)
         {
-            /* Get the preferred resolution */
-            for (int_fast32_t m = 0; m < valid_connector->count_modes; m++)
+            uint64_t const now_us = monotonic_us();
+            if (!stats.start_us)
             {
-                drmModeModeInfo * __restrict tested_resolution = &valid_connector->modes[m];
-                if (tested_resolution->type & DRM_MODE_TYPE_PREFERRED)
-                {
-                    chosen_resolution = tested_resolution;
-                    break;
-                }
+                stats.start_us = now_us;
+                first_index    = frame->index;
             }
 
-            /* Bail out if there's no such thing as a "preferred resolution" */
-            if (!chosen_resolution)
+            uint64_t const position = frame->index - first_index;
+            uint64_t const due_us = stats.start_us + (rate_numerator
+                ? position * 1000000ull * rate_denominator / rate_numerator
+                : position * refresh_us);
+
+            late      = (now_us > due_us + refresh_us);
+            late_read = late && (frame->read_us > due_us);
+            if (late && source.ready())
             {
-                qDebug() << __FUNCTION__ << __LINE__ << "No preferred resolution on the selected connector " << valid_connector->connector_id;
-                ret = -ENAVAIL;
-                drmModeFreeConnector(valid_connector);
-                close(drm_fd);
+                source.release(frame);
+                frame = NULL;
+                stats.dropped++;
+                continue;
             }
-            else
+
+            if (due_us > now_us + refresh_us)
             {
-                /* Get an encoder that will transform our CRTC data into something
-                 * the screen comprehend natively, through the chosen connector */
-                screen_encoder = drmModeGetEncoder(drm_fd, valid_connector->encoder_id);
+                due_timer.arm(due_us - refresh_us - now_us);
+                show = false;
+            }
+        }
 
-                /* If there's no screen encoder through the chosen connector, bail
-                 * out quickly. */
-                if (!screen_encoder)
-                {
-                    qDebug("%s %d Could not retrieve the encoder for mode %s, on connector %u",
-                           __FUNCTION__,
-                           __LINE__,
-                           chosen_resolution->name,
-                           valid_connector->connector_id );
-                    ret = -ENOLINK;
-                    drmModeFreeModeInfo(chosen_resolution);
-                    drmModeFreeConnector(valid_connector);
-                    close(drm_fd);
-                }
-                else
-                {
-                    /* We're almost done with KMS. We'll now allocate a "dumb" buffer on
-                     * the GPU, and use it as a "frame buffer", that is something that
-                     * will be read and displayed on screen (the CRTC to be exact) */
-
-                    /* Request a dumb buffer */
-                    struct drm_mode_create_dumb create_request;
-                    memset(&create_request, 0, sizeof(create_request) );
-                    create_request.width  = chosen_resolution->hdisplay;
-                    create_request.height = chosen_resolution->vdisplay;
-                    create_request.bpp    = 32;
-
-                    ret = ioctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_request);
-
-                    /* Bail out if we could not allocate a dumb buffer */
-                    if (ret)
-                    {
-                        qDebug("%s %d Dumb Buffer Object Allocation request of %ux%u@%u failed : %s\n",
-                               __FUNCTION__,
-                               __LINE__,
-                               create_request.width, create_request.height,
-                               create_request.bpp,
-                               strerror(ret)
-                               );
-                        drmModeFreeEncoder(screen_encoder);
-                        drmModeFreeModeInfo(chosen_resolution);
-                        drmModeFreeConnector(valid_connector);
-                        close(drm_fd);
-                    }
-                    else
-                    {
-                        /* Create a framebuffer, using the old method.
-                         *
-                         * A new method exist, drmModeAddFB2 : Return of the Revengeance !
-                         *
-                         * Jokes aside, this other method takes well defined color formats
-                         * as arguments instead of specifying the depth and BPP manually.
-                         */
-                        uint32_t frame_buffer_id;
-                        ret = drmModeAddFB
-                        (
-                            drm_fd,
-                            chosen_resolution->hdisplay,
-                            chosen_resolution->vdisplay,
-                            24,
-                            32,
-                            create_request.pitch,
-                            create_request.handle,
-                            &frame_buffer_id
-                        );
-
-
-                        /* Without framebuffer, we won't do anything so bail out ! */
-                        if (ret)
-                        {
-                            qDebug("%s %d Could not add a framebuffer using drmModeAddFB : %s\n",
-                                   __FUNCTION__,
-                                   __LINE__,
-                                   strerror(ret) );
-                            drmModeFreeEncoder(screen_encoder);
-                            drmModeFreeModeInfo(chosen_resolution);
-                            drmModeFreeConnector(valid_connector);
-                            close(drm_fd);
-                        }
-                        else
-                        {
-                            /* We assume that the currently chosen encoder CRTC ID is the current
-                             * one.
-                             */
-                            uint32_t current_crtc_id = screen_encoder->crtc_id;
-
-                            if (!current_crtc_id)
-                            {
-                                qDebug("%s %d The retrieved encoder has no CRTC attached... ?", __FUNCTION__, __LINE__);
-                                drmModeRmFB(drm_fd, frame_buffer_id);
-                                drmModeFreeEncoder(screen_encoder);
-                                drmModeFreeModeInfo(chosen_resolution);
-                                drmModeFreeConnector(valid_connector);
-                                close(drm_fd);
-                            }
-                            else
-                            {
-                                /* Backup the informations of the CRTC to restore when we're done.
-                                 * The most important piece seems to currently be the buffer ID.
-                                 */
-                                drmModeCrtc * __restrict crtc_to_restore = drmModeGetCrtc(drm_fd, current_crtc_id);
-
-                                if (!crtc_to_restore)
-                                {
-                                    qDebug("%s %d Could not retrieve the current CRTC with a valid ID !\n", __FUNCTION__, __LINE__);
-                                    drmModeRmFB(drm_fd, frame_buffer_id);
-                                    drmModeFreeEncoder(screen_encoder);
-                                    drmModeFreeModeInfo(chosen_resolution);
-                                    drmModeFreeConnector(valid_connector);
-                                    close(drm_fd);
-                                }
-                                else
-                                {
-                                    /* Set the CRTC so that it uses our new framebuffer */
-                                    ret = drmModeSetCrtc ( drm_fd,
-                                                           current_crtc_id,
-                                                           frame_buffer_id,
-                                                           0,
-                                                           0,
-                                                           &valid_connector->connector_id,
-                                                           1,
-                                                           chosen_resolution );
-
-                                    /* For this test only : Export our dumb buffer using PRIME */
-                                    /* This will provide us a PRIME File Descriptor that we'll use to
-                                     * map the represented buffer. This could be also be used to reimport
-                                     * the GEM buffer into another GPU */
-                                    struct drm_prime_handle prime_request =
-                                    {
-                                        .handle = create_request.handle,
-                                        .flags  = DRM_CLOEXEC | DRM_RDWR,
-                                        .fd     = -1
-                                    };
-
-                                    ret = ioctl(drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &prime_request);
-                                    int const dma_buf_fd = prime_request.fd;
-
-                                    /* If we could not export the buffer, bail out since that's the
-                                     * purpose of our test */
-                                    if (ret || dma_buf_fd < 0)
-                                    {
-                                        qDebug("%s %d Could not export buffer : %s (%d) - FD : %d\n",
-                                               __FUNCTION__,
-                                               __LINE__,
-                                               strerror(ret), ret,
-                                               dma_buf_fd );
-
-                                        struct drm_mode_destroy_dumb destroy_request;
-                                        memset(&destroy_request, 0 , sizeof(destroy_request));
-                                        destroy_request.handle = create_request.handle;
-                                        ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_request);
-                                        drmModeSetCrtc
-                                        (
-                                            drm_fd,
-                                            crtc_to_restore->crtc_id, crtc_to_restore->buffer_id,
-                                            0, 0, &valid_connector->connector_id, 1, &crtc_to_restore->mode
-                                        );
-                                        drmModeRmFB(drm_fd, frame_buffer_id);
-                                        drmModeFreeEncoder(screen_encoder);
-                                        drmModeFreeModeInfo(chosen_resolution);
-                                        drmModeFreeConnector(valid_connector);
-                                        close(drm_fd);
-                                    }
-                                    else
-                                    {
-                                        /* Map the exported buffer, using the PRIME File descriptor */
-                                        /* That ONLY works if the DRM driver implements gem_prime_mmap.
-                                         * This function is not implemented in most of the DRM drivers for
-                                         * GPU with discrete memory. Meaning that it will surely fail with
-                                         * Radeon, AMDGPU and Nouveau drivers for desktop cards ! */
-                                        void *pMap = mmap(0, create_request.size, PROT_READ | PROT_WRITE, MAP_SHARED, dma_buf_fd, 0);
-                                        uint8_t* primed_framebuffer = static_cast<uint8_t*>(pMap);
-
-                                        ret = errno;
-
-                                        /* Bail out if we could not map the framebuffer using this method */
-                                        if (primed_framebuffer == NULL || primed_framebuffer == MAP_FAILED)
-                                        {
-                                            qDebug( "%s %d Could not map buffer exported through PRIME : %s (%d). Buffer : %p\n",
-                                                __FUNCTION__,
-                                                __LINE__,
-                                                strerror(ret),
-                                                ret,
-                                                primed_framebuffer );
-
-                                            struct drm_mode_destroy_dumb destroy_request;
-                                            memset(&destroy_request, 0 , sizeof(destroy_request));
-                                            destroy_request.handle = create_request.handle;
-                                            ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_request);
-                                            drmModeSetCrtc
-                                            (
-                                                drm_fd,
-                                                crtc_to_restore->crtc_id, crtc_to_restore->buffer_id,
-                                                0, 0, &valid_connector->connector_id, 1, &crtc_to_restore->mode
-                                            );
-                                            drmModeRmFB(drm_fd, frame_buffer_id);
-                                            drmModeFreeEncoder(screen_encoder);
-                                            drmModeFreeModeInfo(chosen_resolution);
-                                            drmModeFreeConnector(valid_connector);
-                                            close(drm_fd);
-                                        }
-                                        else
-                                        {
-                                            qDebug("%s %d Buffer mapped !\n", __FUNCTION__, __LINE__);
-
-                                            /* The fun begins ! At last !
-                                             * We'll do something simple :
-                                             * We'll lit a row of pixel, on the screen, starting from the top,
-                                             * down to the bottom of screen, using either Red, Blue or Green
-                                             * randomly, each time we press Enter.
-                                             * If we press 'q' and then Enter, the process will stop.
-                                             * The process will also stop once we've reached the bottom of the
-                                             * screen.
-                                             */
-                                            uint32_t const bytes_per_pixel = 4;
-                                            uint_fast64_t pixel = 0;
-                                            uint_fast64_t size = create_request.size;
-
-                                            /* Cleanup the framebuffer */
-                                            memset(primed_framebuffer, 0xffffff00, size);
-
-                                            /* The colors table */
-                                            uint32_t const red   = (0xff<<16);
-                                            uint32_t const green = (0xff<<8);
-                                            uint32_t const blue  = (0xff);
-                                            uint32_t const colors[] = {red, green, blue};
-
-                                            /* Pitch is the stride in bytes.
-                                             * However, for our purpose we'd like to know the stride in pixels.
-                                             * So we'll divide the pitch (in bytes) by the number of bytes
-                                             * composing a pixel to get that information.
-                                             */
-                                            uint32_t const stride_pixel = create_request.pitch / bytes_per_pixel;
-                                            uint32_t const width_pixel  = create_request.width;
-
-                                            /* The width is padded so that each row starts with a specific
-                                             * alignment. That means that we have useless pixels that we could
-                                             * avoid dealing with in the first place.
-                                             * Now, it might be faster to just lit these useless pixels and get
-                                             * done with it. */
-                                            uint32_t const diff_between_width_and_stride = stride_pixel - width_pixel;
-                                            uint_fast64_t const size_in_pixels =create_request.height * stride_pixel;
-
-                                            qDebug() << "enter a key to start drawing pixels. enter will draw a line, 'q' will exit";
-                                            getc(stdin);
-
-                                            /* While we didn't get a 'q' + Enter or reached the bottom of the
-                                             * screen... */
-                                            while (getc(stdin) != 'q' && pixel < size_in_pixels)
-                                            {
-                                                /* Choose a random color. 3 being the size of the colors table. */
-                                                uint32_t current_color = colors[rand()%3];
-
-                                                /* Color every pixel of the row.
-                                                 * Now, the framebuffer is linear. Meaning that the first pixel of
-                                                 * the first row should be at index 0, but the first pixel of the
-                                                 * second row should be at index (stride+0) and the first pixel of
-                                                 * the n-th row should be at (n*stride+0).
-                                                 *
-                                                 * Instead of computing the value, we'll just increment the "pixel"
-                                                 * index and accumulate the padding once done with the current row,
-                                                 * in order to be ready to start for the next row.
-                                                 */
-                                                for (uint_fast32_t p = 0; p < width_pixel; p++)
-                                                {
-                                                    ((uint32_t *) primed_framebuffer)[pixel++] = current_color;
-                                                }
-                                                pixel += diff_between_width_and_stride;
-                                                //LOG("pixel : %lu, size : %lu\n", pixel, size_in_pixels);
-                                            }
-
-                                            struct drm_mode_destroy_dumb destroy_request;
-                                            memset(&destroy_request, 0 , sizeof(destroy_request));
-                                            destroy_request.handle = create_request.handle;
-                                            ioctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_request);
-                                            drmModeSetCrtc
-                                            (
-                                                drm_fd,
-                                                crtc_to_restore->crtc_id, crtc_to_restore->buffer_id,
-                                                0, 0, &valid_connector->connector_id, 1, &crtc_to_restore->mode
-                                            );
-                                            munmap(primed_framebuffer, create_request.size);
-                                            drmModeRmFB(drm_fd, frame_buffer_id);
-                                            drmModeFreeEncoder(screen_encoder);
-                                            drmModeFreeModeInfo(chosen_resolution);
-                                            //drmModeFreeConnector(valid_connector); // double free error for some reason
-                                            close(drm_fd);
-                                        } // ~ successfully mapped buffer
-                                    } // ~ successfully export buffer
-                                } // ~ crtc_to_restore is valid
-                            } // ~ successfully retrieved ctrc encoder
-                        } // ~successfully added a framebuffer
-                    } // ~ buffer successfully allocated
-                } // ~valid screen_encoder
-            } // ~valid_resolution
-        } // ~valid_connector
-    } // ~valid_fd
+        if (!show)
+        {
+            ret = loop.dispatch(-1);
+            if (ret < 0)
+                break;
+            ret = flips.error();
+            if (ret)
+                break;
+
+            if (flip_deadline.expired() && swapchain.flip_pending())
+            {
+                qDebug("%s %d No page flip for %llu us\n",
+                       __FUNCTION__, __LINE__, (unsigned long long) flip_timeout_us);
+                ret = -ETIMEDOUT;
+                break;
+            }
+            continue;
+        }
+
+        uint64_t const frame_number = swapchain.next_frame();
+        swapchain_buffer *buffer = swapchain.acquire(0);
+        if (!buffer)
+        {
+            qDebug("%s %d Could not acquire a buffer\n", __FUNCTION__, __LINE__);
+            ret = -EIO;
+            break;
+        }
+
+        uint64_t const convert_start_us = monotonic_us();
+        if (frame_stats)
+            frame_stats->record(FRAME_RENDER_START, frame_number, convert_start_us);
+
+        pixel_surface const surface = swapchain_surface(*buffer);
+        pixel_image target;
+        pixel_image_layout(DRM_FORMAT_XRGB8888, buffer->width, buffer->height,
+                           surface.pixels, surface.pitch, target);
+
+        pixel_image const &image = frame->image;
+        int32_t const x = ((int32_t) buffer->width - (int32_t) image.width) / 2;
+        int32_t const y = ((int32_t) buffer->height - (int32_t) image.height) / 2;
+
+        /* Every frame covers the same area : only a buffer we know
+         * nothing about needs the rest of the screen */
+        if (!buffer->age)
+            pixel_fill(surface, 0xff000000);
+        else
+            buffer->damage.add(std::max(x, 0), std::max(y, 0),
+                               std::min(image.width, buffer->width),
+                               std::min(image.height, buffer->height));
+
+        ret = pixel_image_convert(target, x, y, image, 0, 0, image.width, image.height);
+        source.release(frame);
+        frame = NULL;
+        if (ret)
+        {
+            qDebug("%s %d Cannot convert the frames : %s\n", __FUNCTION__, __LINE__, strerror(-ret));
+            break;
+        }
+
+        uint64_t const convert_end_us = monotonic_us();
+        stats.convert_us += convert_end_us - convert_start_us;
+        if (frame_stats)
+            frame_stats->record(FRAME_RENDER_END, frame_number, convert_end_us);
+
+        ret = swapchain.present(buffer);
+        if (ret)
+            break;
+        flip_deadline.arm(flip_timeout_us);
+        stats.presented++;
+        if (late)
+            stats.late++;
+        if (late_read)
+            stats.late_reads++;
+    }
+
+    source.release(frame);
+    stats.end_us = monotonic_us();
+
+    /* The last flip is still dispatched by the swapchain itself */
+    flips.detach();
+    due_timer.detach();
+    flip_deadline.detach();
+    source.detach();
+
+    int const idle = swapchain.wait_idle();
+    if (!ret)
+        ret = source.error();
+    return ret ? ret : idle;
+}
+
+static void print_playback_stats(FrameSource const &source, playback_stats const &stats)
+{
+    frame_source_stats const reading = source.stats();
+
+    qDebug("%llu frames read, %.1f MB/s while reading, %llu us per frame, %llu times all read ahead",
+           (unsigned long long) reading.frames_read,
+           reading.read_us ? (double) reading.bytes_read / reading.read_us : 0.0,
+           (unsigned long long) (reading.frames_read ? reading.read_us / reading.frames_read : 0),
+           (unsigned long long) reading.queue_full);
+
+    uint64_t const elapsed_us = stats.end_us - stats.start_us;
+    qDebug("%llu frames presented, %.1f per second, %llu dropped, %llu late (%llu read late), %llu us converting per frame",
+           (unsigned long long) stats.presented,
+           elapsed_us ? stats.presented * 1000000.0 / elapsed_us : 0.0,
+           (unsigned long long) stats.dropped,
+           (unsigned long long) stats.late,
+           (unsigned long long) stats.late_reads,
+           (unsigned long long) (stats.presented ? stats.convert_us / stats.presented : 0));
+}
+
+/* Runs the demo chosen by the options on an initialised swapchain.
+ * loop may already watch other fds, like the hotplug uevents.
+ * refresh_hz : the one of the mode, which paces the playback.
+ * Returns -EINTR when stopped by a signal. */
+static int run_demo(Swapchain &swapchain, EventLoop &loop,
+                    demo_options const &options,
+                    uint32_t width, uint32_t height,
+                    unsigned int refresh_hz)
+{
+    if (options.signals)
+        options.signals->attach(loop);
+
+    FrameStats frame_stats;
+    bool const timed = !options.frame_stats.empty();
+    if (timed)
+    {
+        FrameStats::install_dump_signal();
+        frame_stats.start_collector(options.frame_stats);
+        swapchain.set_frame_stats(&frame_stats);
+    }
+
+    int ret;
+    if (!options.playback.path.empty())
+    {
+        FrameSource source;
+        ret = source.open(options.playback);
+        if (!ret)
+            ret = source.start();
+        if (ret)
+            qDebug("%s %d Could not play %s : %s\n",
+                   __FUNCTION__, __LINE__, options.playback.path.c_str(), strerror(-ret));
+        else
+        {
+            playback_stats stats;
+            ret = run_playback(swapchain, loop, source, options, refresh_hz,
+                               timed ? &frame_stats : NULL, stats);
+            print_swapchain_stats(swapchain);
+            print_playback_stats(source, stats);
+        }
+    }
+    else if (options.render_threads < 0)
+    {
+        ret = run_row_demo(swapchain, loop, options, timed ? &frame_stats : NULL);
+        print_swapchain_stats(swapchain);
+    }
     else
     {
-        qDebug() << __FUNCTION__ << __LINE__ << "Could not open /dev/dri/card0 : %m\n";
+        RenderPool pool(options.render_threads);
+        render_demo_stats demo_stats;
+        ret = run_render_demo(swapchain, loop, pool, options, timed ? &frame_stats : NULL, demo_stats);
+        print_swapchain_stats(swapchain);
+        print_render_stats(pool, demo_stats, width, height);
+    }
+
+    if (timed)
+    {
+        /* Writes the final dump */
+        swapchain.set_frame_stats(NULL);
+        frame_stats.stop_collector();
+        print_frame_stats(frame_stats);
+    }
+
+    if (options.signals)
+    {
+        options.signals->detach();
+        if (!ret && options.signals->received())
+            ret = -EINTR;
+    }
+    return ret;
+}
+
+static int run_headless(demo_options const &options)
+{
+    MemorySwapchainBackend backend(options.refresh_hz);
+    Swapchain swapchain(backend);
+
+    int ret = swapchain.init(options.width, options.height, options.buffer_count,
+                             options.shadow, options.format);
+    if (ret)
+    {
+        qDebug("%s %d Could not allocate the swapchain : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+
+    EventLoop loop;
+    ret = loop.init();
+    if (ret)
+        return ret;
+
+    return run_demo(swapchain, loop, options, options.width, options.height, options.refresh_hz);
+}
+
+/* Renders the same frames with 1 to N threads, N being render_threads
+ * or the number of cores */
+static int run_scaling(demo_options const &options)
+{
+    unsigned int max_threads = options.render_threads;
+    if (!max_threads)
+        max_threads = std::thread::hardware_concurrency();
+    if (!max_threads)
+        max_threads = 1;
+
+    demo_options scaling_options = options;
+    if (!scaling_options.max_frames)
+        scaling_options.max_frames = 120;
+
+    uint64_t single_thread_us = 0;
+    for (unsigned int threads = 1; threads <= max_threads; threads++)
+    {
+        MemorySwapchainBackend backend(options.refresh_hz);
+        Swapchain swapchain(backend);
+
+        int ret = swapchain.init(options.width, options.height, options.buffer_count,
+                                 options.shadow, options.format);
+        if (ret)
+        {
+            qDebug("%s %d Could not allocate the swapchain : %s\n",
+                   __FUNCTION__, __LINE__, strerror(-ret));
+            return ret;
+        }
+
+        EventLoop loop;
+        ret = loop.init();
+        if (ret)
+            return ret;
+        if (options.signals)
+            options.signals->attach(loop);
+
+        RenderPool pool(threads);
+        render_demo_stats demo_stats;
+        ret = run_render_demo(swapchain, loop, pool, scaling_options, NULL, demo_stats);
+        if (options.signals)
+        {
+            options.signals->detach();
+            if (!ret && options.signals->received())
+                ret = -EINTR;
+        }
+        if (ret)
+            return ret;
+
+        print_render_stats(pool, demo_stats, options.width, options.height);
+        if (threads == 1)
+            single_thread_us = demo_stats.render_us;
+        else if (demo_stats.render_us)
+            qDebug("  %.2fx faster than 1 thread", (double) single_thread_us / demo_stats.render_us);
     }
 
     return 0;
 }
 
+struct display_timings
+{
+    /* From the first KMS call to the swapchain being allocated */
+    uint64_t setup_us;
+    /* Part of the setup spent finding out what is connected */
+    uint64_t topology_us;
+    unsigned int probed;
+    /* From the end of the demo to everything being released */
+    uint64_t teardown_us;
+};
+
+/* DRM is based on the fact that you can connect multiple screens,
+ * on multiple different connectors which have, of course, multiple
+ * encoders that transform CRTC (The screen final buffer where all
+ * the framebuffers are blended together) represented in XRGB8888 (or
+ * similar) into something the selected screen comprehend.
+ * (Think XRGB8888 to DVI-D format for example)
+ *
+ * The output and its mode are chosen by the policy given on the command
+ * line. By default, that's the first connected screen and its preferred
+ * resolution.
+ *
+ * Everything acquired here is owned by a RAII object, so returning
+ * early releases whatever was acquired so far. */
+static int run_display(DrmDevice &device,
+                       demo_options const &options,
+                       display_timings &timings)
+{
+    uint64_t const setup_start_us = monotonic_us();
+
+    /* Listen before looking at the connectors, so that no hotplug
+     * happening in between goes unnoticed */
+    HotplugMonitor hotplug;
+    int const hotplug_ret = hotplug.open();
+    bool hotplug_watched = (hotplug_ret == 0);
+    if (!hotplug_watched)
+        qDebug("%s %d Could not watch the hotplugs, not trusting the topology cache : %s\n",
+               __FUNCTION__, __LINE__, strerror(-hotplug_ret));
+
+    /* Let's see what we can use through this drm node */
+    ResourcesPtr drm_resources = get_resources(device);
+    if (!drm_resources)
+    {
+        qDebug("%s %d Could not get the DRM resources : %s\n",
+               __FUNCTION__, __LINE__, strerror(errno));
+        return -ENODEV;
+    }
+
+    /* Probing every connector is slow, only probe the ones that changed
+     * since the last run */
+    TopologyCache topology(options.topology_cache);
+    if (hotplug_watched)
+        topology.load();
+    topology.refresh(device, *drm_resources);
+    timings.topology_us = topology.stats().refresh_us;
+    timings.probed      = topology.stats().probed;
+    if (topology.dirty())
+        topology.save();
+
+    output_choice output;
+    if (select_output(topology.connectors(), options.policy, output))
+    {
+        qDebug() << __FUNCTION__ << __LINE__ << "No connected connector and mode matching the policy found...\n";
+        return -ENOLINK;
+    }
+
+    /* Get an encoder that will transform our CRTC data into something
+     * the screen comprehend natively, through the chosen connector */
+    EncoderPtr screen_encoder = get_encoder(device, output.encoder_id);
+    if (!screen_encoder)
+    {
+        qDebug("%s %d Could not retrieve the encoder for mode %s, on connector %u",
+               __FUNCTION__,
+               __LINE__,
+               output.mode.name,
+               output.connector_id);
+        return -ENOLINK;
+    }
+
+    /* We assume that the currently chosen encoder CRTC ID is the current
+     * one. Its state is put back when leaving, whatever the path. */
+    uint32_t const current_crtc_id = screen_encoder->crtc_id;
+    CrtcRestore crtc_to_restore(device, current_crtc_id, output.connector_id);
+    if (!current_crtc_id || !crtc_to_restore.valid())
+    {
+        qDebug("%s %d Could not retrieve the CRTC attached to the encoder (%u) !\n",
+               __FUNCTION__, __LINE__, current_crtc_id);
+        return -ENOLINK;
+    }
+
+    /* We're almost done with KMS. We'll now allocate "dumb" buffers on
+     * the GPU, and use them as "frame buffers", that is something that
+     * will be read and displayed on screen (the CRTC to be exact).
+     *
+     * Instead of drawing into the buffer being scanned out, which
+     * tears, we rotate between several of them : we draw into one
+     * while another one is on screen, and switch between them
+     * using page flips, which happen during the vertical blanking.
+     */
+    unsigned int crtc_index = 0;
+    while (crtc_index < (unsigned int) drm_resources->count_crtcs &&
+           drm_resources->crtcs[crtc_index] != current_crtc_id)
+    {
+        crtc_index++;
+    }
+
+    DrmSwapchainBackend legacy_backend(device,
+                                       current_crtc_id,
+                                       output.connector_id,
+                                       output.mode);
+
+    /* Atomic commits let the overlay planes do the blending,
+     * when the driver supports them */
+    DrmAtomicDevice atomic_device(device.fd());
+    AtomicSwapchainBackend atomic_backend(device,
+                                          atomic_device,
+                                          current_crtc_id,
+                                          crtc_index,
+                                          output.connector_id,
+                                          output.mode);
+
+    SwapchainBackend &backend = (options.atomic && atomic_device.init() == 0)
+        ? static_cast<SwapchainBackend &>(atomic_backend)
+        : static_cast<SwapchainBackend &>(legacy_backend);
+
+    Swapchain swapchain(backend);
+    int ret = swapchain.init(output.mode.hdisplay,
+                             output.mode.vdisplay,
+                             options.buffer_count,
+                             options.shadow, options.format);
+    if (ret)
+    {
+        qDebug("%s %d Could not allocate the swapchain : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+
+    qDebug("%s %d %u buffers mapped !\n",
+           __FUNCTION__, __LINE__, swapchain.buffer_count());
+    timings.setup_us = monotonic_us() - setup_start_us;
+
+    /* Hotplugs are noticed while running, not only once done */
+    EventLoop loop;
+    HotplugSource hotplug_events(hotplug);
+    ret = loop.init();
+    if (ret)
+        return ret;
+    if (hotplug_watched)
+    {
+        int const attach_ret = hotplug_events.attach(loop);
+        if (attach_ret)
+        {
+            qDebug("%s %d Could not watch the hotplugs while running : %s\n",
+                   __FUNCTION__, __LINE__, strerror(-attach_ret));
+            hotplug_watched = false;
+        }
+    }
+
+    ret = run_demo(swapchain, loop, options, output.mode.hdisplay, output.mode.vdisplay,
+                   output.mode.vrefresh);
+    hotplug_events.detach();
+
+    /* Put the previous framebuffer back before the swapchain destroys
+     * ours, since removing a framebuffer being scanned out disables the
+     * CRTC */
+    uint64_t const teardown_start_us = monotonic_us();
+    swapchain.wait_idle();
+    crtc_to_restore.restore();
+    swapchain.release();
+    timings.teardown_us = monotonic_us() - teardown_start_us;
+
+    /* What we saved may not be true anymore, or we could not tell */
+    if (!hotplug_watched || hotplug_events.hotplugged() || hotplug.check())
+    {
+        topology.invalidate();
+        topology.save();
+    }
+
+    return ret;
+}
 
+/* Each output gets its own color, slowly pulsing */
+static void draw_output(swapchain_buffer &buffer,
+                        unsigned int output,
+                        uint64_t frame,
+                        void *context)
+{
+    Q_UNUSED(context);
+    static uint32_t const colors[] = { 0x00ff0000, 0x0000ff00, 0x000000ff, 0x00ffff00 };
+
+    uint32_t const level = (frame * 4) & 0xff;
+    uint32_t const color = colors[output % 4] & ((level << 16) | (level << 8) | level);
+    pixel_fill_rect(swapchain_surface(buffer), 0, 0, buffer.width, buffer.height,
+                    0xff000000 | color);
+}
+
+/* The CRTC driving connector_id, 0 if none */
+static uint32_t connector_crtc(DrmDevice &device, uint32_t connector_id)
+{
+    ConnectorPtr connector = get_connector_current(device, connector_id);
+    if (!connector || !connector->encoder_id)
+        return 0;
+
+    EncoderPtr encoder = get_encoder(device, connector->encoder_id);
+    return encoder ? encoder->crtc_id : 0;
+}
+
+/* Drives every connected output accepted by the policy at once, each at
+ * its own refresh rate, until the frames are shown or a signal is
+ * received. The CRTCs get their state back either way. */
+static int run_multi_display(DrmDevice &device, demo_options const &options)
+{
+    ResourcesPtr drm_resources = get_resources(device);
+    if (!drm_resources)
+    {
+        qDebug("%s %d Could not get the DRM resources : %s\n",
+               __FUNCTION__, __LINE__, strerror(errno));
+        return -ENODEV;
+    }
+
+    TopologyCache topology(options.topology_cache);
+    topology.load();
+    topology.refresh(device, *drm_resources);
+    if (topology.dirty())
+        topology.save();
+
+    std::vector<output_choice> choices;
+    std::vector<output_assignment> outputs;
+    if (select_outputs(topology.connectors(), options.policy, choices) ||
+        assign_outputs(device, *drm_resources, choices, options.clone, outputs))
+    {
+        qDebug("%s %d No connected connector and mode matching the policy found...\n",
+               __FUNCTION__, __LINE__);
+        return -ENOLINK;
+    }
+
+    /* Save the CRTCs we are going to use, and the ones our connectors
+     * leave. The ones that were off are put back first, so that the
+     * connectors are free again when the others take theirs back. */
+    std::vector<uint32_t> crtc_ids;
+    std::vector<uint32_t> first_connectors;
+    for (size_t o = 0; o < outputs.size(); o++)
+    {
+        for (size_t c = 0; c < outputs[o].connector_ids.size(); c++)
+        {
+            uint32_t const connector_id = outputs[o].connector_ids[c];
+            uint32_t const previous_crtc_id = connector_crtc(device, connector_id);
+            if (previous_crtc_id && std::find(crtc_ids.begin(), crtc_ids.end(), previous_crtc_id) == crtc_ids.end())
+            {
+                crtc_ids.push_back(previous_crtc_id);
+                first_connectors.push_back(connector_id);
+            }
+        }
+    }
+    std::vector<std::unique_ptr<CrtcRestore> > crtcs_to_restore;
+    for (size_t o = 0; o < outputs.size(); o++)
+    {
+        if (std::find(crtc_ids.begin(), crtc_ids.end(), outputs[o].crtc_id) == crtc_ids.end())
+            crtcs_to_restore.emplace_back(new CrtcRestore(device, outputs[o].crtc_id, 0));
+    }
+    for (size_t c = 0; c < crtc_ids.size(); c++)
+        crtcs_to_restore.emplace_back(new CrtcRestore(device, crtc_ids[c], first_connectors[c]));
+
+    /* Declared after the CRTCs to restore : the CRTCs get their state
+     * back before our framebuffers go away */
+    OutputScheduler scheduler(device);
+    int ret = scheduler.init(outputs, options.buffer_count, options.shadow, options.format);
+    if (ret)
+        return ret;
+
+    for (unsigned int o = 0; o < scheduler.output_count(); o++)
+    {
+        output_assignment const &output = scheduler.assignment(o);
+        qDebug("output %u : CRTC %u, %u connector(s), %ux%u@%u",
+               o, output.crtc_id, (unsigned int) output.connector_ids.size(),
+               output.mode.hdisplay, output.mode.vdisplay, output.mode.vrefresh);
+    }
+
+    ret = scheduler.run(draw_output, NULL, options.max_frames ? options.max_frames : 300,
+                        options.signals);
+    if (ret == -EINTR)
+        qDebug("%s %d %s received, leaving\n",
+               __FUNCTION__, __LINE__, strsignal(options.signals->received()));
+
+    for (unsigned int o = 0; o < scheduler.output_count(); o++)
+    {
+        output_stats const stats = scheduler.stats(o);
+        qDebug("output %u : %llu frames, %llu flips, %llu missed vblanks, %llu us per frame",
+               o,
+               (unsigned long long) stats.frames,
+               (unsigned long long) stats.flips,
+               (unsigned long long) stats.missed_vblanks,
+               (unsigned long long) stats.flip_interval_us);
+    }
+
+    scheduler.wait_idle();
+    for (size_t c = 0; c < crtcs_to_restore.size(); c++)
+        crtcs_to_restore[c]->restore();
+    scheduler.release();
+
+    return ret;
+}
+
+static unsigned int open_fd_count()
+{
+    unsigned int count = 0;
+    DIR *fds = opendir("/proc/self/fd");
+    if (!fds)
+        return 0;
+
+    while (readdir(fds))
+        count++;
+    closedir(fds);
+
+    /* ".", ".." and the fd of the directory itself */
+    return count - 3;
+}
+
+/* Reports what a self-check left behind on the fake device : live_objects,
+ * sampled just before the device went away, and the fds open since
+ * fds_before. Returns -EBADFD if anything leaked. */
+static int check_fake_teardown(unsigned int live_objects, unsigned int fds_before, char const *what)
+{
+    int const fds_leaked = (int) open_fd_count() - (int) fds_before;
+    qDebug("fake device, %s : %u objects and %d fds leaked", what, live_objects, fds_leaked);
+    return (live_objects || fds_leaked) ? -EBADFD : 0;
+}
+
+/* A connected screen for the fake device, with a single preferred mode */
+static fake_connector fake_screen(uint32_t width, uint32_t height, uint32_t refresh_hz,
+                                  uint32_t connector_type = DRM_MODE_CONNECTOR_HDMIA)
+{
+    drmModeModeInfo mode;
+    memset(&mode, 0, sizeof(mode));
+    mode.hdisplay = width;
+    mode.vdisplay = height;
+    mode.vrefresh = refresh_hz;
+    mode.type     = DRM_MODE_TYPE_PREFERRED | DRM_MODE_TYPE_DRIVER;
+    snprintf(mode.name, sizeof(mode.name), "%ux%u", width, height);
+
+    fake_connector screen;
+    screen.connector_type = connector_type;
+    screen.connected      = true;
+    screen.modes.push_back(mode);
+    return screen;
+}
+
+/* Runs the whole setup and teardown sequence against an in-process
+ * device, with a 1920x1080 screen and an empty VGA port, and checks that
+ * nothing is left behind. Needs no GPU.
+ * Every probe takes 100 ms, like a slow DDC bus. The sequence is run
+ * three times : without topology cache, with it, and with another screen
+ * plugged in since the last run. */
+static int run_fake(demo_options const &options)
+{
+    char const * const runs[] = { "cold", "cached", "replugged" };
+
+    unlink(options.topology_cache.c_str());
+
+    int ret = 0;
+    for (unsigned int run = 0; run < 3 && !ret; run++)
+    {
+        unsigned int const fds_before = open_fd_count();
+        display_timings timings = { 0, 0, 0, 0 };
+        unsigned int live_objects = 0;
+        {
+            FakeDrmDevice device;
+            device.set_probe_delay(100000);
+
+            /* Only the header and the serial number matter here */
+            uint8_t const edid_header[] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+            fake_connector screen = fake_screen(1920, 1080, 60);
+            screen.edid.assign(edid_header, edid_header + sizeof(edid_header));
+            screen.edid.resize(128, 0);
+            screen.edid[12] = (run == 2) ? 2 : 1;
+            device.add_connector(screen);
+
+            fake_connector vga_port;
+            vga_port.connector_type = DRM_MODE_CONNECTOR_VGA;
+            vga_port.connected      = false;
+            device.add_connector(vga_port);
+
+            ret = run_display(device, options, timings);
+            live_objects = device.live_objects();
+        }
+
+        qDebug("fake device, %s : setup %llu us (%llu us and %u probes for the topology), teardown %llu us",
+               runs[run],
+               (unsigned long long) timings.setup_us,
+               (unsigned long long) timings.topology_us,
+               timings.probed,
+               (unsigned long long) timings.teardown_us);
+
+        int const leaked = check_fake_teardown(live_objects, fds_before, runs[run]);
+        if (!ret)
+            ret = leaked;
+    }
+
+    return ret;
+}
+
+static void send_sigterm(unsigned int delay_us)
+{
+    usleep(delay_us);
+    kill(getpid(), SIGTERM);
+}
+
+/* Drives the row demo on the fake device, with its simulated vblanks,
+ * through the event loop : lines written to a pipe instead of stdin,
+ * the same lines from a file, which epoll cannot watch, then a SIGTERM
+ * in the middle of an endless run. All must leave with the console
+ * framebuffer back on the CRTC and nothing leaked. */
+static int run_fake_events(demo_options const &options)
+{
+    if (!options.signals)
+        return -EINVAL;
+
+    char const * const runs[] = { "pipe", "file", "SIGTERM" };
+    unsigned int const run_count = sizeof(runs) / sizeof(runs[0]);
+
+    int ret = 0;
+    for (unsigned int run = 0; run < run_count && !ret; run++)
+    {
+        unsigned int const fds_before = open_fd_count();
+        unsigned int live_objects = 0;
+        uint32_t console_fb_id = 0, restored_fb_id = 0;
+        swapchain_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        int run_ret;
+        {
+            FakeDrmDevice device;
+            device.set_vblank_simulation(true);
+
+            uint32_t const crtc_id = connector_crtc(device, device.add_connector(fake_screen(640, 480, 60)));
+            CrtcPtr console = get_crtc(device, crtc_id);
+            console_fb_id = console ? console->buffer_id : 0;
+            console.reset();
+
+            demo_options events_options = options;
+            events_options.render_threads = -1;
+            events_options.max_frames     = 0;
+
+            /* Start, 3 rows, then quit : "q" stops before its row */
+            char const lines[] = "\n\n\n\nq\n";
+            ssize_t const lines_size = sizeof(lines) - 1;
+            int pipe_fds[2] = { -1, -1 };
+            FILE *lines_file = NULL;
+            std::thread terminator;
+            if (run == 0)
+            {
+                if (pipe2(pipe_fds, O_CLOEXEC))
+                    return -errno;
+                if (write(pipe_fds[1], lines, lines_size) != lines_size)
+                    ret = -EIO;
+                close(pipe_fds[1]);
+
+                events_options.automatic = false;
+                events_options.input_fd  = pipe_fds[0];
+            }
+            else if (run == 1)
+            {
+                /* As with drmTest < keys.txt */
+                lines_file = tmpfile();
+                if (!lines_file)
+                    return -errno;
+                if (write(fileno(lines_file), lines, lines_size) != lines_size ||
+                    lseek(fileno(lines_file), 0, SEEK_SET))
+                {
+                    ret = -EIO;
+                }
+
+                events_options.automatic = false;
+                events_options.input_fd  = fileno(lines_file);
+            }
+            else
+            {
+                /* 480 rows at 60 Hz would take 8 s. The thread inherits
+                 * the blocked signals, the signalfd gets it. */
+                events_options.automatic = true;
+                terminator = std::thread(send_sigterm, 200000u);
+            }
+
+            display_timings timings = { 0, 0, 0, 0 };
+            run_ret = run_display(device, events_options, timings);
+            if (terminator.joinable())
+                terminator.join();
+            if (pipe_fds[0] >= 0)
+                close(pipe_fds[0]);
+            if (lines_file)
+                fclose(lines_file);
+
+            CrtcPtr restored = get_crtc(device, crtc_id);
+            restored_fb_id = restored ? restored->buffer_id : 0;
+            restored.reset();
+            live_objects = device.live_objects();
+        }
+        int const leaked = check_fake_teardown(live_objects, fds_before, runs[run]);
+        int const signal_number = options.signals->received();
+        options.signals->reset();
+
+        qDebug("fake device, %s : %s, console framebuffer %s",
+               runs[run],
+               run_ret ? strerror(-run_ret) : "done",
+               (console_fb_id && restored_fb_id == console_fb_id) ? "restored" : "lost");
+
+        bool const expected = (run < 2) ? run_ret == 0 : (run_ret == -EINTR && signal_number == SIGTERM);
+        if (!ret && (!expected || !console_fb_id || restored_fb_id != console_fb_id))
+            ret = -EBADFD;
+        if (!ret)
+            ret = leaked;
+    }
+
+    return ret;
+}
+
+/* Plays the part of a video decoder handing NV12 frames over as
+ * dma-bufs, on the fake device : the frames are imported, cached, and
+ * page flipped to directly. Half of the buffers use the AFBC layout the
+ * Rockchip decoders can produce. */
+static int run_fake_import(demo_options const &options)
+{
+    unsigned int const decoder_buffers = 6;
+    uint32_t const width  = options.width;
+    uint32_t const height = options.height;
+    unsigned int const frames = options.max_frames ? options.max_frames : 300;
+
+    unsigned int const fds_before = open_fd_count();
+    unsigned int live_objects = 0;
+    int ret = 0;
+    {
+        FakeDrmDevice device;
+        device.set_afbc_supported(true);
+
+        device.add_connector(fake_screen(width, height, 60));
+
+        ResourcesPtr resources = get_resources(device);
+        uint32_t const crtc_id = resources->crtcs[0];
+
+        /* What the decoder allocated : NV12, chroma right after luma */
+        uint32_t const pitch = ALIGN_ON_POW2(width, 64u);
+        std::vector<int> buffers;
+        for (unsigned int b = 0; b < decoder_buffers; b++)
+        {
+            int fd = create_stand_in_dmabuf((size_t) pitch * height * 3 / 2);
+            if (fd < 0)
+            {
+                ret = fd;
+                break;
+            }
+            buffers.push_back(fd);
+        }
+
+        DmabufImporter importer(device);
+        uint64_t const start_us = monotonic_us();
+        for (unsigned int frame = 0; frame < frames && !ret; frame++)
+        {
+            unsigned int const b = frame % buffers.size();
+
+            dmabuf_frame decoded;
+            memset(&decoded, 0, sizeof(decoded));
+            decoded.width        = width;
+            decoded.height       = height;
+            decoded.format       = DRM_FORMAT_NV12;
+            decoded.modifier     = (b & 1)
+                ? DRM_FORMAT_MOD_ARM_AFBC(AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE)
+                : DRM_FORMAT_MOD_LINEAR;
+            decoded.plane_count  = 2;
+            decoded.planes[0].fd     = buffers[b];
+            decoded.planes[0].offset = 0;
+            decoded.planes[0].pitch  = pitch;
+            decoded.planes[1].fd     = buffers[b];
+            decoded.planes[1].offset = pitch * height;
+            decoded.planes[1].pitch  = pitch;
+
+            uint32_t fb_id;
+            ret = importer.framebuffer(decoded, fb_id);
+            if (!ret)
+                ret = device.page_flip(crtc_id, fb_id, DRM_MODE_PAGE_FLIP_EVENT, &device);
+            if (!ret)
+            {
+                drmEventContext event_context;
+                memset(&event_context, 0, sizeof(event_context));
+                event_context.version = 2;
+                ret = device.handle_event(event_context);
+            }
+        }
+        uint64_t const elapsed_us = monotonic_us() - start_us;
+
+        /* The console framebuffer goes back on screen before ours go */
+        device.set_crtc(crtc_id, 0, NULL, 0, NULL);
+
+        dmabuf_import_stats const &stats = importer.stats();
+        qDebug("%u frames from %u decoder buffers : %llu imports (%llu us each), %llu cache hits, %llu evictions, %llu us per frame",
+               frames, decoder_buffers,
+               (unsigned long long) stats.imports,
+               (unsigned long long) (stats.imports ? stats.import_us / stats.imports : 0),
+               (unsigned long long) stats.hits,
+               (unsigned long long) stats.evictions,
+               (unsigned long long) (frames ? elapsed_us / frames : 0));
+
+        importer.clear();
+        for (size_t b = 0; b < buffers.size(); b++)
+            close(buffers[b]);
+        resources.reset();
+        live_objects = device.live_objects();
+    }
+
+    int const leaked = check_fake_teardown(live_objects, fds_before, "dma-buf import");
+    return ret ? ret : leaked;
+}
+
+/* A kiosk : a 1080p HDMI monitor and a 1080p eDP panel, which both
+ * display controllers can drive, and a 800x1280 DSI panel at 50 Hz on the
+ * second one only, with three CRTCs flipping at their own vblanks.
+ * Without clone, every output runs on its own clock. With clone, HDMI and
+ * eDP share a CRTC and its buffers. */
+static int run_fake_multi(demo_options const &options)
+{
+    unsigned int const fds_before = open_fd_count();
+    unsigned int live_objects = 0;
+    int ret = 0;
+    {
+        FakeDrmDevice device;
+        device.set_vblank_simulation(true);
+
+        fake_connector hdmi = fake_screen(1920, 1080, 60);
+        hdmi.modes[0].clock = 148500;
+
+        fake_connector edp = hdmi;
+        edp.connector_type = DRM_MODE_CONNECTOR_eDP;
+
+        fake_connector dsi = fake_screen(800, 1280, 50, DRM_MODE_CONNECTOR_DSI);
+        dsi.modes[0].clock = 58000;
+
+        device.add_crtc();
+        device.add_crtc();
+        device.add_crtc();
+        device.add_connector(hdmi, 0x3);
+        device.add_connector(edp, 0x5);
+        device.add_connector(dsi, 0x2);
+
+        ret = run_multi_display(device, options);
+        live_objects = device.live_objects();
+    }
+
+    int const leaked = check_fake_teardown(live_objects, fds_before,
+                                           options.clone ? "cloned outputs" : "independent outputs");
+    return ret ? ret : leaked;
+}
+
+/* A primary plane and two overlays on the first CRTC, the one below
+ * reading XRGB8888 and the one above NV12, plus a cursor plane and an
+ * overlay of another CRTC, which must be left alone */
+static void add_fake_planes(FakeAtomicDevice &atomic)
+{
+    plane_info primary;
+    primary.plane_id       = 31;
+    primary.type           = DRM_PLANE_TYPE_PRIMARY;
+    primary.possible_crtcs = 0x1;
+    primary.zpos           = 0;
+    primary.formats.push_back(DRM_FORMAT_XRGB8888);
+    primary.formats.push_back(DRM_FORMAT_ARGB8888);
+    atomic.add_plane(primary);
+
+    /* Added out of zpos order */
+    plane_info top = primary;
+    top.plane_id = 41;
+    top.type     = DRM_PLANE_TYPE_OVERLAY;
+    top.zpos     = 2;
+    top.formats.clear();
+    top.formats.push_back(DRM_FORMAT_ARGB8888);
+    top.formats.push_back(DRM_FORMAT_NV12);
+    atomic.add_plane(top);
+
+    plane_info bottom = primary;
+    bottom.plane_id = 42;
+    bottom.type     = DRM_PLANE_TYPE_OVERLAY;
+    bottom.zpos     = 1;
+    atomic.add_plane(bottom);
+
+    plane_info cursor = top;
+    cursor.plane_id = 51;
+    cursor.type     = DRM_PLANE_TYPE_CURSOR;
+    cursor.zpos     = 3;
+    atomic.add_plane(cursor);
+
+    plane_info other_crtc = top;
+    other_crtc.plane_id       = 61;
+    other_crtc.possible_crtcs = 0x2;
+    atomic.add_plane(other_crtc);
+}
+
+/* plane_id, fb_id : what a plane of the configuration shows */
+struct expected_plane
+{
+    uint32_t plane_id;
+    uint32_t fb_id;
+};
+
+/* Assigns layers on a fresh plane table with the given limits, and
+ * compares the planes, in order, the layers blended by the CPU and the
+ * TEST_ONLY commits it took */
+static bool check_planes(char const *what,
+                         std::vector<plane_layer> const &layers,
+                         unsigned int max_active_planes,
+                         bool overlay_scaling,
+                         expected_plane const *expected, size_t count,
+                         unsigned int expected_cpu_layers,
+                         unsigned int expected_test_commits)
+{
+    FakeAtomicDevice atomic;
+    add_fake_planes(atomic);
+    atomic.set_max_active_planes(max_active_planes);
+    atomic.set_overlay_scaling(overlay_scaling);
+
+    plane_configuration configuration;
+    configuration.cpu_layers = 0;
+    int const ret = assign_planes(atomic, 1, 0, layers, NULL, configuration);
+
+    bool same = !ret &&
+                configuration.planes.size() == count &&
+                configuration.cpu_layers == expected_cpu_layers &&
+                atomic.test_commits() == expected_test_commits;
+    for (size_t p = 0; p < count && same; p++)
+    {
+        same = configuration.planes[p].plane_id == expected[p].plane_id &&
+               configuration.planes[p].layer.fb_id == expected[p].fb_id;
+    }
+
+    std::string planes;
+    for (size_t p = 0; p < configuration.planes.size(); p++)
+    {
+        char plane[32];
+        snprintf(plane, sizeof(plane), " %u:%u",
+                 configuration.planes[p].plane_id, configuration.planes[p].layer.fb_id);
+        planes += plane;
+    }
+    qDebug("planes, %s :%s, %u layers blended, %u test commits%s",
+           what, ret ? " none" : planes.c_str(), configuration.cpu_layers,
+           atomic.test_commits(), same ? "" : " : WRONG");
+    return same;
+}
+
+static plane_layer fake_layer(uint32_t fb_id, uint32_t format,
+                              uint32_t width, uint32_t height,
+                              uint32_t crtc_width, uint32_t crtc_height,
+                              uint8_t *map)
+{
+    plane_layer layer;
+    memset(&layer, 0, sizeof(layer));
+    layer.fb_id  = fb_id;
+    layer.format = format;
+    layer.crtc_w = crtc_width;
+    layer.crtc_h = crtc_height;
+    layer.src_w  = width;
+    layer.src_h  = height;
+    layer.map    = map;
+    layer.pitch  = width * 4;
+    return layer;
+}
+
+/* Checks the plane assignment against the table of add_fake_planes :
+ * the overlays taken in zpos order, the formats they cannot read, and
+ * the fallback to CPU blending when the TEST_ONLY commits are refused.
+ * Then runs the row demo through AtomicSwapchainBackend with an ARGB8888
+ * overlay which, one plane only being allowed, is blended by the CPU. */
+static int run_fake_planes(demo_options const &options)
+{
+    bool passed = true;
+
+    /* Never read : only tells assign_planes the layers can be blended */
+    uint8_t pixels[4] = { 0, 0, 0, 0 };
+    plane_layer const base    = fake_layer(100, DRM_FORMAT_XRGB8888, 640, 480, 640, 480, pixels);
+    plane_layer const argb    = fake_layer(101, DRM_FORMAT_ARGB8888, 64, 64, 64, 64, pixels);
+    plane_layer const video   = fake_layer(102, DRM_FORMAT_NV12, 320, 240, 320, 240, pixels);
+    plane_layer const scaled  = fake_layer(102, DRM_FORMAT_NV12, 320, 240, 640, 480, pixels);
+    plane_layer const opaque  = fake_layer(103, DRM_FORMAT_XRGB8888, 64, 64, 64, 64, pixels);
+
+    std::vector<plane_layer> layers;
+    layers.push_back(base);
+    layers.push_back(argb);
+    layers.push_back(video);
+    expected_plane const all_planes[] = { { 31, 100 }, { 42, 101 }, { 41, 102 } };
+    passed &= check_planes("no limit", layers, 0, true, all_planes, 3, 1, 1);
+
+    /* The ARGB8888 layer goes to the CPU, the video keeps the top plane */
+    expected_plane const two_planes[] = { { 31, 100 }, { 41, 102 }, { 42, 0 } };
+    passed &= check_planes("2 planes at most", layers, 2, true, two_planes, 3, 2, 2);
+
+    layers[2] = scaled;
+    expected_plane const no_scaling[] = { { 31, 100 }, { 42, 0 }, { 41, 0 } };
+    passed &= check_planes("no overlay scaling", layers, 0, false, no_scaling, 3, 3, 3);
+
+    /* Nothing above the NV12 plane reads XRGB8888 : the video is blended,
+     * without even trying the configuration that cannot exist */
+    layers[1] = video;
+    layers[2] = opaque;
+    expected_plane const formats[] = { { 31, 100 }, { 42, 103 }, { 41, 0 } };
+    passed &= check_planes("formats in zpos order", layers, 0, true, formats, 3, 2, 1);
+
+    unsigned int const fds_before = open_fd_count();
+    unsigned int live_objects = 0;
+    int ret = 0;
+    {
+        FakeDrmDevice device;
+        device.set_vblank_simulation(true);
+
+        fake_connector const screen = fake_screen(640, 480, 60);
+        uint32_t const connector_id = device.add_connector(screen);
+        uint32_t const crtc_id = connector_crtc(device, connector_id);
+
+        ResourcesPtr resources = get_resources(device);
+        unsigned int crtc_index = 0;
+        while (crtc_index < (unsigned int) resources->count_crtcs &&
+               resources->crtcs[crtc_index] != crtc_id)
+        {
+            crtc_index++;
+        }
+        resources.reset();
+
+        FakeAtomicDevice atomic;
+        add_fake_planes(atomic);
+        atomic.set_max_active_planes(1);
+        atomic.set_drm_device(&device);
+
+        pooled_buffer overlay;
+        ret = create_scanout_buffer(device, 128, 128, DRM_FORMAT_ARGB8888, overlay);
+        if (ret)
+            return ret;
+        pixel_surface const overlay_surface = { overlay.map, overlay.width, overlay.height, overlay.pitch };
+        pixel_fill(overlay_surface, 0x80ff00ff);
+
+        plane_layer overlay_layer = fake_layer(overlay.fb_id, DRM_FORMAT_ARGB8888, 128, 128, 128, 128, overlay.map);
+        overlay_layer.crtc_x = 32;
+        overlay_layer.crtc_y = 32;
+        overlay_layer.pitch  = overlay.pitch;
+        std::vector<plane_layer> overlays(1, overlay_layer);
+
+        swapchain_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        unsigned int cpu_layers = 0;
+        {
+            CrtcRestore crtc_to_restore(device, crtc_id, connector_id);
+            AtomicSwapchainBackend backend(device, atomic, crtc_id, crtc_index,
+                                           connector_id, screen.modes[0]);
+            backend.set_overlay_layers(overlays);
+
+            Swapchain swapchain(backend);
+            EventLoop loop;
+            ret = swapchain.init(640, 480, options.buffer_count);
+            if (!ret)
+                ret = loop.init();
+            if (!ret)
+            {
+                demo_options planes_options = options;
+                planes_options.automatic      = true;
+                planes_options.render_threads = -1;
+                planes_options.max_frames     = 30;
+                planes_options.playback.path.clear();
+                ret = run_demo(swapchain, loop, planes_options, 640, 480, 60);
+            }
+
+            stats      = swapchain.stats();
+            cpu_layers = backend.cpu_blended_layers();
+            swapchain.wait_idle();
+            crtc_to_restore.restore();
+            swapchain.release();
+        }
+        destroy_scanout_buffer(device, overlay);
+
+        /* Every frame is repainted, none copied from a buffer holding the
+         * blended overlay, and the overlay is part of every damage */
+        qDebug("planes, demo : %s, %u layers blended, %llu commits, %llu frames, %llu pixels damaged, %llu copied",
+               ret ? strerror(-ret) : "done", cpu_layers,
+               (unsigned long long) atomic.commits(),
+               (unsigned long long) stats.frames_presented,
+               (unsigned long long) stats.damaged_pixels,
+               (unsigned long long) stats.repaired_pixels);
+        if (!ret && (cpu_layers != 2 || !stats.frames_presented || !atomic.commits() ||
+                     stats.repaired_pixels ||
+                     stats.damaged_pixels < stats.frames_presented * 128 * 128))
+        {
+            ret = -EBADFD;
+        }
+
+        live_objects = device.live_objects();
+    }
+
+    int const leaked = check_fake_teardown(live_objects, fds_before, "atomic planes");
+    if (!ret)
+        ret = leaked;
+    if (!ret && !passed)
+        ret = -EBADFD;
+    return ret;
+}
+
+static bool rect_before(damage_rect const &a, damage_rect const &b)
+{
+    if (a.y1 != b.y1)
+        return a.y1 < b.y1;
+    if (a.x1 != b.x1)
+        return a.x1 < b.x1;
+    if (a.y2 != b.y2)
+        return a.y2 < b.y2;
+    return a.x2 < b.x2;
+}
+
+/* Compares the rectangles of region, in any order, and its area with
+ * what is expected */
+static bool check_damage(char const *what, DamageRegion const &region,
+                         damage_rect const *expected, size_t count)
+{
+    std::vector<damage_rect> rects = region.rects();
+    std::vector<damage_rect> wanted(expected, expected + count);
+    std::sort(rects.begin(), rects.end(), rect_before);
+    std::sort(wanted.begin(), wanted.end(), rect_before);
+
+    uint64_t wanted_area = 0;
+    bool same = rects.size() == wanted.size();
+    for (size_t r = 0; r < wanted.size(); r++)
+    {
+        wanted_area += (uint64_t) (wanted[r].x2 - wanted[r].x1) * (wanted[r].y2 - wanted[r].y1);
+        if (same)
+            same = !memcmp(&rects[r], &wanted[r], sizeof(damage_rect));
+    }
+    same = same && region.area() == wanted_area;
+
+    qDebug("damage, %s : %u rectangles, %llu pixels%s",
+           what, (unsigned int) rects.size(), (unsigned long long) region.area(),
+           same ? "" : " : WRONG");
+    for (size_t r = 0; r < rects.size() && !same; r++)
+        qDebug("  (%d, %d) - (%d, %d)", rects[r].x1, rects[r].y1, rects[r].x2, rects[r].y2);
+    return same;
+}
+
+/* Checks the damage tracking on its own : how rectangles merge, the cap
+ * on their number, clipping, and what a buffer of each age missed.
+ * Needs no device at all. */
+static int run_fake_damage()
+{
+    bool passed = true;
+
+    /* Merged : the union is no bigger than both */
+    DamageRegion overlapping;
+    overlapping.add(0, 0, 10, 10);
+    overlapping.add(5, 0, 10, 10);
+    damage_rect const overlapping_rects[] = { { 0, 0, 15, 10 } };
+    passed &= check_damage("overlapping", overlapping, overlapping_rects, 1);
+
+    DamageRegion adjacent;
+    adjacent.add(0, 0, 10, 10);
+    adjacent.add(10, 0, 10, 10);
+    damage_rect const adjacent_rects[] = { { 0, 0, 20, 10 } };
+    passed &= check_damage("adjacent", adjacent, adjacent_rects, 1);
+
+    DamageRegion contained;
+    contained.add(0, 0, 10, 10);
+    contained.add(2, 2, 4, 4);
+    damage_rect const contained_rects[] = { { 0, 0, 10, 10 } };
+    passed &= check_damage("contained", contained, contained_rects, 1);
+
+    /* Kept apart : touching corners would double the area */
+    DamageRegion corners;
+    corners.add(0, 0, 10, 10);
+    corners.add(10, 10, 10, 10);
+    damage_rect const corners_rects[] = { { 0, 0, 10, 10 }, { 10, 10, 20, 20 } };
+    passed &= check_damage("touching corners", corners, corners_rects, 2);
+
+    DamageRegion disjoint;
+    disjoint.add(0, 0, 10, 10);
+    disjoint.add(100, 100, 10, 10);
+    damage_rect const disjoint_rects[] = { { 0, 0, 10, 10 }, { 100, 100, 110, 110 } };
+    passed &= check_damage("disjoint", disjoint, disjoint_rects, 2);
+
+    /* Over the cap, the closest pair is merged */
+    DamageRegion capped(2);
+    capped.add(0, 0, 10, 10);
+    capped.add(20, 0, 10, 10);
+    capped.add(100, 100, 10, 10);
+    damage_rect const capped_rects[] = { { 0, 0, 30, 10 }, { 100, 100, 110, 110 } };
+    passed &= check_damage("over the cap", capped, capped_rects, 2);
+
+    DamageRegion clipped;
+    clipped.add(-5, -5, 10, 10);
+    clipped.add(20, 20, 10, 10);
+    clipped.clip(8, 8);
+    damage_rect const clipped_rects[] = { { 0, 0, 5, 5 } };
+    passed &= check_damage("clipped", clipped, clipped_rects, 1);
+
+    /* Frames A, B then C, C being the last one presented */
+    DamageHistory history(3);
+    DamageRegion frame;
+    frame.add(0, 0, 10, 10);
+    history.push(frame);
+    frame.clear();
+    frame.add(50, 50, 10, 10);
+    history.push(frame);
+    frame.clear();
+    frame.add(10, 0, 10, 10);
+    history.push(frame);
+
+    struct age_case
+    {
+        unsigned int age;
+        bool         known;
+        size_t       count;
+        damage_rect  rects[2];
+    };
+    /* Age 4 missed all three : A and C merge, B stays apart */
+    age_case const ages[] = {
+        { 0, false, 0, { { 0, 0, 0, 0 } } },
+        { 1, true,  0, { { 0, 0, 0, 0 } } },
+        { 2, true,  1, { { 10, 0, 20, 10 } } },
+        { 3, true,  2, { { 10, 0, 20, 10 }, { 50, 50, 60, 60 } } },
+        { 4, true,  2, { { 0, 0, 20, 10 }, { 50, 50, 60, 60 } } },
+        { 5, false, 0, { { 0, 0, 0, 0 } } },
+    };
+    for (size_t a = 0; a < sizeof(ages) / sizeof(ages[0]); a++)
+    {
+        char what[32];
+        snprintf(what, sizeof(what), "age %u", ages[a].age);
+
+        DamageRegion stale;
+        bool const known = history.stale_region(ages[a].age, stale);
+        if (known != ages[a].known)
+        {
+            qDebug("damage, %s : %s, expected the opposite : WRONG",
+                   what, known ? "known" : "full repaint");
+            passed = false;
+        }
+        else if (!known)
+        {
+            qDebug("damage, %s : full repaint", what);
+        }
+        else
+        {
+            passed &= check_damage(what, stale, ages[a].rects, ages[a].count);
+        }
+    }
+
+    /* Only the last max_age frames are kept : A is gone */
+    frame.clear();
+    frame.add(200, 200, 10, 10);
+    history.push(frame);
+    DamageRegion stale;
+    bool const known = history.stale_region(4, stale);
+    damage_rect const dropped_rects[] = { { 10, 0, 20, 10 }, { 50, 50, 60, 60 }, { 200, 200, 210, 210 } };
+    passed &= known && check_damage("age 4, after a 4th frame", stale, dropped_rects, 3);
+    passed &= !history.stale_region(5, stale);
+
+    return passed ? 0 : -EBADFD;
+}
+
+enum access_bench_operation
+{
+    BENCH_FILL,
+    BENCH_BLIT,
+    BENCH_BLEND
+};
+
+/* Draws the rectangles of a frame the way operation does */
+static void bench_draw(access_bench_operation operation,
+                       pixel_surface const &destination,
+                       pixel_surface const &image,
+                       std::vector<damage_rect> const &rects)
+{
+    for (size_t r = 0; r < rects.size(); r++)
+    {
+        damage_rect const &rect = rects[r];
+        uint32_t const width  = rect.x2 - rect.x1;
+        uint32_t const height = rect.y2 - rect.y1;
+
+        if (operation == BENCH_FILL)
+            pixel_fill_rect(destination, rect.x1, rect.y1, width, height, 0xff000000 | (r * 0x10204));
+        else if (operation == BENCH_BLIT)
+            pixel_blit(destination, rect.x1, rect.y1, image, rect.x1, rect.y1, width, height);
+        else
+            pixel_blend(destination, rect.x1, rect.y1, image, rect.x1, rect.y1, width, height);
+    }
+}
+
+/* Dumb buffers are mapped write-combined by most ARM drivers : writes are
+ * gathered and sent out in order, reads bypass the caches. Draws the same
+ * rectangles directly into a mapped dumb buffer, then into a cacheable
+ * shadow copy flushed into the buffer once per frame, and compares.
+ * Each frame is bracketed by DMA_BUF_IOCTL_SYNC like the swapchain does.
+ * On the fake device, the buffers are plain memory : the numbers only
+ * show the cost of the extra copy. */
+static int run_access_bench(DrmDevice &device, demo_options const &options)
+{
+    uint32_t const width  = options.width;
+    uint32_t const height = options.height;
+    unsigned int const frames = options.max_frames ? options.max_frames : 60;
+    unsigned int const rects_per_frame = 32;
+    uint32_t const rect_size = 256;
+
+    DumbBuffer dumb;
+    int ret = dumb.create(device, width, height, 32);
+    if (ret)
+    {
+        qDebug("%s %d Could not allocate a %ux%u dumb buffer : %s\n",
+               __FUNCTION__, __LINE__, width, height, strerror(-ret));
+        return ret;
+    }
+
+    int prime_fd = -1;
+    ret = device.prime_handle_to_fd(dumb.handle(), DRM_CLOEXEC | DRM_RDWR, &prime_fd);
+    if (ret)
+    {
+        qDebug("%s %d Could not export the dumb buffer : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+    UniqueFd dma_buf(prime_fd);
+
+    Mapping map(dma_buf.get(), dumb.info().size);
+    if (!map.valid())
+    {
+        int const err = errno;
+        qDebug("%s %d Could not map the dumb buffer : %s\n",
+               __FUNCTION__, __LINE__, strerror(err));
+        return -err;
+    }
+
+    uint32_t const pitch = dumb.info().pitch;
+    pixel_surface const mapped = { map.get(), width, height, pitch };
+
+    std::vector<uint32_t> shadow_pixels((size_t) pitch / 4 * height, 0);
+    pixel_surface const shadow = {
+        reinterpret_cast<uint8_t *>(&shadow_pixels[0]), width, height, pitch
+    };
+
+    /* Translucent gradient, blended or copied over the buffer */
+    std::vector<uint32_t> image_pixels((size_t) width * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+            image_pixels[(size_t) y * width + x] = 0x80000000 | ((x & 0xff) << 16) | ((y & 0xff) << 8) | ((x ^ y) & 0xff);
+    }
+    pixel_surface const image = {
+        reinterpret_cast<uint8_t *>(&image_pixels[0]), width, height, width * 4
+    };
+
+    /* The same rectangles for both ways of drawing */
+    std::vector<std::vector<damage_rect> > frame_rects(frames);
+    uint64_t pixels = 0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        for (unsigned int r = 0; r < rects_per_frame; r++)
+        {
+            damage_rect rect;
+            rect.x1 = (width > rect_size) ? rand() % (width - rect_size) : 0;
+            rect.y1 = (height > rect_size) ? rand() % (height - rect_size) : 0;
+            rect.x2 = std::min(rect.x1 + rect_size, width);
+            rect.y2 = std::min(rect.y1 + rect_size, height);
+            frame_rects[frame].push_back(rect);
+            pixels += (uint64_t) (rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+        }
+    }
+
+    char const * const names[] = { "fill", "blit", "blend" };
+    for (int operation = BENCH_FILL; operation <= BENCH_BLEND; operation++)
+    {
+        access_bench_operation const current = (access_bench_operation) operation;
+        cpu_access_mode const direct_mode = (current == BENCH_BLEND)
+            ? CPU_ACCESS_READ_WRITE
+            : CPU_ACCESS_WRITE;
+
+        uint64_t const direct_start_us = monotonic_us();
+        for (unsigned int frame = 0; frame < frames; frame++)
+        {
+            CpuAccess access(dma_buf.get(), direct_mode);
+            bench_draw(current, mapped, image, frame_rects[frame]);
+        }
+        uint64_t const direct_us = monotonic_us() - direct_start_us;
+
+        uint64_t flushed_pixels = 0;
+        uint64_t const shadow_start_us = monotonic_us();
+        for (unsigned int frame = 0; frame < frames; frame++)
+        {
+            bench_draw(current, shadow, image, frame_rects[frame]);
+
+            DamageRegion damage;
+            for (size_t r = 0; r < frame_rects[frame].size(); r++)
+                damage.add(frame_rects[frame][r]);
+            flushed_pixels += damage.area();
+
+            CpuAccess access(dma_buf.get(), CPU_ACCESS_WRITE);
+            copy_damage(mapped, shadow, damage);
+        }
+        uint64_t const shadow_us = monotonic_us() - shadow_start_us;
+
+        qDebug("%-5s : direct %llu MPix/s, shadow + flush %llu MPix/s (%.2fx, %llu%% of the pixels flushed)",
+               names[operation],
+               (unsigned long long) (direct_us ? pixels / direct_us : 0),
+               (unsigned long long) (shadow_us ? pixels / shadow_us : 0),
+               shadow_us ? (double) direct_us / shadow_us : 0.0,
+               (unsigned long long) (pixels ? flushed_pixels * 100 / pixels : 0));
+    }
+
+    CpuAccess probe(dma_buf.get(), CPU_ACCESS_READ);
+    qDebug("%ux%u, %u frames of %u %ux%u rectangles, DMA_BUF_IOCTL_SYNC %s",
+           width, height, frames, rects_per_frame, rect_size, rect_size,
+           probe.synced() ? "used" : "not supported by this buffer");
+    return 0;
+}
+
+// Works on Rockchip systems but fail with ENOSYS on AMDGPU
+int main(int argc, char *argv[])
+{
+    demo_options options;
+    parse_options(argc, argv, options);
+
+    /* Before any thread is started : they all inherit the blocked
+     * signals, which then only reach the event loops.
+     * The benchmark and the import check never look at them, and keep
+     * the default action : Ctrl-C kills them. */
+    SignalSource signals;
+    int ret = 0;
+    if (!options.access_bench && !(options.fake && (options.import || options.damage)))
+    {
+        ret = signals.open();
+        if (ret)
+            qDebug("%s %d Could not watch the signals : %s\n",
+                   __FUNCTION__, __LINE__, strerror(-ret));
+        else
+            options.signals = &signals;
+    }
+
+    if ((options.fake || options.headless) && options.access_bench)
+    {
+        FakeDrmDevice device;
+        return run_access_bench(device, options) ? 1 : 0;
+    }
+
+    if (options.headless && options.scaling)
+        return run_scaling(options) ? 1 : 0;
+
+    if (options.headless)
+        return run_headless(options) ? 1 : 0;
+
+    if (options.fake && options.import)
+        return run_fake_import(options) ? 1 : 0;
+
+    if (options.fake && options.damage)
+        return run_fake_damage() ? 1 : 0;
+
+    if (options.fake && options.planes)
+        return run_fake_planes(options) ? 1 : 0;
+
+    if (options.fake && options.events)
+    {
+        if (options.topology_cache.empty())
+            options.topology_cache = "/tmp/drmTest-events.topology";
+        unlink(options.topology_cache.c_str());
+        return run_fake_events(options) ? 1 : 0;
+    }
+
+    if (options.fake && options.multi)
+    {
+        if (options.topology_cache.empty())
+            options.topology_cache = "/tmp/drmTest-multi.topology";
+        unlink(options.topology_cache.c_str());
+        return run_fake_multi(options) ? 1 : 0;
+    }
+
+    if (options.fake)
+    {
+        if (options.topology_cache.empty())
+            options.topology_cache = "/tmp/drmTest-fake.topology";
+        return run_fake(options) ? 1 : 0;
+    }
+
+    if (options.topology_cache.empty())
+        options.topology_cache = "/var/cache/drmTest.topology";
+
+    /* Open the DRM device node and get a File Descriptor */
+    LinuxDrmDevice device;
+    ret = device.open("/dev/dri/card0");
+    if (ret)
+    {
+        qDebug("%s %d Could not open /dev/dri/card0 : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return 1;
+    }
+
+    if (options.access_bench)
+        return run_access_bench(device, options) ? 1 : 0;
+
+    if (options.multi)
+        return run_multi_display(device, options) ? 1 : 0;
+
+    display_timings timings = { 0, 0, 0, 0 };
+    return run_display(device, options, timings) ? 1 : 0;
+}
@@ -0,0 +1,387 @@
+#include "output_scheduler.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <QDebug>
+
+/* ---- CRTC assignment ---- */
+
+/* Connectors that will show the same thing */
+struct output_group
+{
+    std::vector<uint32_t> connector_ids;
+    drmModeModeInfo       mode;
+    uint32_t              possible_crtcs;
+    /* CRTC already driving the first connector, -1 if none */
+    int                   current_crtc;
+    /* CRTC given by the matching, -1 if none */
+    int                   crtc;
+};
+
+static bool same_mode(drmModeModeInfo const &a, drmModeModeInfo const &b)
+{
+    return a.clock == b.clock &&
+           a.hdisplay == b.hdisplay && a.vdisplay == b.vdisplay &&
+           a.htotal == b.htotal && a.vtotal == b.vtotal &&
+           a.vrefresh == b.vrefresh && a.flags == b.flags;
+}
+
+static int crtc_index_of(drmModeRes const &resources, uint32_t crtc_id)
+{
+    for (int c = 0; c < resources.count_crtcs; c++)
+    {
+        if (resources.crtcs[c] == crtc_id)
+            return c;
+    }
+    return -1;
+}
+
+/* Kuhn's augmenting paths : gives group a CRTC, moving the groups already
+ * served to other CRTCs they can use if needed */
+static bool match_group(std::vector<output_group> &groups,
+                        std::vector<int> &crtc_owners,
+                        std::vector<bool> &visited,
+                        size_t group)
+{
+    output_group &wanting = groups[group];
+
+    /* The CRTC in use first : no need to move anything on screen */
+    std::vector<int> order;
+    if (wanting.current_crtc >= 0)
+        order.push_back(wanting.current_crtc);
+    for (int c = 0; c < (int) crtc_owners.size(); c++)
+    {
+        if (c != wanting.current_crtc)
+            order.push_back(c);
+    }
+
+    for (size_t o = 0; o < order.size(); o++)
+    {
+        int const c = order[o];
+        if (!(wanting.possible_crtcs & (1u << c)) || visited[c])
+            continue;
+
+        visited[c] = true;
+        if (crtc_owners[c] < 0 || match_group(groups, crtc_owners, visited, crtc_owners[c]))
+        {
+            crtc_owners[c] = group;
+            wanting.crtc   = c;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool fewer_crtcs(output_group const &a, output_group const &b)
+{
+    return __builtin_popcount(a.possible_crtcs) < __builtin_popcount(b.possible_crtcs);
+}
+
+int assign_outputs(DrmDevice &device,
+                   drmModeRes const &resources,
+                   std::vector<output_choice> const &choices,
+                   bool clone,
+                   std::vector<output_assignment> &assignments)
+{
+    assignments.clear();
+
+    int const crtc_count = std::min(resources.count_crtcs, 32);
+    uint32_t const all_crtcs = (crtc_count == 32) ? 0xffffffffu : (1u << crtc_count) - 1;
+
+    std::vector<output_group> groups;
+    for (size_t o = 0; o < choices.size(); o++)
+    {
+        output_choice const &choice = choices[o];
+
+        ConnectorPtr connector = get_connector_current(device, choice.connector_id);
+        if (!connector)
+        {
+            qDebug("%s %d Could not get connector %u : %s\n",
+                   __FUNCTION__, __LINE__, choice.connector_id, strerror(errno));
+            continue;
+        }
+
+        /* Any of the encoders of the connector will do */
+        uint32_t possible_crtcs = 0;
+        int current_crtc = -1;
+        for (int e = 0; e < connector->count_encoders; e++)
+        {
+            EncoderPtr encoder = get_encoder(device, connector->encoders[e]);
+            if (!encoder)
+                continue;
+
+            possible_crtcs |= encoder->possible_crtcs;
+            if (encoder->encoder_id == connector->encoder_id && encoder->crtc_id)
+                current_crtc = crtc_index_of(resources, encoder->crtc_id);
+        }
+        possible_crtcs &= all_crtcs;
+
+        if (!possible_crtcs)
+        {
+            qDebug("%s %d No CRTC can drive connector %u, skipped\n",
+                   __FUNCTION__, __LINE__, choice.connector_id);
+            continue;
+        }
+
+        output_group *joined = NULL;
+        for (size_t g = 0; clone && !joined && g < groups.size(); g++)
+        {
+            if (same_mode(groups[g].mode, choice.mode) &&
+                (groups[g].possible_crtcs & possible_crtcs))
+            {
+                joined = &groups[g];
+            }
+        }
+
+        if (joined)
+        {
+            joined->connector_ids.push_back(choice.connector_id);
+            joined->possible_crtcs &= possible_crtcs;
+            continue;
+        }
+
+        output_group group;
+        group.connector_ids.push_back(choice.connector_id);
+        group.mode           = choice.mode;
+        group.possible_crtcs = possible_crtcs;
+        group.current_crtc   = (current_crtc >= 0 && (possible_crtcs & (1u << current_crtc))) ? current_crtc : -1;
+        group.crtc           = -1;
+        groups.push_back(group);
+    }
+
+    /* Served first, the outputs only a few CRTCs can drive are less
+     * likely to find them all taken */
+    std::stable_sort(groups.begin(), groups.end(), fewer_crtcs);
+
+    std::vector<int> crtc_owners(crtc_count, -1);
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        std::vector<bool> visited(crtc_count, false);
+        match_group(groups, crtc_owners, visited, g);
+    }
+
+    /* Not enough CRTCs : show the same thing as an output using the same
+     * mode rather than nothing */
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        output_group &group = groups[g];
+        if (group.crtc >= 0)
+            continue;
+
+        for (int c = 0; c < crtc_count && group.crtc < 0; c++)
+        {
+            if (crtc_owners[c] >= 0 && (group.possible_crtcs & (1u << c)) &&
+                same_mode(groups[crtc_owners[c]].mode, group.mode))
+            {
+                output_group &owner = groups[crtc_owners[c]];
+                owner.connector_ids.insert(owner.connector_ids.end(),
+                                           group.connector_ids.begin(),
+                                           group.connector_ids.end());
+                group.crtc = c;
+                qDebug("%s %d No CRTC left for connector %u, cloning CRTC %u\n",
+                       __FUNCTION__, __LINE__, group.connector_ids[0], resources.crtcs[c]);
+            }
+        }
+
+        if (group.crtc < 0)
+            qDebug("%s %d No CRTC left for connector %u, skipped\n",
+                   __FUNCTION__, __LINE__, group.connector_ids[0]);
+    }
+
+    for (int c = 0; c < crtc_count; c++)
+    {
+        if (crtc_owners[c] < 0)
+            continue;
+
+        output_group const &group = groups[crtc_owners[c]];
+        output_assignment assignment;
+        assignment.crtc_id       = resources.crtcs[c];
+        assignment.crtc_index    = c;
+        assignment.connector_ids = group.connector_ids;
+        assignment.mode          = group.mode;
+        assignments.push_back(assignment);
+    }
+
+    return assignments.empty() ? -ENOENT : 0;
+}
+
+/* ---- Scheduler ---- */
+
+void OutputScheduler::FlipRelay::flip_complete(unsigned int sequence,
+                                               unsigned int tv_sec,
+                                               unsigned int tv_usec)
+{
+    if (m_dispatching)
+        m_swapchain.complete_flip(sequence, tv_sec, tv_usec);
+    else
+        m_swapchain.flip_complete(sequence, tv_sec, tv_usec);
+}
+
+OutputScheduler::OutputScheduler(DrmDevice &device) :
+    m_device(device),
+    m_dispatching(false)
+{
+}
+
+OutputScheduler::~OutputScheduler()
+{
+    release();
+}
+
+int OutputScheduler::init(std::vector<output_assignment> const &outputs,
+                          unsigned int buffer_count,
+                          bool shadow,
+                          uint32_t format)
+{
+    release();
+
+    for (size_t o = 0; o < outputs.size(); o++)
+    {
+        output_assignment const &assignment = outputs[o];
+
+        std::unique_ptr<output> added(new output);
+        added->assignment = assignment;
+        added->frames     = 0;
+        added->backend.reset(new DrmSwapchainBackend(m_device,
+                                                     assignment.crtc_id,
+                                                     assignment.connector_ids,
+                                                     assignment.mode));
+        added->swapchain.reset(new Swapchain(*added->backend));
+        added->relay.reset(new FlipRelay(*added->swapchain, m_dispatching));
+
+        int ret = added->swapchain->init(assignment.mode.hdisplay,
+                                         assignment.mode.vdisplay,
+                                         buffer_count, shadow, format);
+        if (ret)
+        {
+            qDebug("%s %d Could not allocate the swapchain of CRTC %u : %s\n",
+                   __FUNCTION__, __LINE__, assignment.crtc_id, strerror(-ret));
+            release();
+            return ret;
+        }
+
+        added->swapchain->set_external_dispatch(true);
+        added->backend->set_listener(added->relay.get());
+        m_outputs.push_back(std::move(added));
+    }
+
+    return m_outputs.empty() ? -ENOENT : 0;
+}
+
+int OutputScheduler::dispatch(int timeout_ms)
+{
+    /* Any backend will do : they all read the same fd, and the events go
+     * to the backend given as user data to the page flip */
+    m_dispatching = true;
+    int ret = m_outputs[0]->backend->dispatch_events(timeout_ms);
+    m_dispatching = false;
+
+    return (ret == 0) ? -ETIMEDOUT : ret;
+}
+
+int OutputScheduler::run(output_draw_function draw, void *context, unsigned int frames,
+                         SignalSource *signals)
+{
+    if (m_outputs.empty())
+        return -ENOENT;
+
+    int ret = 0;
+    while (!ret)
+    {
+        if (signals && signals->poll())
+        {
+            ret = -EINTR;
+            break;
+        }
+
+        bool drawing = false;
+        for (size_t o = 0; o < m_outputs.size() && !ret; o++)
+        {
+            output &current = *m_outputs[o];
+            if (current.frames >= frames)
+                continue;
+
+            drawing = true;
+            if (current.swapchain->flip_pending())
+                continue;
+
+            swapchain_buffer *buffer = current.swapchain->acquire(0);
+            if (!buffer)
+                continue;
+
+            draw(*buffer, o, current.frames, context);
+            ret = current.swapchain->present(buffer);
+            if (ret)
+                qDebug("%s %d Could not present on CRTC %u : %s\n",
+                       __FUNCTION__, __LINE__, current.assignment.crtc_id, strerror(-ret));
+            current.frames++;
+        }
+
+        if (ret || !drawing)
+            break;
+
+        /* Every output waits for its flip : sleep until one completes */
+        bool waiting = true;
+        for (size_t o = 0; o < m_outputs.size() && waiting; o++)
+        {
+            output const &current = *m_outputs[o];
+            waiting = current.frames >= frames || current.swapchain->flip_pending();
+        }
+        if (waiting)
+        {
+            int dispatched = dispatch(1000);
+            if (dispatched < 0)
+                ret = dispatched;
+        }
+    }
+
+    int const idle = wait_idle();
+    return ret ? ret : idle;
+}
+
+int OutputScheduler::wait_idle()
+{
+    for (size_t o = 0; o < m_outputs.size(); o++)
+    {
+        while (m_outputs[o]->swapchain->flip_pending())
+        {
+            int ret = dispatch(1000);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+void OutputScheduler::release()
+{
+    wait_idle();
+
+    /* The swapchains wait for their flips by themselves again while
+     * releasing, there is nothing left to wait for anyway */
+    for (size_t o = 0; o < m_outputs.size(); o++)
+    {
+        output &current = *m_outputs[o];
+        current.swapchain->set_external_dispatch(false);
+        current.backend->set_listener(current.swapchain.get());
+    }
+    m_outputs.clear();
+}
+
+output_stats OutputScheduler::stats(unsigned int output) const
+{
+    swapchain_stats const swapchain = m_outputs[output]->swapchain->stats();
+
+    output_stats stats;
+    stats.frames         = swapchain.frames_presented;
+    stats.flips          = swapchain.flips_completed;
+    stats.missed_vblanks = swapchain.missed_vblanks;
+    stats.flip_interval_us = (swapchain.flips_completed > 1)
+        ? (swapchain.last_flip_us - swapchain.first_flip_us) / (swapchain.flips_completed - 1)
+        : 0;
+    return stats;
+}
@@ -0,0 +1,125 @@
+#ifndef OUTPUT_SCHEDULER_H
+#define OUTPUT_SCHEDULER_H
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+#include "drm_device.h"
+#include "event_loop.h"
+#include "swapchain.h"
+#include "topology_cache.h"
+
+/* A CRTC and the connectors showing what it scans out. Several connectors
+ * means they are cloned : same mode, same buffers, same vblank. */
+struct output_assignment
+{
+    uint32_t              crtc_id;
+    unsigned int          crtc_index;
+    std::vector<uint32_t> connector_ids;
+    drmModeModeInfo       mode;
+};
+
+/* Gives every output of choices a CRTC its encoders can drive
+ * (possible_crtcs), each output getting its own CRTC when there are enough
+ * of them. Connectors keep the CRTC they already use when possible, and
+ * the most constrained outputs are served first.
+ * With clone, outputs using the same mode share a CRTC whenever they can.
+ * Without, an output left without a CRTC still shares one driving the
+ * same mode if it can, and is skipped otherwise.
+ * Returns -ENOENT when no output could be assigned. */
+int assign_outputs(DrmDevice &device,
+                   drmModeRes const &resources,
+                   std::vector<output_choice> const &choices,
+                   bool clone,
+                   std::vector<output_assignment> &assignments);
+
+/* Draws frame into buffer, the output being the index-th one */
+typedef void (*output_draw_function)(swapchain_buffer &buffer,
+                                     unsigned int output,
+                                     uint64_t frame,
+                                     void *context);
+
+struct output_stats
+{
+    uint64_t frames;
+    uint64_t flips;
+    uint64_t missed_vblanks;
+    /* Mean time between two flips, from the flip timestamps */
+    uint64_t flip_interval_us;
+};
+
+/* Drives several CRTCs at once, each with its own swapchain and its own
+ * vblank clock, from a single thread.
+ *
+ * Every backend shares the DRM fd : the flip events of all the CRTCs come
+ * through it, and drmHandleEvent hands each one to the backend that
+ * queued the flip. The scheduler is the only one reading that fd, the
+ * swapchains are in external dispatch mode. A new frame is drawn for an
+ * output as soon as its previous flip completed, so a 50 Hz panel never
+ * waits for a 60 Hz one. */
+class OutputScheduler
+{
+public:
+    explicit OutputScheduler(DrmDevice &device);
+    ~OutputScheduler();
+
+    /* Returns 0 or a negative errno */
+    int init(std::vector<output_assignment> const &outputs,
+             unsigned int buffer_count,
+             bool shadow = false,
+             uint32_t format = DRM_FORMAT_XRGB8888);
+    /* Presents frames frames on every output, or until an error.
+     * Stops with -EINTR once signals, if any, received one. */
+    int run(output_draw_function draw, void *context, unsigned int frames,
+            SignalSource *signals = NULL);
+    /* Wait until no flip is pending on any output */
+    int wait_idle();
+    /* Gives the buffers back. Done by the destructor too. */
+    void release();
+
+    unsigned int output_count() const { return m_outputs.size(); }
+    output_assignment const &assignment(unsigned int output) const { return m_outputs[output]->assignment; }
+    output_stats stats(unsigned int output) const;
+
+private:
+    OutputScheduler(OutputScheduler const &);
+    OutputScheduler &operator=(OutputScheduler const &);
+
+    /* Forwards the flip events to a swapchain, taking its lock unless the
+     * event comes from a present, which already holds it */
+    class FlipRelay : public FlipListener
+    {
+    public:
+        FlipRelay(Swapchain &swapchain, bool const &dispatching) :
+            m_swapchain(swapchain), m_dispatching(dispatching) {}
+        void flip_complete(unsigned int sequence,
+                           unsigned int tv_sec,
+                           unsigned int tv_usec);
+
+    private:
+        Swapchain  &m_swapchain;
+        bool const &m_dispatching;
+    };
+
+    struct output
+    {
+        output_assignment                    assignment;
+        std::unique_ptr<DrmSwapchainBackend> backend;
+        std::unique_ptr<Swapchain>           swapchain;
+        std::unique_ptr<FlipRelay>           relay;
+        uint64_t                             frames;
+    };
+
+    /* Waits for flip events and dispatches them.
+     * Returns 1 if some were, or a negative errno (-ETIMEDOUT) */
+    int dispatch(int timeout_ms);
+
+    DrmDevice                           &m_device;
+    std::vector<std::unique_ptr<output> > m_outputs;
+    bool                                 m_dispatching;
+};
+
+#endif // OUTPUT_SCHEDULER_H
@@ -0,0 +1,164 @@
+#include "pixel_format.h"
+
+#include <errno.h>
+
+template <uint32_t Format>
+static pixel_format_info format_info()
+{
+    typedef pixel_format_traits<Format> traits;
+
+    pixel_format_info info;
+    info.format                 = Format;
+    info.name                   = traits::name();
+    info.plane_count            = traits::plane_count;
+    info.bytes_per_pixel        = traits::bytes_per_pixel;
+    info.chroma_bytes           = traits::chroma_bytes;
+    info.horizontal_subsampling = traits::horizontal_subsampling;
+    info.vertical_subsampling   = traits::vertical_subsampling;
+    info.has_alpha              = traits::has_alpha;
+    info.legacy_depth           = traits::legacy_depth;
+    return info;
+}
+
+pixel_format_info const *pixel_format_find(uint32_t format)
+{
+    static pixel_format_info const infos[] = {
+        format_info<DRM_FORMAT_XRGB8888>(),
+        format_info<DRM_FORMAT_ARGB8888>(),
+        format_info<DRM_FORMAT_RGB565>(),
+        format_info<DRM_FORMAT_NV12>(),
+        format_info<DRM_FORMAT_NV16>()
+    };
+
+    for (size_t i = 0; i < sizeof(infos) / sizeof(infos[0]); i++)
+    {
+        if (infos[i].format == format)
+            return &infos[i];
+    }
+    return NULL;
+}
+
+uint32_t pixel_format_row_bytes(pixel_format_info const &info, unsigned int plane, uint32_t width)
+{
+    if (plane == 0)
+        return width * info.bytes_per_pixel;
+
+    return (width + info.horizontal_subsampling - 1) / info.horizontal_subsampling * info.chroma_bytes;
+}
+
+uint32_t pixel_format_plane_rows(pixel_format_info const &info, unsigned int plane, uint32_t height)
+{
+    if (plane == 0)
+        return height;
+
+    return (height + info.vertical_subsampling - 1) / info.vertical_subsampling;
+}
+
+uint64_t pixel_image_layout(uint32_t format, uint32_t width, uint32_t height,
+                            uint8_t *pixels, uint32_t pitch,
+                            pixel_image &image)
+{
+    pixel_format_info const *info = pixel_format_find(format);
+    if (!info)
+        return 0;
+
+    memset(&image, 0, sizeof(image));
+    image.format = format;
+    image.width  = width;
+    image.height = height;
+
+    uint64_t offset = 0;
+    for (unsigned int plane = 0; plane < info->plane_count; plane++)
+    {
+        uint32_t const rows = pixel_format_plane_rows(*info, plane, height);
+
+        image.planes[plane].pixels = pixels ? pixels + offset : NULL;
+        image.planes[plane].width  = plane ? pixel_format_row_bytes(*info, plane, width) / info->chroma_bytes : width;
+        image.planes[plane].height = rows;
+        image.planes[plane].pitch  = pitch;
+        offset += (uint64_t) pitch * rows;
+    }
+
+    return offset;
+}
+
+/* ---- Dispatch ---- */
+
+template <uint32_t Destination>
+static int convert_to(pixel_image const &destination,
+                      int32_t x, int32_t y,
+                      pixel_image const &source,
+                      uint32_t source_x, uint32_t source_y,
+                      uint32_t width, uint32_t height)
+{
+    switch (source.format)
+    {
+    case DRM_FORMAT_XRGB8888:
+        pixel_convert_as<Destination, DRM_FORMAT_XRGB8888>(destination, x, y, source, source_x, source_y, width, height);
+        return 0;
+    case DRM_FORMAT_ARGB8888:
+        pixel_convert_as<Destination, DRM_FORMAT_ARGB8888>(destination, x, y, source, source_x, source_y, width, height);
+        return 0;
+    case DRM_FORMAT_RGB565:
+        pixel_convert_as<Destination, DRM_FORMAT_RGB565>(destination, x, y, source, source_x, source_y, width, height);
+        return 0;
+    case DRM_FORMAT_NV12:
+        pixel_convert_as<Destination, DRM_FORMAT_NV12>(destination, x, y, source, source_x, source_y, width, height);
+        return 0;
+    case DRM_FORMAT_NV16:
+        pixel_convert_as<Destination, DRM_FORMAT_NV16>(destination, x, y, source, source_x, source_y, width, height);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+int pixel_image_convert(pixel_image const &destination,
+                        int32_t x, int32_t y,
+                        pixel_image const &source,
+                        uint32_t source_x, uint32_t source_y,
+                        uint32_t width, uint32_t height)
+{
+    switch (destination.format)
+    {
+    case DRM_FORMAT_XRGB8888:
+        return convert_to<DRM_FORMAT_XRGB8888>(destination, x, y, source, source_x, source_y, width, height);
+    case DRM_FORMAT_ARGB8888:
+        return convert_to<DRM_FORMAT_ARGB8888>(destination, x, y, source, source_x, source_y, width, height);
+    case DRM_FORMAT_RGB565:
+        return convert_to<DRM_FORMAT_RGB565>(destination, x, y, source, source_x, source_y, width, height);
+    case DRM_FORMAT_NV12:
+        return convert_to<DRM_FORMAT_NV12>(destination, x, y, source, source_x, source_y, width, height);
+    case DRM_FORMAT_NV16:
+        return convert_to<DRM_FORMAT_NV16>(destination, x, y, source, source_x, source_y, width, height);
+    default:
+        return -EINVAL;
+    }
+}
+
+int pixel_image_fill_rect(pixel_image const &destination,
+                          int32_t x, int32_t y,
+                          uint32_t width, uint32_t height,
+                          uint32_t argb)
+{
+    switch (destination.format)
+    {
+    case DRM_FORMAT_XRGB8888:
+        pixel_fill_rect_as<DRM_FORMAT_XRGB8888>(destination, x, y, width, height, argb);
+        return 0;
+    case DRM_FORMAT_ARGB8888:
+        pixel_fill_rect_as<DRM_FORMAT_ARGB8888>(destination, x, y, width, height, argb);
+        return 0;
+    case DRM_FORMAT_RGB565:
+        pixel_fill_rect_as<DRM_FORMAT_RGB565>(destination, x, y, width, height, argb);
+        return 0;
+    case DRM_FORMAT_NV12:
+        pixel_fill_rect_as<DRM_FORMAT_NV12>(destination, x, y, width, height, argb);
+        return 0;
+    case DRM_FORMAT_NV16:
+        pixel_fill_rect_as<DRM_FORMAT_NV16>(destination, x, y, width, height, argb);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
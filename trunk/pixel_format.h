@@ -0,0 +1,544 @@
+#ifndef PIXEL_FORMAT_H
+#define PIXEL_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#include <drm_fourcc.h>
+
+#include "pixel_ops.h"
+
+/* An image of any of the formats below. Packed formats only use
+ * planes[0]. Semi-planar ones have the Y plane in planes[0] and the
+ * interleaved UV plane in planes[1], whose width and height count UV
+ * pairs. width and height are the ones of the image, in pixels. */
+struct pixel_image
+{
+    uint32_t      format;
+    uint32_t      width;
+    uint32_t      height;
+    pixel_surface planes[2];
+};
+
+/* ---- Format traits ----
+ * What the kernels need to know about a DRM_FORMAT_*, at compile time :
+ * each kernel is instantiated per format, so nothing is decided per
+ * pixel. pack and unpack convert from and to ARGB8888. */
+
+/* One plane, one pixel_type per pixel */
+struct packed_layout {};
+/* A Y plane, then an interleaved UV plane subsampled horizontally and
+ * vertically. BT.601 limited range. */
+struct semi_planar_layout {};
+
+template <uint32_t Format> struct pixel_format_traits;
+
+/* The top bits are replicated in the low bits, so that 0x1f gives 0xff */
+static inline uint32_t pixel_rgb565_to_argb(uint32_t v)
+{
+    return 0xff000000
+         | ((v & 0xf800) << 8) | ((v & 0xe000) << 3)
+         | ((v & 0x07e0) << 5) | ((v & 0x0600) >> 1)
+         | ((v & 0x001f) << 3) | ((v & 0x001c) >> 2);
+}
+
+template <> struct pixel_format_traits<DRM_FORMAT_XRGB8888>
+{
+    typedef packed_layout layout;
+    typedef uint32_t      pixel_type;
+    enum { plane_count = 1, bytes_per_pixel = 4, chroma_bytes = 0,
+           horizontal_subsampling = 1, vertical_subsampling = 1,
+           has_alpha = 0, legacy_depth = 24 };
+    static char const *name() { return "XRGB8888"; }
+    static pixel_type pack(uint32_t argb) { return argb; }
+    static uint32_t unpack(pixel_type pixel) { return 0xff000000 | pixel; }
+};
+
+template <> struct pixel_format_traits<DRM_FORMAT_ARGB8888>
+{
+    typedef packed_layout layout;
+    typedef uint32_t      pixel_type;
+    enum { plane_count = 1, bytes_per_pixel = 4, chroma_bytes = 0,
+           horizontal_subsampling = 1, vertical_subsampling = 1,
+           has_alpha = 1, legacy_depth = 32 };
+    static char const *name() { return "ARGB8888"; }
+    static pixel_type pack(uint32_t argb) { return argb; }
+    static uint32_t unpack(pixel_type pixel) { return pixel; }
+};
+
+template <> struct pixel_format_traits<DRM_FORMAT_RGB565>
+{
+    typedef packed_layout layout;
+    typedef uint16_t      pixel_type;
+    enum { plane_count = 1, bytes_per_pixel = 2, chroma_bytes = 0,
+           horizontal_subsampling = 1, vertical_subsampling = 1,
+           has_alpha = 0, legacy_depth = 16 };
+    static char const *name() { return "RGB565"; }
+    static pixel_type pack(uint32_t argb)
+    {
+        return ((argb >> 8) & 0xf800) | ((argb >> 5) & 0x07e0) | ((argb >> 3) & 0x001f);
+    }
+    static uint32_t unpack(pixel_type pixel) { return pixel_rgb565_to_argb(pixel); }
+};
+
+template <> struct pixel_format_traits<DRM_FORMAT_NV12>
+{
+    typedef semi_planar_layout layout;
+    typedef uint8_t            pixel_type;
+    enum { plane_count = 2, bytes_per_pixel = 1, chroma_bytes = 2,
+           horizontal_subsampling = 2, vertical_subsampling = 2,
+           has_alpha = 0, legacy_depth = 0 };
+    static char const *name() { return "NV12"; }
+};
+
+template <> struct pixel_format_traits<DRM_FORMAT_NV16>
+{
+    typedef semi_planar_layout layout;
+    typedef uint8_t            pixel_type;
+    enum { plane_count = 2, bytes_per_pixel = 1, chroma_bytes = 2,
+           horizontal_subsampling = 2, vertical_subsampling = 1,
+           has_alpha = 0, legacy_depth = 0 };
+    static char const *name() { return "NV16"; }
+};
+
+/* ---- Runtime description ---- */
+
+/* The traits of a format, for the code that only knows it at run time */
+struct pixel_format_info
+{
+    uint32_t     format;
+    char const  *name;
+    unsigned int plane_count;
+    /* Per pixel of the Y or packed plane, and per UV pair */
+    unsigned int bytes_per_pixel;
+    unsigned int chroma_bytes;
+    unsigned int horizontal_subsampling;
+    unsigned int vertical_subsampling;
+    bool         has_alpha;
+    /* The depth drmModeAddFB wants, 0 if it cannot describe the format */
+    unsigned int legacy_depth;
+};
+
+/* NULL for the formats the kernels do not support */
+pixel_format_info const *pixel_format_find(uint32_t format);
+
+/* Bytes used by a row of plane, and rows of plane, in a width x height
+ * image */
+uint32_t pixel_format_row_bytes(pixel_format_info const &info, unsigned int plane, uint32_t width);
+uint32_t pixel_format_plane_rows(pixel_format_info const &info, unsigned int plane, uint32_t height);
+
+/* The image stored in a single buffer, the planes one after the other
+ * with the same pitch, like dumb buffers and most decoders lay them out.
+ * Returns the size of the buffer, 0 for an unknown format. */
+uint64_t pixel_image_layout(uint32_t format, uint32_t width, uint32_t height,
+                            uint8_t *pixels, uint32_t pitch,
+                            pixel_image &image);
+
+/* ---- YUV ---- */
+
+static inline uint8_t pixel_clamp_255(int v)
+{
+    return (v < 0) ? 0 : ((v > 255) ? 255 : v);
+}
+
+/* BT.601 limited range, 8 bits fixed point */
+static inline uint8_t pixel_argb_to_y(uint32_t argb)
+{
+    int const r = (argb >> 16) & 0xff, g = (argb >> 8) & 0xff, b = argb & 0xff;
+    return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static inline void pixel_rgb_to_uv(int r, int g, int b, uint8_t &u, uint8_t &v)
+{
+    u = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+    v = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static inline uint32_t pixel_yuv_to_argb(int y, int u, int v)
+{
+    int const c = 298 * (y - 16);
+    u -= 128;
+    v -= 128;
+    return 0xff000000
+         | (pixel_clamp_255((c + 409 * v + 128) >> 8) << 16)
+         | (pixel_clamp_255((c - 100 * u - 208 * v + 128) >> 8) << 8)
+         | pixel_clamp_255((c + 516 * u + 128) >> 8);
+}
+
+/* ---- Kernels ---- */
+
+template <class Pixel>
+static inline Pixel *pixel_row(pixel_surface const &plane, uint32_t x, uint32_t y)
+{
+    return (Pixel *) (plane.pixels + (size_t) y * plane.pitch) + x;
+}
+
+/* Fills of a rectangle of one plane, by pixel size */
+static inline void pixel_fill_rows(pixel_surface const &plane, uint32_t x, uint32_t y,
+                                   uint32_t width, uint32_t height, uint32_t value)
+{
+    pixel_kernels const &kernels = pixel_ops_kernels();
+    for (uint32_t row = 0; row < height; row++)
+        kernels.fill_row(pixel_row<uint32_t>(plane, x, y + row), width, value);
+}
+
+static inline void pixel_fill_rows(pixel_surface const &plane, uint32_t x, uint32_t y,
+                                   uint32_t width, uint32_t height, uint16_t value)
+{
+    for (uint32_t row = 0; row < height; row++)
+        std::fill_n(pixel_row<uint16_t>(plane, x, y + row), width, value);
+}
+
+static inline void pixel_fill_rows(pixel_surface const &plane, uint32_t x, uint32_t y,
+                                   uint32_t width, uint32_t height, uint8_t value)
+{
+    for (uint32_t row = 0; row < height; row++)
+        memset(pixel_row<uint8_t>(plane, x, y + row), value, width);
+}
+
+/* A UV pair, U first in memory */
+static inline uint16_t pixel_uv_pair(uint8_t u, uint8_t v)
+{
+    uint8_t const bytes[2] = { u, v };
+    uint16_t pair;
+    memcpy(&pair, bytes, sizeof(pair));
+    return pair;
+}
+
+template <uint32_t Format, class Layout = typename pixel_format_traits<Format>::layout>
+struct pixel_format_kernels;
+
+template <uint32_t Format>
+struct pixel_format_kernels<Format, packed_layout>
+{
+    typedef pixel_format_traits<Format> traits;
+
+    static void fill(pixel_image const &image, uint32_t x, uint32_t y,
+                     uint32_t width, uint32_t height, uint32_t argb)
+    {
+        pixel_fill_rows(image.planes[0], x, y, width, height, traits::pack(argb));
+    }
+};
+
+template <uint32_t Format>
+struct pixel_format_kernels<Format, semi_planar_layout>
+{
+    typedef pixel_format_traits<Format> traits;
+
+    /* The UV pairs covering a rectangle of pixels */
+    static void chroma_rect(uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                            uint32_t &chroma_x, uint32_t &chroma_y,
+                            uint32_t &chroma_width, uint32_t &chroma_height)
+    {
+        chroma_x      = x / traits::horizontal_subsampling;
+        chroma_y      = y / traits::vertical_subsampling;
+        chroma_width  = (x + width - 1) / traits::horizontal_subsampling + 1 - chroma_x;
+        chroma_height = (y + height - 1) / traits::vertical_subsampling + 1 - chroma_y;
+    }
+
+    static void fill(pixel_image const &image, uint32_t x, uint32_t y,
+                     uint32_t width, uint32_t height, uint32_t argb)
+    {
+        pixel_fill_rows(image.planes[0], x, y, width, height, pixel_argb_to_y(argb));
+
+        uint8_t u, v;
+        pixel_rgb_to_uv((argb >> 16) & 0xff, (argb >> 8) & 0xff, argb & 0xff, u, v);
+
+        uint32_t chroma_x, chroma_y, chroma_width, chroma_height;
+        chroma_rect(x, y, width, height, chroma_x, chroma_y, chroma_width, chroma_height);
+        pixel_fill_rows(image.planes[1], chroma_x, chroma_y, chroma_width, chroma_height,
+                        pixel_uv_pair(u, v));
+    }
+};
+
+/* Converts a row between packed formats. The pairs the SIMD kernels
+ * handle are specialized below. */
+template <uint32_t Destination, uint32_t Source>
+struct pixel_row_converter
+{
+    typedef pixel_format_traits<Destination> destination_traits;
+    typedef pixel_format_traits<Source>      source_traits;
+
+    static void convert(pixel_kernels const &kernels,
+                        typename destination_traits::pixel_type *destination,
+                        typename source_traits::pixel_type const *source,
+                        uint32_t count)
+    {
+        (void) kernels;
+        for (uint32_t p = 0; p < count; p++)
+            destination[p] = destination_traits::pack(source_traits::unpack(source[p]));
+    }
+};
+
+/* Same layout : the X byte is whatever the source had */
+template <uint32_t Format>
+struct pixel_copy_row_converter
+{
+    static void convert(pixel_kernels const &kernels, uint32_t *destination,
+                        uint32_t const *source, uint32_t count)
+    {
+        kernels.copy_row(destination, source, count);
+    }
+};
+
+template <> struct pixel_row_converter<DRM_FORMAT_XRGB8888, DRM_FORMAT_XRGB8888> :
+    pixel_copy_row_converter<DRM_FORMAT_XRGB8888> {};
+template <> struct pixel_row_converter<DRM_FORMAT_ARGB8888, DRM_FORMAT_ARGB8888> :
+    pixel_copy_row_converter<DRM_FORMAT_ARGB8888> {};
+template <> struct pixel_row_converter<DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888> :
+    pixel_copy_row_converter<DRM_FORMAT_XRGB8888> {};
+
+template <> struct pixel_row_converter<DRM_FORMAT_RGB565, DRM_FORMAT_RGB565>
+{
+    static void convert(pixel_kernels const &, uint16_t *destination,
+                        uint16_t const *source, uint32_t count)
+    {
+        memcpy(destination, source, count * sizeof(uint16_t));
+    }
+};
+
+template <uint32_t Source>
+struct pixel_to_rgb565_row_converter
+{
+    static void convert(pixel_kernels const &kernels, uint16_t *destination,
+                        uint32_t const *source, uint32_t count)
+    {
+        kernels.xrgb_to_rgb565_row(destination, source, count);
+    }
+};
+
+template <> struct pixel_row_converter<DRM_FORMAT_RGB565, DRM_FORMAT_XRGB8888> :
+    pixel_to_rgb565_row_converter<DRM_FORMAT_XRGB8888> {};
+template <> struct pixel_row_converter<DRM_FORMAT_RGB565, DRM_FORMAT_ARGB8888> :
+    pixel_to_rgb565_row_converter<DRM_FORMAT_ARGB8888> {};
+
+/* The kernels give opaque pixels */
+template <uint32_t Destination>
+struct pixel_from_rgb565_row_converter
+{
+    static void convert(pixel_kernels const &kernels, uint32_t *destination,
+                        uint16_t const *source, uint32_t count)
+    {
+        kernels.rgb565_to_xrgb_row(destination, source, count);
+    }
+};
+
+template <> struct pixel_row_converter<DRM_FORMAT_XRGB8888, DRM_FORMAT_RGB565> :
+    pixel_from_rgb565_row_converter<DRM_FORMAT_XRGB8888> {};
+template <> struct pixel_row_converter<DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565> :
+    pixel_from_rgb565_row_converter<DRM_FORMAT_ARGB8888> {};
+
+/* Converts the width x height rectangle at (source_x, source_y) of source
+ * to (x, y) in destination, both being already clipped */
+template <uint32_t Destination, uint32_t Source,
+          class DestinationLayout = typename pixel_format_traits<Destination>::layout,
+          class SourceLayout = typename pixel_format_traits<Source>::layout>
+struct pixel_converter;
+
+template <uint32_t Destination, uint32_t Source>
+struct pixel_converter<Destination, Source, packed_layout, packed_layout>
+{
+    typedef typename pixel_format_traits<Destination>::pixel_type destination_pixel;
+    typedef typename pixel_format_traits<Source>::pixel_type      source_pixel;
+
+    static void convert(pixel_image const &destination, uint32_t x, uint32_t y,
+                        pixel_image const &source, uint32_t source_x, uint32_t source_y,
+                        uint32_t width, uint32_t height)
+    {
+        pixel_kernels const &kernels = pixel_ops_kernels();
+        for (uint32_t row = 0; row < height; row++)
+        {
+            pixel_row_converter<Destination, Source>::convert(
+                kernels,
+                pixel_row<destination_pixel>(destination.planes[0], x, y + row),
+                pixel_row<source_pixel const>(source.planes[0], source_x, source_y + row),
+                width);
+        }
+    }
+};
+
+template <uint32_t Destination, uint32_t Source>
+struct pixel_converter<Destination, Source, packed_layout, semi_planar_layout>
+{
+    typedef pixel_format_traits<Destination> destination_traits;
+    typedef pixel_format_traits<Source>      source_traits;
+    typedef typename destination_traits::pixel_type destination_pixel;
+
+    static void convert(pixel_image const &destination, uint32_t x, uint32_t y,
+                        pixel_image const &source, uint32_t source_x, uint32_t source_y,
+                        uint32_t width, uint32_t height)
+    {
+        pixel_surface const &chroma = source.planes[1];
+        for (uint32_t row = 0; row < height; row++)
+        {
+            uint32_t const source_row = source_y + row;
+            uint8_t const *luma = pixel_row<uint8_t const>(source.planes[0], 0, source_row);
+            uint8_t const *uv   = pixel_row<uint8_t const>(chroma, 0,
+                std::min<uint32_t>(source_row / source_traits::vertical_subsampling, chroma.height - 1));
+            destination_pixel *d = pixel_row<destination_pixel>(destination.planes[0], x, y + row);
+
+            for (uint32_t p = 0; p < width; p++)
+            {
+                uint32_t const column = source_x + p;
+                uint32_t const pair   = (column / source_traits::horizontal_subsampling) * 2;
+                d[p] = destination_traits::pack(pixel_yuv_to_argb(luma[column], uv[pair], uv[pair + 1]));
+            }
+        }
+    }
+};
+
+template <uint32_t Destination, uint32_t Source>
+struct pixel_converter<Destination, Source, semi_planar_layout, packed_layout>
+{
+    typedef pixel_format_traits<Destination> destination_traits;
+    typedef pixel_format_traits<Source>      source_traits;
+    typedef typename source_traits::pixel_type source_pixel;
+
+    static void convert(pixel_image const &destination, uint32_t x, uint32_t y,
+                        pixel_image const &source, uint32_t source_x, uint32_t source_y,
+                        uint32_t width, uint32_t height)
+    {
+        for (uint32_t row = 0; row < height; row++)
+        {
+            source_pixel const *s = pixel_row<source_pixel const>(source.planes[0], source_x, source_y + row);
+            uint8_t *luma = pixel_row<uint8_t>(destination.planes[0], x, y + row);
+            for (uint32_t p = 0; p < width; p++)
+                luma[p] = pixel_argb_to_y(source_traits::unpack(s[p]));
+        }
+
+        /* Each UV pair from the average of the pixels of its block that
+         * are in the rectangle */
+        uint32_t chroma_x, chroma_y, chroma_width, chroma_height;
+        pixel_format_kernels<Destination>::chroma_rect(x, y, width, height,
+                                                       chroma_x, chroma_y,
+                                                       chroma_width, chroma_height);
+        uint32_t const block_width  = destination_traits::horizontal_subsampling;
+        uint32_t const block_height = destination_traits::vertical_subsampling;
+
+        for (uint32_t chroma_row = chroma_y; chroma_row < chroma_y + chroma_height; chroma_row++)
+        {
+            uint32_t const top    = std::max(chroma_row * block_height, y);
+            uint32_t const bottom = std::min(chroma_row * block_height + block_height, y + height);
+            uint8_t *uv = pixel_row<uint8_t>(destination.planes[1], 0, chroma_row);
+
+            for (uint32_t pair = chroma_x; pair < chroma_x + chroma_width; pair++)
+            {
+                uint32_t const left  = std::max(pair * block_width, x);
+                uint32_t const right = std::min(pair * block_width + block_width, x + width);
+
+                int r = 0, g = 0, b = 0, count = 0;
+                for (uint32_t row = top; row < bottom; row++)
+                {
+                    source_pixel const *s = pixel_row<source_pixel const>(source.planes[0], 0, source_y + row - y);
+                    for (uint32_t column = left; column < right; column++)
+                    {
+                        uint32_t const argb = source_traits::unpack(s[source_x + column - x]);
+                        r += (argb >> 16) & 0xff;
+                        g += (argb >> 8) & 0xff;
+                        b += argb & 0xff;
+                        count++;
+                    }
+                }
+
+                pixel_rgb_to_uv((r + count / 2) / count, (g + count / 2) / count, (b + count / 2) / count,
+                                uv[pair * 2], uv[pair * 2 + 1]);
+            }
+        }
+    }
+};
+
+template <uint32_t Destination, uint32_t Source>
+struct pixel_converter<Destination, Source, semi_planar_layout, semi_planar_layout>
+{
+    typedef pixel_format_traits<Destination> destination_traits;
+    typedef pixel_format_traits<Source>      source_traits;
+
+    static void convert(pixel_image const &destination, uint32_t x, uint32_t y,
+                        pixel_image const &source, uint32_t source_x, uint32_t source_y,
+                        uint32_t width, uint32_t height)
+    {
+        for (uint32_t row = 0; row < height; row++)
+        {
+            memcpy(pixel_row<uint8_t>(destination.planes[0], x, y + row),
+                   pixel_row<uint8_t const>(source.planes[0], source_x, source_y + row),
+                   width);
+        }
+
+        /* Each UV pair from the source pair under its first pixel in the
+         * rectangle : a copy when the subsamplings match */
+        uint32_t chroma_x, chroma_y, chroma_width, chroma_height;
+        pixel_format_kernels<Destination>::chroma_rect(x, y, width, height,
+                                                       chroma_x, chroma_y,
+                                                       chroma_width, chroma_height);
+
+        pixel_surface const &source_chroma = source.planes[1];
+        for (uint32_t chroma_row = chroma_y; chroma_row < chroma_y + chroma_height; chroma_row++)
+        {
+            uint32_t const top = std::max<uint32_t>(chroma_row * destination_traits::vertical_subsampling, y);
+            uint32_t const source_row = std::min<uint32_t>((source_y + top - y) / source_traits::vertical_subsampling,
+                                                           source_chroma.height - 1);
+            uint16_t *uv = pixel_row<uint16_t>(destination.planes[1], 0, chroma_row);
+            uint16_t const *source_uv = pixel_row<uint16_t const>(source_chroma, 0, source_row);
+
+            for (uint32_t pair = chroma_x; pair < chroma_x + chroma_width; pair++)
+            {
+                uint32_t const left = std::max<uint32_t>(pair * destination_traits::horizontal_subsampling, x);
+                uv[pair] = source_uv[(source_x + left - x) / source_traits::horizontal_subsampling];
+            }
+        }
+    }
+};
+
+/* Fills a rectangle of an image of format Format, with clipping */
+template <uint32_t Format>
+void pixel_fill_rect_as(pixel_image const &destination,
+                        int32_t x, int32_t y,
+                        uint32_t width, uint32_t height,
+                        uint32_t argb)
+{
+    uint32_t skip_x, skip_y;
+    if (!pixel_clip_rect(destination.width, destination.height, x, y, width, height, skip_x, skip_y))
+        return;
+
+    pixel_format_kernels<Format>::fill(destination, x, y, width, height, argb);
+}
+
+/* Copies a rectangle of source to (x, y) in destination, converting it
+ * from Source to Destination, with clipping */
+template <uint32_t Destination, uint32_t Source>
+void pixel_convert_as(pixel_image const &destination,
+                      int32_t x, int32_t y,
+                      pixel_image const &source,
+                      uint32_t source_x, uint32_t source_y,
+                      uint32_t width, uint32_t height)
+{
+    if (source_x >= source.width || source_y >= source.height)
+        return;
+
+    width  = std::min(width,  source.width  - source_x);
+    height = std::min(height, source.height - source_y);
+
+    uint32_t skip_x, skip_y;
+    if (!pixel_clip_rect(destination.width, destination.height, x, y, width, height, skip_x, skip_y))
+        return;
+
+    pixel_converter<Destination, Source>::convert(destination, x, y,
+                                                  source, source_x + skip_x, source_y + skip_y,
+                                                  width, height);
+}
+
+/* The same, for formats only known at run time : a single switch per
+ * call picks the instantiation. Return 0, or -EINVAL for an unsupported
+ * format. */
+int pixel_image_fill_rect(pixel_image const &destination,
+                          int32_t x, int32_t y,
+                          uint32_t width, uint32_t height,
+                          uint32_t argb);
+int pixel_image_convert(pixel_image const &destination,
+                        int32_t x, int32_t y,
+                        pixel_image const &source,
+                        uint32_t source_x, uint32_t source_y,
+                        uint32_t width, uint32_t height);
+
+#endif // PIXEL_FORMAT_H
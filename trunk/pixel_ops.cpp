@@ -0,0 +1,700 @@
+#include "pixel_ops.h"
+#include "pixel_format.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_OPS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXEL_OPS_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Rounded division by 255 of a value up to 255 * 255 */
+#define DIV_255(x) ((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+
+/* ---- Scalar reference ---- */
+
+static void fill_row_scalar(uint32_t *destination, uint32_t count, uint32_t color)
+{
+    for (uint32_t p = 0; p < count; p++)
+        destination[p] = color;
+}
+
+static void copy_row_scalar(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    memcpy(destination, source, count * sizeof(uint32_t));
+}
+
+static void blend_row_scalar(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    for (uint32_t p = 0; p < count; p++)
+    {
+        uint32_t const s     = source[p];
+        uint32_t const d     = destination[p];
+        uint32_t const alpha = s >> 24;
+        uint32_t result = 0xff000000;
+
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            uint32_t const mixed = ((s >> shift) & 0xff) * alpha
+                                 + ((d >> shift) & 0xff) * (255 - alpha);
+            result |= DIV_255(mixed) << shift;
+        }
+        destination[p] = result;
+    }
+}
+
+static void xrgb_to_rgb565_row_scalar(uint16_t *destination, uint32_t const *source, uint32_t count)
+{
+    for (uint32_t p = 0; p < count; p++)
+    {
+        uint32_t const s = source[p];
+        destination[p] = ((s >> 8) & 0xf800) | ((s >> 5) & 0x07e0) | ((s >> 3) & 0x001f);
+    }
+}
+
+static void rgb565_to_xrgb_row_scalar(uint32_t *destination, uint16_t const *source, uint32_t count)
+{
+    for (uint32_t p = 0; p < count; p++)
+        destination[p] = pixel_rgb565_to_argb(source[p]);
+}
+
+static pixel_kernels const scalar_kernels =
+{
+    "scalar",
+    fill_row_scalar,
+    copy_row_scalar,
+    blend_row_scalar,
+    xrgb_to_rgb565_row_scalar,
+    rgb565_to_xrgb_row_scalar
+};
+
+/* ---- x86 : SSE2 and AVX2 ----
+ * Dumb buffers are mapped write-combined, so the fills and copies use
+ * non temporal stores : full lines go straight to memory, without reading
+ * them into the cache first. */
+
+#ifdef PIXEL_OPS_X86
+
+#define SSE2_FUNCTION __attribute__((target("sse2")))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+SSE2_FUNCTION
+static void fill_row_sse2(uint32_t *destination, uint32_t count, uint32_t color)
+{
+    while (count && ((uintptr_t) destination & 15))
+    {
+        *destination++ = color;
+        count--;
+    }
+
+    __m128i const colors = _mm_set1_epi32(color);
+    for (; count >= 16; count -= 16, destination += 16)
+    {
+        _mm_stream_si128((__m128i *) destination + 0, colors);
+        _mm_stream_si128((__m128i *) destination + 1, colors);
+        _mm_stream_si128((__m128i *) destination + 2, colors);
+        _mm_stream_si128((__m128i *) destination + 3, colors);
+    }
+    for (; count >= 4; count -= 4, destination += 4)
+        _mm_stream_si128((__m128i *) destination, colors);
+    _mm_sfence();
+
+    fill_row_scalar(destination, count, color);
+}
+
+SSE2_FUNCTION
+static void copy_row_sse2(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    while (count && ((uintptr_t) destination & 15))
+    {
+        *destination++ = *source++;
+        count--;
+    }
+
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        __m128i const a = _mm_loadu_si128((__m128i const *) source);
+        __m128i const b = _mm_loadu_si128((__m128i const *) source + 1);
+        _mm_stream_si128((__m128i *) destination, a);
+        _mm_stream_si128((__m128i *) destination + 1, b);
+    }
+    _mm_sfence();
+
+    copy_row_scalar(destination, source, count);
+}
+
+/* Blends 2 pixels unpacked to 16 bits per channel */
+SSE2_FUNCTION
+static inline __m128i blend_pixels_sse2(__m128i source, __m128i destination)
+{
+    __m128i const alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(source, 0xff), 0xff);
+    __m128i const inverse_alpha = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    __m128i mixed = _mm_add_epi16(_mm_mullo_epi16(source, alpha),
+                                  _mm_mullo_epi16(destination, inverse_alpha));
+    mixed = _mm_add_epi16(mixed, _mm_set1_epi16(128));
+    mixed = _mm_add_epi16(mixed, _mm_srli_epi16(mixed, 8));
+    return _mm_srli_epi16(mixed, 8);
+}
+
+SSE2_FUNCTION
+static void blend_row_sse2(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    __m128i const zero   = _mm_setzero_si128();
+    __m128i const opaque = _mm_set1_epi32(0xff000000);
+
+    for (; count >= 4; count -= 4, destination += 4, source += 4)
+    {
+        __m128i const s = _mm_loadu_si128((__m128i const *) source);
+        __m128i const d = _mm_loadu_si128((__m128i const *) destination);
+
+        __m128i const low  = blend_pixels_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i const high = blend_pixels_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i *) destination, _mm_or_si128(_mm_packus_epi16(low, high), opaque));
+    }
+
+    blend_row_scalar(destination, source, count);
+}
+
+SSE2_FUNCTION
+static inline __m128i xrgb_to_rgb565_sse2(__m128i pixels)
+{
+    __m128i const r = _mm_and_si128(_mm_srli_epi32(pixels, 8), _mm_set1_epi32(0xf800));
+    __m128i const g = _mm_and_si128(_mm_srli_epi32(pixels, 5), _mm_set1_epi32(0x07e0));
+    __m128i const b = _mm_and_si128(_mm_srli_epi32(pixels, 3), _mm_set1_epi32(0x001f));
+    /* packs is a signed saturation : move the values to the signed range
+     * first, and back once packed */
+    return _mm_sub_epi32(_mm_or_si128(_mm_or_si128(r, g), b), _mm_set1_epi32(0x8000));
+}
+
+SSE2_FUNCTION
+static void xrgb_to_rgb565_row_sse2(uint16_t *destination, uint32_t const *source, uint32_t count)
+{
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        __m128i const low  = xrgb_to_rgb565_sse2(_mm_loadu_si128((__m128i const *) source));
+        __m128i const high = xrgb_to_rgb565_sse2(_mm_loadu_si128((__m128i const *) source + 1));
+        __m128i const packed = _mm_xor_si128(_mm_packs_epi32(low, high), _mm_set1_epi16((short) 0x8000));
+        _mm_storeu_si128((__m128i *) destination, packed);
+    }
+
+    xrgb_to_rgb565_row_scalar(destination, source, count);
+}
+
+SSE2_FUNCTION
+static inline __m128i rgb565_to_xrgb_sse2(__m128i v)
+{
+    __m128i const r = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xf800)), 8),
+                                   _mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0xe000)), 3));
+    __m128i const g = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x07e0)), 5),
+                                   _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x0600)), 1));
+    __m128i const b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x001f)), 3),
+                                   _mm_srli_epi32(_mm_and_si128(v, _mm_set1_epi32(0x001c)), 2));
+    return _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, _mm_set1_epi32(0xff000000)));
+}
+
+SSE2_FUNCTION
+static void rgb565_to_xrgb_row_sse2(uint32_t *destination, uint16_t const *source, uint32_t count)
+{
+    __m128i const zero = _mm_setzero_si128();
+
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        __m128i const v = _mm_loadu_si128((__m128i const *) source);
+        _mm_storeu_si128((__m128i *) destination,     rgb565_to_xrgb_sse2(_mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_si128((__m128i *) destination + 1, rgb565_to_xrgb_sse2(_mm_unpackhi_epi16(v, zero)));
+    }
+
+    rgb565_to_xrgb_row_scalar(destination, source, count);
+}
+
+static pixel_kernels const sse2_kernels =
+{
+    "sse2",
+    fill_row_sse2,
+    copy_row_sse2,
+    blend_row_sse2,
+    xrgb_to_rgb565_row_sse2,
+    rgb565_to_xrgb_row_sse2
+};
+
+AVX2_FUNCTION
+static void fill_row_avx2(uint32_t *destination, uint32_t count, uint32_t color)
+{
+    while (count && ((uintptr_t) destination & 31))
+    {
+        *destination++ = color;
+        count--;
+    }
+
+    __m256i const colors = _mm256_set1_epi32(color);
+    for (; count >= 32; count -= 32, destination += 32)
+    {
+        _mm256_stream_si256((__m256i *) destination + 0, colors);
+        _mm256_stream_si256((__m256i *) destination + 1, colors);
+        _mm256_stream_si256((__m256i *) destination + 2, colors);
+        _mm256_stream_si256((__m256i *) destination + 3, colors);
+    }
+    for (; count >= 8; count -= 8, destination += 8)
+        _mm256_stream_si256((__m256i *) destination, colors);
+    _mm_sfence();
+
+    fill_row_scalar(destination, count, color);
+}
+
+AVX2_FUNCTION
+static void copy_row_avx2(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    while (count && ((uintptr_t) destination & 31))
+    {
+        *destination++ = *source++;
+        count--;
+    }
+
+    for (; count >= 16; count -= 16, destination += 16, source += 16)
+    {
+        __m256i const a = _mm256_loadu_si256((__m256i const *) source);
+        __m256i const b = _mm256_loadu_si256((__m256i const *) source + 1);
+        _mm256_stream_si256((__m256i *) destination, a);
+        _mm256_stream_si256((__m256i *) destination + 1, b);
+    }
+    _mm_sfence();
+
+    copy_row_scalar(destination, source, count);
+}
+
+AVX2_FUNCTION
+static inline __m256i blend_pixels_avx2(__m256i source, __m256i destination)
+{
+    __m256i const alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(source, 0xff), 0xff);
+    __m256i const inverse_alpha = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+    __m256i mixed = _mm256_add_epi16(_mm256_mullo_epi16(source, alpha),
+                                     _mm256_mullo_epi16(destination, inverse_alpha));
+    mixed = _mm256_add_epi16(mixed, _mm256_set1_epi16(128));
+    mixed = _mm256_add_epi16(mixed, _mm256_srli_epi16(mixed, 8));
+    return _mm256_srli_epi16(mixed, 8);
+}
+
+AVX2_FUNCTION
+static void blend_row_avx2(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    __m256i const zero   = _mm256_setzero_si256();
+    __m256i const opaque = _mm256_set1_epi32(0xff000000);
+
+    /* unpack and pack work within each 128 bits lane, so the pixel order
+     * is preserved */
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        __m256i const s = _mm256_loadu_si256((__m256i const *) source);
+        __m256i const d = _mm256_loadu_si256((__m256i const *) destination);
+
+        __m256i const low  = blend_pixels_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i const high = blend_pixels_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i *) destination, _mm256_or_si256(_mm256_packus_epi16(low, high), opaque));
+    }
+
+    blend_row_sse2(destination, source, count);
+}
+
+AVX2_FUNCTION
+static inline __m256i xrgb_to_rgb565_avx2(__m256i pixels)
+{
+    __m256i const r = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), _mm256_set1_epi32(0xf800));
+    __m256i const g = _mm256_and_si256(_mm256_srli_epi32(pixels, 5), _mm256_set1_epi32(0x07e0));
+    __m256i const b = _mm256_and_si256(_mm256_srli_epi32(pixels, 3), _mm256_set1_epi32(0x001f));
+    return _mm256_or_si256(_mm256_or_si256(r, g), b);
+}
+
+AVX2_FUNCTION
+static void xrgb_to_rgb565_row_avx2(uint16_t *destination, uint32_t const *source, uint32_t count)
+{
+    for (; count >= 16; count -= 16, destination += 16, source += 16)
+    {
+        __m256i const low  = xrgb_to_rgb565_avx2(_mm256_loadu_si256((__m256i const *) source));
+        __m256i const high = xrgb_to_rgb565_avx2(_mm256_loadu_si256((__m256i const *) source + 1));
+        /* Unsigned pack, then put the 64 bits quarters back in order */
+        __m256i const packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xd8);
+        _mm256_storeu_si256((__m256i *) destination, packed);
+    }
+
+    xrgb_to_rgb565_row_sse2(destination, source, count);
+}
+
+AVX2_FUNCTION
+static void rgb565_to_xrgb_row_avx2(uint32_t *destination, uint16_t const *source, uint32_t count)
+{
+    __m256i const red_high   = _mm256_set1_epi32(0xf800);
+    __m256i const red_low    = _mm256_set1_epi32(0xe000);
+    __m256i const green_high = _mm256_set1_epi32(0x07e0);
+    __m256i const green_low  = _mm256_set1_epi32(0x0600);
+    __m256i const blue_high  = _mm256_set1_epi32(0x001f);
+    __m256i const blue_low   = _mm256_set1_epi32(0x001c);
+    __m256i const opaque     = _mm256_set1_epi32(0xff000000);
+
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        __m256i const v = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i const *) source));
+        __m256i const r = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v, red_high), 8),
+                                          _mm256_slli_epi32(_mm256_and_si256(v, red_low), 3));
+        __m256i const g = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v, green_high), 5),
+                                          _mm256_srli_epi32(_mm256_and_si256(v, green_low), 1));
+        __m256i const b = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(v, blue_high), 3),
+                                          _mm256_srli_epi32(_mm256_and_si256(v, blue_low), 2));
+        _mm256_storeu_si256((__m256i *) destination,
+                            _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, opaque)));
+    }
+
+    rgb565_to_xrgb_row_scalar(destination, source, count);
+}
+
+static pixel_kernels const avx2_kernels =
+{
+    "avx2",
+    fill_row_avx2,
+    copy_row_avx2,
+    blend_row_avx2,
+    xrgb_to_rgb565_row_avx2,
+    rgb565_to_xrgb_row_avx2
+};
+
+#endif // PIXEL_OPS_X86
+
+/* ---- ARM : NEON ---- */
+
+#ifdef PIXEL_OPS_NEON
+
+static void fill_row_neon(uint32_t *destination, uint32_t count, uint32_t color)
+{
+    uint32x4_t const colors = vdupq_n_u32(color);
+    for (; count >= 16; count -= 16, destination += 16)
+    {
+        vst1q_u32(destination + 0,  colors);
+        vst1q_u32(destination + 4,  colors);
+        vst1q_u32(destination + 8,  colors);
+        vst1q_u32(destination + 12, colors);
+    }
+    for (; count >= 4; count -= 4, destination += 4)
+        vst1q_u32(destination, colors);
+
+    fill_row_scalar(destination, count, color);
+}
+
+static void copy_row_neon(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    for (; count >= 16; count -= 16, destination += 16, source += 16)
+    {
+        uint32x4_t const a = vld1q_u32(source + 0);
+        uint32x4_t const b = vld1q_u32(source + 4);
+        uint32x4_t const c = vld1q_u32(source + 8);
+        uint32x4_t const d = vld1q_u32(source + 12);
+        vst1q_u32(destination + 0,  a);
+        vst1q_u32(destination + 4,  b);
+        vst1q_u32(destination + 8,  c);
+        vst1q_u32(destination + 12, d);
+    }
+
+    copy_row_scalar(destination, source, count);
+}
+
+static inline uint8x8_t blend_channel_neon(uint8x8_t source, uint8x8_t destination,
+                                           uint8x8_t alpha, uint8x8_t inverse_alpha)
+{
+    uint16x8_t mixed = vaddq_u16(vmull_u8(source, alpha), vmull_u8(destination, inverse_alpha));
+    mixed = vaddq_u16(mixed, vdupq_n_u16(128));
+    mixed = vaddq_u16(mixed, vshrq_n_u16(mixed, 8));
+    return vshrn_n_u16(mixed, 8);
+}
+
+static void blend_row_neon(uint32_t *destination, uint32_t const *source, uint32_t count)
+{
+    /* vld4 splits 8 pixels into B, G, R and A vectors */
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        uint8x8x4_t const s = vld4_u8((uint8_t const *) source);
+        uint8x8x4_t d = vld4_u8((uint8_t const *) destination);
+        uint8x8_t const inverse_alpha = vmvn_u8(s.val[3]);
+
+        d.val[0] = blend_channel_neon(s.val[0], d.val[0], s.val[3], inverse_alpha);
+        d.val[1] = blend_channel_neon(s.val[1], d.val[1], s.val[3], inverse_alpha);
+        d.val[2] = blend_channel_neon(s.val[2], d.val[2], s.val[3], inverse_alpha);
+        d.val[3] = vdup_n_u8(0xff);
+        vst4_u8((uint8_t *) destination, d);
+    }
+
+    blend_row_scalar(destination, source, count);
+}
+
+static inline uint16x4_t xrgb_to_rgb565_neon(uint32x4_t pixels)
+{
+    uint32x4_t const r = vandq_u32(vshrq_n_u32(pixels, 8), vdupq_n_u32(0xf800));
+    uint32x4_t const g = vandq_u32(vshrq_n_u32(pixels, 5), vdupq_n_u32(0x07e0));
+    uint32x4_t const b = vandq_u32(vshrq_n_u32(pixels, 3), vdupq_n_u32(0x001f));
+    return vmovn_u32(vorrq_u32(vorrq_u32(r, g), b));
+}
+
+static void xrgb_to_rgb565_row_neon(uint16_t *destination, uint32_t const *source, uint32_t count)
+{
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        vst1q_u16(destination, vcombine_u16(xrgb_to_rgb565_neon(vld1q_u32(source)),
+                                            xrgb_to_rgb565_neon(vld1q_u32(source + 4))));
+    }
+
+    xrgb_to_rgb565_row_scalar(destination, source, count);
+}
+
+static inline uint32x4_t rgb565_to_xrgb_neon(uint32x4_t v)
+{
+    uint32x4_t const r = vorrq_u32(vshlq_n_u32(vandq_u32(v, vdupq_n_u32(0xf800)), 8),
+                                   vshlq_n_u32(vandq_u32(v, vdupq_n_u32(0xe000)), 3));
+    uint32x4_t const g = vorrq_u32(vshlq_n_u32(vandq_u32(v, vdupq_n_u32(0x07e0)), 5),
+                                   vshrq_n_u32(vandq_u32(v, vdupq_n_u32(0x0600)), 1));
+    uint32x4_t const b = vorrq_u32(vshlq_n_u32(vandq_u32(v, vdupq_n_u32(0x001f)), 3),
+                                   vshrq_n_u32(vandq_u32(v, vdupq_n_u32(0x001c)), 2));
+    return vorrq_u32(vorrq_u32(r, g), vorrq_u32(b, vdupq_n_u32(0xff000000)));
+}
+
+static void rgb565_to_xrgb_row_neon(uint32_t *destination, uint16_t const *source, uint32_t count)
+{
+    for (; count >= 8; count -= 8, destination += 8, source += 8)
+    {
+        uint16x8_t const v = vld1q_u16(source);
+        vst1q_u32(destination,     rgb565_to_xrgb_neon(vmovl_u16(vget_low_u16(v))));
+        vst1q_u32(destination + 4, rgb565_to_xrgb_neon(vmovl_u16(vget_high_u16(v))));
+    }
+
+    rgb565_to_xrgb_row_scalar(destination, source, count);
+}
+
+static pixel_kernels const neon_kernels =
+{
+    "neon",
+    fill_row_neon,
+    copy_row_neon,
+    blend_row_neon,
+    xrgb_to_rgb565_row_neon,
+    rgb565_to_xrgb_row_neon
+};
+
+#endif // PIXEL_OPS_NEON
+
+/* ---- Dispatch ---- */
+
+static pixel_kernels const &select_kernels()
+{
+    char const * const forced = getenv("PIXEL_OPS");
+    if (forced && !strcmp(forced, "scalar"))
+        return scalar_kernels;
+
+#ifdef PIXEL_OPS_X86
+    __builtin_cpu_init();
+    if (forced && !strcmp(forced, "sse2") && __builtin_cpu_supports("sse2"))
+        return sse2_kernels;
+    if (__builtin_cpu_supports("avx2"))
+        return avx2_kernels;
+    if (__builtin_cpu_supports("sse2"))
+        return sse2_kernels;
+#endif
+
+#ifdef PIXEL_OPS_NEON
+    return neon_kernels;
+#endif
+
+    return scalar_kernels;
+}
+
+pixel_kernels const &pixel_ops_kernels()
+{
+    static pixel_kernels const &kernels = select_kernels();
+    return kernels;
+}
+
+pixel_kernels const &pixel_ops_scalar_kernels()
+{
+    return scalar_kernels;
+}
+
+/* ---- Surface operations ---- */
+
+bool pixel_clip_rect(uint32_t surface_width, uint32_t surface_height,
+                     int32_t &x, int32_t &y,
+                     uint32_t &width, uint32_t &height,
+                     uint32_t &skip_x, uint32_t &skip_y)
+{
+    int64_t x0 = x, y0 = y;
+    int64_t x1 = x0 + width, y1 = y0 + height;
+
+    x0 = std::max<int64_t>(x0, 0);
+    y0 = std::max<int64_t>(y0, 0);
+    x1 = std::min<int64_t>(x1, surface_width);
+    y1 = std::min<int64_t>(y1, surface_height);
+
+    if (x1 <= x0 || y1 <= y0)
+        return false;
+
+    skip_x = x0 - x;
+    skip_y = y0 - y;
+    x      = x0;
+    y      = y0;
+    width  = x1 - x0;
+    height = y1 - y0;
+    return true;
+}
+
+static inline uint32_t *row32(pixel_surface const &surface, uint32_t x, uint32_t y)
+{
+    return (uint32_t *) (surface.pixels + (size_t) y * surface.pitch) + x;
+}
+
+void pixel_fill_rect(pixel_surface const &destination,
+                     int32_t x, int32_t y,
+                     uint32_t width, uint32_t height,
+                     uint32_t color)
+{
+    uint32_t skip_x, skip_y;
+    if (!pixel_clip_rect(destination.width, destination.height, x, y, width, height, skip_x, skip_y))
+        return;
+
+    pixel_kernels const &kernels = pixel_ops_kernels();
+    for (uint32_t row = 0; row < height; row++)
+        kernels.fill_row(row32(destination, x, y + row), width, color);
+}
+
+void pixel_fill(pixel_surface const &destination, uint32_t color)
+{
+    pixel_fill_rect(destination, 0, 0, destination.width, destination.height, color);
+}
+
+/* Blits share their clipping : to the destination, then to the source */
+static bool clip_blit(pixel_surface const &destination,
+                      int32_t &x, int32_t &y,
+                      pixel_surface const &source,
+                      uint32_t &source_x, uint32_t &source_y,
+                      uint32_t &width, uint32_t &height)
+{
+    if (source_x >= source.width || source_y >= source.height)
+        return false;
+
+    width  = std::min(width,  source.width  - source_x);
+    height = std::min(height, source.height - source_y);
+
+    uint32_t skip_x, skip_y;
+    if (!pixel_clip_rect(destination.width, destination.height, x, y, width, height, skip_x, skip_y))
+        return false;
+
+    source_x += skip_x;
+    source_y += skip_y;
+    return true;
+}
+
+void pixel_blit(pixel_surface const &destination,
+                int32_t x, int32_t y,
+                pixel_surface const &source,
+                uint32_t source_x, uint32_t source_y,
+                uint32_t width, uint32_t height)
+{
+    if (!clip_blit(destination, x, y, source, source_x, source_y, width, height))
+        return;
+
+    pixel_kernels const &kernels = pixel_ops_kernels();
+    for (uint32_t row = 0; row < height; row++)
+    {
+        kernels.copy_row(row32(destination, x, y + row),
+                         row32(source, source_x, source_y + row),
+                         width);
+    }
+}
+
+void pixel_blend(pixel_surface const &destination,
+                 int32_t x, int32_t y,
+                 pixel_surface const &source,
+                 uint32_t source_x, uint32_t source_y,
+                 uint32_t width, uint32_t height)
+{
+    if (!clip_blit(destination, x, y, source, source_x, source_y, width, height))
+        return;
+
+    pixel_kernels const &kernels = pixel_ops_kernels();
+    for (uint32_t row = 0; row < height; row++)
+    {
+        kernels.blend_row(row32(destination, x, y + row),
+                          row32(source, source_x, source_y + row),
+                          width);
+    }
+}
+
+void pixel_xrgb_to_rgb565(pixel_surface const &destination, pixel_surface const &source)
+{
+    uint32_t const width  = std::min(destination.width,  source.width);
+    uint32_t const height = std::min(destination.height, source.height);
+
+    pixel_kernels const &kernels = pixel_ops_kernels();
+    for (uint32_t row = 0; row < height; row++)
+    {
+        kernels.xrgb_to_rgb565_row((uint16_t *) (destination.pixels + (size_t) row * destination.pitch),
+                                   row32(source, 0, row),
+                                   width);
+    }
+}
+
+void pixel_rgb565_to_xrgb(pixel_surface const &destination, pixel_surface const &source)
+{
+    uint32_t const width  = std::min(destination.width,  source.width);
+    uint32_t const height = std::min(destination.height, source.height);
+
+    pixel_kernels const &kernels = pixel_ops_kernels();
+    for (uint32_t row = 0; row < height; row++)
+    {
+        kernels.rgb565_to_xrgb_row(row32(destination, 0, row),
+                                   (uint16_t const *) (source.pixels + (size_t) row * source.pitch),
+                                   width);
+    }
+}
+
+/* Whole images of the size of luma */
+static pixel_image nv12_image(pixel_surface const &luma, pixel_surface const &chroma)
+{
+    pixel_image image;
+    image.format    = DRM_FORMAT_NV12;
+    image.width     = luma.width;
+    image.height    = luma.height;
+    image.planes[0] = luma;
+    image.planes[1] = chroma;
+    return image;
+}
+
+static pixel_image xrgb_image(pixel_surface const &surface)
+{
+    pixel_image image;
+    memset(&image, 0, sizeof(image));
+    image.format    = DRM_FORMAT_XRGB8888;
+    image.width     = surface.width;
+    image.height    = surface.height;
+    image.planes[0] = surface;
+    return image;
+}
+
+void pixel_xrgb_to_nv12(pixel_surface const &luma,
+                        pixel_surface const &chroma,
+                        pixel_surface const &source)
+{
+    pixel_convert_as<DRM_FORMAT_NV12, DRM_FORMAT_XRGB8888>(nv12_image(luma, chroma), 0, 0,
+                                                            xrgb_image(source), 0, 0,
+                                                            source.width, source.height);
+}
+
+void pixel_nv12_to_xrgb(pixel_surface const &destination,
+                        pixel_surface const &luma,
+                        pixel_surface const &chroma)
+{
+    pixel_convert_as<DRM_FORMAT_XRGB8888, DRM_FORMAT_NV12>(xrgb_image(destination), 0, 0,
+                                                            nv12_image(luma, chroma), 0, 0,
+                                                            luma.width, luma.height);
+}
@@ -0,0 +1,83 @@
+#ifndef PIXEL_OPS_H
+#define PIXEL_OPS_H
+
+#include <stdint.h>
+
+/* A linear image. pitch is the stride in bytes, which can be larger than
+ * width * bytes per pixel. The padding at the end of each row is never
+ * touched by the operations below. */
+struct pixel_surface
+{
+    uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+};
+
+/* The per-row kernels every implementation provides.
+ * Pixels are XRGB8888/ARGB8888 (uint32_t) or RGB565 (uint16_t). */
+struct pixel_kernels
+{
+    char const *name;
+    void (*fill_row)(uint32_t *destination, uint32_t count, uint32_t color);
+    void (*copy_row)(uint32_t *destination, uint32_t const *source, uint32_t count);
+    /* ARGB8888 source over an opaque destination. The result is opaque. */
+    void (*blend_row)(uint32_t *destination, uint32_t const *source, uint32_t count);
+    void (*xrgb_to_rgb565_row)(uint16_t *destination, uint32_t const *source, uint32_t count);
+    void (*rgb565_to_xrgb_row)(uint32_t *destination, uint16_t const *source, uint32_t count);
+};
+
+/* The fastest kernels this CPU supports : NEON on ARM, AVX2 or SSE2 on x86,
+ * the scalar ones otherwise.
+ * Setting PIXEL_OPS=scalar (or sse2 on x86) in the environment forces
+ * those kernels, to compare them. */
+pixel_kernels const &pixel_ops_kernels();
+/* The portable reference implementation */
+pixel_kernels const &pixel_ops_scalar_kernels();
+
+/* All the operations below clip to the surfaces. */
+
+/* Clips the width x height rectangle at (x, y) to a surface of that size.
+ * Returns false if nothing is left. skip_x and skip_y tell how much was
+ * cut on the left and top, for the source of blits. */
+bool pixel_clip_rect(uint32_t surface_width, uint32_t surface_height,
+                     int32_t &x, int32_t &y,
+                     uint32_t &width, uint32_t &height,
+                     uint32_t &skip_x, uint32_t &skip_y);
+
+void pixel_fill(pixel_surface const &destination, uint32_t color);
+
+void pixel_fill_rect(pixel_surface const &destination,
+                     int32_t x, int32_t y,
+                     uint32_t width, uint32_t height,
+                     uint32_t color);
+
+void pixel_blit(pixel_surface const &destination,
+                int32_t x, int32_t y,
+                pixel_surface const &source,
+                uint32_t source_x, uint32_t source_y,
+                uint32_t width, uint32_t height);
+
+/* Same as pixel_blit, blending an ARGB8888 source */
+void pixel_blend(pixel_surface const &destination,
+                 int32_t x, int32_t y,
+                 pixel_surface const &source,
+                 uint32_t source_x, uint32_t source_y,
+                 uint32_t width, uint32_t height);
+
+/* Conversions of a whole XRGB8888 surface. The converted area is the
+ * smallest of both surfaces. */
+void pixel_xrgb_to_rgb565(pixel_surface const &destination, pixel_surface const &source);
+void pixel_rgb565_to_xrgb(pixel_surface const &destination, pixel_surface const &source);
+
+/* NV12 is a full resolution Y plane followed by a half resolution
+ * interleaved UV plane. BT.601 limited range.
+ * luma.width counts Y bytes, chroma.width counts UV pairs. */
+void pixel_xrgb_to_nv12(pixel_surface const &luma,
+                        pixel_surface const &chroma,
+                        pixel_surface const &source);
+void pixel_nv12_to_xrgb(pixel_surface const &destination,
+                        pixel_surface const &luma,
+                        pixel_surface const &chroma);
+
+#endif // PIXEL_OPS_H
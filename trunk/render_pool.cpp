@@ -0,0 +1,215 @@
+#include "render_pool.h"
+
+#include <string.h>
+
+#ifndef ALIGN_ON_POW2
+#define ALIGN_ON_POW2(n, align) ((n + align - 1) & ~(align - 1))
+#endif
+
+/* Pixels of XRGB8888 in a cache line */
+static uint32_t const cache_line_pixels = 64 / sizeof(uint32_t);
+
+void split_tiles(uint32_t width, uint32_t height,
+                 uint32_t tile_width, uint32_t tile_height,
+                 std::vector<render_tile> &tiles)
+{
+    tiles.clear();
+    if (!width || !height)
+        return;
+
+    tile_width  = tile_width ? ALIGN_ON_POW2(tile_width, cache_line_pixels) : width;
+    tile_height = tile_height ? tile_height : height;
+
+    for (uint32_t y = 0; y < height; y += tile_height)
+    {
+        for (uint32_t x = 0; x < width; x += tile_width)
+        {
+            render_tile tile;
+            tile.x      = x;
+            tile.y      = y;
+            tile.width  = (width - x < tile_width) ? width - x : tile_width;
+            tile.height = (height - y < tile_height) ? height - y : tile_height;
+            tiles.push_back(tile);
+        }
+    }
+}
+
+pixel_surface tile_surface(pixel_surface const &target, render_tile const &tile)
+{
+    pixel_surface part;
+    part.pixels = target.pixels + (size_t) tile.y * target.pitch + tile.x * sizeof(uint32_t);
+    part.width  = tile.width;
+    part.height = tile.height;
+    part.pitch  = target.pitch;
+    return part;
+}
+
+RenderPool::RenderPool(unsigned int thread_count) :
+    m_generation(0),
+    m_stopping(false),
+    m_remaining(0),
+    m_tiles(NULL),
+    m_draw(NULL),
+    m_context(NULL),
+    m_frames(0)
+{
+    memset(&m_target, 0, sizeof(m_target));
+
+    if (!thread_count)
+        thread_count = std::thread::hardware_concurrency();
+    if (!thread_count)
+        thread_count = 1;
+
+    for (unsigned int w = 0; w < thread_count; w++)
+    {
+        worker *added = new worker;
+        added->drawn  = 0;
+        added->steals = 0;
+        m_workers.push_back(added);
+    }
+
+    /* The calling thread is worker 0 */
+    for (unsigned int w = 1; w < thread_count; w++)
+        m_workers[w]->thread = std::thread(&RenderPool::worker_main, this, w);
+}
+
+RenderPool::~RenderPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_job_mutex);
+        m_stopping = true;
+    }
+    m_job_started.notify_all();
+
+    for (size_t w = 0; w < m_workers.size(); w++)
+    {
+        if (m_workers[w]->thread.joinable())
+            m_workers[w]->thread.join();
+        delete m_workers[w];
+    }
+}
+
+void RenderPool::render(pixel_surface const &target,
+                        std::vector<render_tile> const &tiles,
+                        render_function draw,
+                        void *context)
+{
+    if (tiles.empty())
+        return;
+
+    unsigned int const worker_count = m_workers.size();
+    {
+        std::lock_guard<std::mutex> lock(m_job_mutex);
+        m_target  = target;
+        m_tiles   = &tiles[0];
+        m_draw    = draw;
+        m_context = context;
+        m_remaining.store(tiles.size());
+
+        /* Contiguous runs, so that each thread walks through memory in
+         * order until it starts stealing */
+        for (unsigned int w = 0; w < worker_count; w++)
+        {
+            uint32_t const first = (uint64_t) tiles.size() * w / worker_count;
+            uint32_t const last  = (uint64_t) tiles.size() * (w + 1) / worker_count;
+
+            std::lock_guard<std::mutex> queue_lock(m_workers[w]->mutex);
+            for (uint32_t t = first; t < last; t++)
+                m_workers[w]->tiles.push_back(t);
+        }
+
+        m_generation++;
+        m_frames++;
+    }
+    m_job_started.notify_all();
+
+    drain(0);
+
+    std::unique_lock<std::mutex> lock(m_job_mutex);
+    while (m_remaining.load())
+        m_job_done.wait(lock);
+}
+
+void RenderPool::worker_main(unsigned int index)
+{
+    uint64_t seen_generation = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_job_mutex);
+            while (!m_stopping && m_generation == seen_generation)
+                m_job_started.wait(lock);
+
+            if (m_stopping)
+                return;
+            seen_generation = m_generation;
+        }
+
+        drain(index);
+    }
+}
+
+bool RenderPool::take_tile(unsigned int index, uint32_t &tile)
+{
+    worker &self = *m_workers[index];
+    {
+        std::lock_guard<std::mutex> lock(self.mutex);
+        if (!self.tiles.empty())
+        {
+            tile = self.tiles.front();
+            self.tiles.pop_front();
+            return true;
+        }
+    }
+
+    /* Steal from the end of the other queues, which is the farthest from
+     * where their owner is drawing */
+    unsigned int const worker_count = m_workers.size();
+    for (unsigned int other = 1; other < worker_count; other++)
+    {
+        worker &victim = *m_workers[(index + other) % worker_count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tiles.empty())
+        {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            self.steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void RenderPool::drain(unsigned int index)
+{
+    uint32_t tile;
+    while (take_tile(index, tile))
+    {
+        /* The job is only changed once every tile is drawn, and taking
+         * the tile under the queue mutex makes it visible here */
+        render_tile const &area = m_tiles[tile];
+        m_draw(tile_surface(m_target, area), area, m_context);
+        m_workers[index]->drawn.fetch_add(1, std::memory_order_relaxed);
+
+        if (m_remaining.fetch_sub(1) == 1)
+        {
+            std::lock_guard<std::mutex> lock(m_job_mutex);
+            m_job_done.notify_all();
+        }
+    }
+}
+
+render_pool_stats RenderPool::stats() const
+{
+    render_pool_stats stats;
+    stats.frames = m_frames;
+    stats.tiles  = 0;
+    stats.steals = 0;
+    for (size_t w = 0; w < m_workers.size(); w++)
+    {
+        stats.tiles  += m_workers[w]->drawn.load(std::memory_order_relaxed);
+        stats.steals += m_workers[w]->steals.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
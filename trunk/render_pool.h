@@ -0,0 +1,105 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pixel_ops.h"
+
+/* Part of a surface drawn by one task */
+struct render_tile
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/* Cuts a width x height XRGB8888 surface into tiles, row by row.
+ * Tile widths are rounded up to 16 pixels, a 64 bytes cache line, so
+ * that two tiles never write into the same cache line as long as the
+ * pitch is a multiple of 64 bytes too (swapchain buffers are).
+ * A tile_width of 0 gives bands covering whole rows, which keeps each
+ * task on contiguous memory. */
+void split_tiles(uint32_t width, uint32_t height,
+                 uint32_t tile_width, uint32_t tile_height,
+                 std::vector<render_tile> &tiles);
+
+/* The tile part of target */
+pixel_surface tile_surface(pixel_surface const &target, render_tile const &tile);
+
+/* Draws tile, a part of the surface being rendered. tile_pixels only
+ * covers that part. Called from any thread of the pool. */
+typedef void (*render_function)(pixel_surface const &tile_pixels,
+                                render_tile const &tile,
+                                void *context);
+
+struct render_pool_stats
+{
+    uint64_t frames;
+    uint64_t tiles;
+    /* Tiles taken from another thread queue */
+    uint64_t steals;
+};
+
+/* Renders the tiles of a frame on several threads.
+ * Each thread gets a contiguous run of tiles in its own queue, and takes
+ * tiles from the end of the other queues once its own is empty. */
+class RenderPool
+{
+public:
+    /* thread_count includes the thread calling render.
+     * 0 starts one thread per core. */
+    explicit RenderPool(unsigned int thread_count = 0);
+    ~RenderPool();
+
+    unsigned int thread_count() const { return m_workers.size(); }
+
+    /* Draws every tile and returns once they are all drawn */
+    void render(pixel_surface const &target,
+                std::vector<render_tile> const &tiles,
+                render_function draw,
+                void *context);
+
+    render_pool_stats stats() const;
+
+private:
+    RenderPool(RenderPool const &);
+    RenderPool &operator=(RenderPool const &);
+
+    struct worker
+    {
+        std::mutex            mutex;
+        std::deque<uint32_t>  tiles;
+        std::thread           thread;
+        std::atomic<uint64_t> drawn;
+        std::atomic<uint64_t> steals;
+    };
+
+    void worker_main(unsigned int index);
+    /* Draws tiles until none is left anywhere */
+    void drain(unsigned int index);
+    bool take_tile(unsigned int index, uint32_t &tile);
+
+    std::vector<worker *>     m_workers;
+
+    /* The frame being rendered */
+    std::mutex                m_job_mutex;
+    std::condition_variable   m_job_started;
+    std::condition_variable   m_job_done;
+    uint64_t                  m_generation;
+    bool                      m_stopping;
+    std::atomic<uint32_t>     m_remaining;
+    pixel_surface             m_target;
+    render_tile const        *m_tiles;
+    render_function           m_draw;
+    void                     *m_context;
+    uint64_t                  m_frames;
+};
+
+#endif // RENDER_POOL_H
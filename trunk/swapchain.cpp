@@ -0,0 +1,767 @@
+#include "swapchain.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include <libdrm/drm.h>
+#include <xf86drm.h>
+#include <drm_fourcc.h>
+
+#include <chrono>
+
+#include <QDebug>
+
+static uint64_t monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* ---- DRM backend ---- */
+
+DrmSwapchainBackend::DrmSwapchainBackend(DrmDevice &device,
+                                         uint32_t crtc_id,
+                                         uint32_t connector_id,
+                                         drmModeModeInfo const &mode) :
+    m_device(device),
+    m_crtc_id(crtc_id),
+    m_connector_ids(1, connector_id),
+    m_mode(mode),
+    m_pool(NULL),
+    m_crtc_set(false),
+    m_dirty_fb_supported(true)
+{
+}
+
+DrmSwapchainBackend::DrmSwapchainBackend(DrmDevice &device,
+                                         uint32_t crtc_id,
+                                         std::vector<uint32_t> const &connector_ids,
+                                         drmModeModeInfo const &mode) :
+    m_device(device),
+    m_crtc_id(crtc_id),
+    m_connector_ids(connector_ids),
+    m_mode(mode),
+    m_pool(NULL),
+    m_crtc_set(false),
+    m_dirty_fb_supported(true)
+{
+}
+
+int DrmSwapchainBackend::allocate(uint32_t width, uint32_t height, uint32_t format,
+                                  swapchain_buffer &buffer)
+{
+    pooled_buffer pooled;
+    int ret = m_pool
+        ? m_pool->acquire(width, height, format, pooled)
+        : create_scanout_buffer(m_device, width, height, format, pooled);
+    if (ret)
+        return ret;
+
+    buffer.width      = pooled.width;
+    buffer.height     = pooled.height;
+    buffer.format     = pooled.format;
+    buffer.pitch      = pooled.pitch;
+    buffer.size       = pooled.size;
+    buffer.handle     = pooled.handle;
+    buffer.fb_id      = pooled.fb_id;
+    buffer.dma_buf_fd = pooled.dma_buf_fd;
+    buffer.map        = pooled.map;
+    return 0;
+}
+
+void DrmSwapchainBackend::release(swapchain_buffer &buffer)
+{
+    pooled_buffer pooled;
+    pooled.width      = buffer.width;
+    pooled.height     = buffer.height;
+    pooled.format     = buffer.format;
+    pooled.pitch      = buffer.pitch;
+    pooled.size       = buffer.size;
+    pooled.handle     = buffer.handle;
+    pooled.fb_id      = buffer.fb_id;
+    pooled.dma_buf_fd = buffer.dma_buf_fd;
+    pooled.map        = buffer.map;
+
+    if (m_pool)
+        m_pool->release(pooled);
+    else
+        destroy_scanout_buffer(m_device, pooled);
+
+    buffer.map        = NULL;
+    buffer.dma_buf_fd = -1;
+    buffer.fb_id      = 0;
+    buffer.handle     = 0;
+}
+
+int DrmSwapchainBackend::queue_flip(swapchain_buffer &buffer)
+{
+    /* Page flipping only works on an active CRTC, so the first buffer
+     * goes through a full modeset. That one is synchronous. */
+    if (!m_crtc_set)
+    {
+        int ret = m_device.set_crtc(m_crtc_id, buffer.fb_id,
+                                    &m_connector_ids[0], m_connector_ids.size(),
+                                    &m_mode);
+        if (ret)
+        {
+            qDebug("%s %d drmModeSetCrtc failed : %s\n",
+                   __FUNCTION__, __LINE__, strerror(-ret));
+            return ret;
+        }
+
+        m_crtc_set = true;
+        uint64_t const now_us = monotonic_ns() / 1000;
+        if (m_listener)
+            m_listener->flip_complete(0, now_us / 1000000, now_us % 1000000);
+        return 0;
+    }
+
+    int ret = m_device.page_flip(m_crtc_id, buffer.fb_id,
+                                 DRM_MODE_PAGE_FLIP_EVENT, this);
+    if (ret)
+    {
+        qDebug("%s %d drmModePageFlip failed : %s\n",
+               __FUNCTION__, __LINE__, strerror(-ret));
+        return ret;
+    }
+
+    /* Tell displays that only refresh what changed (command mode panels,
+     * virtual and USB displays) which parts of the buffer are new */
+    if (m_dirty_fb_supported && !buffer.damage.empty())
+    {
+        std::vector<damage_rect> const &rects = buffer.damage.rects();
+        std::vector<drmModeClip> clips(rects.size());
+        for (size_t r = 0; r < rects.size(); r++)
+        {
+            clips[r].x1 = rects[r].x1;
+            clips[r].y1 = rects[r].y1;
+            clips[r].x2 = rects[r].x2;
+            clips[r].y2 = rects[r].y2;
+        }
+
+        if (m_device.dirty_fb(buffer.fb_id, &clips[0], clips.size()) == -ENOSYS)
+            m_dirty_fb_supported = false;
+    }
+
+    return 0;
+}
+
+void DrmSwapchainBackend::page_flip_handler(int fd,
+                                            unsigned int sequence,
+                                            unsigned int tv_sec,
+                                            unsigned int tv_usec,
+                                            void *user_data)
+{
+    Q_UNUSED(fd);
+    DrmSwapchainBackend * const backend = static_cast<DrmSwapchainBackend *>(user_data);
+    if (backend->m_listener)
+        backend->m_listener->flip_complete(sequence, tv_sec, tv_usec);
+}
+
+int DrmSwapchainBackend::dispatch_events(int timeout_ms)
+{
+    struct pollfd drm_poll;
+    drm_poll.fd      = m_device.fd();
+    drm_poll.events  = POLLIN;
+    drm_poll.revents = 0;
+
+    int ret = poll(&drm_poll, 1, timeout_ms);
+    if (ret < 0)
+        return (errno == EINTR) ? 0 : -errno;
+    if (ret == 0)
+        return 0;
+
+    drmEventContext event_context;
+    memset(&event_context, 0, sizeof(event_context));
+    event_context.version           = 2;
+    event_context.page_flip_handler = page_flip_handler;
+
+    int const err = m_device.handle_event(event_context);
+    if (err)
+        return err;
+
+    return 1;
+}
+
+/* ---- Memory backend ---- */
+
+MemorySwapchainBackend::MemorySwapchainBackend(unsigned int refresh_hz) :
+    m_timer_fd(-1),
+    m_period_ns(1000000000ull / (refresh_hz ? refresh_hz : 60)),
+    m_start_ns(0),
+    m_sequence(0),
+    m_pending(NULL)
+{
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (m_timer_fd < 0)
+    {
+        qDebug("%s %d Could not create the vblank timer : %s\n",
+               __FUNCTION__, __LINE__, strerror(errno));
+        return;
+    }
+
+    struct itimerspec vblank_timer;
+    vblank_timer.it_interval.tv_sec  = m_period_ns / 1000000000ull;
+    vblank_timer.it_interval.tv_nsec = m_period_ns % 1000000000ull;
+    vblank_timer.it_value            = vblank_timer.it_interval;
+
+    m_start_ns = monotonic_ns();
+    timerfd_settime(m_timer_fd, 0, &vblank_timer, NULL);
+}
+
+MemorySwapchainBackend::~MemorySwapchainBackend()
+{
+    if (m_timer_fd >= 0)
+        close(m_timer_fd);
+}
+
+int MemorySwapchainBackend::allocate(uint32_t width, uint32_t height, uint32_t format,
+                                     swapchain_buffer &buffer)
+{
+    pixel_format_info const *info = pixel_format_find(format);
+    if (!info)
+        return -EINVAL;
+
+    /* Same rules as most dumb buffer implementations :
+     * rows aligned on 64 bytes, the planes one after the other. */
+    uint32_t const pitch = ALIGN_ON_POW2(pixel_format_row_bytes(*info, 0, width), 64u);
+    pixel_image image;
+    uint64_t const size  = pixel_image_layout(format, width, height, NULL, pitch, image);
+
+    int memory_fd = memfd_create("swapchain_buffer", MFD_CLOEXEC);
+    if (memory_fd < 0)
+        return -errno;
+
+    if (ftruncate(memory_fd, size))
+    {
+        int const err = errno;
+        close(memory_fd);
+        return -err;
+    }
+
+    void *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        int const err = errno;
+        close(memory_fd);
+        return -err;
+    }
+
+    buffer.width      = width;
+    buffer.height     = height;
+    buffer.format     = format;
+    buffer.pitch      = pitch;
+    buffer.size       = size;
+    buffer.handle     = 0;
+    buffer.fb_id      = 0;
+    buffer.dma_buf_fd = memory_fd;
+    buffer.map        = static_cast<uint8_t *>(map);
+
+    return 0;
+}
+
+void MemorySwapchainBackend::release(swapchain_buffer &buffer)
+{
+    if (m_pending == &buffer)
+        m_pending = NULL;
+
+    munmap(buffer.map, buffer.size);
+    close(buffer.dma_buf_fd);
+
+    buffer.map        = NULL;
+    buffer.dma_buf_fd = -1;
+}
+
+int MemorySwapchainBackend::queue_flip(swapchain_buffer &buffer)
+{
+    if (m_timer_fd < 0)
+        return -ENODEV;
+
+    /* drmModePageFlip refuses a second flip until the first one is done */
+    if (m_pending)
+        return -EBUSY;
+
+    /* Forget about the vblanks that happened before this flip was queued,
+     * or we would complete it without waiting. */
+    uint64_t expirations = 0;
+    if (read(m_timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        m_sequence += expirations;
+
+    m_pending = &buffer;
+    return 0;
+}
+
+int MemorySwapchainBackend::dispatch_events(int timeout_ms)
+{
+    if (m_timer_fd < 0)
+        return -ENODEV;
+
+    struct pollfd timer_poll;
+    timer_poll.fd      = m_timer_fd;
+    timer_poll.events  = POLLIN;
+    timer_poll.revents = 0;
+
+    int ret = poll(&timer_poll, 1, timeout_ms);
+    if (ret < 0)
+        return (errno == EINTR) ? 0 : -errno;
+    if (ret == 0)
+        return 0;
+
+    uint64_t expirations = 0;
+    if (read(m_timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return 0;
+
+    m_sequence += expirations;
+
+    if (!m_pending)
+        return 0;
+
+    /* Report the time of the vblank itself, not the time we noticed it */
+    m_pending = NULL;
+    uint64_t const vblank_us = (m_start_ns + m_sequence * m_period_ns) / 1000;
+    if (m_listener)
+        m_listener->flip_complete(m_sequence, vblank_us / 1000000, vblank_us % 1000000);
+
+    return 1;
+}
+
+/* ---- Swapchain ---- */
+
+Swapchain::Swapchain(SwapchainBackend &backend) :
+    m_backend(backend),
+    m_queued(-1),
+    m_scanout(-1),
+    m_next(0),
+    m_last_presented(NULL),
+    m_shadow(NULL),
+    m_frame_stats(NULL),
+    m_external_dispatch(false)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_backend.set_listener(this);
+}
+
+Swapchain::~Swapchain()
+{
+    release();
+    m_backend.set_listener(NULL);
+}
+
+void Swapchain::release()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    wait_idle_locked(lock);
+
+    for (size_t b = 0; b < m_buffers.size(); b++)
+        m_backend.release(m_buffers[b]);
+    m_buffers.clear();
+
+    m_queued  = -1;
+    m_scanout = -1;
+    m_next    = 0;
+    m_last_presented = NULL;
+    m_history.reset();
+
+    free(m_shadow);
+    m_shadow = NULL;
+}
+
+int Swapchain::init(uint32_t width, uint32_t height, unsigned int buffer_count,
+                    bool shadow, uint32_t format)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (buffer_count < 2 || !m_buffers.empty())
+        return -EINVAL;
+
+    /* Without the shadow copy, the renderer draws into the buffers */
+    bool const drawable = format == DRM_FORMAT_XRGB8888 || format == DRM_FORMAT_ARGB8888;
+    pixel_format_info const *info = pixel_format_find(format);
+    if (!info || info->plane_count != 1 || (!drawable && !shadow))
+    {
+        qDebug("%s %d Cannot scan out format %.4s%s\n",
+               __FUNCTION__, __LINE__, (char const *) &format,
+               info && info->plane_count == 1 ? " without shadow mode" : "");
+        return -EINVAL;
+    }
+
+    m_buffers.reserve(buffer_count);
+    for (unsigned int b = 0; b < buffer_count; b++)
+    {
+        swapchain_buffer buffer = swapchain_buffer();
+        buffer.dma_buf_fd = -1;
+
+        int ret = m_backend.allocate(width, height, format, buffer);
+        if (ret)
+        {
+            for (size_t allocated = 0; allocated < m_buffers.size(); allocated++)
+                m_backend.release(m_buffers[allocated]);
+            m_buffers.clear();
+            return ret;
+        }
+
+        buffer.state = swapchain_buffer::BUFFER_FREE;
+        buffer.index = b;
+        buffer.cpu_sync = true;
+        m_buffers.push_back(buffer);
+    }
+
+    if (shadow)
+    {
+        /* Same layout as the buffers, so that flushing is a plain copy,
+         * unless it has to convert anyway */
+        uint32_t const shadow_pitch = drawable
+            ? m_buffers[0].pitch
+            : ALIGN_ON_POW2(width * 4, 64u);
+        size_t const shadow_size = (size_t) shadow_pitch * height;
+        void *memory = NULL;
+        if (posix_memalign(&memory, 64, shadow_size))
+        {
+            for (size_t b = 0; b < m_buffers.size(); b++)
+                m_backend.release(m_buffers[b]);
+            m_buffers.clear();
+            return -ENOMEM;
+        }
+        memset(memory, 0, shadow_size);
+
+        m_shadow = static_cast<uint8_t *>(memory);
+        for (size_t b = 0; b < m_buffers.size(); b++)
+        {
+            m_buffers[b].shadow       = m_shadow;
+            m_buffers[b].shadow_pitch = shadow_pitch;
+        }
+    }
+
+    return 0;
+}
+
+swapchain_buffer *Swapchain::acquire(int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_buffers.empty())
+        return NULL;
+
+    swapchain_buffer *acquired = NULL;
+    bool waited = false;
+    while (!acquired)
+    {
+        /* Round robin, so that every buffer gets used */
+        for (size_t tried = 0; tried < m_buffers.size(); tried++)
+        {
+            swapchain_buffer &buffer = m_buffers[(m_next + tried) % m_buffers.size()];
+            if (buffer.state == swapchain_buffer::BUFFER_FREE)
+            {
+                m_next = (buffer.index + 1) % m_buffers.size();
+                buffer.state = swapchain_buffer::BUFFER_ACQUIRED;
+                buffer.age = (buffer.presented_frame && !m_backend.draws_into_buffers())
+                    ? m_stats.frames_presented - buffer.presented_frame + 1
+                    : 0;
+                buffer.damage.clear();
+                acquired = &buffer;
+                break;
+            }
+        }
+        if (acquired)
+            break;
+
+        /* Everything is either on screen or about to be. Wait for the
+         * pending flip to release the currently displayed buffer. */
+        if (m_queued < 0)
+            return NULL;
+
+        if (!waited)
+        {
+            m_stats.waits++;
+            waited = true;
+        }
+
+        int ret = wait_flip(lock, timeout_ms);
+        if (ret < 0 || (ret == 0 && timeout_ms >= 0))
+            return NULL;
+    }
+    lock.unlock();
+
+    /* Drawn directly into the mapping, read back by blending and by
+     * copy_stale_regions. The shadow copy needs no sync, the mapping is
+     * only written by flush_shadow. */
+    if (!acquired->shadow && acquired->cpu_sync)
+    {
+        int ret = dma_buf_begin_cpu_access(acquired->dma_buf_fd, CPU_ACCESS_READ_WRITE);
+        if (ret == -ENOTTY)
+            acquired->cpu_sync = false;
+        else if (ret)
+            qDebug("%s %d Could not start the CPU access to buffer %u : %s\n",
+                   __FUNCTION__, __LINE__, acquired->index, strerror(-ret));
+    }
+
+    return acquired;
+}
+
+int Swapchain::present(swapchain_buffer *buffer)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!buffer || buffer->state != swapchain_buffer::BUFFER_ACQUIRED)
+        return -EINVAL;
+
+    /* An empty damage means the whole frame changed */
+    if (buffer->damage.empty())
+        buffer->damage.add(0, 0, buffer->width, buffer->height);
+
+    /* The buffer belongs to the calling thread until it is queued :
+     * write it back without blocking the flip events */
+    lock.unlock();
+    if (buffer->shadow)
+    {
+        flush_shadow(*buffer);
+    }
+    else if (buffer->cpu_sync)
+    {
+        int ret = dma_buf_end_cpu_access(buffer->dma_buf_fd, CPU_ACCESS_READ_WRITE);
+        if (ret)
+            qDebug("%s %d Could not end the CPU access to buffer %u : %s\n",
+                   __FUNCTION__, __LINE__, buffer->index, strerror(-ret));
+    }
+    lock.lock();
+
+    /* Only one flip can be pending */
+    if (m_queued >= 0)
+    {
+        m_stats.waits++;
+        int ret = wait_idle_locked(lock);
+        if (ret)
+            return ret;
+    }
+
+    buffer->state = swapchain_buffer::BUFFER_QUEUED;
+    m_queued = buffer->index;
+
+    /* Set before queueing : backends completing the flip right away
+     * report it from queue_flip */
+    uint64_t const previous_frame = buffer->presented_frame;
+    buffer->presented_frame = m_stats.frames_presented + 1;
+
+    if (m_frame_stats)
+        m_frame_stats->record(FRAME_SUBMIT, buffer->presented_frame, monotonic_ns() / 1000);
+
+    int ret = m_backend.queue_flip(*buffer);
+    if (ret)
+    {
+        if (m_queued == (int) buffer->index)
+            m_queued = -1;
+        buffer->state = swapchain_buffer::BUFFER_ACQUIRED;
+        buffer->presented_frame = previous_frame;
+        return ret;
+    }
+
+    m_stats.frames_presented++;
+    m_stats.damaged_pixels += buffer->damage.area();
+    m_history.push(buffer->damage);
+    m_last_presented = buffer;
+    return 0;
+}
+
+bool Swapchain::copy_stale_regions(swapchain_buffer &buffer)
+{
+    DamageRegion stale;
+    swapchain_buffer *last_presented;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        last_presented = m_last_presented;
+        if (buffer.shadow)
+            return last_presented != NULL;
+        if (!last_presented || !m_history.stale_region(buffer.age, stale))
+            return false;
+    }
+
+    /* The last presented buffer is only read by the display, copy from
+     * it without blocking the flip events */
+    if (last_presented != &buffer)
+    {
+        CpuAccess reading(last_presented->cpu_sync ? last_presented->dma_buf_fd : -1,
+                          CPU_ACCESS_READ);
+        copy_damage(swapchain_surface(buffer), swapchain_surface(*last_presented), stale);
+        reading.end();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.repaired_pixels += stale.area();
+    }
+    return true;
+}
+
+int Swapchain::wait_flip(std::unique_lock<std::mutex> &lock, int timeout_ms)
+{
+    if (!m_external_dispatch)
+        return m_backend.dispatch_events(timeout_ms);
+
+    uint64_t const flips = m_stats.flips_completed;
+    if (timeout_ms < 0)
+    {
+        while (m_external_dispatch && m_stats.flips_completed == flips)
+            m_flipped.wait(lock);
+    }
+    else
+    {
+        /* wait_until, not wait_for : a spurious wakeup must not cut the
+         * timeout short */
+        std::chrono::steady_clock::time_point const deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (m_external_dispatch && m_stats.flips_completed == flips)
+        {
+            if (m_flipped.wait_until(lock, deadline) == std::cv_status::timeout)
+                break;
+        }
+    }
+
+    return (m_stats.flips_completed != flips) ? 1 : 0;
+}
+
+int Swapchain::wait_idle_locked(std::unique_lock<std::mutex> &lock)
+{
+    while (m_queued >= 0)
+    {
+        int ret = wait_flip(lock, -1);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+void Swapchain::flush_shadow(swapchain_buffer &buffer)
+{
+    DamageRegion flushed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_history.stale_region(buffer.age, flushed))
+            flushed.add(0, 0, buffer.width, buffer.height);
+    }
+    flushed.add(buffer.damage);
+    flushed.clip(buffer.width, buffer.height);
+
+    /* Write only : nothing of the mapping is read, so nothing has to be
+     * invalidated. copy_row streams the rows out where the CPU can. */
+    CpuAccess writing(buffer.cpu_sync ? buffer.dma_buf_fd : -1, CPU_ACCESS_WRITE);
+    if (!writing.synced())
+        buffer.cpu_sync = false;
+    if (buffer.format == DRM_FORMAT_XRGB8888 || buffer.format == DRM_FORMAT_ARGB8888)
+    {
+        copy_damage(swapchain_mapping(buffer), swapchain_surface(buffer), flushed);
+    }
+    else
+    {
+        pixel_image mapping, shadow;
+        pixel_image_layout(buffer.format, buffer.width, buffer.height,
+                           buffer.map, buffer.pitch, mapping);
+        pixel_image_layout(DRM_FORMAT_XRGB8888, buffer.width, buffer.height,
+                           buffer.shadow, buffer.shadow_pitch, shadow);
+
+        std::vector<damage_rect> const &rects = flushed.rects();
+        for (size_t r = 0; r < rects.size(); r++)
+        {
+            damage_rect const &rect = rects[r];
+            pixel_image_convert(mapping, rect.x1, rect.y1, shadow, rect.x1, rect.y1,
+                                rect.x2 - rect.x1, rect.y2 - rect.y1);
+        }
+    }
+    writing.end();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stats.flushed_pixels += flushed.area();
+}
+
+int Swapchain::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return wait_idle_locked(lock);
+}
+
+void Swapchain::set_external_dispatch(bool external)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_external_dispatch = external;
+    }
+    /* Whoever waits must now dispatch by itself */
+    m_flipped.notify_all();
+}
+
+int Swapchain::dispatch_events(int timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_backend.dispatch_events(timeout_ms);
+}
+
+void Swapchain::complete_flip(unsigned int sequence,
+                              unsigned int tv_sec,
+                              unsigned int tv_usec)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    flip_complete(sequence, tv_sec, tv_usec);
+}
+
+bool Swapchain::flip_pending() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queued >= 0;
+}
+
+swapchain_stats Swapchain::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
+
+void Swapchain::set_frame_stats(FrameStats *frame_stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_frame_stats = frame_stats;
+}
+
+uint64_t Swapchain::next_frame() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats.frames_presented + 1;
+}
+
+void Swapchain::flip_complete(unsigned int sequence,
+                              unsigned int tv_sec,
+                              unsigned int tv_usec)
+{
+    if (m_queued < 0)
+        return;
+
+    if (m_scanout >= 0)
+        m_buffers[m_scanout].state = swapchain_buffer::BUFFER_FREE;
+
+    m_scanout = m_queued;
+    m_queued  = -1;
+    m_buffers[m_scanout].state = swapchain_buffer::BUFFER_SCANOUT;
+
+    uint64_t const flip_us = (uint64_t) tv_sec * 1000000ull + tv_usec;
+    if (m_stats.flips_completed == 0)
+        m_stats.first_flip_us = flip_us;
+
+    /* The modeset done by the first present has no vblank sequence */
+    unsigned int missed = 0;
+    if (m_stats.last_sequence && sequence > m_stats.last_sequence + 1)
+        missed = sequence - m_stats.last_sequence - 1;
+    m_stats.missed_vblanks += missed;
+
+    if (m_frame_stats)
+    {
+        if (missed)
+            m_frame_stats->record(FRAME_MISSED_VBLANK, 0, flip_us, missed);
+        m_frame_stats->record(FRAME_FLIP, m_buffers[m_scanout].presented_frame, flip_us, sequence);
+    }
+
+    m_stats.flips_completed++;
+    m_stats.last_sequence = sequence;
+    m_stats.last_flip_us  = flip_us;
+
+    m_flipped.notify_all();
+}
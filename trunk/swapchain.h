@@ -0,0 +1,328 @@
+#ifndef SWAPCHAIN_H
+#define SWAPCHAIN_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+#include "buffer_pool.h"
+#include "damage.h"
+#include "drm_device.h"
+#include "frame_stats.h"
+#include "pixel_format.h"
+#include "pixel_ops.h"
+
+#ifndef ALIGN_ON_POW2
+#define ALIGN_ON_POW2(n, align) ((n + align - 1) & ~(align - 1))
+#endif
+
+/* One buffer of the swapchain.
+ * For the DRM backend, this is a dumb buffer, its framebuffer and the PRIME
+ * mapping we draw into. For the memory backend, handle and fb_id stay at 0
+ * and dma_buf_fd is a memfd. */
+struct swapchain_buffer
+{
+    enum buffer_state
+    {
+        BUFFER_FREE,     /* Can be handed to the renderer */
+        BUFFER_ACQUIRED, /* The renderer is drawing into it */
+        BUFFER_QUEUED,   /* Waiting for the next vblank to be scanned out */
+        BUFFER_SCANOUT   /* Currently displayed */
+    };
+
+    uint32_t width;
+    uint32_t height;
+    /* DRM_FORMAT_XRGB8888 or DRM_FORMAT_ARGB8888, or any packed format of
+     * pixel_format_find in shadow mode */
+    uint32_t format;
+    uint32_t pitch;
+    uint64_t size;
+
+    uint32_t handle;
+    uint32_t fb_id;
+    int      dma_buf_fd;
+    uint8_t *map;
+
+    buffer_state state;
+    unsigned int index;
+
+    /* What the renderer changed in this frame. Left empty, the whole
+     * buffer is considered damaged. */
+    DamageRegion damage;
+    /* Set by acquire : the buffer holds the frame presented age frames
+     * ago. 0 means its content is unknown. */
+    unsigned int age;
+    uint64_t     presented_frame;
+
+    /* In shadow mode, the cacheable copy every buffer is drawn through.
+     * NULL otherwise. Always XRGB8888, converted to format when flushed. */
+    uint8_t *shadow;
+    uint32_t shadow_pitch;
+    /* The CPU access to the mapping is bracketed with DMA_BUF_IOCTL_SYNC.
+     * Cleared once dma_buf_fd turns out not to be a dma-buf. */
+    bool     cpu_sync;
+};
+
+/* Where the renderer draws : the mapping, or the shadow copy */
+static inline pixel_surface swapchain_surface(swapchain_buffer const &buffer)
+{
+    pixel_surface surface = { buffer.shadow ? buffer.shadow : buffer.map,
+                              buffer.width, buffer.height,
+                              buffer.shadow ? buffer.shadow_pitch : buffer.pitch };
+    return surface;
+}
+
+static inline pixel_surface swapchain_mapping(swapchain_buffer const &buffer)
+{
+    pixel_surface surface = { buffer.map, buffer.width, buffer.height, buffer.pitch };
+    return surface;
+}
+
+/* Notified by the backends when a queued buffer reached the screen.
+ * sequence, tv_sec and tv_usec are the ones provided by the page flip event. */
+class FlipListener
+{
+public:
+    virtual ~FlipListener() {}
+    virtual void flip_complete(unsigned int sequence,
+                               unsigned int tv_sec,
+                               unsigned int tv_usec) = 0;
+};
+
+/* Where the swapchain buffers come from and how they reach the screen. */
+class SwapchainBackend
+{
+public:
+    SwapchainBackend() : m_listener(NULL) {}
+    virtual ~SwapchainBackend() {}
+
+    /* Allocate and map a buffer of width x height pixels of format, one of
+     * pixel_format_find. Returns 0 or a negative errno value. */
+    virtual int allocate(uint32_t width, uint32_t height, uint32_t format,
+                         swapchain_buffer &buffer) = 0;
+    virtual void release(swapchain_buffer &buffer) = 0;
+
+    /* Ask for the buffer to be displayed at the next vblank.
+     * Only one flip can be pending at a time, like with drmModePageFlip.
+     * The listener is notified once the flip is done. */
+    virtual int queue_flip(swapchain_buffer &buffer) = 0;
+
+    /* Wait for at most timeout_ms milliseconds (-1 : forever) for events and
+     * dispatch them to the listener.
+     * Returns 1 if events were dispatched, 0 on timeout, or a negative errno. */
+    virtual int dispatch_events(int timeout_ms) = 0;
+
+    /* File descriptor that becomes readable when dispatch_events has
+     * something to do. */
+    virtual int event_fd() const = 0;
+
+    /* The backend drew into the buffers it presented, like the layers it
+     * blends on them : what they hold is not only what was rendered, and
+     * acquire gives them an age of 0 */
+    virtual bool draws_into_buffers() const { return false; }
+
+    void set_listener(FlipListener *listener) { m_listener = listener; }
+
+protected:
+    FlipListener *m_listener;
+};
+
+/* Dumb buffers exported through PRIME, displayed with drmModePageFlip.
+ * The first buffer presented is set with drmModeSetCrtc. */
+class DrmSwapchainBackend : public SwapchainBackend
+{
+public:
+    DrmSwapchainBackend(DrmDevice &device,
+                        uint32_t crtc_id,
+                        uint32_t connector_id,
+                        drmModeModeInfo const &mode);
+    /* Every connector shows the same buffers : clone mode */
+    DrmSwapchainBackend(DrmDevice &device,
+                        uint32_t crtc_id,
+                        std::vector<uint32_t> const &connector_ids,
+                        drmModeModeInfo const &mode);
+
+    int allocate(uint32_t width, uint32_t height, uint32_t format,
+                 swapchain_buffer &buffer);
+    void release(swapchain_buffer &buffer);
+    int queue_flip(swapchain_buffer &buffer);
+    int dispatch_events(int timeout_ms);
+    int event_fd() const { return m_device.fd(); }
+
+    /* Take the buffers from pool and give them back to it, instead of
+     * creating and destroying them. pool must outlive the buffers. */
+    void set_buffer_pool(BufferPool *pool) { m_pool = pool; }
+
+protected:
+    /* The user_data of the flip events must be the backend, seen as a
+     * DrmSwapchainBackend */
+    static void page_flip_handler(int fd,
+                                  unsigned int sequence,
+                                  unsigned int tv_sec,
+                                  unsigned int tv_usec,
+                                  void *user_data);
+
+    DrmDevice      &m_device;
+    uint32_t        m_crtc_id;
+    std::vector<uint32_t> m_connector_ids;
+    drmModeModeInfo m_mode;
+    BufferPool     *m_pool;
+    bool            m_crtc_set;
+    /* Most drivers do not implement drmModeDirtyFB */
+    bool            m_dirty_fb_supported;
+};
+
+/* Headless backend : memfd backed buffers and a timerfd ticking at the
+ * requested refresh rate, standing in for the vblank interrupt.
+ * Lets us check frame pacing and buffer rotation without a display. */
+class MemorySwapchainBackend : public SwapchainBackend
+{
+public:
+    explicit MemorySwapchainBackend(unsigned int refresh_hz);
+    ~MemorySwapchainBackend();
+
+    int allocate(uint32_t width, uint32_t height, uint32_t format,
+                 swapchain_buffer &buffer);
+    void release(swapchain_buffer &buffer);
+    int queue_flip(swapchain_buffer &buffer);
+    int dispatch_events(int timeout_ms);
+    int event_fd() const { return m_timer_fd; }
+
+private:
+    int                m_timer_fd;
+    uint64_t           m_period_ns;
+    uint64_t           m_start_ns;
+    uint64_t           m_sequence;
+    swapchain_buffer * m_pending;
+};
+
+struct swapchain_stats
+{
+    uint64_t frames_presented;
+    uint64_t flips_completed;
+    /* Number of times acquire or present had to wait for a vblank */
+    uint64_t waits;
+    /* vblanks where the previous frame stayed on screen because no new
+     * frame was queued in time */
+    uint64_t missed_vblanks;
+    /* Pixels declared damaged by the presented frames */
+    uint64_t damaged_pixels;
+    /* Pixels copied to bring reused buffers up to date */
+    uint64_t repaired_pixels;
+    /* Shadow mode : pixels written from the shadow copy to the mappings */
+    uint64_t flushed_pixels;
+    unsigned int last_sequence;
+    uint64_t first_flip_us;
+    uint64_t last_flip_us;
+};
+
+/* N buffers rotating between the renderer and the display.
+ * With 2 buffers, the CPU draws into one while the other is on screen.
+ * With 3 buffers, the CPU can also draw while a flip is pending.
+ *
+ * The flip events are dispatched by the thread waiting for a buffer,
+ * unless set_external_dispatch(true) was called : another thread (see
+ * EventThread) then calls dispatch_events, and the rendering thread
+ * sleeps until it did.
+ *
+ * Dumb buffers are usually mapped write-combined : writing them in order
+ * is fast, but reading them (blending, copy_stale_regions) is not cached
+ * at all. In shadow mode, the renderer draws into a single cacheable copy
+ * instead, and present writes what changed into the buffer with streaming
+ * stores.
+ *
+ * The renderer always draws XRGB8888. Other scanout formats, like RGB565
+ * which halves the bandwidth the display reads, need shadow mode : flushing
+ * converts the shadow copy into them. */
+class Swapchain : public FlipListener
+{
+public:
+    explicit Swapchain(SwapchainBackend &backend);
+    ~Swapchain();
+
+    /* Returns 0 or a negative errno, -EINVAL for a format that needs
+     * shadow mode without it */
+    int init(uint32_t width, uint32_t height, unsigned int buffer_count,
+             bool shadow = false, uint32_t format = DRM_FORMAT_XRGB8888);
+    /* Wait for the pending flip and give the buffers back to the backend.
+     * Done by the destructor too. */
+    void release();
+
+    /* Returns a buffer that is neither displayed nor waiting to be, waiting
+     * for a page flip if needed. Returns NULL on error or timeout. */
+    swapchain_buffer *acquire(int timeout_ms = -1);
+
+    /* Queue an acquired buffer for display. Returns 0 or a negative errno. */
+    int present(swapchain_buffer *buffer);
+
+    /* Wait until no flip is pending anymore */
+    int wait_idle();
+
+    void set_external_dispatch(bool external);
+    /* Dispatch the flip events of the backend. To be called when
+     * backend_fd() is readable, with a timeout of 0. */
+    int dispatch_events(int timeout_ms);
+    int backend_fd() const { return m_backend.event_fd(); }
+
+    /* Bring an acquired buffer up to date with the last presented frame,
+     * by copying what changed since the buffer was last presented.
+     * Returns false if the buffer age is unknown, in which case the
+     * whole buffer must be repainted.
+     * In shadow mode, the shadow copy is always up to date once a frame
+     * was presented. */
+    bool copy_stale_regions(swapchain_buffer &buffer);
+
+    unsigned int buffer_count() const { return m_buffers.size(); }
+    swapchain_stats stats() const;
+
+    /* Records the submits, flips and missed vblanks into frame_stats,
+     * which must outlive the swapchain. NULL stops recording. */
+    void set_frame_stats(FrameStats *frame_stats);
+    /* The number the next presented frame gets, to record its render
+     * times. Only meaningful on the thread calling present. */
+    uint64_t next_frame() const;
+
+    /* Called by the backend, with m_mutex held */
+    void flip_complete(unsigned int sequence,
+                       unsigned int tv_sec,
+                       unsigned int tv_usec);
+    /* Same, for events dispatched by someone else than the swapchain,
+     * like the scheduler sharing the DRM fd between several swapchains */
+    void complete_flip(unsigned int sequence,
+                       unsigned int tv_sec,
+                       unsigned int tv_usec);
+    bool flip_pending() const;
+
+private:
+    Swapchain(Swapchain const &);
+    Swapchain &operator=(Swapchain const &);
+
+    /* Waits for the next flip event. Returns 1 once it happened, 0 on
+     * timeout or a negative errno */
+    int wait_flip(std::unique_lock<std::mutex> &lock, int timeout_ms);
+    int wait_idle_locked(std::unique_lock<std::mutex> &lock);
+    /* Writes the damage of the buffer, and what it missed while others
+     * were presented, from the shadow copy into its mapping */
+    void flush_shadow(swapchain_buffer &buffer);
+
+    SwapchainBackend             &m_backend;
+    std::vector<swapchain_buffer> m_buffers;
+    int                           m_queued;
+    int                           m_scanout;
+    unsigned int                  m_next;
+    swapchain_stats               m_stats;
+    DamageHistory                 m_history;
+    swapchain_buffer             *m_last_presented;
+    uint8_t                      *m_shadow;
+    FrameStats                   *m_frame_stats;
+
+    /* Protects everything above but the buffer contents */
+    mutable std::mutex            m_mutex;
+    std::condition_variable       m_flipped;
+    bool                          m_external_dispatch;
+};
+
+#endif // SWAPCHAIN_H
@@ -0,0 +1,502 @@
+#include "topology_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <QDebug>
+
+#include "frame_stats.h"
+
+static uint64_t const fnv_offset_basis = 0xcbf29ce484222325ull;
+static uint64_t const fnv_prime        = 0x100000001b3ull;
+
+static uint64_t fnv1a(uint64_t hash, void const *data, size_t size)
+{
+    uint8_t const *bytes = static_cast<uint8_t const *>(data);
+    for (size_t b = 0; b < size; b++)
+    {
+        hash ^= bytes[b];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+uint64_t edid_hash(std::vector<uint8_t> const &edid)
+{
+    if (edid.empty())
+        return 0;
+
+    uint64_t const hash = fnv1a(fnv_offset_basis, &edid[0], edid.size());
+    return hash ? hash : 1;
+}
+
+std::string connector_name(uint32_t connector_type, uint32_t connector_type_id)
+{
+    /* Same names as the kernel, indexed by DRM_MODE_CONNECTOR_* */
+    static char const * const type_names[] =
+    {
+        "Unknown", "VGA", "DVI-I", "DVI-D", "DVI-A", "Composite", "SVIDEO",
+        "LVDS", "Component", "DIN", "DP", "HDMI-A", "HDMI-B", "TV", "eDP",
+        "Virtual", "DSI", "DPI", "Writeback", "SPI", "USB"
+    };
+    size_t const type_count = sizeof(type_names) / sizeof(type_names[0]);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s-%u",
+             (connector_type < type_count) ? type_names[connector_type] : "Unknown",
+             connector_type_id);
+    return name;
+}
+
+/* ---- Topology cache ---- */
+
+/* The file is :
+ * - a header : magic, version, sizeof(drmModeModeInfo), connector count
+ * - for each connector : id, type, type id, connected, EDID hash,
+ *   mode count, then the modes as they are in memory
+ * - the FNV-1a of everything before it
+ * Everything in the native byte order, the file never leaves the board. */
+static uint32_t const topology_magic   = 0x544d5244; /* "DRMT" */
+static uint32_t const topology_version = 1;
+
+struct topology_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mode_size;
+    uint32_t connector_count;
+};
+
+struct topology_connector_record
+{
+    uint32_t connector_id;
+    uint32_t connector_type;
+    uint32_t connector_type_id;
+    uint32_t connected;
+    uint64_t edid_hash;
+    uint32_t mode_count;
+    uint32_t padding;
+};
+
+template <typename T>
+static void append(std::vector<uint8_t> &data, T const &value)
+{
+    uint8_t const *bytes = reinterpret_cast<uint8_t const *>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static bool extract(std::vector<uint8_t> const &data, size_t &offset, T &value)
+{
+    if (data.size() - offset < sizeof(T))
+        return false;
+
+    memcpy(&value, &data[offset], sizeof(T));
+    offset += sizeof(T);
+    return true;
+}
+
+TopologyCache::TopologyCache(std::string const &path) :
+    m_path(path),
+    m_dirty(false)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+int TopologyCache::load()
+{
+    FILE *file = fopen(m_path.c_str(), "rb");
+    if (!file)
+        return -errno;
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t read_size;
+    while ((read_size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data.insert(data.end(), chunk, chunk + read_size);
+    fclose(file);
+
+    uint64_t stored_hash;
+    if (data.size() < sizeof(topology_header) + sizeof(stored_hash))
+        return -EINVAL;
+
+    memcpy(&stored_hash, &data[data.size() - sizeof(stored_hash)], sizeof(stored_hash));
+    data.resize(data.size() - sizeof(stored_hash));
+    if (fnv1a(fnv_offset_basis, &data[0], data.size()) != stored_hash)
+        return -EINVAL;
+
+    size_t offset = 0;
+    topology_header header;
+    extract(data, offset, header);
+    if (header.magic != topology_magic ||
+        header.version != topology_version ||
+        header.mode_size != sizeof(drmModeModeInfo))
+    {
+        return -EINVAL;
+    }
+
+    std::vector<connector_topology> connectors;
+    for (uint32_t c = 0; c < header.connector_count; c++)
+    {
+        topology_connector_record record;
+        if (!extract(data, offset, record))
+            return -EINVAL;
+
+        connector_topology connector;
+        connector.connector_id      = record.connector_id;
+        connector.connector_type    = record.connector_type;
+        connector.connector_type_id = record.connector_type_id;
+        connector.encoder_id        = 0;
+        connector.connected         = record.connected != 0;
+        connector.edid_hash         = record.edid_hash;
+
+        if ((data.size() - offset) / sizeof(drmModeModeInfo) < record.mode_count)
+            return -EINVAL;
+        connector.modes.resize(record.mode_count);
+        for (uint32_t m = 0; m < record.mode_count; m++)
+            extract(data, offset, connector.modes[m]);
+
+        connectors.push_back(connector);
+    }
+
+    m_connectors.swap(connectors);
+    m_dirty = false;
+    return 0;
+}
+
+int TopologyCache::save()
+{
+    std::vector<uint8_t> data;
+
+    topology_header header;
+    header.magic           = topology_magic;
+    header.version         = topology_version;
+    header.mode_size       = sizeof(drmModeModeInfo);
+    header.connector_count = m_connectors.size();
+    append(data, header);
+
+    for (size_t c = 0; c < m_connectors.size(); c++)
+    {
+        connector_topology const &connector = m_connectors[c];
+
+        topology_connector_record record;
+        memset(&record, 0, sizeof(record));
+        record.connector_id      = connector.connector_id;
+        record.connector_type    = connector.connector_type;
+        record.connector_type_id = connector.connector_type_id;
+        record.connected         = connector.connected;
+        record.edid_hash         = connector.edid_hash;
+        record.mode_count        = connector.modes.size();
+        append(data, record);
+
+        for (size_t m = 0; m < connector.modes.size(); m++)
+            append(data, connector.modes[m]);
+    }
+    append(data, fnv1a(fnv_offset_basis, &data[0], data.size()));
+
+    /* Write a new file and move it over the old one, so that a crash
+     * never leaves half a cache behind */
+    std::string const temporary_path = m_path + ".new";
+    FILE *file = fopen(temporary_path.c_str(), "wb");
+    if (!file)
+        return -errno;
+
+    bool const written = fwrite(&data[0], 1, data.size(), file) == data.size();
+    if (fclose(file) || !written)
+    {
+        int const err = errno ? errno : EIO;
+        unlink(temporary_path.c_str());
+        return -err;
+    }
+
+    if (rename(temporary_path.c_str(), m_path.c_str()))
+    {
+        int const err = errno;
+        unlink(temporary_path.c_str());
+        return -err;
+    }
+
+    m_dirty = false;
+    return 0;
+}
+
+void TopologyCache::invalidate()
+{
+    m_connectors.clear();
+    m_dirty = true;
+}
+
+connector_topology const *TopologyCache::find(uint32_t connector_id) const
+{
+    for (size_t c = 0; c < m_connectors.size(); c++)
+    {
+        if (m_connectors[c].connector_id == connector_id)
+            return &m_connectors[c];
+    }
+    return NULL;
+}
+
+static void fill_topology(drmModeConnector const &connector,
+                          uint64_t hash,
+                          connector_topology &topology)
+{
+    topology.connector_id      = connector.connector_id;
+    topology.connector_type    = connector.connector_type;
+    topology.connector_type_id = connector.connector_type_id;
+    topology.encoder_id        = connector.encoder_id;
+    topology.connected         = connector.connection == DRM_MODE_CONNECTED;
+    topology.edid_hash         = hash;
+    topology.modes.assign(connector.modes, connector.modes + connector.count_modes);
+}
+
+int TopologyCache::refresh(DrmDevice &device, drmModeRes const &resources, bool force_probe)
+{
+    uint64_t const start_us = monotonic_us();
+    m_stats.probed = 0;
+    m_stats.cached = 0;
+
+    std::vector<connector_topology> connectors;
+    std::vector<uint8_t> edid;
+
+    for (int c = 0; c < resources.count_connectors; c++)
+    {
+        uint32_t const connector_id = resources.connectors[c];
+        connector_topology topology;
+
+        ConnectorPtr current = get_connector_current(device, connector_id);
+        device.get_edid(connector_id, edid);
+        uint64_t const current_hash = edid_hash(edid);
+
+        connector_topology const *cached = find(connector_id);
+        bool const current_connected =
+            current && current->connection == DRM_MODE_CONNECTED;
+        bool const up_to_date =
+            !force_probe && current && cached &&
+            current->connection != DRM_MODE_UNKNOWNCONNECTION &&
+            cached->connector_type == current->connector_type &&
+            cached->connected == current_connected &&
+            cached->edid_hash == current_hash &&
+            (!current_connected || !cached->modes.empty());
+
+        if (up_to_date)
+        {
+            topology = *cached;
+            topology.encoder_id = current->encoder_id;
+            m_stats.cached++;
+        }
+        else
+        {
+            ConnectorPtr probed = get_connector(device, connector_id);
+            if (!probed)
+            {
+                qDebug("%s %d Could not probe connector %u : %s\n",
+                       __FUNCTION__, __LINE__, connector_id, strerror(errno));
+                continue;
+            }
+
+            /* The probe may have read a new EDID */
+            device.get_edid(connector_id, edid);
+            fill_topology(*probed, edid_hash(edid), topology);
+            m_stats.probed++;
+            m_dirty = true;
+        }
+
+        connectors.push_back(topology);
+    }
+
+    if (connectors.size() != m_connectors.size())
+        m_dirty = true;
+    m_connectors.swap(connectors);
+
+    m_stats.refresh_us = monotonic_us() - start_us;
+    return m_connectors.empty() ? -ENODEV : 0;
+}
+
+/* ---- Mode selection ---- */
+
+bool parse_mode_constraint(char const *text, mode_policy &policy)
+{
+    unsigned int width = 0, height = 0, refresh = 0;
+
+    if (text[0] == '@')
+    {
+        if (sscanf(text, "@%u", &refresh) != 1)
+            return false;
+    }
+    else if (sscanf(text, "%ux%u@%u", &width, &height, &refresh) < 2)
+    {
+        return false;
+    }
+
+    policy.width      = width;
+    policy.height     = height;
+    policy.refresh_hz = refresh;
+    return true;
+}
+
+static bool connector_accepted(connector_topology const &connector, mode_policy const &policy)
+{
+    if (policy.connector_name.empty())
+        return true;
+
+    std::string const name = connector_name(connector.connector_type, connector.connector_type_id);
+    if (name == policy.connector_name)
+        return true;
+
+    /* "HDMI-A" accepts "HDMI-A-1", "HDMI-A-2"... */
+    return name.size() > policy.connector_name.size() &&
+           name.compare(0, policy.connector_name.size(), policy.connector_name) == 0 &&
+           name[policy.connector_name.size()] == '-' &&
+           name.find('-', policy.connector_name.size() + 1) == std::string::npos;
+}
+
+static bool mode_accepted(drmModeModeInfo const &mode, mode_policy const &policy)
+{
+    return (!policy.width      || mode.hdisplay == policy.width) &&
+           (!policy.height     || mode.vdisplay == policy.height) &&
+           (!policy.refresh_hz || mode.vrefresh == policy.refresh_hz);
+}
+
+/* Whether a is a better mode than b */
+static bool mode_better(drmModeModeInfo const &a, drmModeModeInfo const &b)
+{
+    bool const a_preferred = a.type & DRM_MODE_TYPE_PREFERRED;
+    bool const b_preferred = b.type & DRM_MODE_TYPE_PREFERRED;
+    if (a_preferred != b_preferred)
+        return a_preferred;
+
+    uint32_t const a_area = (uint32_t) a.hdisplay * a.vdisplay;
+    uint32_t const b_area = (uint32_t) b.hdisplay * b.vdisplay;
+    if (a_area != b_area)
+        return a_area > b_area;
+
+    return a.vrefresh > b.vrefresh;
+}
+
+/* The best mode of connector accepted by the policy, NULL if none */
+static drmModeModeInfo const *best_mode(connector_topology const &connector,
+                                        mode_policy const &policy)
+{
+    drmModeModeInfo const *best = NULL;
+    for (size_t m = 0; m < connector.modes.size(); m++)
+    {
+        drmModeModeInfo const &mode = connector.modes[m];
+        if (mode_accepted(mode, policy) && (!best || mode_better(mode, *best)))
+            best = &mode;
+    }
+    return best;
+}
+
+int select_output(std::vector<connector_topology> const &connectors,
+                  mode_policy const &policy,
+                  output_choice &choice)
+{
+    std::vector<output_choice> choices;
+    int ret = select_outputs(connectors, policy, choices);
+    if (ret)
+        return ret;
+
+    choice = choices[0];
+    return 0;
+}
+
+int select_outputs(std::vector<connector_topology> const &connectors,
+                   mode_policy const &policy,
+                   std::vector<output_choice> &choices)
+{
+    choices.clear();
+    for (size_t c = 0; c < connectors.size(); c++)
+    {
+        connector_topology const &connector = connectors[c];
+        if (!connector.connected || !connector_accepted(connector, policy))
+            continue;
+
+        drmModeModeInfo const *best = best_mode(connector, policy);
+        if (best)
+        {
+            output_choice choice;
+            choice.connector_id = connector.connector_id;
+            choice.encoder_id   = connector.encoder_id;
+            choice.mode         = *best;
+            choices.push_back(choice);
+        }
+    }
+
+    return choices.empty() ? -ENOENT : 0;
+}
+
+/* ---- Hotplug monitor ---- */
+
+HotplugMonitor::HotplugMonitor() :
+    m_fd(-1)
+{
+}
+
+HotplugMonitor::~HotplugMonitor()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int HotplugMonitor::open()
+{
+    if (m_fd >= 0)
+        return 0;
+
+    m_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (m_fd < 0)
+        return -errno;
+
+    /* Group 1 : the kernel uevents, as udev receives them */
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;
+
+    if (bind(m_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)))
+    {
+        int const err = errno;
+        close(m_fd);
+        m_fd = -1;
+        return -err;
+    }
+
+    return 0;
+}
+
+bool HotplugMonitor::check()
+{
+    if (m_fd < 0)
+        return false;
+
+    bool hotplug = false;
+    char message[4096];
+    ssize_t size;
+    while ((size = recv(m_fd, message, sizeof(message) - 1, 0)) > 0)
+    {
+        message[size] = '\0';
+
+        /* "action@devpath" followed by KEY=value strings, each one ending
+         * with a '\0' */
+        bool drm_subsystem = false, hotplug_event = false;
+        for (ssize_t offset = 0; offset < size; offset += strlen(message + offset) + 1)
+        {
+            char const *field = message + offset;
+            if (!strcmp(field, "SUBSYSTEM=drm"))
+                drm_subsystem = true;
+            else if (!strcmp(field, "HOTPLUG=1"))
+                hotplug_event = true;
+        }
+
+        if (drm_subsystem && hotplug_event)
+            hotplug = true;
+    }
+
+    return hotplug;
+}
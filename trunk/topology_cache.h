@@ -0,0 +1,137 @@
+#ifndef TOPOLOGY_CACHE_H
+#define TOPOLOGY_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <xf86drmMode.h>
+
+#include "drm_device.h"
+
+/* What we know about a connector */
+struct connector_topology
+{
+    uint32_t connector_id;
+    uint32_t connector_type;
+    uint32_t connector_type_id;
+    /* Not saved : always taken from the current state */
+    uint32_t encoder_id;
+    bool     connected;
+    /* edid_hash of the EDID blob, 0 without EDID */
+    uint64_t edid_hash;
+    std::vector<drmModeModeInfo> modes;
+};
+
+/* Name of a connector, as the kernel prints it : "HDMI-A-1", "DSI-1"... */
+std::string connector_name(uint32_t connector_type, uint32_t connector_type_id);
+
+/* 64 bits FNV-1a of the EDID. Never 0. */
+uint64_t edid_hash(std::vector<uint8_t> const &edid);
+
+struct topology_stats
+{
+    /* Connectors that went through a full probe */
+    unsigned int probed;
+    /* Connectors taken from the cache */
+    unsigned int cached;
+    uint64_t     refresh_us;
+};
+
+/* The connectors and their modes, saved to a small binary file between
+ * runs.
+ *
+ * drmModeGetConnector probes the connector, which means reading the
+ * EDID over DDC and can take hundreds of milliseconds.
+ * drmModeGetConnectorCurrent only returns what the kernel already knows.
+ * A connector is only probed when its current state does not match the
+ * cache : a different EDID, a different connection state, or no modes
+ * known. A hotplug uevent seen while running invalidates everything. */
+class TopologyCache
+{
+public:
+    explicit TopologyCache(std::string const &path);
+
+    /* 0, -ENOENT without file, -EINVAL if the file is not a valid cache */
+    int load();
+    int save();
+
+    /* Forget everything : the next refresh probes every connector */
+    void invalidate();
+
+    /* Update the state of every connector of resources */
+    int refresh(DrmDevice &device, drmModeRes const &resources, bool force_probe = false);
+
+    std::vector<connector_topology> const &connectors() const { return m_connectors; }
+    /* Changed since it was loaded or saved */
+    bool dirty() const { return m_dirty; }
+    topology_stats const &stats() const { return m_stats; }
+
+private:
+    connector_topology const *find(uint32_t connector_id) const;
+
+    std::string                     m_path;
+    std::vector<connector_topology> m_connectors;
+    bool                            m_dirty;
+    topology_stats                  m_stats;
+};
+
+/* Which output and which mode to use. Fields left to 0 or empty accept
+ * anything. */
+struct mode_policy
+{
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    refresh_hz;
+    /* Either a full name like "HDMI-A-2", or a type like "HDMI-A" */
+    std::string connector_name;
+};
+
+struct output_choice
+{
+    uint32_t        connector_id;
+    uint32_t        encoder_id;
+    drmModeModeInfo mode;
+};
+
+/* Parses "WxH", "WxH@Hz" or "@Hz" into the policy. Returns false if
+ * nothing could be read. */
+bool parse_mode_constraint(char const *text, mode_policy &policy);
+
+/* Picks the first connected connector accepted by the policy, and among
+ * its modes accepted by the policy : the preferred one, or else the
+ * biggest, then the fastest.
+ * Returns -ENOENT if nothing fits. */
+int select_output(std::vector<connector_topology> const &connectors,
+                  mode_policy const &policy,
+                  output_choice &choice);
+
+/* Same as select_output, for every connected connector accepted by the
+ * policy, in the order of the connectors */
+int select_outputs(std::vector<connector_topology> const &connectors,
+                   mode_policy const &policy,
+                   std::vector<output_choice> &choices);
+
+/* Reads the kernel uevents, to know when a connector was plugged or
+ * unplugged. */
+class HotplugMonitor
+{
+public:
+    HotplugMonitor();
+    ~HotplugMonitor();
+
+    int open();
+    /* Becomes readable when uevents are pending */
+    int fd() const { return m_fd; }
+
+    /* Reads every pending uevent. True if one of them was a DRM hotplug. */
+    bool check();
+
+private:
+    HotplugMonitor(HotplugMonitor const &);
+    HotplugMonitor &operator=(HotplugMonitor const &);
+
+    int m_fd;
+};
+
+#endif // TOPOLOGY_CACHE_H